@@ -0,0 +1,809 @@
+/* Copyright 2021 Phasmatic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* webrays_bench
+ * Builds a set of procedural (and optionally OBJ) scenes with every BLAS
+ * builder, then traces primary, diffuse and shadow rays through the CPU and
+ * the GLES backend. The CPU rays are traced once more with ray sorting
+ * enabled, which mostly affects the incoherent diffuse rays. The GLES
+ * backend runs on ANGLE's SwiftShader device when available so that numbers
+ * are comparable across machines, and on Mesa's surfaceless platform or the
+ * default EGL display otherwise.
+ * Results are written as JSON.
+ *
+ * Usage: webrays_bench [--obj file.obj] [--width N] [--height N]
+ *                      [--iterations N] [--output file.json] [--no-gl]
+ *                      [--layout DFS|TREELET]
+ *                      [--triangles INDEXED|PRECOMPUTED|COMPACT]
+ */
+
+/* Embeded GL */
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <EGL/eglext_angle.h>
+#include <EGL/eglplatform.h>
+
+/* Embeded GL Version 3 */
+#define GL_GLEXT_PROTOTYPES
+#include <GLES3/gl3.h>
+
+#include <webrays/webrays.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#define BENCH_DEFAULT_WIDTH 256
+#define BENCH_DEFAULT_HEIGHT 256
+#define BENCH_DEFAULT_ITERATIONS 4
+#define BENCH_PI_F 3.14159265359f
+
+static const char* const bench_builders[]     = { "SAH", "SBVH", "WIDEBVH" };
+static const char* const bench_distributions[] = { "primary", "diffuse",
+                                                   "shadow" };
+
+typedef struct
+{
+  float x, y, z;
+} bench_vec3;
+
+typedef struct
+{
+  std::string        name;
+  std::vector<float> positions; // xyz
+  std::vector<int>   faces;     // v0, v1, v2, w
+  bench_vec3         bounds_min;
+  bench_vec3         bounds_max;
+} bench_scene;
+
+typedef struct
+{
+  std::vector<float> origins;    // (origin, t_min)
+  std::vector<float> directions; // (direction, t_max), t_max = 0 disables
+  wr_size            active;
+  bool               occlusion;
+} bench_rays;
+
+typedef struct
+{
+  EGLDisplay display;
+  EGLContext context;
+  EGLSurface surface;
+  bool       valid;
+} bench_gl;
+
+typedef struct
+{
+  int         width;
+  int         height;
+  int         iterations;
+  const char* obj_path;
+  const char* output_path;
+  bool        use_gl;
+  const char* layout;    // "layout" ADS option of the measured BLASes
+  const char* triangles; // "triangles" ADS option of the measured BLASes
+} bench_options;
+
+static double
+bench_elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double, std::milli>(
+           std::chrono::steady_clock::now() - start)
+    .count();
+}
+
+/* Scenes */
+
+static void
+bench_scene_add_vertex(bench_scene* scene, float x, float y, float z)
+{
+  scene->positions.push_back(x);
+  scene->positions.push_back(y);
+  scene->positions.push_back(z);
+}
+
+static void
+bench_scene_add_face(bench_scene* scene, int v0, int v1, int v2)
+{
+  scene->faces.push_back(v0);
+  scene->faces.push_back(v1);
+  scene->faces.push_back(v2);
+  scene->faces.push_back(0);
+}
+
+static void
+bench_scene_compute_bounds(bench_scene* scene)
+{
+  scene->bounds_min = { 1e30f, 1e30f, 1e30f };
+  scene->bounds_max = { -1e30f, -1e30f, -1e30f };
+  for (size_t i = 0; i < scene->positions.size(); i += 3) {
+    scene->bounds_min.x = fminf(scene->bounds_min.x, scene->positions[i + 0]);
+    scene->bounds_min.y = fminf(scene->bounds_min.y, scene->positions[i + 1]);
+    scene->bounds_min.z = fminf(scene->bounds_min.z, scene->positions[i + 2]);
+    scene->bounds_max.x = fmaxf(scene->bounds_max.x, scene->positions[i + 0]);
+    scene->bounds_max.y = fmaxf(scene->bounds_max.y, scene->positions[i + 1]);
+    scene->bounds_max.z = fmaxf(scene->bounds_max.z, scene->positions[i + 2]);
+  }
+}
+
+static bench_scene
+bench_scene_triangle_soup(int triangle_count)
+{
+  bench_scene scene;
+  scene.name = "triangle_soup";
+
+  std::mt19937                          rng(7);
+  std::uniform_real_distribution<float> position(0.0f, 1.0f);
+  std::uniform_real_distribution<float> offset(-0.02f, 0.02f);
+  for (int i = 0; i < triangle_count; ++i) {
+    float cx = position(rng), cy = position(rng), cz = position(rng);
+    for (int v = 0; v < 3; ++v)
+      bench_scene_add_vertex(&scene, cx + offset(rng), cy + offset(rng),
+                             cz + offset(rng));
+    bench_scene_add_face(&scene, 3 * i + 0, 3 * i + 1, 3 * i + 2);
+  }
+
+  bench_scene_compute_bounds(&scene);
+  return scene;
+}
+
+static void
+bench_scene_add_sphere(bench_scene* scene, bench_vec3 center, float radius,
+                       int slices, int stacks)
+{
+  const int base = (int)scene->positions.size() / 3;
+  for (int j = 0; j <= stacks; ++j) {
+    float theta = BENCH_PI_F * j / stacks;
+    for (int i = 0; i <= slices; ++i) {
+      float phi = 2.0f * BENCH_PI_F * i / slices;
+      bench_scene_add_vertex(
+        scene, center.x + radius * sinf(theta) * cosf(phi),
+        center.y + radius * cosf(theta),
+        center.z + radius * sinf(theta) * sinf(phi));
+    }
+  }
+  for (int j = 0; j < stacks; ++j) {
+    for (int i = 0; i < slices; ++i) {
+      int v0 = base + j * (slices + 1) + i;
+      int v1 = v0 + slices + 1;
+      bench_scene_add_face(scene, v0, v1, v0 + 1);
+      bench_scene_add_face(scene, v0 + 1, v1, v1 + 1);
+    }
+  }
+}
+
+static bench_scene
+bench_scene_sphere(int slices, int stacks)
+{
+  bench_scene scene;
+  scene.name = "tessellated_sphere";
+  bench_scene_add_sphere(&scene, { 0.0f, 0.0f, 0.0f }, 1.0f, slices, stacks);
+  bench_scene_compute_bounds(&scene);
+  return scene;
+}
+
+/* Instances are baked into a single BLAS, the TLAS path is GLES only */
+static bench_scene
+bench_scene_instanced_grid(int grid_size, int slices, int stacks)
+{
+  bench_scene scene;
+  scene.name = "instanced_grid";
+  for (int z = 0; z < grid_size; ++z)
+    for (int x = 0; x < grid_size; ++x)
+      bench_scene_add_sphere(&scene, { 2.5f * x, 0.0f, 2.5f * z }, 1.0f,
+                             slices, stacks);
+  bench_scene_compute_bounds(&scene);
+  return scene;
+}
+
+static int
+bench_obj_index(const char* token, int vertex_count)
+{
+  int index = atoi(token);
+  return (index < 0) ? vertex_count + index : index - 1;
+}
+
+static bool
+bench_scene_obj(const char* path, bench_scene* scene)
+{
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return false;
+
+  scene->name = std::string("obj:") + path;
+
+  char line[1024];
+  while (fgets(line, sizeof(line), file)) {
+    if (line[0] == 'v' && line[1] == ' ') {
+      float x, y, z;
+      if (3 == sscanf(line + 2, "%f %f %f", &x, &y, &z))
+        bench_scene_add_vertex(scene, x, y, z);
+    } else if (line[0] == 'f' && line[1] == ' ') {
+      const int vertex_count = (int)scene->positions.size() / 3;
+      int       polygon[64];
+      int       polygon_size = 0;
+      for (char* token = strtok(line + 2, " \t\r\n");
+           token && polygon_size < 64; token = strtok(WR_NULL, " \t\r\n"))
+        polygon[polygon_size++] = bench_obj_index(token, vertex_count);
+      for (int i = 2; i < polygon_size; ++i)
+        bench_scene_add_face(scene, polygon[0], polygon[i - 1], polygon[i]);
+    }
+  }
+  fclose(file);
+
+  bench_scene_compute_bounds(scene);
+  return !scene->faces.empty();
+}
+
+/* Rays */
+
+static bench_vec3
+bench_normalize(bench_vec3 v)
+{
+  float length = sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+  return { v.x / length, v.y / length, v.z / length };
+}
+
+static void
+bench_rays_init(bench_rays* rays, wr_size count, bool occlusion)
+{
+  rays->origins.assign(4 * count, 0.0f);
+  rays->directions.assign(4 * count, 0.0f);
+  rays->active    = 0;
+  rays->occlusion = occlusion;
+}
+
+static void
+bench_rays_set(bench_rays* rays, wr_size index, bench_vec3 origin,
+               float t_min, bench_vec3 direction, float t_max)
+{
+  float* o = &rays->origins[4 * index];
+  float* d = &rays->directions[4 * index];
+  o[0] = origin.x, o[1] = origin.y, o[2] = origin.z, o[3] = t_min;
+  d[0] = direction.x, d[1] = direction.y, d[2] = direction.z, d[3] = t_max;
+  rays->active++;
+}
+
+static void
+bench_rays_primary(const bench_scene* scene, int width, int height,
+                   bench_rays* rays)
+{
+  bench_vec3 center = { 0.5f * (scene->bounds_min.x + scene->bounds_max.x),
+                        0.5f * (scene->bounds_min.y + scene->bounds_max.y),
+                        0.5f * (scene->bounds_min.z + scene->bounds_max.z) };
+  float      extent =
+    fmaxf(scene->bounds_max.x - scene->bounds_min.x,
+          fmaxf(scene->bounds_max.y - scene->bounds_min.y,
+                scene->bounds_max.z - scene->bounds_min.z));
+  bench_vec3 eye = { center.x, center.y + 0.5f * extent,
+                     center.z + 1.5f * extent };
+  bench_vec3 front =
+    bench_normalize({ center.x - eye.x, center.y - eye.y, center.z - eye.z });
+  bench_vec3 right = bench_normalize({ -front.z, 0.0f, front.x });
+  bench_vec3 up    = { right.y * front.z - right.z * front.y,
+                    right.z * front.x - right.x * front.z,
+                    right.x * front.y - right.y * front.x };
+
+  const float tan_half_fov = tanf(0.5f * 60.0f * BENCH_PI_F / 180.0f);
+  bench_rays_init(rays, (wr_size)width * height, false);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      float u = (2.0f * (x + 0.5f) / width - 1.0f) * tan_half_fov;
+      float v = (2.0f * (y + 0.5f) / height - 1.0f) * tan_half_fov;
+      bench_vec3 direction = bench_normalize(
+        { front.x + u * right.x + v * up.x, front.y + u * right.y + v * up.y,
+          front.z + u * right.z + v * up.z });
+      bench_rays_set(rays, (wr_size)y * width + x, eye, 0.0f, direction, 1e27f);
+    }
+  }
+}
+
+/* Secondary rays start at the primary hit points. Diffuse rays sample the
+ * hemisphere facing the incoming ray, shadow rays target a point light above
+ * the scene */
+static void
+bench_rays_secondary(const bench_scene* scene, const bench_rays* primary,
+                     const std::vector<int>& hits, bench_rays* diffuse,
+                     bench_rays* shadow)
+{
+  const wr_size count  = primary->origins.size() / 4;
+  const float   extent = fmaxf(scene->bounds_max.x - scene->bounds_min.x,
+                             fmaxf(scene->bounds_max.y - scene->bounds_min.y,
+                                   scene->bounds_max.z - scene->bounds_min.z));
+  const float   t_min  = 1e-4f * extent;
+  bench_vec3    light  = { 0.5f * (scene->bounds_min.x + scene->bounds_max.x),
+                       scene->bounds_max.y + extent,
+                       0.5f * (scene->bounds_min.z + scene->bounds_max.z) };
+
+  std::mt19937                          rng(11);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+  bench_rays_init(diffuse, count, false);
+  bench_rays_init(shadow, count, true);
+  for (wr_size i = 0; i < count; ++i) {
+    if (hits[4 * i + 0] < 0)
+      continue;
+
+    float hit_distance;
+    std::memcpy(&hit_distance, &hits[4 * i + 3], sizeof(float));
+    const float* o   = &primary->origins[4 * i];
+    const float* d   = &primary->directions[4 * i];
+    bench_vec3   hit = { o[0] + hit_distance * d[0], o[1] + hit_distance * d[1],
+                       o[2] + hit_distance * d[2] };
+
+    bench_vec3 sample = bench_normalize(
+      { 2.0f * uniform(rng) - 1.0f, 2.0f * uniform(rng) - 1.0f,
+        2.0f * uniform(rng) - 1.0f });
+    if (sample.x * d[0] + sample.y * d[1] + sample.z * d[2] > 0.0f)
+      sample = { -sample.x, -sample.y, -sample.z };
+    bench_rays_set(diffuse, i, hit, t_min, sample, 1e27f);
+
+    bench_vec3 to_light = { light.x - hit.x, light.y - hit.y,
+                            light.z - hit.z };
+    float      distance = sqrtf(to_light.x * to_light.x +
+                           to_light.y * to_light.y + to_light.z * to_light.z);
+    bench_rays_set(shadow, i, hit, t_min, bench_normalize(to_light),
+                   distance);
+  }
+}
+
+/* CPU backend */
+
+static wr_handle
+bench_create_context(wr_backend_type backend, const bench_scene* scene,
+                     const char* builder, const char* layout,
+                     const char* triangles, wr_handle* ads)
+{
+  wr_handle webrays = wrays_init(backend, WR_NULL);
+
+  wr_ads_descriptor descriptors[] = { { "type", "BLAS" },
+                                      { "builder", builder },
+                                      { "layout", layout },
+                                      { "triangles", triangles } };
+  wr_error          err           = wrays_create_ads(
+    webrays, ads, descriptors, sizeof(descriptors) / sizeof(descriptors[0]));
+  if (WR_SUCCESS != err) {
+    fprintf(stderr, "webrays_bench: %s\n", wrays_error_string(webrays, err));
+    return WR_NULL;
+  }
+
+  int shape_id = 0;
+  err          = wrays_add_shape(
+    webrays, *ads, (float*)scene->positions.data(), 3, WR_NULL, 0, WR_NULL, 0,
+    (int)scene->positions.size() / 3, (int*)scene->faces.data(),
+    (int)scene->faces.size() / 4, &shape_id);
+  if (WR_SUCCESS != err) {
+    fprintf(stderr, "webrays_bench: %s\n", wrays_error_string(webrays, err));
+    return WR_NULL;
+  }
+
+  return webrays;
+}
+
+static double
+bench_cpu_trace(wr_handle webrays, wr_handle ads, bench_rays* rays,
+                int iterations, std::vector<int>* results)
+{
+  wr_handle ray_buffers[] = { rays->origins.data(), rays->directions.data() };
+  wr_size   dimensions[]  = { (wr_size)rays->origins.size() / 4 };
+
+  results->assign(rays->occlusion ? dimensions[0] : 4 * dimensions[0], -1);
+
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    if (rays->occlusion)
+      wrays_query_occlusion(webrays, ads, ray_buffers, 2, results->data(),
+                            dimensions, 1);
+    else
+      wrays_query_intersection(webrays, ads, ray_buffers, 2, results->data(),
+                               dimensions, 1);
+  }
+  return bench_elapsed_ms(start) / iterations;
+}
+
+/* GLES backend */
+
+/* eglGetPlatformDisplayEXT is an extension that not every libEGL exports,
+ * so it is looked up at runtime. Mesa's surfaceless platform runs without a
+ * window system */
+static EGLDisplay
+bench_gl_display()
+{
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+      "eglGetPlatformDisplayEXT");
+  const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (get_platform_display && extensions &&
+      strstr(extensions, "EGL_ANGLE_platform_angle")) {
+    EGLint display_attributes[] = {
+      EGL_PLATFORM_ANGLE_TYPE_ANGLE,
+      EGL_PLATFORM_ANGLE_TYPE_VULKAN_ANGLE,
+      EGL_PLATFORM_ANGLE_DEVICE_TYPE_ANGLE,
+      EGL_PLATFORM_ANGLE_DEVICE_TYPE_SWIFTSHADER_ANGLE,
+      EGL_NONE
+    };
+    return get_platform_display(EGL_PLATFORM_ANGLE_ANGLE, EGL_DEFAULT_DISPLAY,
+                                display_attributes);
+  }
+  if (get_platform_display && extensions &&
+      strstr(extensions, "EGL_MESA_platform_surfaceless"))
+    return get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                EGL_DEFAULT_DISPLAY, WR_NULL);
+  return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+static bool
+bench_gl_init(bench_gl* gl)
+{
+  memset(gl, 0, sizeof(*gl));
+
+  gl->display = bench_gl_display();
+  if (EGL_NO_DISPLAY == gl->display)
+    return false;
+
+  EGLint major, minor;
+  if (!eglInitialize(gl->display, &major, &minor) ||
+      !eglBindAPI(EGL_OPENGL_ES_API))
+    return false;
+
+  EGLint    config_attributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+                                 EGL_SURFACE_TYPE,    EGL_PBUFFER_BIT,
+                                 EGL_NONE };
+  EGLint    config_count        = 0;
+  EGLConfig config;
+  if (!eglChooseConfig(gl->display, config_attributes, &config, 1,
+                       &config_count) ||
+      0 == config_count)
+    return false;
+
+  EGLint surface_attributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+  gl->surface =
+    eglCreatePbufferSurface(gl->display, config, surface_attributes);
+  EGLint context_attributes[] = { EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE };
+  gl->context =
+    eglCreateContext(gl->display, config, EGL_NO_CONTEXT, context_attributes);
+  if (EGL_NO_SURFACE == gl->surface || EGL_NO_CONTEXT == gl->context)
+    return false;
+
+  gl->valid =
+    eglMakeCurrent(gl->display, gl->surface, gl->surface, gl->context);
+  return gl->valid;
+}
+
+static void
+bench_gl_destroy(bench_gl* gl)
+{
+  if (EGL_NO_DISPLAY == gl->display)
+    return;
+  eglMakeCurrent(gl->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  if (gl->context)
+    eglDestroyContext(gl->display, gl->context);
+  if (gl->surface)
+    eglDestroySurface(gl->display, gl->surface);
+  eglTerminate(gl->display);
+}
+
+static GLuint
+bench_gl_texture(const wr_buffer_info* info, GLenum format, GLenum type,
+                 const void* data)
+{
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, info->data.as_texture_2d.internal_format,
+               info->data.as_texture_2d.width, info->data.as_texture_2d.height,
+               0, format, type, data);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  return texture;
+}
+
+static double
+bench_gl_trace(wr_handle webrays, wr_handle ads, const bench_rays* rays,
+               int width, int height, int iterations)
+{
+  wr_size        dimensions[] = { (wr_size)width, (wr_size)height };
+  wr_buffer_info ray_info, result_info;
+  wrays_ray_buffer_requirements(webrays, &ray_info, dimensions, 2);
+  if (rays->occlusion)
+    wrays_occlusion_buffer_requirements(webrays, &result_info, dimensions, 2);
+  else
+    wrays_intersection_buffer_requirements(webrays, &result_info, dimensions,
+                                           2);
+
+  GLuint origins =
+    bench_gl_texture(&ray_info, GL_RGBA, GL_FLOAT, rays->origins.data());
+  GLuint directions =
+    bench_gl_texture(&ray_info, GL_RGBA, GL_FLOAT, rays->directions.data());
+  GLuint results = bench_gl_texture(
+    &result_info, rays->occlusion ? GL_RED_INTEGER : GL_RGBA_INTEGER, GL_INT,
+    WR_NULL);
+
+  wr_handle ray_buffers[] = { (wr_handle)(size_t)origins,
+                              (wr_handle)(size_t)directions };
+
+  /* Warm up, the first query links the kernels */
+  if (rays->occlusion)
+    wrays_query_occlusion(webrays, ads, ray_buffers, 2,
+                          (wr_handle)(size_t)results, dimensions, 2);
+  else
+    wrays_query_intersection(webrays, ads, ray_buffers, 2,
+                             (wr_handle)(size_t)results, dimensions, 2);
+  glFinish();
+
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    if (rays->occlusion)
+      wrays_query_occlusion(webrays, ads, ray_buffers, 2,
+                            (wr_handle)(size_t)results, dimensions, 2);
+    else
+      wrays_query_intersection(webrays, ads, ray_buffers, 2,
+                               (wr_handle)(size_t)results, dimensions, 2);
+  }
+  glFinish();
+  const double elapsed = bench_elapsed_ms(start) / iterations;
+
+  glDeleteTextures(1, &origins);
+  glDeleteTextures(1, &directions);
+  glDeleteTextures(1, &results);
+
+  return elapsed;
+}
+
+/* JSON */
+
+static void
+bench_json_rates(FILE* out, const char* backend, const double* elapsed_ms,
+                 const bench_rays* rays)
+{
+  fprintf(out, "          \"%s\": {", backend);
+  for (int i = 0; i < 3; ++i) {
+    double rays_per_sec =
+      (elapsed_ms[i] > 0.0) ? rays[i].active / (elapsed_ms[i] * 1e-3) : 0.0;
+    fprintf(out, "%s\"%s\": { \"rays\": %u, \"ms\": %.3f, \"rays_per_sec\": %.1f }",
+            i ? ", " : " ", bench_distributions[i], rays[i].active,
+            elapsed_ms[i], rays_per_sec);
+  }
+  fprintf(out, " }");
+}
+
+static void
+bench_json_traversal(FILE* out, const wr_traversal_stats* traversal)
+{
+  fprintf(out, "          \"traversal\": {");
+  for (int i = 0; i < 3; ++i) {
+    const double ray_count =
+      traversal[i].ray_count ? (double)traversal[i].ray_count : 1.0;
+    fprintf(out,
+            "%s\"%s\": { \"nodes_per_ray\": %.2f, \"triangles_per_ray\": "
+            "%.2f, \"terminated_rays\": %llu, \"max_nodes\": %d, "
+            "\"max_stack_depth\": %d }",
+            i ? ", " : " ", bench_distributions[i],
+            traversal[i].nodes_visited / ray_count,
+            traversal[i].triangles_tested / ray_count,
+            traversal[i].terminated_rays, traversal[i].max_nodes_visited,
+            traversal[i].max_stack_depth);
+  }
+  fprintf(out, " }");
+}
+
+static void
+bench_usage()
+{
+  fprintf(stderr, "usage: webrays_bench [--obj file.obj] [--width N] "
+                  "[--height N] [--iterations N] [--output file.json] "
+                  "[--no-gl] [--layout DFS|TREELET] "
+                  "[--triangles INDEXED|PRECOMPUTED|COMPACT]\n");
+}
+
+int
+main(int argc, char* argv[])
+{
+  bench_options options = { BENCH_DEFAULT_WIDTH, BENCH_DEFAULT_HEIGHT,
+                            BENCH_DEFAULT_ITERATIONS, WR_NULL, WR_NULL, true,
+                            "DFS", "INDEXED" };
+  for (int i = 1; i < argc; ++i) {
+    if (0 == strcmp(argv[i], "--obj") && i + 1 < argc)
+      options.obj_path = argv[++i];
+    else if (0 == strcmp(argv[i], "--width") && i + 1 < argc)
+      options.width = atoi(argv[++i]);
+    else if (0 == strcmp(argv[i], "--height") && i + 1 < argc)
+      options.height = atoi(argv[++i]);
+    else if (0 == strcmp(argv[i], "--iterations") && i + 1 < argc)
+      options.iterations = atoi(argv[++i]);
+    else if (0 == strcmp(argv[i], "--output") && i + 1 < argc)
+      options.output_path = argv[++i];
+    else if (0 == strcmp(argv[i], "--no-gl"))
+      options.use_gl = false;
+    else if (0 == strcmp(argv[i], "--layout") && i + 1 < argc)
+      options.layout = argv[++i];
+    else if (0 == strcmp(argv[i], "--triangles") && i + 1 < argc)
+      options.triangles = argv[++i];
+    else {
+      bench_usage();
+      return 1;
+    }
+  }
+  if (options.width <= 0 || options.height <= 0 || options.iterations <= 0) {
+    bench_usage();
+    return 1;
+  }
+
+  std::vector<bench_scene> scenes;
+  scenes.push_back(bench_scene_triangle_soup(50000));
+  scenes.push_back(bench_scene_sphere(256, 128));
+  scenes.push_back(bench_scene_instanced_grid(8, 32, 16));
+  if (options.obj_path) {
+    bench_scene scene;
+    if (bench_scene_obj(options.obj_path, &scene))
+      scenes.push_back(scene);
+    else
+      fprintf(stderr, "webrays_bench: could not load %s\n", options.obj_path);
+  }
+
+  bench_gl gl;
+  memset(&gl, 0, sizeof(gl));
+  if (options.use_gl && !bench_gl_init(&gl)) {
+    fprintf(stderr, "webrays_bench: GLES context unavailable, "
+                    "skipping GL measurements\n");
+    bench_gl_destroy(&gl);
+    gl.valid = false;
+  }
+
+  FILE* out = options.output_path ? fopen(options.output_path, "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "webrays_bench: could not open %s\n", options.output_path);
+    return 1;
+  }
+
+  int major, minor;
+  wrays_version(&major, &minor);
+  fprintf(out, "{\n  \"version\": \"%d.%d\",\n", major, minor);
+  fprintf(out, "  \"width\": %d,\n  \"height\": %d,\n  \"iterations\": %d,\n",
+          options.width, options.height, options.iterations);
+  fprintf(out, "  \"layout\": \"%s\",\n", options.layout);
+  fprintf(out, "  \"triangles\": \"%s\",\n", options.triangles);
+  fprintf(out, "  \"gl\": %s,\n", gl.valid ? "true" : "false");
+  fprintf(out, "  \"gl_renderer\": \"%s\",\n  \"scenes\": [\n",
+          gl.valid ? (const char*)glGetString(GL_RENDERER) : "");
+
+  for (size_t s = 0; s < scenes.size(); ++s) {
+    const bench_scene* scene = &scenes[s];
+
+    /* The ray distributions only depend on the geometry, so they are
+     * generated once with the default builder */
+    bench_rays       rays[3];
+    std::vector<int> hits;
+    {
+      wr_handle ads;
+      wr_handle webrays = bench_create_context(
+        WR_BACKEND_TYPE_CPU, scene, "WIDEBVH", "DFS", "INDEXED", &ads);
+      if (WR_NULL == webrays)
+        return 1;
+      wr_update_flags flags;
+      wrays_update(webrays, &flags);
+      bench_rays_primary(scene, options.width, options.height, &rays[0]);
+      bench_cpu_trace(webrays, ads, &rays[0], 1, &hits);
+      bench_rays_secondary(scene, &rays[0], hits, &rays[1], &rays[2]);
+    }
+
+    fprintf(out, "    {\n      \"name\": \"%s\",\n", scene->name.c_str());
+    fprintf(out, "      \"triangles\": %zu,\n      \"builders\": [\n",
+            scene->faces.size() / 4);
+
+    const int builder_count =
+      (int)(sizeof(bench_builders) / sizeof(bench_builders[0]));
+    for (int b = 0; b < builder_count; ++b) {
+      wr_handle ads;
+      wr_handle webrays =
+        bench_create_context(WR_BACKEND_TYPE_CPU, scene, bench_builders[b],
+                             options.layout, options.triangles, &ads);
+      if (WR_NULL == webrays)
+        return 1;
+
+      wr_update_flags flags;
+      wrays_update(webrays, &flags);
+
+      wr_ads_stats stats;
+      wrays_ads_get_stats(webrays, ads, &stats);
+
+      double           cpu_ms[3];
+      std::vector<int> results;
+      for (int r = 0; r < 3; ++r)
+        cpu_ms[r] =
+          bench_cpu_trace(webrays, ads, &rays[r], options.iterations, &results);
+
+      /* The same rays traced in coherence order, see wrays_set_ray_sorting */
+      double cpu_sorted_ms[3];
+      wrays_set_ray_sorting(webrays, WR_TRUE);
+      for (int r = 0; r < 3; ++r)
+        cpu_sorted_ms[r] =
+          bench_cpu_trace(webrays, ads, &rays[r], options.iterations, &results);
+      wrays_set_ray_sorting(webrays, WR_FALSE);
+
+      /* One more untimed pass per distribution with the counters enabled */
+      wr_traversal_stats traversal[3];
+      wrays_set_traversal_stats(webrays, WR_TRUE);
+      wrays_update(webrays, &flags);
+      for (int r = 0; r < 3; ++r) {
+        wrays_reset_traversal_stats(webrays);
+        bench_cpu_trace(webrays, ads, &rays[r], 1, &results);
+        wrays_get_traversal_stats(webrays, &traversal[r]);
+      }
+
+      fprintf(out, "        {\n          \"builder\": \"%s\",\n",
+              bench_builders[b]);
+      fprintf(out,
+              "          \"build_ms\": %.3f, \"nodes\": %d, \"leaves\": %d, "
+              "\"max_depth\": %d, \"sah_cost\": %.3f, \"node_bytes\": %u,\n",
+              stats.build_time, stats.node_count, stats.leaf_count,
+              stats.max_depth, stats.sah_cost, stats.node_bytes);
+      bench_json_rates(out, "cpu", cpu_ms, rays);
+      fprintf(out, ",\n");
+      bench_json_rates(out, "cpu_sorted", cpu_sorted_ms, rays);
+      fprintf(out, ",\n");
+      bench_json_traversal(out, traversal);
+
+      if (gl.valid) {
+        wr_handle gl_ads;
+        wr_handle gl_webrays =
+          bench_create_context(WR_BACKEND_TYPE_GLES, scene, bench_builders[b],
+                               options.layout, options.triangles, &gl_ads);
+        if (WR_NULL == gl_webrays)
+          return 1;
+
+        /* The update builds the BLAS and uploads it, the build time is
+         * reported separately by the statistics */
+        const auto start = std::chrono::steady_clock::now();
+        wrays_update(gl_webrays, &flags);
+        glFinish();
+        const double update_ms = bench_elapsed_ms(start);
+
+        wr_ads_stats gl_stats;
+        wrays_ads_get_stats(gl_webrays, gl_ads, &gl_stats);
+
+        double gl_ms[3];
+        for (int r = 0; r < 3; ++r)
+          gl_ms[r] = bench_gl_trace(gl_webrays, gl_ads, &rays[r], options.width,
+                                    options.height, options.iterations);
+
+        fprintf(out, ",\n          \"upload_ms\": %.3f, \"gpu_bytes\": %u,\n",
+                update_ms - gl_stats.build_time, gl_stats.gpu_bytes);
+        bench_json_rates(out, "gl", gl_ms, rays);
+
+        wrays_destroy(gl_webrays);
+      }
+
+      fprintf(out, "\n        }%s\n", (b + 1 < builder_count) ? "," : "");
+      wrays_destroy(webrays);
+    }
+
+    fprintf(out, "      ]\n    }%s\n", (s + 1 < scenes.size()) ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+
+  if (out != stdout)
+    fclose(out);
+  if (gl.valid)
+    bench_gl_destroy(&gl);
+
+  return 0;
+}
@@ -164,6 +164,20 @@ extern "C"
     WR_ADS_TYPE_MAX
   } wr_ads_type;
 
+  typedef enum
+  {
+    WR_OCCLUSION_FORMAT_INT,    /* one int per ray */
+    WR_OCCLUSION_FORMAT_PACKED, /* one bit per ray, 32 rays per int */
+    WR_OCCLUSION_FORMAT_MAX
+  } wr_occlusion_format;
+
+  typedef enum
+  {
+    WR_INTERSECTION_FORMAT_FULL,    /* int[4], 16 bytes per ray */
+    WR_INTERSECTION_FORMAT_COMPACT, /* int[2], 8 bytes per ray */
+    WR_INTERSECTION_FORMAT_MAX
+  } wr_intersection_format;
+
   typedef struct
   {
     unsigned int target;
@@ -189,6 +203,54 @@ extern "C"
     const char* value;
   } wr_ads_descriptor;
 
+  typedef struct
+  {
+    /* Host memory (bytes) */
+    wr_size vertex_bytes;
+    wr_size normal_bytes;
+    wr_size triangle_bytes;
+    wr_size node_bytes;
+
+    /* Device memory (bytes). Padding is the part of the allocated textures
+     * that is lost to power-of-two and max-layer sizing */
+    wr_size gpu_bytes;
+    wr_size gpu_padding_bytes;
+
+    /* Hierarchy */
+    int   node_count;
+    int   leaf_count;
+    int   max_depth;
+    float average_leaf_size;
+    float sah_cost;
+
+    /* Build time (milliseconds) */
+    float build_time;
+  } wr_ads_stats;
+
+#define WR_TRAVERSAL_HISTOGRAM_SIZE 16
+
+  typedef struct
+  {
+    /* Totals over all rays traced since the statistics were reset */
+    unsigned long long ray_count;
+    unsigned long long nodes_visited;
+    unsigned long long triangles_tested;
+    /* Occlusion rays that ended their traversal at the first hit, on all
+     * backends. A packed GPU group of 32 rays counts once if any of them
+     * hit */
+    unsigned long long terminated_rays;
+
+    /* Rays binned by visited nodes. Bin i counts the rays that visited
+     * [2^i, 2^(i+1)) nodes. Bin 0 also counts the rays that visited none and
+     * the last bin everything above */
+    unsigned long long nodes_histogram[WR_TRAVERSAL_HISTOGRAM_SIZE];
+
+    /* Worst single ray */
+    int max_nodes_visited;
+    int max_triangles_tested;
+    int max_stack_depth;
+  } wr_traversal_stats;
+
   WRAYS_API void
   wrays_version(int* major, int* minor);
   WRAYS_API char const*
@@ -217,6 +279,38 @@ extern "C"
   WRAYS_API wr_error
             wrays_update(wr_handle handle, wr_update_flags* flags);
 
+  //
+  // wrays_update_async
+  // Start building the pending BLASes in the background and return. On
+  // builds with ENABLE_THREADS the BLASes are built on worker threads (web
+  // workers sharing the WASM memory on the web), so that large models do not
+  // freeze the calling thread. Poll wrays_update_ready and then call
+  // wrays_update as usual, which uploads the built BLASes and generates the
+  // kernels on the calling thread, since only it may use the GL context.
+  // Calling wrays_update, creating, inspecting or destroying an ADS, adding
+  // shapes, or a CPU backend query earlier waits for the builds.
+  // Without ENABLE_THREADS the BLASes are built before this returns.
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_update_async(wr_handle handle);
+
+  //
+  // wrays_update_ready
+  // Check whether the builds started by wrays_update_async have finished,
+  // without waiting for them.
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  // - ready, set to WR_TRUE once wrays_update will not wait for the builds
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_update_ready(wr_handle handle, wr_bool* ready);
+
   WRAYS_API wr_error
             wrays_destroy(wr_handle handle);
 
@@ -234,6 +328,11 @@ extern "C"
   // - dimensions, the dimensions of ray_buffers and intersections
   // - dimension_count, size of the dimensions array
   //
+  // On the CPU backend, ray_buffers are host arrays of float[4] holding
+  // (origin, t_min) and (direction, t_max) and intersections is a host array
+  // of int[4], or of int[2] with the compact format, see
+  // wrays_set_intersection_format. Only BLAS queries are supported there.
+  //
   // Returns a handle to the created instance.
   WRAYS_API wr_error
             wrays_query_intersection(wr_handle handle, wr_handle ads,
@@ -255,12 +354,46 @@ extern "C"
   // - dimensions, the dimensions of ray_buffers and intersections
   // - dimension_count, size of the dimensions array
   //
+  // On the CPU backend, occlusion is a host array of int, or of uint32_t
+  // words with the packed format, see wrays_set_occlusion_format.
+  //
   // Returns a handle to the created instance.
   WRAYS_API wr_error
             wrays_query_occlusion(wr_handle handle, wr_handle ads, wr_handle* ray_buffers,
                                   wr_size ray_buffer_count, wr_handle occlusion,
                                   wr_size* dimensions, wr_size dimension_count);
 
+  //
+  // wrays_query_intersection_occlusion
+  // Query the ADS for the intersections of one set of rays and the
+  // occlusions of another in a single pass, e.g. the continuation and shadow
+  // rays of a path tracing bounce. Both sets share the dimensions. On the
+  // GLES backend one draw writes the intersections to the first and the
+  // occlusions to the second color attachment, so the scene data is bound
+  // once and the traversal of both ray sets shares the texture cache. With
+  // WR_OCCLUSION_FORMAT_PACKED or the traversal statistics enabled it issues
+  // the two queries instead.
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  // - ads, ads handle
+  // - ray_buffers, the ray buffers of the intersection query
+  // - ray_buffer_count, size of the ray_buffers array
+  // - intersections, the returned intersections
+  // - occlusion_ray_buffers, the ray buffers of the occlusion query
+  // - occlusion_ray_buffer_count, size of the occlusion_ray_buffers array
+  // - occlusion, the returned occlusions
+  // - dimensions, the dimensions of all ray and result buffers
+  // - dimension_count, size of the dimensions array
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_query_intersection_occlusion(
+              wr_handle handle, wr_handle ads, wr_handle* ray_buffers,
+              wr_size ray_buffer_count, wr_handle intersections,
+              wr_handle* occlusion_ray_buffers, wr_size occlusion_ray_buffer_count,
+              wr_handle occlusion, wr_size* dimensions, wr_size dimension_count);
+
   //
   // wrays_ads_create
   // Create an Acceleration Data Structure (ADS) based on the provided options.
@@ -272,10 +405,82 @@ extern "C"
   // Parameters:
   // - handle, webrays instance handle
   // - ads, the returned ads handle (int)
-  // - options, an array of {key, value} strings. Available options are {"type"
-  // : "BLAS" || "TLAS" }
+  // - options, an array of {key, value} strings, see the options below
   // - options_count, the number of descriptors
   //
+  // Options, each as key: values (default), then the builders that accept
+  // it and whether it is shared. A shared option must be the same for all
+  // BLASes of an instance and, when left out, is taken from the first BLAS.
+  // An option that the builder rejects, a shared option that differs from
+  // the first BLAS or a value out of range fails with an error. Numbers must
+  // be finite and make up the whole value. A TLAS only reads "type" and
+  // "deduplicate", a deduplicating TLAS passes the others on to its BLASes.
+  //
+  // - "type": "BLAS" || "TLAS" ("BLAS"). Any other value gives a BLAS.
+  // - "builder": "SAH" || "SBVH" || "WIDEBVH" ("WIDEBVH"). Shared, although
+  //   "SAH" and "SBVH" BLASes can be mixed. "SBVH" builds the "SAH"
+  //   hierarchy with spatial splits, which clip the triangles that straddle
+  //   a split plane into both children so that long or diagonal triangles
+  //   no longer make sibling nodes overlap. A split triangle is stored once
+  //   per leaf that references it.
+  // - "split_budget": >= 0 (0.3). Used by "SBVH", ignored by the others.
+  //   Caps the extra references of split triangles at the given fraction of
+  //   the triangle count.
+  // - "layout": "DFS" || "TREELET" ("DFS"). All builders, per BLAS. The
+  //   order of the nodes in memory: depth-first, or treelets ordered by
+  //   surface area that keep the nodes near the root together for better
+  //   cache locality.
+  // - "triangles": "INDEXED" || "PRECOMPUTED" || "COMPACT" ("INDEXED"). All
+  //   builders, shared. What the triangle tests read: the face indices and
+  //   then the vertex positions, an extra leaf-ordered copy of each triangle
+  //   as a vertex and two edges that needs no index fetch, or the face
+  //   indices stored as 8 or 16 bit offsets from a base index shared by
+  //   blocks of 16 faces, which halves the index memory or better. Compact
+  //   faces also need the face IDs to fit and no spheres in the scene,
+  //   otherwise the faces are uploaded as with "INDEXED".
+  // - "traversal": "STACK" || "STACKLESS" ("STACK"). "STACKLESS" needs
+  //   "SAH" or "SBVH", shared. How the generated code walks the nodes: with
+  //   a per-ray stack, or by following parent and sibling links stored with
+  //   each node, which needs no local array.
+  // - "quads": "OFF" || "ON" ("OFF"). "ON" needs "SAH" or "SBVH" and the
+  //   "INDEXED" or "COMPACT" triangles, shared. Pairs triangles that share
+  //   an edge into quads before the build, so the hierarchy holds fewer
+  //   primitives and a leaf tests both triangles of a quad from four vertex
+  //   fetches. The hit still reports the triangle and its face keeps its ID,
+  //   but the face may be rotated to start from another vertex, with the
+  //   barycentrics to match.
+  // - "streaming": "OFF" || "ON" ("OFF"). "ON" needs "SAH" or "SBVH", per
+  //   BLAS. Builds each update only over the shapes added since the previous
+  //   one and joins these chunks under a small top tree, so that a model
+  //   streamed in over several updates can be queried early. Call
+  //   wrays_finish_streaming once all shapes are in to get a single
+  //   optimized hierarchy.
+  // - "optimize": milliseconds >= 0 (0, off). All builders, per BLAS. Time
+  //   spent after every full build moving the subtrees that waste the most
+  //   surface area to better places in the binary hierarchy, before
+  //   "WIDEBVH" collapses it. Builds with threads split the work over
+  //   subtrees.
+  // - "buckets": 2 to 256 (64). All builders, per BLAS. The centroid bins
+  //   each SAH split step sweeps.
+  // - "leaf_size": 1 to 255 (3). All builders, at most 3 with "WIDEBVH",
+  //   per BLAS. The most primitives a leaf takes before the builder always
+  //   splits.
+  // - "node_cost" and "triangle_cost": > 0 (1.0 and 0.3). "WIDEBVH" only,
+  //   per BLAS. The relative cost of a node test and a triangle test that
+  //   the collapse of the binary hierarchy weighs.
+  // - "tune": "OFF" || "ON" ("OFF"). All builders, ignored with "streaming",
+  //   per BLAS. Builds the BLAS once per candidate set of "buckets" and
+  //   "leaf_size", or of "leaf_size" and "triangle_cost" with "WIDEBVH",
+  //   times host traversal of sample rays against each and keeps the
+  //   fastest. The "optimize" passes only run on the kept build. Runs once,
+  //   on the first full build.
+  // - "deduplicate": "OFF" || "EXACT" || "TRANSLATION" ("OFF"). TLAS only.
+  //   Lets the TLAS take shapes in wrays_add_shape. Each distinct mesh is
+  //   stored once in a BLAS of its own and every shape becomes an instance
+  //   of it. "TRANSLATION" also matches copies that differ by a translation.
+  //   The BLASes are built with the other options of the TLAS, except
+  //   "streaming", and count against the BLAS limit, see wrays_add_shape
+  //
   // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
   WRAYS_API wr_error
             wrays_create_ads(wr_handle handle, wr_handle* ads, wr_ads_descriptor* options,
@@ -287,7 +492,10 @@ extern "C"
   //
   // Parameters:
   // - handle, webrays instance handle
-  // - ads, the id of the BLAS
+  // - ads, the id of the BLAS, or of a TLAS created with "deduplicate". The
+  // shape id is then the id of the instance that holds the shape, distinct
+  // for every shape. A shape whose mesh is not a copy of a stored one needs
+  // a new BLAS, so it fails with an error once the BLAS limit is reached
   // - positions, position buffer (each position is of type float[3])
   // - position_stride, stride of positions on the position buffer
   // - normals, normals buffer (each normal is of type float[3])
@@ -306,6 +514,45 @@ extern "C"
                             float* uvs, int uv_stride, int num_vertices, int* indices,
                             int num_triangles, int* shape_id);
 
+  //
+  // wrays_add_spheres
+  // Add a group of analytic spheres to the BLAS. Spheres are built into the
+  // same hierarchy as the triangles and are intersected analytically. For a
+  // sphere hit, the barycentric coordinates of the intersection hold the
+  // spherical coordinates (phi, theta) of the normal at the hit point
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  // - ads, the id of the BLAS
+  // - spheres, sphere buffer (each sphere is of type float[4], center XYZ and
+  // radius)
+  // - sphere_stride, stride of spheres on the sphere buffer
+  // - user_data, per-sphere value returned as the w component of the face.
+  // Array can be NULL
+  // - num_spheres, number of spheres
+  // - shape_id, the returned id of the created shape
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_add_spheres(wr_handle handle, wr_handle ads, float* spheres,
+                              int sphere_stride, int* user_data, int num_spheres,
+                              int* shape_id);
+
+  //
+  // wrays_finish_streaming
+  // End the streaming ingestion of a BLAS created with {"streaming" : "ON" }.
+  // The next update replaces its chunks with a full build, which
+  // wrays_update_async runs off the calling thread. Shapes added afterwards
+  // trigger full builds
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  // - ads, the id of the BLAS
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_finish_streaming(wr_handle handle, wr_handle ads);
+
   //
   // wrays_add_instance
   // Creates an instance of the given BLAS
@@ -337,6 +584,189 @@ extern "C"
             wrays_update_instance(wr_handle handle, wr_handle tlas, int instance_id,
                                   float* transformation);
 
+  //
+  // wrays_ads_get_stats
+  // Get memory and hierarchy statistics of a BLAS. The statistics are
+  // refreshed every time the BLAS is built by wrays_update. Device memory is
+  // only reported by GPU backends.
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  // - ads, the handle of the BLAS
+  // - stats, the returned statistics
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_ads_get_stats(wr_handle handle, wr_handle ads, wr_ads_stats* stats);
+
+  //
+  // wrays_set_traversal_stats
+  // Enable or disable the traversal statistics counters. While enabled, every
+  // intersection and occlusion query counts the visited nodes, the tested
+  // triangles and the stack depth of each ray and accumulates them. The GPU
+  // kernels are compiled with the counters, so changing this takes effect on
+  // the next wrays_update which also reports new accessor code. Counting is
+  // slow on GPU backends as the per-ray counters are read back after every
+  // query. Enabling resets the accumulated statistics.
+  //
+  // The accessor code of an instance with enabled statistics defines
+  // WR_TRAVERSAL_STATS and provides
+  // - ivec4 wr_GetTraversalStats(), the (nodes, triangles, stack depth,
+  //   terminated) counted by the queries of the current invocation
+  // - void wr_ResetTraversalStats()
+  // for per-ray heatmaps in user shaders.
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  // - enable, WR_TRUE to enable the counters, WR_FALSE to disable them
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_set_traversal_stats(wr_handle handle, wr_bool enable);
+
+  //
+  // wrays_get_traversal_stats
+  // Get the traversal statistics accumulated since they were enabled or last
+  // reset
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  // - stats, the returned statistics
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_get_traversal_stats(wr_handle handle, wr_traversal_stats* stats);
+
+  //
+  // wrays_reset_traversal_stats
+  // Clear the accumulated traversal statistics
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_reset_traversal_stats(wr_handle handle);
+
+  //
+  // wrays_set_occlusion_format
+  // Select how wrays_query_occlusion writes its results. The default
+  // WR_OCCLUSION_FORMAT_INT writes one int per ray. WR_OCCLUSION_FORMAT_PACKED
+  // writes one bit per ray: the rays of a row are packed 32 per int, ray x of
+  // row y going to bit (x % 32) of int (x / 32, y). Rows are padded to whole
+  // ints and 1D ray buffers are a single row. Each fragment of the packed GPU
+  // kernel traces the 32 rays of its int, so the occlusion buffer from
+  // wrays_occlusion_buffer_requirements is 32 times narrower. The format is
+  // compiled into the GPU kernel, so changing it takes effect on the next
+  // wrays_update. The accessor code provides
+  // - bool wr_GetPackedOcclusion(highp isampler2D occlusion, ivec2 ray)
+  // to read a packed occlusion buffer in user shaders. With the packed
+  // format, the GPU traversal statistics count each group of 32 rays as one.
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  // - format, the occlusion buffer format
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_set_occlusion_format(wr_handle handle, wr_occlusion_format format);
+
+  //
+  // wrays_set_intersection_format
+  // Select how wrays_query_intersection writes its results. The default
+  // WR_INTERSECTION_FORMAT_FULL writes (primitive, 2 x float attributes,
+  // float distance) per ray. WR_INTERSECTION_FORMAT_COMPACT writes
+  // (primitive, attributes) into 8 bytes: the packed instance and primitive
+  // ID and the barycentrics (or sphere texture coordinates) as 2x16 unorm,
+  // the first in the low half. The hit distance is not stored. The accessor
+  // code of an instance with the compact format defines
+  // WR_INTERSECTION_COMPACT and its accessors decode the compact results;
+  // wr_GetHitDistance returns 0. The format is compiled into the GPU kernel,
+  // so changing it takes effect on the next wrays_update which also reports
+  // new accessor code.
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  // - format, the intersection buffer format
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_set_intersection_format(wr_handle              handle,
+                                          wr_intersection_format format);
+
+  //
+  // wrays_set_query_tiling
+  // Split the 2D queries into tiles of tile_width x tile_height rays. On the
+  // GLES backend every tile is a separate scissored draw that is flushed on
+  // its own, so that no single command of a large ray batch runs long enough
+  // to trigger the GPU watchdog (a TDR, or a lost context in browsers) and
+  // the compositor can be scheduled in between. The CPU backend traces the
+  // rays tile by tile in the same order. A zero tile size spans the whole
+  // buffer along that axis and setting both to zero disables tiling, which
+  // is the default. Takes effect on the next query.
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  // - tile_width, tile width in rays
+  // - tile_height, tile height in rays
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_set_query_tiling(wr_handle handle, wr_size tile_width,
+                                   wr_size tile_height);
+
+  //
+  // wrays_set_ray_sorting
+  // Trace the rays of each query (or of each tile, see
+  // wrays_set_query_tiling) in coherence order. The rays are binned by
+  // direction octant and by the Morton code of their origin within the
+  // bounds of the batch, so that neighbouring rays visit the same nodes,
+  // which helps incoherent batches such as diffuse bounces. The results are
+  // still written at the index of each ray. Only the CPU backend sorts,
+  // enabling it on another backend returns an error. Disabled by default.
+  // Takes effect on the next query.
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  // - enable, WR_TRUE to sort the rays of the following queries
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_set_ray_sorting(wr_handle handle, wr_bool enable);
+
+  //
+  // wrays_query_complete
+  // Check whether the device finished the last query without waiting for
+  // it, e.g. to read back the results of a large batch in a later frame.
+  // Queries of the CPU backend are always complete.
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  // - complete, set to WR_TRUE once the results of the last query are ready
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_query_complete(wr_handle handle, wr_bool* complete);
+
+  //
+  // wrays_profile_dump
+  // Write the timing zones recorded since the last dump as Chrome trace-event
+  // JSON, viewable in chrome://tracing or ui.perfetto.dev, and clear them.
+  // Zones cover wrays_update (BLAS build, wide collapse, texture allocation
+  // and upload, shader generation, compilation and linking) and the queries.
+  // GPU durations come from EXT_disjoint_timer_query when the driver exposes
+  // it and are dropped if the timer was disjoint.
+  //
+  // Zones are only recorded when the library is built with ENABLE_PROFILING.
+  //
+  // Parameters:
+  // - handle, webrays instance handle
+  // - path, output file path
+  //
+  // Returns WR_SUCCESS if operation was successful. Otherwise an error string.
+  WRAYS_API wr_error
+            wrays_profile_dump(wr_handle handle, const char* path);
+
   //
   // wrays_error_string
   // Get human friendly error message of the provided error
@@ -412,6 +842,10 @@ extern "C"
   WRAYS_API wr_error
             _wrays_internal_get_occlusion_kernel(wr_handle handle, unsigned int* program);
 
+  WRAYS_API wr_error
+            _wrays_internal_get_intersection_occlusion_kernel(wr_handle     handle,
+                                                              unsigned int* program);
+
 #endif
 
 #ifdef __cplusplus
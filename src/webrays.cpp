@@ -18,10 +18,15 @@
 #include "webrays_cpu.h"
 #include "webrays_ads.h"
 #include "webrays_tlas.h"
+#include "webrays_profile.h"
+#include "webrays_builder.h"
+#include "webrays_dedup.h"
 
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <climits>
+#include <cmath>
 
 #include "webrays_queue.h"
 
@@ -71,14 +76,71 @@ wrays_init(wr_backend_type backend_type, wr_handle data)
   ((wr_error) "You cannot create more than " WR_XSTR(WR_MAX_TLAS_COUNT) " TLA" \
                                                                         "S")
 #define WR_INVALID_OPTIONS ((wr_error) "You provided invalid options.")
+
+// Numeric option values, false unless the whole value is a finite number
+static bool
+wr_option_float(const char* value, float* result)
+{
+  char* end;
+  *result = strtof(value, &end);
+  return end != value && '\0' == *end && std::isfinite(*result);
+}
+
+static bool
+wr_option_int(const char* value, int* result)
+{
+  char* end;
+  long  number = strtol(value, &end, 10);
+  *result      = (int)number;
+  return end != value && '\0' == *end && number >= INT_MIN &&
+         number <= INT_MAX;
+}
+
 wr_error
 wrays_create_ads(wr_handle handle, wr_handle* ads, wr_ads_descriptor* options,
                  int options_count)
 {
   wr_context* webrays = (wr_context*)handle;
 
+  // The first BLAS decides the options of the others, and may still be
+  // building, see wrays_update_async
+  wr_builder_wait(webrays);
+
   // Get the type of the ADS
   wr_ads_type ads_type = wr_ads_type::WR_ADS_TYPE_BLAS;
+  // All BLASes of an instance share the same hierarchy type
+  wr_blas_type blas_type = (webrays->scene.blas_count > 0)
+                             ? webrays->scene.blas_type
+                             : WR_BLAS_TYPE_WIDEBVH;
+
+  // Node order of the flattened hierarchy
+  wr_node_layout node_layout = WR_NODE_LAYOUT_DFS;
+  // The triangle tests are shared by all BLASes, like the hierarchy type
+  wr_triangle_format triangle_format =
+    (webrays->scene.blas_count > 0)
+      ? webrays->scene.blas_handles[0]->m_triangle_format
+      : WR_TRIANGLE_FORMAT_INDEXED;
+  // So is the traversal
+  wr_traversal_kind traversal = (webrays->scene.blas_count > 0)
+                                  ? webrays->scene.blas_handles[0]->m_traversal
+                                  : WR_TRAVERSAL_STACK;
+  // and the pairing of triangles into quads
+  bool quads =
+    webrays->scene.blas_count > 0 && webrays->scene.blas_handles[0]->m_quads;
+  // Chunked builds until wrays_finish_streaming
+  bool streaming = false;
+  // Spatial splits of the SAH hierarchy, with at most split_budget extra
+  // references per face
+  bool  spatial_splits = false;
+  float split_budget   = 0.3f;
+  // Milliseconds of reinsertion passes after each full build
+  float optimize_budget = 0.0f;
+  // Cost model of the builders, picked on the first build with tune
+  wr_build_params params;
+  bool            wide_costs = false;
+  bool            tune       = false;
+  // Shapes added to a TLAS, see wr_dedup_add_shape
+  wr_dedup_mode dedup = WR_DEDUP_OFF;
   if (options != nullptr && options_count > 0) {
     for (int i = 0; i < options_count; ++i) {
       if (strncmp(options[i].key, "type", 4) == 0) {
@@ -87,9 +149,131 @@ wrays_create_ads(wr_handle handle, wr_handle* ads, wr_ads_descriptor* options,
                      : (strncmp(options[i].value, "TLAS", 4) == 0)
                          ? WR_ADS_TYPE_TLAS
                          : WR_ADS_TYPE_BLAS;
+      } else if (strncmp(options[i].key, "builder", 7) == 0) {
+        spatial_splits = strncmp(options[i].value, "SBVH", 4) == 0;
+        wr_blas_type requested =
+          (strncmp(options[i].value, "SAH", 3) == 0 || spatial_splits)
+            ? WR_BLAS_TYPE_SAH
+            : (strncmp(options[i].value, "WIDEBVH", 7) == 0)
+                ? WR_BLAS_TYPE_WIDEBVH
+                : WR_BLAS_TYPE_UNKNOWN;
+        if (WR_BLAS_TYPE_UNKNOWN == requested ||
+            (webrays->scene.blas_count > 0 && requested != blas_type))
+          return WR_INVALID_OPTIONS;
+        blas_type = requested;
+      } else if (strncmp(options[i].key, "layout", 6) == 0) {
+        if (strncmp(options[i].value, "DFS", 3) == 0)
+          node_layout = WR_NODE_LAYOUT_DFS;
+        else if (strncmp(options[i].value, "TREELET", 7) == 0)
+          node_layout = WR_NODE_LAYOUT_TREELET;
+        else
+          return WR_INVALID_OPTIONS;
+      } else if (strncmp(options[i].key, "triangles", 9) == 0) {
+        wr_triangle_format requested;
+        if (strncmp(options[i].value, "INDEXED", 7) == 0)
+          requested = WR_TRIANGLE_FORMAT_INDEXED;
+        else if (strncmp(options[i].value, "PRECOMPUTED", 11) == 0)
+          requested = WR_TRIANGLE_FORMAT_PRECOMPUTED;
+        else if (strncmp(options[i].value, "COMPACT", 7) == 0)
+          requested = WR_TRIANGLE_FORMAT_COMPACT;
+        else
+          return WR_INVALID_OPTIONS;
+        if (webrays->scene.blas_count > 0 && requested != triangle_format)
+          return WR_INVALID_OPTIONS;
+        triangle_format = requested;
+      } else if (strncmp(options[i].key, "traversal", 9) == 0) {
+        wr_traversal_kind requested;
+        if (strncmp(options[i].value, "STACKLESS", 9) == 0)
+          requested = WR_TRAVERSAL_STACKLESS;
+        else if (strncmp(options[i].value, "STACK", 5) == 0)
+          requested = WR_TRAVERSAL_STACK;
+        else
+          return WR_INVALID_OPTIONS;
+        if (webrays->scene.blas_count > 0 && requested != traversal)
+          return WR_INVALID_OPTIONS;
+        traversal = requested;
+      } else if (strncmp(options[i].key, "quads", 5) == 0) {
+        bool requested;
+        if (strncmp(options[i].value, "ON", 2) == 0)
+          requested = true;
+        else if (strncmp(options[i].value, "OFF", 3) == 0)
+          requested = false;
+        else
+          return WR_INVALID_OPTIONS;
+        if (webrays->scene.blas_count > 0 && requested != quads)
+          return WR_INVALID_OPTIONS;
+        quads = requested;
+      } else if (strncmp(options[i].key, "streaming", 9) == 0) {
+        if (strncmp(options[i].value, "ON", 2) == 0)
+          streaming = true;
+        else if (strncmp(options[i].value, "OFF", 3) == 0)
+          streaming = false;
+        else
+          return WR_INVALID_OPTIONS;
+      } else if (strncmp(options[i].key, "split_budget", 12) == 0) {
+        if (!wr_option_float(options[i].value, &split_budget) ||
+            !(split_budget >= 0.0f))
+          return WR_INVALID_OPTIONS;
+      } else if (strncmp(options[i].key, "optimize", 8) == 0) {
+        if (!wr_option_float(options[i].value, &optimize_budget) ||
+            !(optimize_budget >= 0.0f))
+          return WR_INVALID_OPTIONS;
+      } else if (strncmp(options[i].key, "buckets", 7) == 0) {
+        if (!wr_option_int(options[i].value, &params.bucket_count) ||
+            params.bucket_count < 2 || params.bucket_count > WR_MAX_BUCKETS)
+          return WR_INVALID_OPTIONS;
+      } else if (strncmp(options[i].key, "leaf_size", 9) == 0) {
+        if (!wr_option_int(options[i].value, &params.leaf_size) ||
+            params.leaf_size < 1 || params.leaf_size > 255)
+          return WR_INVALID_OPTIONS;
+      } else if (strncmp(options[i].key, "node_cost", 9) == 0) {
+        wide_costs = true;
+        if (!wr_option_float(options[i].value, &params.node_cost) ||
+            !(params.node_cost > 0.0f))
+          return WR_INVALID_OPTIONS;
+      } else if (strncmp(options[i].key, "triangle_cost", 13) == 0) {
+        wide_costs = true;
+        if (!wr_option_float(options[i].value, &params.triangle_cost) ||
+            !(params.triangle_cost > 0.0f))
+          return WR_INVALID_OPTIONS;
+      } else if (strncmp(options[i].key, "tune", 4) == 0) {
+        if (strncmp(options[i].value, "ON", 2) == 0)
+          tune = true;
+        else if (strncmp(options[i].value, "OFF", 3) == 0)
+          tune = false;
+        else
+          return WR_INVALID_OPTIONS;
+      } else if (strncmp(options[i].key, "deduplicate", 11) == 0) {
+        if (strncmp(options[i].value, "OFF", 3) == 0)
+          dedup = WR_DEDUP_OFF;
+        else if (strncmp(options[i].value, "EXACT", 5) == 0)
+          dedup = WR_DEDUP_EXACT;
+        else if (strncmp(options[i].value, "TRANSLATION", 11) == 0)
+          dedup = WR_DEDUP_TRANSLATION;
+        else
+          return WR_INVALID_OPTIONS;
       }
     }
   }
+  // The links of the stackless traversal are only built for binary nodes
+  if (WR_TRAVERSAL_STACKLESS == traversal && WR_BLAS_TYPE_SAH != blas_type)
+    return WR_INVALID_OPTIONS;
+  // and so are the chunks of streaming ingestion
+  if (streaming && WR_BLAS_TYPE_SAH != blas_type)
+    return WR_INVALID_OPTIONS;
+  // Quads are paired in the SAH leaves, and the precomputed triangles leave
+  // no index fetches to share
+  if (quads && (WR_BLAS_TYPE_SAH != blas_type ||
+                WR_TRIANGLE_FORMAT_PRECOMPUTED == triangle_format))
+    return WR_INVALID_OPTIONS;
+  if (WR_DEDUP_OFF != dedup && WR_ADS_TYPE_TLAS != ads_type)
+    return WR_INVALID_OPTIONS;
+  // Wide leaves hold up to 3 triangles, and only the wide collapse weighs
+  // node against triangle tests
+  if (WR_BLAS_TYPE_WIDEBVH == blas_type && params.leaf_size > 3)
+    return WR_INVALID_OPTIONS;
+  if (wide_costs && WR_BLAS_TYPE_WIDEBVH != blas_type)
+    return WR_INVALID_OPTIONS;
 
   // the type of the ADS
   if (ads_type == WR_ADS_TYPE_BLAS) {
@@ -99,9 +283,24 @@ wrays_create_ads(wr_handle handle, wr_handle* ads, wr_ads_descriptor* options,
     int ads_id = webrays->scene.blas_count++;
     *ads       = (wr_handle)((intptr_t)ads_id);
 
-    webrays->scene.blas_type = WR_BLAS_TYPE_WIDEBVH;
-    // webrays->scene.blas_handles[(int)*ads] = new SAHBVH();
-    webrays->scene.blas_handles[ads_id] = new WideBVH();
+    webrays->scene.blas_type = blas_type;
+    if (WR_BLAS_TYPE_SAH == blas_type)
+      webrays->scene.blas_handles[ads_id] = new SAHBVH();
+    else
+      webrays->scene.blas_handles[ads_id] = new WideBVH();
+    webrays->scene.blas_handles[ads_id]->m_node_layout     = node_layout;
+    webrays->scene.blas_handles[ads_id]->m_triangle_format = triangle_format;
+    webrays->scene.blas_handles[ads_id]->m_traversal       = traversal;
+    webrays->scene.blas_handles[ads_id]->m_quads           = quads;
+    webrays->scene.blas_handles[ads_id]->m_optimize_budget = optimize_budget;
+    webrays->scene.blas_handles[ads_id]->m_params          = params;
+    webrays->scene.blas_handles[ads_id]->m_tune            = tune;
+    if (WR_BLAS_TYPE_SAH == blas_type) {
+      SAHBVH* bvh           = (SAHBVH*)webrays->scene.blas_handles[ads_id];
+      bvh->m_streaming      = streaming;
+      bvh->m_spatial_splits = spatial_splits;
+      bvh->m_split_budget   = split_budget;
+    }
 
     switch (webrays->backend_type) {
       case WR_BACKEND_TYPE_GLES:
@@ -116,7 +315,17 @@ wrays_create_ads(wr_handle handle, wr_handle* ads, wr_ads_descriptor* options,
     int ads_id = webrays->scene.tlas_count++;
     *ads       = WR_INT2PTR(ads_id | WR_TLAS_ID_MASK);
 
-    webrays->scene.tlas_handles[ads_id] = new TLAS();
+    webrays->scene.tlas_handles[ads_id]          = new TLAS();
+    webrays->scene.tlas_handles[ads_id]->m_dedup = dedup;
+    // The BLASes of the unique meshes are built with the same options.
+    // Streaming is left out as they are never finished explicitly
+    for (int i = 0; WR_DEDUP_OFF != dedup && i < options_count; ++i) {
+      if (strncmp(options[i].key, "type", 4) != 0 &&
+          strncmp(options[i].key, "deduplicate", 11) != 0 &&
+          strncmp(options[i].key, "streaming", 9) != 0)
+        webrays->scene.tlas_handles[ads_id]->m_blas_options.push_back(
+          { options[i].key, options[i].value });
+    }
   }
 
   webrays->update_flags =
@@ -138,10 +347,19 @@ wrays_add_shape(wr_handle handle, wr_handle ads, float* positions,
   wr_context* webrays = (wr_context*)handle;
   wr_error    error   = WR_SUCCESS;
 
+  // The BLAS may still be building, see wrays_update_async
+  wr_builder_wait(webrays);
+
   int ads_id = WR_PTR2INT(ads);
 
-  if ((ads_id & WR_TLAS_ID_MASK) == WR_TLAS_ID_MASK)
-    return WR_INVALID_ADS_HANDLE;
+  // Only a deduplicating TLAS takes shapes, it instances its own BLASes
+  const bool is_tlas = (ads_id & WR_TLAS_ID_MASK) == WR_TLAS_ID_MASK;
+  if (is_tlas) {
+    const int tlas_id = ads_id & ~WR_TLAS_ID_MASK;
+    if (tlas_id >= webrays->scene.tlas_count ||
+        WR_DEDUP_OFF == webrays->scene.tlas_handles[tlas_id]->m_dedup)
+      return WR_INVALID_ADS_HANDLE;
+  }
 
   *shape_id = -1;
 
@@ -153,6 +371,11 @@ wrays_add_shape(wr_handle handle, wr_handle ads, float* positions,
     return WR_INVALID_INDEX_BUFFER;
   }
 
+  if (is_tlas)
+    return wr_dedup_add_shape(webrays, ads, positions, position_stride,
+                              normals, normal_stride, uvs, uv_stride,
+                              num_vertices, indices, num_triangles, shape_id);
+
   switch (webrays->backend_type) {
     case WR_BACKEND_TYPE_GLES:
       error = wrays_gl_add_shape(
@@ -175,6 +398,88 @@ wrays_add_shape(wr_handle handle, wr_handle ads, float* positions,
   return error;
 }
 
+#define WR_INVALID_SPHERE_BUFFER ((wr_error) "Invalid sphere buffer")
+#define WR_INVALID_SPHERE_RADIUS ((wr_error) "Sphere radius must be positive")
+wr_error
+wrays_add_spheres(wr_handle handle, wr_handle ads, float* spheres,
+                  int sphere_stride, int* user_data, int num_spheres,
+                  int* shape_id)
+{
+  wr_context* webrays = (wr_context*)handle;
+  wr_error    error   = WR_SUCCESS;
+
+  wr_builder_wait(webrays);
+
+  int ads_id = WR_PTR2INT(ads);
+
+  if ((ads_id & WR_TLAS_ID_MASK) == WR_TLAS_ID_MASK)
+    return WR_INVALID_ADS_HANDLE;
+
+  *shape_id = -1;
+
+  if (WR_NULL == spheres) {
+    return WR_INVALID_SPHERE_BUFFER;
+  }
+
+  // The radius also tells spheres apart from triangles in the precomputed
+  // triangle format
+  for (int i = 0; i < num_spheres; ++i) {
+    if (!(spheres[i * sphere_stride + 3] > 0.0f))
+      return WR_INVALID_SPHERE_RADIUS;
+  }
+
+  switch (webrays->backend_type) {
+    case WR_BACKEND_TYPE_GLES:
+      error = wrays_gl_add_spheres(handle, ads, spheres, sphere_stride,
+                                   user_data, num_spheres, shape_id);
+      break;
+    case WR_BACKEND_TYPE_CPU:
+      error = wrays_cpu_add_spheres(handle, ads, spheres, sphere_stride,
+                                    user_data, num_spheres, shape_id);
+      break;
+    default: break;
+  }
+
+  webrays->needs_update = 1;
+  webrays->update_flags =
+    (wr_update_flags)(webrays->update_flags | WR_UPDATE_FLAG_ACCESSOR_CODE |
+                      WR_UPDATE_FLAG_ACCESSOR_BINDINGS);
+
+  return error;
+}
+
+#define WR_NOT_STREAMING ((wr_error) "The BLAS was not created for streaming")
+wr_error
+wrays_finish_streaming(wr_handle handle, wr_handle ads)
+{
+  wr_context* webrays = (wr_context*)handle;
+
+  int ads_id = WR_PTR2INT(ads);
+
+  if ((ads_id & WR_TLAS_ID_MASK) == WR_TLAS_ID_MASK ||
+      ads_id >= webrays->scene.blas_count)
+    return WR_INVALID_ADS_HANDLE;
+
+  if (WR_BLAS_TYPE_SAH != webrays->scene.blas_type ||
+      !((SAHBVH*)webrays->scene.blas_handles[ads_id])->m_streaming)
+    return WR_NOT_STREAMING;
+
+  // The chunks may still be building, see wrays_update_async
+  wr_builder_wait(webrays);
+
+  // The next update rebuilds the BLAS from scratch
+  SAHBVH* bvh        = (SAHBVH*)webrays->scene.blas_handles[ads_id];
+  bvh->m_streaming   = false;
+  bvh->m_need_update = true;
+
+  webrays->needs_update = 1;
+  webrays->update_flags =
+    (wr_update_flags)(webrays->update_flags | WR_UPDATE_FLAG_ACCESSOR_CODE |
+                      WR_UPDATE_FLAG_ACCESSOR_BINDINGS);
+
+  return WR_SUCCESS;
+}
+
 #define WR_INVALID_BLAS_HANDLE ((wr_error) "Invalid BLAS handle")
 #define WR_INVALID_TLAS_HANDLE ((wr_error) "Invalid TLAS handle")
 #define WR_INVALID_TRANSFORM_BUFFER ((wr_error) "Invalid transformation matrix")
@@ -240,6 +545,185 @@ wrays_update_instance(wr_handle handle, wr_handle tlas, int instance_id,
   return WR_SUCCESS;
 }
 
+#define WR_INVALID_STATS_BUFFER ((wr_error) "Invalid statistics buffer")
+wr_error
+wrays_ads_get_stats(wr_handle handle, wr_handle ads, wr_ads_stats* stats)
+{
+  wr_context* webrays = (wr_context*)handle;
+
+  // The statistics are written by the build
+  wr_builder_wait(webrays);
+
+  int blas_id = WR_PTR2INT(ads);
+
+  if ((blas_id & WR_TLAS_ID_MASK) == WR_TLAS_ID_MASK)
+    return WR_INVALID_BLAS_HANDLE;
+  if (blas_id < 0 || blas_id >= webrays->scene.blas_count ||
+      webrays->scene.blas_handles[blas_id] == nullptr)
+    return WR_INVALID_BLAS_HANDLE;
+  if (stats == nullptr)
+    return WR_INVALID_STATS_BUFFER;
+
+  *stats = webrays->scene.blas_handles[blas_id]->m_stats;
+
+  return WR_SUCCESS;
+}
+
+wr_error
+wrays_set_traversal_stats(wr_handle handle, wr_bool enable)
+{
+  wr_context* webrays = (wr_context*)handle;
+
+  enable = enable ? WR_TRUE : WR_FALSE;
+  if (enable == webrays->traversal_stats_enabled)
+    return WR_SUCCESS;
+
+  webrays->traversal_stats_enabled = enable;
+  memset(&webrays->traversal_stats, 0, sizeof(webrays->traversal_stats));
+
+  // The counters are compiled into the kernels and the accessor code
+  webrays->needs_update = 1;
+  webrays->update_flags =
+    (wr_update_flags)(webrays->update_flags | WR_UPDATE_FLAG_ACCESSOR_CODE);
+
+  return WR_SUCCESS;
+}
+
+#define WR_INVALID_OCCLUSION_FORMAT ((wr_error) "Invalid occlusion format")
+wr_error
+wrays_set_occlusion_format(wr_handle handle, wr_occlusion_format format)
+{
+  wr_context* webrays = (wr_context*)handle;
+
+  if (format < WR_OCCLUSION_FORMAT_INT || format >= WR_OCCLUSION_FORMAT_MAX)
+    return WR_INVALID_OCCLUSION_FORMAT;
+  if (format == webrays->occlusion_format)
+    return WR_SUCCESS;
+
+  webrays->occlusion_format = format;
+
+  // The format is compiled into the occlusion kernel, which is rebuilt along
+  // with the accessor code
+  webrays->needs_update = 1;
+  webrays->update_flags =
+    (wr_update_flags)(webrays->update_flags | WR_UPDATE_FLAG_ACCESSOR_CODE);
+
+  return WR_SUCCESS;
+}
+
+#define WR_INVALID_INTERSECTION_FORMAT ((wr_error) "Invalid intersection format")
+wr_error
+wrays_set_intersection_format(wr_handle handle, wr_intersection_format format)
+{
+  wr_context* webrays = (wr_context*)handle;
+
+  if (format < WR_INTERSECTION_FORMAT_FULL ||
+      format >= WR_INTERSECTION_FORMAT_MAX)
+    return WR_INVALID_INTERSECTION_FORMAT;
+  if (format == webrays->intersection_format)
+    return WR_SUCCESS;
+
+  webrays->intersection_format = format;
+
+  // The accessors decode the format the intersection kernel writes
+  webrays->needs_update = 1;
+  webrays->update_flags =
+    (wr_update_flags)(webrays->update_flags | WR_UPDATE_FLAG_ACCESSOR_CODE);
+
+  return WR_SUCCESS;
+}
+
+wr_error
+wrays_set_query_tiling(wr_handle handle, wr_size tile_width,
+                       wr_size tile_height)
+{
+  wr_context* webrays = (wr_context*)handle;
+
+  // Applied by the next query, the kernels do not depend on it
+  webrays->query_tile_width  = tile_width;
+  webrays->query_tile_height = tile_height;
+
+  return WR_SUCCESS;
+}
+
+#define WR_RAY_SORTING_UNSUPPORTED                                             \
+  ((wr_error) "Ray sorting is only supported on the CPU backend")
+wr_error
+wrays_set_ray_sorting(wr_handle handle, wr_bool enable)
+{
+  wr_context* webrays = (wr_context*)handle;
+
+  // Only the host-side queries reorder their rays
+  if (enable && WR_BACKEND_TYPE_CPU != webrays->backend_type)
+    return WR_RAY_SORTING_UNSUPPORTED;
+  webrays->ray_sorting = enable;
+
+  return WR_SUCCESS;
+}
+
+#define WR_INVALID_COMPLETION_FLAG ((wr_error) "Invalid completion flag")
+wr_error
+wrays_query_complete(wr_handle handle, wr_bool* complete)
+{
+  wr_context* webrays = (wr_context*)handle;
+
+  if (complete == nullptr)
+    return WR_INVALID_COMPLETION_FLAG;
+
+  switch (webrays->backend_type) {
+    case WR_BACKEND_TYPE_GLES: return wrays_gl_query_complete(handle, complete);
+    default: break;
+  }
+
+  // Host-side queries are complete when they return
+  *complete = WR_TRUE;
+
+  return WR_SUCCESS;
+}
+
+wr_error
+wrays_get_traversal_stats(wr_handle handle, wr_traversal_stats* stats)
+{
+  wr_context* webrays = (wr_context*)handle;
+
+  if (stats == nullptr)
+    return WR_INVALID_STATS_BUFFER;
+
+  *stats = webrays->traversal_stats;
+
+  return WR_SUCCESS;
+}
+
+wr_error
+wrays_reset_traversal_stats(wr_handle handle)
+{
+  wr_context* webrays = (wr_context*)handle;
+
+  memset(&webrays->traversal_stats, 0, sizeof(webrays->traversal_stats));
+
+  return WR_SUCCESS;
+}
+
+void
+wr_traversal_stats_accumulate(wr_traversal_stats* stats, int nodes_visited,
+                              int triangles_tested, int stack_depth,
+                              int terminated)
+{
+  int bin = 0;
+  while (bin < WR_TRAVERSAL_HISTOGRAM_SIZE - 1 && (nodes_visited >> (bin + 1)))
+    ++bin;
+
+  stats->ray_count++;
+  stats->nodes_visited += nodes_visited;
+  stats->triangles_tested += triangles_tested;
+  stats->terminated_rays += terminated ? 1 : 0;
+  stats->nodes_histogram[bin]++;
+  stats->max_nodes_visited = wrays_maxi(stats->max_nodes_visited, nodes_visited);
+  stats->max_triangles_tested =
+    wrays_maxi(stats->max_triangles_tested, triangles_tested);
+  stats->max_stack_depth = wrays_maxi(stats->max_stack_depth, stack_depth);
+}
+
 const char*
 wrays_get_scene_accessor(wr_handle handle)
 {
@@ -329,11 +813,49 @@ wrays_query_intersection(wr_handle handle, wr_handle ads,
                          wr_size dimension_count)
 {
   wr_context* webrays = (wr_context*)handle;
+  WR_PROFILE_BIND(webrays);
+  WR_PROFILE_ZONE("wrays_query_intersection");
 
   switch (webrays->backend_type) {
     case WR_BACKEND_TYPE_GLES:
-      wrays_gl_query_intersection(webrays, ads, ray_buffers, ray_buffer_count,
-                                  intersections, dimensions, dimension_count);
+      return wrays_gl_query_intersection(webrays, ads, ray_buffers,
+                                         ray_buffer_count, intersections,
+                                         dimensions, dimension_count);
+    case WR_BACKEND_TYPE_CPU:
+      // The host traversal reads the nodes that a build replaces
+      wr_builder_wait(webrays);
+      return wrays_cpu_query_intersection(webrays, ads, ray_buffers,
+                                          ray_buffer_count, intersections,
+                                          dimensions, dimension_count);
+    default: break;
+  }
+
+  return WR_SUCCESS;
+}
+
+wr_error
+wrays_query_intersection_occlusion(
+  wr_handle handle, wr_handle ads, wr_handle* ray_buffers,
+  wr_size ray_buffer_count, wr_handle intersections,
+  wr_handle* occlusion_ray_buffers, wr_size occlusion_ray_buffer_count,
+  wr_handle occlusion, wr_size* dimensions, wr_size dimension_count)
+{
+  wr_context* webrays = (wr_context*)handle;
+  WR_PROFILE_BIND(webrays);
+  WR_PROFILE_ZONE("wrays_query_intersection_occlusion");
+
+  switch (webrays->backend_type) {
+    case WR_BACKEND_TYPE_GLES:
+      return wrays_gl_query_intersection_occlusion(
+        webrays, ads, ray_buffers, ray_buffer_count, intersections,
+        occlusion_ray_buffers, occlusion_ray_buffer_count, occlusion,
+        dimensions, dimension_count);
+    case WR_BACKEND_TYPE_CPU:
+      wr_builder_wait(webrays);
+      return wrays_cpu_query_intersection_occlusion(
+        webrays, ads, ray_buffers, ray_buffer_count, intersections,
+        occlusion_ray_buffers, occlusion_ray_buffer_count, occlusion,
+        dimensions, dimension_count);
     default: break;
   }
 
@@ -346,11 +868,19 @@ wrays_query_occlusion(wr_handle handle, wr_handle ads, wr_handle* ray_buffers,
                       wr_size* dimensions, wr_size dimension_count)
 {
   wr_context* webrays = (wr_context*)handle;
+  WR_PROFILE_BIND(webrays);
+  WR_PROFILE_ZONE("wrays_query_occlusion");
 
   switch (webrays->backend_type) {
     case WR_BACKEND_TYPE_GLES:
-      wrays_gl_query_occlusion(webrays, ads, ray_buffers, ray_buffer_count,
-                               occlusion, dimensions, dimension_count);
+      return wrays_gl_query_occlusion(webrays, ads, ray_buffers,
+                                      ray_buffer_count, occlusion, dimensions,
+                                      dimension_count);
+    case WR_BACKEND_TYPE_CPU:
+      wr_builder_wait(webrays);
+      return wrays_cpu_query_occlusion(webrays, ads, ray_buffers,
+                                       ray_buffer_count, occlusion, dimensions,
+                                       dimension_count);
     default: break;
   }
 
@@ -368,6 +898,13 @@ wrays_update(wr_handle handle, wr_update_flags* flags)
   if (webrays->needs_update == 0)
     return WR_SUCCESS;
 
+  WR_PROFILE_BIND(webrays);
+  WR_PROFILE_ZONE("wrays_update");
+
+  // Finish the builds of wrays_update_async, the backends skip the BLASes
+  // that are already built
+  wr_builder_wait(webrays);
+
   switch (webrays->backend_type) {
     case WR_BACKEND_TYPE_GLES: error = wrays_gl_update(handle, flags); break;
     case WR_BACKEND_TYPE_CPU: error = wrays_cpu_update(handle); break;
@@ -379,9 +916,59 @@ wrays_update(wr_handle handle, wr_update_flags* flags)
   return error;
 }
 
+wr_error
+wrays_update_async(wr_handle handle)
+{
+  wr_context* webrays = (wr_context*)handle;
+
+  if (webrays->needs_update == 0)
+    return WR_SUCCESS;
+
+  wr_builder_start(webrays);
+
+  return WR_SUCCESS;
+}
+
+wr_error
+wrays_update_ready(wr_handle handle, wr_bool* ready)
+{
+  wr_context* webrays = (wr_context*)handle;
+
+  if (ready == nullptr)
+    return WR_INVALID_COMPLETION_FLAG;
+
+  *ready = wr_builder_done(webrays) ? WR_TRUE : WR_FALSE;
+
+  return WR_SUCCESS;
+}
+
+#define WR_PROFILE_DISABLED                                                    \
+  ((wr_error) "WebRays was built without profiling (ENABLE_PROFILING)")
+#define WR_INVALID_PROFILE_PATH ((wr_error) "Invalid profile output path")
+wr_error
+wrays_profile_dump(wr_handle handle, const char* path)
+{
+#if WRAYS_PROFILE
+  wr_context* webrays = (wr_context*)handle;
+
+  if (WR_NULL == path)
+    return WR_INVALID_PROFILE_PATH;
+
+  // Fetch the GPU zones before they are written out
+  if (WR_BACKEND_TYPE_GLES == webrays->backend_type)
+    wrays_gl_profile_resolve(handle);
+
+  return wr_profile_write(wr_profiler_get(webrays), path);
+#else
+  return WR_PROFILE_DISABLED;
+#endif
+}
+
 wr_error
 wrays_destroy(wr_handle webrays)
 {
+  wr_builder_destroy((wr_context*)webrays);
+
   return WR_SUCCESS;
 }
 
@@ -407,6 +994,8 @@ wrays_occlusion_buffer_destroy(wr_handle handle, wr_handle buffer)
 wr_error
 wrays_ads_destroy(wr_handle handle, wr_handle ads)
 {
+  wr_builder_wait((wr_context*)handle);
+
   return WR_SUCCESS;
 }
 
@@ -450,4 +1039,25 @@ _wrays_internal_get_occlusion_kernel(wr_handle handle, unsigned int* program)
   return error;
 }
 
+wr_error
+_wrays_internal_get_intersection_occlusion_kernel(wr_handle     handle,
+                                                  unsigned int* program)
+{
+  wr_context* webrays = (wr_context*)handle;
+  wr_error    error   = WR_SUCCESS;
+
+  if (WR_NULL == webrays)
+    return (wr_error) "Invalid WebRays context";
+
+  switch (webrays->backend_type) {
+    case WR_BACKEND_TYPE_GLES:
+      error =
+        _wrays_gl_internal_get_intersection_occlusion_kernel(handle, program);
+      break;
+    default: break;
+  }
+
+  return error;
+}
+
 #endif
\ No newline at end of file
@@ -19,8 +19,21 @@
 #include <list>
 #include <cfloat>
 #include <cstring> // memset
+#include <chrono>
+#include <unordered_map>
+#include <queue>
+
+// The reinsertion pass of wr_bvh_optimize spreads over native threads only,
+// on the web the pthread pool is left to the BLAS builds
+#if WRAYS_THREADS && !defined(__EMSCRIPTEN__)
+#define WR_OPTIMIZE_THREADS 1
+#include <atomic>
+#include <thread>
+#endif
 
 #include "webrays_ads.h"
+#include "webrays_profile.h"
+#include "webrays_simd.h"
 
 /* @see https://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2 */
 static unsigned int
@@ -42,11 +55,41 @@ static char const* const g_copysign_func =
   "intBitsToFloat((floatBitsToInt(x) & 0x7fffffff) | (floatBitsToInt(y) & "
   "0x80000000)); }\n";
 
+// Scene configuration the backend specializes the generated code on. The
+// defaults keep every branch, for code compiled without it
+static char const* const g_scene_config_defaults =
+  R"glsl(
+#ifndef WR_SCENE_BLAS_COUNT
+#define WR_SCENE_BLAS_COUNT 0 /* unknown */
+#endif
+#ifndef WR_SCENE_SPHERES
+#define WR_SCENE_SPHERES 1
+#endif
+)glsl";
+
+// Traversal counters compiled in when WR_TRAVERSAL_STATS is defined, see
+// wrays_set_traversal_stats
+static char const* const g_traversal_stats_func =
+  R"glsl(
+#ifdef WR_TRAVERSAL_STATS
+ivec4 wr_traversal_counters = ivec4(0); /* nodes, triangles, stack depth, terminated */
+#define WR_STATS_NODE() wr_traversal_counters.x++
+#define WR_STATS_TRIANGLE() wr_traversal_counters.y++
+#define WR_STATS_STACK(depth) wr_traversal_counters.z = max(wr_traversal_counters.z, (depth))
+#define WR_STATS_TERMINATED() wr_traversal_counters.w = 1
+ivec4 wr_GetTraversalStats() { return wr_traversal_counters; }
+void wr_ResetTraversalStats() { wr_traversal_counters = ivec4(0); }
+#else
+#define WR_STATS_NODE()
+#define WR_STATS_TRIANGLE()
+#define WR_STATS_STACK(depth)
+#define WR_STATS_TERMINATED()
+#endif
+)glsl";
+
 static char const* const g_ray_triangle_intersection_func =
-  R"glsl(vec3 wr_fast_intersect_triangle(vec3 direction, vec3 origin, vec3 v1, vec3 v2, vec3 v3, float t_max)
+  R"glsl(vec3 wr_fast_intersect_triangle_edges(vec3 direction, vec3 origin, vec3 v1, vec3 e1, vec3 e2, float t_max)
 {
-	vec3 e1 = v2 - v1;
-	vec3 e2 = v3 - v1;
 	vec3 s1 = cross(direction, e2);
 
 #define USE_SAFE_MATH
@@ -70,8 +113,153 @@ static char const* const g_ray_triangle_intersection_func =
 	{
 		return vec3(b1, b2, temp);
 	}
+}
+
+vec3 wr_fast_intersect_triangle(vec3 direction, vec3 origin, vec3 v1, vec3 v2, vec3 v3, float t_max)
+{
+	return wr_fast_intersect_triangle_edges(direction, origin, v1, v2 - v1, v3 - v1, t_max);
+}
+
+// Any-hit variant for occlusion, rejects as early as possible and never
+// produces the barycentrics
+bool wr_fast_occlude_triangle_edges(vec3 direction, vec3 origin, vec3 v1, vec3 e1, vec3 e2, float t_max)
+{
+	vec3 s1 = cross(direction, e2);
+	float invd = 1.0 / dot(s1, e1);
+
+	vec3 d = origin - v1;
+	float b1 = dot(d, s1) * invd;
+	if (b1 < 0.0 || b1 > 1.0)
+		return false;
+	vec3 s2 = cross(d, e1);
+	float b2 = dot(direction, s2) * invd;
+	if (b2 < 0.0 || b1 + b2 > 1.0)
+		return false;
+	float temp = dot(e2, s2) * invd;
+	return temp >= 0.0 && temp < t_max;
+}
+
+bool wr_fast_occlude_triangle(vec3 direction, vec3 origin, vec3 v1, vec3 v2, vec3 v3, float t_max)
+{
+	return wr_fast_occlude_triangle_edges(direction, origin, v1, v2 - v1, v3 - v1, t_max);
+})glsl";
+
+// Two-triangle test of the quad (v0, v1, v2), (v0, v2, v3). Both triangles
+// share v0 and the diagonal e, so the determinants and the side of the
+// diagonal the ray passes come from the same two cross products, and a
+// triangle on the wrong side is rejected before its own cross product.
+// Returns the hit as (b1, b2, t) of the triangle, 0 or 1, in w
+static char const* const g_ray_quad_intersection_func =
+  R"glsl(
+vec4 wr_fast_intersect_quad(vec3 direction, vec3 origin, vec3 v0, vec3 v1, vec3 v2, vec3 v3, float t_max)
+{
+	vec3 d = origin - v0;
+	vec3 e = v2 - v0;
+	vec3 s = cross(direction, e);
+	vec3 c = cross(d, e);
+	float side = dot(direction, c);
+	vec4 hit = vec4(0, 0, t_max, 0);
+
+	vec3 e1 = v1 - v0;
+	float inv_a = 1.0 / dot(s, e1);
+	float a1 = -side * inv_a;
+	if (a1 >= 0.0 && a1 <= 1.0) {
+		vec3 c1 = cross(d, e1);
+		float a2 = dot(direction, c1) * inv_a;
+		float ta = dot(e, c1) * inv_a;
+		if (a2 >= 0.0 && a1 + a2 <= 1.0 && ta >= 0.0 && ta < hit.z)
+			hit = vec4(a1, a2, ta, 0);
+	}
+
+	vec3 e3 = v3 - v0;
+	float inv_b = -1.0 / dot(s, e3);
+	float b2 = side * inv_b;
+	if (b2 >= 0.0 && b2 <= 1.0) {
+		float b1 = dot(d, cross(direction, e3)) * inv_b;
+		float tb = dot(e3, c) * inv_b;
+		if (b1 >= 0.0 && b1 + b2 <= 1.0 && tb >= 0.0 && tb < hit.z)
+			hit = vec4(b1, b2, tb, 1);
+	}
+	return hit;
+}
+
+bool wr_fast_occlude_quad(vec3 direction, vec3 origin, vec3 v0, vec3 v1, vec3 v2, vec3 v3, float t_max)
+{
+	return wr_fast_intersect_quad(direction, origin, v0, v1, v2, v3, t_max).z < t_max;
+}
+)glsl";
+
+static char const* const g_ray_sphere_intersection_func =
+  R"glsl(
+vec3 wr_fast_intersect_sphere(vec3 direction, vec3 origin, vec3 center, float radius, float t_max)
+{
+	vec3 oc = origin - center;
+	float a = dot(direction, direction);
+	float b = dot(oc, direction);
+	float c = dot(oc, oc) - radius * radius;
+	float disc = b * b - a * c;
+	if (disc < 0.0)
+	{
+		return vec3(0, 0, t_max);
+	}
+
+	float s = sqrt(disc);
+	float t = (-b - s) / a;
+	if (t < 0.0)
+		t = (-b + s) / a;
+	if (t < 0.0 || t > t_max)
+	{
+		return vec3(0, 0, t_max);
+	}
+
+	// Spherical coordinates of the hit normal, scaled to [0, 1], take the
+	// place of barycentrics
+	vec3 n = (oc + t * direction) / radius;
+	return vec3(atan(n.y, n.x) * 0.15915494 + 0.5, acos(clamp(n.z, -1.0, 1.0)) * 0.31830989, t);
+}
+
+bool wr_fast_occlude_sphere(vec3 direction, vec3 origin, vec3 center, float radius, float t_max)
+{
+	vec3 oc = origin - center;
+	float a = dot(direction, direction);
+	float b = dot(oc, direction);
+	float c = dot(oc, oc) - radius * radius;
+	float disc = b * b - a * c;
+	if (disc < 0.0)
+		return false;
+
+	float s = sqrt(disc);
+	float t = (-b - s) / a;
+	if (t < 0.0)
+		t = (-b + s) / a;
+	return t >= 0.0 && t < t_max;
+}
+
+vec3 wr_GetSphereNormal(ivec4 intersection)
+{
+	vec2 angles = (wr_DecodeHitAttributes(intersection) - vec2(0.5, 0.0)) * vec2(6.28318531, 3.14159265);
+	float sin_theta = sin(angles.y);
+	return vec3(sin_theta * cos(angles.x), sin_theta * sin(angles.x), cos(angles.y));
+}
+
+vec2 wr_GetSphereTexCoords(ivec4 intersection)
+{
+	return wr_DecodeHitAttributes(intersection);
 })glsl";
 
+// Barycentrics of a triangle hit or texture coordinates of a sphere hit, both
+// in [0, 1]. WR_INTERSECTION_COMPACT results store them as 2x16 unorm
+static char const* const g_hit_attributes_func =
+  R"glsl(
+vec2 wr_DecodeHitAttributes(ivec4 intersection) {
+#ifdef WR_INTERSECTION_COMPACT
+  return unpackUnorm2x16(uint(intersection.y));
+#else
+  return intBitsToFloat(intersection.yz);
+#endif
+}
+)glsl";
+
 static char const* const g_linear_nodes_ray_intersect_fragment_shader =
   R"glsl(
 
@@ -80,7 +268,7 @@ uniform isampler2DArray wr_scene_indices;
 
 vec2
 wr_GetBaryCoords(ivec4 intersection) {
-	return intBitsToFloat(intersection.yz);
+	return wr_DecodeHitAttributes(intersection);
 }
 
 ivec4
@@ -97,18 +285,20 @@ wr_GetNormal(ivec4 intersection) {
 
 float
 wr_GetHitDistance(ivec4 intersection) {
+#ifdef WR_INTERSECTION_COMPACT
+	return 0.0; /* not stored */
+#else
 	return intBitsToFloat(intersection.w);
+#endif
 }
 
 bool wr_query_occlusion(vec3 direction, vec3 origin, float t_max) {
-	float min_distance = t_max;
 	for (int primitive_index = 0; primitive_index < wr_TriangleCount; ++primitive_index) {
 		ivec4 indices = texelFetch(wr_scene_indices, ivec3(primitive_index % WR_PRIMITIVE_TEXTURE_SIZE, primitive_index / WR_PRIMITIVE_TEXTURE_SIZE, 0), 0);
 		vec3 v0 = texelFetch(wr_scene_vertices, ivec3(indices.x % WR_SCENE_TEXTURE_SIZE, indices.x / WR_SCENE_TEXTURE_SIZE, 0), 0).xyz;
   		vec3 v1 = texelFetch(wr_scene_vertices, ivec3(indices.y % WR_SCENE_TEXTURE_SIZE, indices.y / WR_SCENE_TEXTURE_SIZE, 0), 0).xyz;
   		vec3 v2 = texelFetch(wr_scene_vertices, ivec3(indices.z % WR_SCENE_TEXTURE_SIZE, indices.z / WR_SCENE_TEXTURE_SIZE, 0), 0).xyz;
-		vec3 ret = wr_fast_intersect_triangle(direction, origin, v0, v1, v2, min_distance);
-		if (ret.z < min_distance) {
+		if (wr_fast_occlude_triangle(direction, origin, v0, v1, v2, t_max)) {
 			return true;
 		}
 	}
@@ -170,31 +360,39 @@ layout (std140) uniform wr_InstancesUBO
 
 vec2
 wr_GetBaryCoords(ivec4 intersection) {
-  return intBitsToFloat(intersection.yz);
+  return wr_DecodeHitAttributes(intersection);
 }
 
 vec3
 wr_GetBaryCoords3D(ivec4 intersection) {
   vec3 barys;
-  barys.yz = intBitsToFloat(intersection.yz);
+  barys.yz = wr_DecodeHitAttributes(intersection);
   barys.x = 1.0 - barys.y - barys.z;
   return barys;
 }
 
 float
 wr_GetHitDistance(ivec4 intersection) {
+#ifdef WR_INTERSECTION_COMPACT
+	return 0.0; /* not stored */
+#else
 	return intBitsToFloat(intersection.w);
+#endif
 }
 
 vec3
 wr_GetInterpolatedNormal(int ads, ivec4 intersection) {
 	ivec4 face = wr_GetFace(ads, intersection);
-	vec3 b  = wr_GetBaryCoords3D(intersection);
-	vec3 n0 = wr_GetNormal(ads, face.x);
-  	vec3 n1 = wr_GetNormal(ads, face.y);
-  	vec3 n2 = wr_GetNormal(ads, face.z);
-		  
-	vec3 normal = normalize(n0 * b.x + n1 * b.y + n2 * b.z);
+	vec3 normal;
+	if (face.y < 0) {
+	  normal = wr_GetSphereNormal(intersection);
+	} else {
+	  vec3 b  = wr_GetBaryCoords3D(intersection);
+	  vec3 n0 = wr_GetNormal(ads, face.x);
+	  vec3 n1 = wr_GetNormal(ads, face.y);
+	  vec3 n2 = wr_GetNormal(ads, face.z);
+	  normal = normalize(n0 * b.x + n1 * b.y + n2 * b.z);
+	}
 
 #if wr_InstanceCount
     mat4 transform = transpose(instances[intersection.w]);
@@ -207,12 +405,16 @@ wr_GetInterpolatedNormal(int ads, ivec4 intersection) {
 vec3
 wr_GetInterpolatedPosition(int ads, ivec4 intersection) {
 	ivec4 face = wr_GetFace(ads, intersection);
-	vec3 b  = wr_GetBaryCoords3D(intersection);
-	vec3 v0 = wr_GetPositionBLAS(ads, face.x);
-  	vec3 v1 = wr_GetPositionBLAS(ads, face.y);
-  	vec3 v2 = wr_GetPositionBLAS(ads, face.z);
-	
-	vec3 position = v0 * b.x + v1 * b.y + v2 * b.z;
+	vec3 position;
+	if (face.y < 0) {
+	  position = wr_GetPosition(ads, face.x) + intBitsToFloat(face.z) * wr_GetSphereNormal(intersection);
+	} else {
+	  vec3 b  = wr_GetBaryCoords3D(intersection);
+	  vec3 v0 = wr_GetPosition(ads, face.x);
+	  vec3 v1 = wr_GetPosition(ads, face.y);
+	  vec3 v2 = wr_GetPosition(ads, face.z);
+	  position = v0 * b.x + v1 * b.y + v2 * b.z;
+	}
 #if wr_InstanceCount
     mat4 transform = transpose(instances[intersection.w]);
     return vec3( transform * vec4(position, 1.0) );
@@ -224,6 +426,8 @@ wr_GetInterpolatedPosition(int ads, ivec4 intersection) {
 vec2
 wr_GetInterpolatedTexCoords(int ads, ivec4 intersection) {
 	ivec4 face = wr_GetFace(ads, intersection);
+	if (face.y < 0)
+	  return wr_GetSphereTexCoords(intersection);
 	vec3 b     = wr_GetBaryCoords3D(intersection);
 	 
 	vec2 t0    = wr_GetTexCoords(ads, face.x);		  
@@ -236,12 +440,15 @@ wr_GetInterpolatedTexCoords(int ads, ivec4 intersection) {
 vec3
 wr_GetGeomNormal(int ads, ivec4 intersection) {
 	ivec4 face = wr_GetFace(ads, intersection);
-	
-	vec3 v0 = wr_GetPosition(ads, face.x);
-  	vec3 v1 = wr_GetPosition(ads, face.y);
-  	vec3 v2 = wr_GetPosition(ads, face.z);
-	
-	vec3 normal = normalize(cross(v1 - v0, v2 - v0));
+	vec3 normal;
+	if (face.y < 0) {
+	  normal = wr_GetSphereNormal(intersection);
+	} else {
+	  vec3 v0 = wr_GetPosition(ads, face.x);
+	  vec3 v1 = wr_GetPosition(ads, face.y);
+	  vec3 v2 = wr_GetPosition(ads, face.z);
+	  normal = normalize(cross(v1 - v0, v2 - v0));
+	}
 #if wr_InstanceCount
     mat4 transform = transpose(instances[intersection.w]);
     return vec3( transform * vec4(normal, 0.0) );
@@ -273,6 +480,7 @@ wr_BoundsIntersect(vec3 vmin, vec3 vmax, vec3 rpos, vec3 dirfrac, float tmax)
   return 1.0;
 }
 
+#ifndef WR_TRAVERSAL_STACKLESS
 ivec4
 wr_query_shape_intersection(int ads, vec3 ray_origin, vec3 ray_direction, float tmax) {
   float min_distance = tmax;
@@ -288,6 +496,7 @@ wr_query_shape_intersection(int ads, vec3 ray_origin, vec3 ray_direction, float
   for(int loop = 0; loop < wr_BVHNodeCount; ++loop) {
   //while(true) {
     vec4 bound_packed_min = wr_GetPackedBoundMin(ads, currentNodeIndex);
+    WR_STATS_NODE();
     vec4 bound_packed_max = wr_GetPackedBoundMax(ads, currentNodeIndex);
     vec3 bound_min = bound_packed_min.xyz;
     vec3 bound_max = bound_packed_max.xyz;
@@ -300,11 +509,20 @@ wr_query_shape_intersection(int ads, vec3 ray_origin, vec3 ray_direction, float
       if (nPrimitives > 0 ) {
         for (int i = 0; i < nPrimitives; i++ ) {
           int primitve_index = node_offset + i;
-          ivec4 indices = wr_GetIndices(ads, primitve_index);
-    	  vec3 v0 = wr_GetPosition(ads, indices.x);
-    	  vec3 v1 = wr_GetPosition(ads, indices.y);
-    	  vec3 v2 = wr_GetPosition(ads, indices.z);
-		  vec3 ret = wr_fast_intersect_triangle(ray_direction, ray_origin, v0, v1, v2, min_distance);
+#ifdef WR_QUADS
+          if (i < 2 * axis) { /* the leaf starts with axis quads */
+            vec4 quad = wr_IntersectQuad(ads, primitve_index, ray_direction, ray_origin, min_distance);
+            WR_STATS_TRIANGLE();
+            if (quad.z < min_distance) {
+              min_distance = quad.z;
+              min_intersection_point = ivec4(primitve_index + int(quad.w), floatBitsToInt(quad.xy), floatBitsToInt(quad.z));
+            }
+            i++;
+            continue;
+          }
+#endif
+		  vec3 ret = wr_IntersectPrimitive(ads, primitve_index, ray_direction, ray_origin, min_distance);
+		  WR_STATS_TRIANGLE();
 		  if(ret.z < min_distance)
 		  {
             min_distance = ret.z;
@@ -322,6 +540,7 @@ wr_query_shape_intersection(int ads, vec3 ray_origin, vec3 ray_direction, float
           nodesToVisit[toVisitOffset++] = node_offset;
           currentNodeIndex = currentNodeIndex + 1;
         }
+        WR_STATS_STACK(toVisitOffset);
       }
     } else {
       if (toVisitOffset == 0)
@@ -331,26 +550,94 @@ wr_query_shape_intersection(int ads, vec3 ray_origin, vec3 ray_direction, float
   }
 #endif /* wr_TriangleCount */
 
-#if wr_SphereCount
-	for(int i = 0; i < wr_SphereCount; i++ ) {
-		vec4 sphere = spheres.sphere[i]; /* {center_x, center_y, center_z, radius} */
+  return min_intersection_point;
+}
+#else /* WR_TRAVERSAL_STACKLESS */
 
-		float dist = rg_fast_intersect_sphere(sphere.xyz, sphere.w, ray_direction, ray_origin, min_distance);
+#define WR_FROM_PARENT 0
+#define WR_FROM_SIBLING 1
+#define WR_FROM_CHILD 2 /* its subtree is done */
 
-		if(dist < min_distance)
-		{
-			min_distance = dist;
-			vec3 point_on_sphere = ray_origin + ray_direction * dist;
-			vec3 normal = normalize(point_on_sphere - sphere.xyz);
-			vec2 spher = vec2(atan(normal.y, normal.x), acos(normal.z));
+// Stackless traversal. The nodes left to visit are recovered from the parent
+// and sibling links of each node (links.xy) instead of a per-ray array. A
+// finished node continues to its sibling only if it was entered first, which
+// depends on the split axis of its parent (links.z >> 1) and on which child
+// it is (links.z & 1)
+ivec4
+wr_query_shape_intersection(int ads, vec3 ray_origin, vec3 ray_direction, float tmax) {
+  float min_distance = tmax;
+  ivec4 min_intersection_point = ivec4(-1,0,0,floatBitsToInt(tmax));
 
-			min_intersection_point = ivec4(wr_TriangleCount + i, floatBitsToInt(spher), floatBitsToInt(dist));
-		}
-	}
-#endif /* wr_SphereCount */
+#if wr_TriangleCount && wr_BVHNodeCount
+  vec3 invDir = vec3(1.0 / ray_direction.x, 1.0 / ray_direction.y, 1.0 / ray_direction.z);
+  bvec3 dirIsNeg = bvec3(invDir.x < 0.0, invDir.y < 0.0, invDir.z < 0.0);
+  int currentNodeIndex = 0;
+  int state = WR_FROM_SIBLING; /* the root */
+  for(int loop = 0; loop < 3 * wr_BVHNodeCount; ++loop) {
+    if (state == WR_FROM_CHILD) {
+      if (currentNodeIndex <= 0)
+        break;
+      ivec4 links = wr_GetNodeLinks(ads, currentNodeIndex);
+      if (((links.z & 1) != 0) != dirIsNeg[links.z >> 1]) {
+        currentNodeIndex = links.y;
+        state = WR_FROM_SIBLING;
+      } else {
+        currentNodeIndex = links.x;
+      }
+      continue;
+    }
+
+    vec4 bound_packed_min = wr_GetPackedBoundMin(ads, currentNodeIndex);
+    WR_STATS_NODE();
+    vec4 bound_packed_max = wr_GetPackedBoundMax(ads, currentNodeIndex);
+    ivec2 node_info = ivec2(floatBitsToInt(bound_packed_min.w), floatBitsToInt(bound_packed_max.w));
+    int node_offset = node_info.x;
+    int nPrimitives = (node_info.y & 0x0000FFFF);
+    int axis = (node_info.y & 0x00FF0000) >> 16;
+    bool found = wr_BoundsIntersect(bound_packed_min.xyz, bound_packed_max.xyz, ray_origin, invDir, min_distance) > 0.0;
+    if (found && nPrimitives == 0) {
+      currentNodeIndex = dirIsNeg[axis] ? node_offset : currentNodeIndex + 1;
+      state = WR_FROM_PARENT;
+      continue;
+    }
+    if (found) {
+      for (int i = 0; i < nPrimitives; i++ ) {
+        int primitve_index = node_offset + i;
+#ifdef WR_QUADS
+        if (i < 2 * axis) { /* the leaf starts with axis quads */
+          vec4 quad = wr_IntersectQuad(ads, primitve_index, ray_direction, ray_origin, min_distance);
+          WR_STATS_TRIANGLE();
+          if (quad.z < min_distance) {
+            min_distance = quad.z;
+            min_intersection_point = ivec4(primitve_index + int(quad.w), floatBitsToInt(quad.xy), floatBitsToInt(quad.z));
+          }
+          i++;
+          continue;
+        }
+#endif
+        vec3 ret = wr_IntersectPrimitive(ads, primitve_index, ray_direction, ray_origin, min_distance);
+        WR_STATS_TRIANGLE();
+        if (ret.z < min_distance) {
+          min_distance = ret.z;
+          min_intersection_point = ivec4(primitve_index, floatBitsToInt(ret.xy), floatBitsToInt(ret.z));
+        }
+      }
+    }
+
+    ivec4 links = wr_GetNodeLinks(ads, currentNodeIndex);
+    if (state == WR_FROM_PARENT) {
+      currentNodeIndex = links.y;
+      state = WR_FROM_SIBLING;
+    } else {
+      currentNodeIndex = links.x;
+      state = WR_FROM_CHILD;
+    }
+  }
+#endif /* wr_TriangleCount */
 
   return min_intersection_point;
 }
+#endif /* WR_TRAVERSAL_STACKLESS */
 
 ivec4
 wr_query_intersection(int ads, vec3 ray_origin, vec3 ray_direction, float tmax) {
@@ -378,19 +665,21 @@ wr_query_intersection(int ads, vec3 ray_origin, vec3 ray_direction, float tmax)
 #endif
 }
 
+#ifndef WR_TRAVERSAL_STACKLESS
+// Any-hit traversal. Children are visited in memory order, since without a
+// closest hit to shrink tMax the ordering buys nothing, and the first hit
+// ends the query
 bool
 wr_query_occlusion(int ads, vec3 ray_origin, vec3 ray_direction, float tMax) {
-  float min_distance = tMax;
-
 #if wr_TriangleCount && wr_BVHNodeCount
   vec3 invDir = vec3(1.0 / ray_direction.x, 1.0 / ray_direction.y, 1.0 / ray_direction.z);
-  bvec3 dirIsNeg = bvec3(invDir.x < 0.0, invDir.y < 0.0, invDir.z < 0.0);
   int toVisitOffset = 0, currentNodeIndex = 0;
   int nodesToVisit[WR_TRAVERSE_STACK_SIZE];
   bool found = false;
   for(int loop = 0; loop < wr_BVHNodeCount; ++loop) {
   //while(true) {
 	vec4 bound_packed_min = wr_GetPackedBoundMin(ads, currentNodeIndex);
+    WR_STATS_NODE();
     vec4 bound_packed_max = wr_GetPackedBoundMax(ads, currentNodeIndex);
     vec3 bound_min = bound_packed_min.xyz;
     vec3 bound_max = bound_packed_max.xyz;        
@@ -398,18 +687,25 @@ wr_query_occlusion(int ads, vec3 ray_origin, vec3 ray_direction, float tMax) {
 
 	int node_offset = node_info.x;
     int nPrimitives = (node_info.y & 0x0000FFFF);
-    int axis = (node_info.y & 0x00FF0000) >> 16;
     found = wr_BoundsIntersect(bound_min, bound_max, ray_origin, invDir, tMax) > 0.0;
     if (found) {
       if (nPrimitives > 0 ) {
+#ifdef WR_QUADS
+        int nQuads = (node_info.y & 0x00FF0000) >> 16;
+#endif
         for (int i = 0; i < nPrimitives; i++ ) {
-          int primitve_index = node_offset + i;
-          ivec4 indices = wr_GetIndices(ads, primitve_index);
-    	  vec3 v0 = wr_GetPosition(ads, indices.x);
-    	  vec3 v1 = wr_GetPosition(ads, indices.y);
-    	  vec3 v2 = wr_GetPosition(ads, indices.z);
-	      vec3 ret = wr_fast_intersect_triangle(ray_direction, ray_origin, v0, v1, v2, tMax);
-	      if( ret.z < tMax ) { 
+	      WR_STATS_TRIANGLE();
+#ifdef WR_QUADS
+	      if (i < 2 * nQuads) {
+	        if (wr_OccludedQuad(ads, node_offset + i++, ray_direction, ray_origin, tMax)) {
+	          WR_STATS_TERMINATED();
+	          return true;
+	        }
+	        continue;
+	      }
+#endif
+	      if (wr_OccludedPrimitive(ads, node_offset + i, ray_direction, ray_origin, tMax)) {
+	        WR_STATS_TERMINATED();
 			return true;
 	      }
         }
@@ -417,13 +713,9 @@ wr_query_occlusion(int ads, vec3 ray_origin, vec3 ray_direction, float tMax) {
           break;
         currentNodeIndex = nodesToVisit[--toVisitOffset];
       } else {
-        if (dirIsNeg[axis]) {
-          nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-          currentNodeIndex = node_offset;
-        } else {
-          nodesToVisit[toVisitOffset++] = node_offset;
-          currentNodeIndex = currentNodeIndex + 1;
-        }
+        nodesToVisit[toVisitOffset++] = node_offset;
+        currentNodeIndex = currentNodeIndex + 1;
+        WR_STATS_STACK(toVisitOffset);
       }
     } else {
       if (toVisitOffset == 0)
@@ -433,32 +725,93 @@ wr_query_occlusion(int ads, vec3 ray_origin, vec3 ray_direction, float tMax) {
   }
 #endif /* wr_TriangleCount */
 
-#if wr_SphereCount
-  /* Special handling for spheres */
-  for(int i = 0; i < wr_SphereCount; i++ ) {
-	vec4 sphere = spheres.sphere[i]; /* {center_x, center_y, center_z, radius} */
+  return false;
+}
+#else /* WR_TRAVERSAL_STACKLESS */
 
-	float dist = rg_fast_intersect_sphere(sphere.xyz, sphere.w, ray_direction, ray_origin, WR_RAY_MAX_DISTANCE);
+// Stackless any-hit traversal, children are entered in memory order
+bool
+wr_query_occlusion(int ads, vec3 ray_origin, vec3 ray_direction, float tMax) {
+#if wr_TriangleCount && wr_BVHNodeCount
+  vec3 invDir = vec3(1.0 / ray_direction.x, 1.0 / ray_direction.y, 1.0 / ray_direction.z);
+  int currentNodeIndex = 0;
+  int state = WR_FROM_SIBLING; /* the root */
+  for(int loop = 0; loop < 3 * wr_BVHNodeCount; ++loop) {
+    if (state == WR_FROM_CHILD) {
+      if (currentNodeIndex <= 0)
+        break;
+      ivec4 links = wr_GetNodeLinks(ads, currentNodeIndex);
+      if ((links.z & 1) != 0) {
+        currentNodeIndex = links.y;
+        state = WR_FROM_SIBLING;
+      } else {
+        currentNodeIndex = links.x;
+      }
+      continue;
+    }
 
-	if(dist < tMax)
-	{
-	  return true;
-	}
+    vec4 bound_packed_min = wr_GetPackedBoundMin(ads, currentNodeIndex);
+    WR_STATS_NODE();
+    vec4 bound_packed_max = wr_GetPackedBoundMax(ads, currentNodeIndex);
+    ivec2 node_info = ivec2(floatBitsToInt(bound_packed_min.w), floatBitsToInt(bound_packed_max.w));
+    int node_offset = node_info.x;
+    int nPrimitives = (node_info.y & 0x0000FFFF);
+    bool found = wr_BoundsIntersect(bound_packed_min.xyz, bound_packed_max.xyz, ray_origin, invDir, tMax) > 0.0;
+    if (found && nPrimitives == 0) {
+      currentNodeIndex = currentNodeIndex + 1;
+      state = WR_FROM_PARENT;
+      continue;
+    }
+    if (found) {
+#ifdef WR_QUADS
+      int nQuads = (node_info.y & 0x00FF0000) >> 16;
+#endif
+      for (int i = 0; i < nPrimitives; i++ ) {
+        WR_STATS_TRIANGLE();
+#ifdef WR_QUADS
+        if (i < 2 * nQuads) {
+          if (wr_OccludedQuad(ads, node_offset + i++, ray_direction, ray_origin, tMax)) {
+            WR_STATS_TERMINATED();
+            return true;
+          }
+          continue;
+        }
+#endif
+        if (wr_OccludedPrimitive(ads, node_offset + i, ray_direction, ray_origin, tMax)) {
+          WR_STATS_TERMINATED();
+          return true;
+        }
+      }
+    }
+
+    ivec4 links = wr_GetNodeLinks(ads, currentNodeIndex);
+    if (state == WR_FROM_PARENT) {
+      currentNodeIndex = links.y;
+      state = WR_FROM_SIBLING;
+    } else {
+      currentNodeIndex = links.x;
+      state = WR_FROM_CHILD;
+    }
   }
-#endif /* wr_SphereCount */
+#endif /* wr_TriangleCount */
 
   return false;
 }
+#endif /* WR_TRAVERSAL_STACKLESS */
 )glsl";
 
 static char const* const g_widebvh_get_instance_transfrom =
   R"glsl(
 
 int wr_GetBLASID(int ads, int instance) { 
+#if WR_SCENE_BLAS_COUNT == 1
+  return 0;
+#else
   int ads_id = wr_GetAdsID(ads);
 
   int b = 4 * instance + 3; 
   return floatBitsToInt(texelFetch(wr_scene_instances, ivec3(b % WR_INSTANCE_TEXTURE_SIZE, 0, ads_id), 0).r); 
+#endif
 }
 
 mat4 wr_GetObjectTranform(int ads, int instance) { 
@@ -494,6 +847,14 @@ mat4 wr_GetNormalTranform(int ads, int instance) {
 static char const* const g_widebvh_get_ads_id =
   R"glsl(
 
+#if defined(WR_ENTRY_TLAS)
+#define WR_ENTRY_IS_TLAS(x) true
+#elif defined(WR_ENTRY_BLAS)
+#define WR_ENTRY_IS_TLAS(x) false
+#else
+#define WR_ENTRY_IS_TLAS(x) WR_IS_TLAS(x)
+#endif
+
 bool wr_IsValidIntersection(ivec4 intersection) {
   return !(intersection.x < 0);
 }
@@ -533,11 +894,11 @@ ivec4 wr_GetFace(int ads, ivec4 intersection) {
 #else
   int blas_id  = ads_id;
 #endif
-  return texelFetch(wr_scene_indices, ivec3(wr_GetTriangleID(ads, intersection) % WR_PRIMITIVE_TEXTURE_SIZE, wr_GetTriangleID(ads, intersection) / WR_PRIMITIVE_TEXTURE_SIZE, blas_id), 0);
+  return wr_FetchFace(blas_id, wr_GetTriangleID(ads, intersection));
 }
 
 ivec4 wr_GetIndicesBLAS(int blas, int i) { 
-  return texelFetch(wr_scene_indices, ivec3(i % WR_PRIMITIVE_TEXTURE_SIZE, i / WR_PRIMITIVE_TEXTURE_SIZE, blas), 0); 
+  return wr_FetchFace(blas, i); 
 }
 
 vec3 wr_GetNormalBLAS(int blas, int i) { 
@@ -553,15 +914,19 @@ vec2 wr_GetTexCoordsBLAS(int blas, int i) {
 }
 
 vec2 wr_GetBaryCoords(ivec4 intersection) {
-  return intBitsToFloat(intersection.yz); 
+  return wr_DecodeHitAttributes(intersection); 
 }
 
 vec3 wr_GetBaryCoords3D(ivec4 intersection) {
-  vec3 barys; barys.yz = intBitsToFloat(intersection.yz); barys.x = 1.0 - barys.y - barys.z; return barys; 
+  vec3 barys; barys.yz = wr_DecodeHitAttributes(intersection); barys.x = 1.0 - barys.y - barys.z; return barys; 
 }
 
 float wr_GetHitDistance(ivec4 intersection) {
+#ifdef WR_INTERSECTION_COMPACT
+  return 0.0; /* not stored */
+#else
   return intBitsToFloat(intersection.w); 
+#endif
 }
 
 ivec4 wr_GetIndices(int ads, ivec4 intersection, int i) { 
@@ -635,12 +1000,17 @@ wr_GetInterpolatedNormal(int ads, ivec4 intersection) {
     int blas_id  = ads_id;
 #endif
 	ivec4 face = wr_GetIndicesBLAS(blas_id, wr_GetTriangleID(ads, intersection));
-	vec3 b  = wr_GetBaryCoords3D(intersection);
-	vec3 n0 = wr_GetNormalBLAS(blas_id, face.x);
-	vec3 n1 = wr_GetNormalBLAS(blas_id, face.y);
-	vec3 n2 = wr_GetNormalBLAS(blas_id, face.z);
-	vec3 normal = n0 * b.x + n1 * b.y + n2 * b.z;
-	normal = normalize(normal);
+	vec3 normal;
+	if (face.y < 0) {
+	  normal = wr_GetSphereNormal(intersection);
+	} else {
+	  vec3 b  = wr_GetBaryCoords3D(intersection);
+	  vec3 n0 = wr_GetNormalBLAS(blas_id, face.x);
+	  vec3 n1 = wr_GetNormalBLAS(blas_id, face.y);
+	  vec3 n2 = wr_GetNormalBLAS(blas_id, face.z);
+	  normal = n0 * b.x + n1 * b.y + n2 * b.z;
+	  normal = normalize(normal);
+	}
 #if wr_InstanceCount
 	if ( WR_IS_TLAS(ads) )
 	  return normalize(wr_TransformDirectionFromObjectToWorldSpace(ads, instance, normal));
@@ -660,11 +1030,16 @@ wr_GetInterpolatedPosition(int ads, ivec4 intersection) {
     int blas_id  = ads_id;
 #endif
 	ivec4 face = wr_GetIndicesBLAS(blas_id, wr_GetTriangleID(ads, intersection));
-	vec3 b  = wr_GetBaryCoords3D(intersection);
-	vec3 v0 = wr_GetPositionBLAS(blas_id, face.x);
-  	vec3 v1 = wr_GetPositionBLAS(blas_id, face.y);
-  	vec3 v2 = wr_GetPositionBLAS(blas_id, face.z);	
-	vec3 position = v0 * b.x + v1 * b.y + v2 * b.z;
+	vec3 position;
+	if (face.y < 0) {
+	  position = wr_GetPositionBLAS(blas_id, face.x) + intBitsToFloat(face.z) * wr_GetSphereNormal(intersection);
+	} else {
+	  vec3 b  = wr_GetBaryCoords3D(intersection);
+	  vec3 v0 = wr_GetPositionBLAS(blas_id, face.x);
+	  vec3 v1 = wr_GetPositionBLAS(blas_id, face.y);
+	  vec3 v2 = wr_GetPositionBLAS(blas_id, face.z);
+	  position = v0 * b.x + v1 * b.y + v2 * b.z;
+	}
 #if wr_InstanceCount
 	if ( WR_IS_TLAS(ads) )
 	  return wr_TransformPositionFromObjectToWorldSpace(ads, instance, position);
@@ -684,6 +1059,8 @@ wr_GetInterpolatedTexCoords(int ads, ivec4 intersection) {
     int blas_id  = ads_id;
 #endif
 	ivec4 face = wr_GetIndicesBLAS(blas_id, wr_GetTriangleID(ads, intersection));
+	if (face.y < 0)
+	  return wr_GetSphereTexCoords(intersection);
 	vec3 b     = wr_GetBaryCoords3D(intersection);	 
 	vec2 t0    = wr_GetTexCoordsBLAS(blas_id, face.x);		  
 	vec2 t1    = wr_GetTexCoordsBLAS(blas_id, face.y);		  
@@ -702,11 +1079,16 @@ wr_GetGeomNormal(int ads, ivec4 intersection) {
 #endif
 
 	ivec4 face = wr_GetIndicesBLAS(blas_id, wr_GetTriangleID(ads, intersection));
-	vec3 v0 = wr_GetPositionBLAS(blas_id, face.x);
-  	vec3 v1 = wr_GetPositionBLAS(blas_id, face.y);
-  	vec3 v2 = wr_GetPositionBLAS(blas_id, face.z);	
-	vec3 normal = cross(v1 - v0, v2 - v0);
-	normal = normalize(normal);
+	vec3 normal;
+	if (face.y < 0) {
+	  normal = wr_GetSphereNormal(intersection);
+	} else {
+	  vec3 v0 = wr_GetPositionBLAS(blas_id, face.x);
+	  vec3 v1 = wr_GetPositionBLAS(blas_id, face.y);
+	  vec3 v2 = wr_GetPositionBLAS(blas_id, face.z);
+	  normal = cross(v1 - v0, v2 - v0);
+	  normal = normalize(normal);
+	}
 #if wr_InstanceCount
 	if ( WR_IS_TLAS(ads) )
 	  return normalize(wr_TransformDirectionFromObjectToWorldSpace(ads, instance, normal));
@@ -732,6 +1114,7 @@ float fmin3(float a, float b, float c) { return min(a, min(b, c)); }
 
 void intersectChildren(int ads, int node_index, inout ivec2 G, inout ivec2 Gt, const in vec3 ray_orig, const in vec3 ray_dir, float ray_tMax)
 {
+	WR_STATS_NODE();
 	vec4 p = wr_GetPackedPosExyzMask(ads, node_index);
 	ivec4 node_data1 = wr_GetPackedNodeTriangleBaseIndexMeta(ads, node_index);
 	ivec4 node_data2 = wr_GetPackedChildBBOX0(ads, node_index);
@@ -930,6 +1313,7 @@ wr_query_shape_intersection(int ads, vec3 ray_origin, vec3 ray_direction, float
 	  {
 		// push the remaining nodes to the stack
 		nodesToVisit[++toVisitOffset] = nodeGroup;
+		WR_STATS_STACK(toVisitOffset);
 	  }
 
 	  intersectChildren(ads, nodeGroup.x + n, nodeGroup, triangleGroup, ray_origin, ray_direction, min_distance);
@@ -944,12 +1328,8 @@ wr_query_shape_intersection(int ads, vec3 ray_origin, vec3 ray_direction, float
 	int relative_index_of_triangle = 0;
 	while (triangle_hits > 0) 
 	{
-		ivec4 indices = wr_GetIndicesBLAS(ads, triangleGroup.x + relative_index_of_triangle);
-		float u, v;
-		vec3 v0 = wr_GetPositionBLAS(ads, indices.x);
-    	vec3 v1 = wr_GetPositionBLAS(ads, indices.y);
-    	vec3 v2 = wr_GetPositionBLAS(ads, indices.z);
-	    vec3 ret = wr_fast_intersect_triangle(ray_direction, ray_origin, v0, v1, v2, min_distance);
+	    vec3 ret = wr_IntersectPrimitive(ads, triangleGroup.x + relative_index_of_triangle, ray_direction, ray_origin, min_distance);
+	    WR_STATS_TRIANGLE();
 	    if( ret.z < min_distance ) { 
 			min_intersection_point = ivec4(triangleGroup.x + relative_index_of_triangle, floatBitsToInt(ret.xy), floatBitsToInt(ret.z));
 			min_distance = ret.z;
@@ -967,24 +1347,6 @@ wr_query_shape_intersection(int ads, vec3 ray_origin, vec3 ray_direction, float
  
 #endif /* wr_TriangleCount */
 
-#if wr_SphereCount
-	for(int i = 0; i < wr_SphereCount; i++ ) {
-		vec4 sphere = spheres.sphere[i]; /* {center_x, center_y, center_z, radius} */
-
-		float dist = rg_fast_intersect_sphere(sphere.xyz, sphere.w, ray_direction, ray_origin, min_distance);
-
-		if(dist < min_distance)
-		{
-			min_distance = dist;
-			vec3 point_on_sphere = ray_origin + ray_direction * dist;
-			vec3 normal = normalize(point_on_sphere - sphere.xyz);
-			vec2 spher = vec2(atan(normal.y, normal.x), acos(normal.z));
-
-			min_intersection_point = ivec4(wr_TriangleCount + i, floatBitsToInt(spher), floatBitsToInt(dist));
-		}
-	}
-#endif /* wr_SphereCount */
-
   return min_intersection_point;
 }
 
@@ -992,7 +1354,7 @@ wr_query_shape_intersection(int ads, vec3 ray_origin, vec3 ray_direction, float
 ivec4
 wr_query_intersection(int ads, vec3 ray_origin, vec3 ray_direction, float tmax) {
 #if wr_InstanceCount
-  if ( WR_IS_TLAS(ads) ) {
+  if ( WR_ENTRY_IS_TLAS(ads) ) {
     float min_distance = tmax;
     ivec4 min_intersection_point = ivec4(-1,0,0,floatBitsToInt(tmax));
     for (int i = 0; i < wr_InstanceCount; ++i) {
@@ -1047,6 +1409,7 @@ wr_query_shape_occlusion(int ads, vec3 ray_origin, vec3 ray_direction, float tMa
 	  {
 		// push the remaining nodes to the stack
 		nodesToVisit[++toVisitOffset] = nodeGroup;
+		WR_STATS_STACK(toVisitOffset);
 	  }
 
 	  // 9: intersect with all children of G (returns G and Gt) (G contains only internal nodes and Gt contains triangle nodes. A WideNode can contain both)
@@ -1063,19 +1426,13 @@ wr_query_shape_occlusion(int ads, vec3 ray_origin, vec3 ray_direction, float tMa
 	while (triangle_hits > 0) // 14: 
 	{
 		//19: t = GetNextTriangle(Gt)
-		ivec4 indices = wr_GetIndicesBLAS(ads, triangleGroup.x + relative_index_of_triangle);
-
 		//20: Gt = Gt / t; // no need to remove since we check for all triangles here
 
 		//21: IntersectTriangle(t, r);
-		float u, v;
-		//float tHit = tMax;
-		vec3 v0 = wr_GetPositionBLAS(ads, indices.x);
-    	vec3 v1 = wr_GetPositionBLAS(ads, indices.y);
-    	vec3 v2 = wr_GetPositionBLAS(ads, indices.z);
-	    vec3 ret = wr_fast_intersect_triangle(ray_direction, ray_origin, v0, v1, v2, tMax);
-	    if( ret.z < tMax ) { 
-			return true;
+	    WR_STATS_TRIANGLE();
+	    if (wr_OccludedPrimitive(ads, triangleGroup.x + relative_index_of_triangle, ray_direction, ray_origin, tMax)) {
+	      WR_STATS_TERMINATED();
+	      return true;
 	    }
 		
 		relative_index_of_triangle++;
@@ -1090,20 +1447,6 @@ wr_query_shape_occlusion(int ads, vec3 ray_origin, vec3 ray_direction, float tMa
   }
 #endif /* wr_TriangleCount */
 
-#if wr_SphereCount
-  /* Special handling for spheres */
-  for(int i = 0; i < wr_SphereCount; i++ ) {
-	vec4 sphere = spheres.sphere[i]; /* {center_x, center_y, center_z, radius} */
-
-	float dist = rg_fast_intersect_sphere(sphere.xyz, sphere.w, ray_direction, ray_origin, WR_RAY_MAX_DISTANCE);
-
-	if(dist < tMax)
-	{
-	  return true;
-	}
-  }
-#endif /* wr_SphereCount */
-
   return false;
 }
 
@@ -1111,7 +1454,7 @@ wr_query_shape_occlusion(int ads, vec3 ray_origin, vec3 ray_direction, float tMa
 bool
 wr_query_occlusion(int ads, vec3 ray_origin, vec3 ray_direction, float tmax) {
 #if wr_InstanceCount
-  if ( WR_IS_TLAS(ads) ) {
+  if ( WR_ENTRY_IS_TLAS(ads) ) {
     for (int i = 0; i < wr_InstanceCount; ++i) {
 	  vec3 world_ray_origin = wr_GetWorldRayOrigin(ads, i, ray_origin);
 	  vec3 world_ray_direction = wr_GetWorldRayDirection(ads, i, ray_direction);
@@ -1194,15 +1537,6 @@ wr_bounds_union(const wr_bounds& b1, const wr_bounds& b2)
                  wrays_maxf(b1.max.z, b2.max.z) } };
 }
 
-static wr_bounds
-wr_bounds_union_point(const wr_bounds& b, const vec3& p)
-{
-  return { vec3{ wrays_minf(b.min.x, p.x), wrays_minf(b.min.y, p.y),
-                 wrays_minf(b.min.z, p.z) },
-           vec3{ wrays_maxf(b.max.x, p.x), wrays_maxf(b.max.y, p.y),
-                 wrays_maxf(b.max.z, p.z) } };
-}
-
 static vec3
 wr_bounds_offset(const wr_bounds& bounds, const vec3 p)
 {
@@ -1237,6 +1571,80 @@ wr_triangle_bounds(vec3 v1, vec3 v2, vec3 v3)
   return bounds;
 }
 
+static float
+wr_sphere_radius(const ivec4& primitive)
+{
+  float radius;
+  std::memcpy(&radius, &primitive.z, sizeof(float));
+  return radius;
+}
+
+// Bounds of an entry of m_triangles, either a triangle or a sphere
+static wr_bounds
+wr_primitive_bounds(const ADS* ads, const ivec4& primitive)
+{
+  const vec4& p0 = ads->m_vertex_data[primitive.x];
+  const vec3  v0 = { p0.x, p0.y, p0.z };
+  if (WR_SPHERE_INDEX == primitive.y) {
+    const float r      = wr_sphere_radius(primitive);
+    wr_bounds   bounds = { { v0.x - r, v0.y - r, v0.z - r },
+                         { v0.x + r, v0.y + r, v0.z + r } };
+    return bounds;
+  }
+
+  const vec4& p1 = ads->m_vertex_data[primitive.y];
+  const vec4& p2 = ads->m_vertex_data[primitive.z];
+  return wr_triangle_bounds(v0, { p1.x, p1.y, p1.z }, { p2.x, p2.y, p2.z });
+}
+
+// Appends num_spheres (x, y, z, radius) spheres, sphere_stride floats apart,
+// as one center vertex and one WR_SPHERE_INDEX primitive each
+static void
+wr_append_spheres(ADS* ads, const float* spheres, int sphere_stride,
+                  const int* user_data, int num_spheres)
+{
+  const int vertex_offset    = (int)ads->m_vertex_data.size();
+  const int primitive_offset = (int)ads->m_triangles.size();
+
+  ads->m_vertex_data.resize(vertex_offset + num_spheres);
+  ads->m_normal_data.resize(vertex_offset + num_spheres);
+  ads->m_triangles.resize(primitive_offset + num_spheres);
+  ads->m_sphere_count += num_spheres;
+  for (int i = 0; i < num_spheres; ++i) {
+    const float* sphere = &spheres[i * sphere_stride];
+    int          radius;
+    std::memcpy(&radius, &sphere[3], sizeof(float));
+
+    ads->m_vertex_data[vertex_offset + i] = { sphere[0], sphere[1], sphere[2],
+                                              0.0f };
+    ads->m_normal_data[vertex_offset + i] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    ads->m_triangles[primitive_offset + i] = {
+      vertex_offset + i, WR_SPHERE_INDEX, radius,
+      (WR_NULL != user_data) ? user_data[i] : 0
+    };
+  }
+}
+
+// Appends num_triangles (v0, v1, v2, ID) index quadruples, offsetting the
+// vertex indices by vertex_offset
+static void
+wr_append_triangles(ADS* ads, const int* indices, int num_triangles,
+                    int vertex_offset)
+{
+  if (num_triangles <= 0)
+    return;
+
+  const size_t  triangle_offset = ads->m_triangles.size();
+  const wr_int4 offset =
+    wr_i4_set(vertex_offset, vertex_offset, vertex_offset, 0);
+
+  ads->m_triangles.resize(triangle_offset + num_triangles);
+  int* triangles = &ads->m_triangles[triangle_offset].x;
+  for (int i = 0; i < num_triangles; ++i)
+    wr_i4_store(&triangles[4 * i],
+                wr_i4_add(wr_i4_load(&indices[4 * i]), offset));
+}
+
 static int
 wr_bounds_maximum_extent(const wr_bounds& bounds)
 {
@@ -1254,12 +1662,14 @@ struct wr_primitive
   int       index;
   wr_bounds bounds;
   vec3      centroid;
+  int       faces = 1; // 2 for a quad, whose second face follows index
 
   wr_primitive() {}
-  wr_primitive(int index, wr_bounds bounds)
+  wr_primitive(int index, wr_bounds bounds, int faces = 1)
     : index(index)
     , bounds(bounds)
     , centroid(wrays_vec3_scalef(wrays_vec3_add(bounds.max, bounds.min), 0.5f))
+    , faces(faces)
   {}
 };
 
@@ -1268,12 +1678,14 @@ struct bvh_node
   wr_bounds bounds;
   bvh_node* children[2];
   int       splitAxis, firstPrimOffset, nPrimitives;
+  int       nQuads; // leaf: the first 2 * nQuads faces are paired
 
   void
-  init_leaf(int first, int n, const wr_bounds& b)
+  init_leaf(int first, int n, const wr_bounds& b, int quads = 0)
   {
     firstPrimOffset = first;
     nPrimitives     = n;
+    nQuads          = quads;
     bounds          = b;
     children[0] = children[1] = nullptr;
   }
@@ -1289,41 +1701,918 @@ struct bvh_node
   }
 };
 
-bvh_node*
-rg_build_bvh_recursive(std::vector<wr_primitive>& primitiveInfo, int start,
-                       int end, std::vector<ivec4>& orderedPrims,
-                       int* total_nodes, const std::vector<ivec4>& m_triangles);
-int
-flattenBVHTree(bvh_node* node, int* offset, wr_linear_bvh_node* nodes);
+// Build-time bounds as (x, y, z, unused) vectors, see webrays_simd.h
+struct wr_bounds4
+{
+  wr_float4 min = wr_f4_splat(std::numeric_limits<float>::max());
+  wr_float4 max = wr_f4_splat(std::numeric_limits<float>::lowest());
+};
 
-SAHBVH::SAHBVH()
-  : maxPrimsInNode(5)
-  , m_shape_id_generator(0)
-  , m_material_id_generator(0)
+static wr_float4
+wr_vec3_to_float4(const vec3& v)
 {
-  std::memset(&m_webgl_textures, 0, sizeof(m_webgl_textures));
-  m_need_update         = true;
-  m_linear_nodes        = nullptr;
-  intersection_code     = nullptr;
-  m_total_nodes         = 0;
-  m_vertex_texture_size = 0;
-  m_index_texture_size  = 0;
-  m_node_texture_size   = 0;
-  m_webgl_binding_count = 3;
+  return wr_f4_set(v.x, v.y, v.z, 0.0f);
 }
 
-SAHBVH::~SAHBVH()
+static void
+wr_bounds4_union(wr_bounds4* bounds, const wr_bounds4& other)
 {
-  delete[] intersection_code;
-  delete[] m_linear_nodes;
+  bounds->min = wr_f4_min(bounds->min, other.min);
+  bounds->max = wr_f4_max(bounds->max, other.max);
 }
 
-int
-SAHBVH::AddSphere(float* position, float radius, int materialID)
+static wr_bounds
+wr_bounds4_to_bounds(const wr_bounds4& bounds)
 {
-  return 0;
+  float lanes[8];
+  wr_f4_store(&lanes[0], bounds.min);
+  wr_f4_store(&lanes[4], bounds.max);
+  return { { lanes[0], lanes[1], lanes[2] }, { lanes[4], lanes[5], lanes[6] } };
+}
+
+// Bounds of the primitives in [start, end) and of their centroids
+static void
+wr_primitive_range_bounds(const std::vector<wr_primitive>& primitives,
+                          int start, int end, wr_bounds* bounds,
+                          wr_bounds* centroid_bounds)
+{
+  wr_bounds4 b, c;
+  for (int i = start; i < end; ++i) {
+    const wr_primitive& primitive = primitives[i];
+    const wr_float4     centroid  = wr_vec3_to_float4(primitive.centroid);
+    b.min = wr_f4_min(b.min, wr_vec3_to_float4(primitive.bounds.min));
+    b.max = wr_f4_max(b.max, wr_vec3_to_float4(primitive.bounds.max));
+    c.min = wr_f4_min(c.min, centroid);
+    c.max = wr_f4_max(c.max, centroid);
+  }
+  *bounds          = wr_bounds4_to_bounds(b);
+  *centroid_bounds = wr_bounds4_to_bounds(c);
+}
+
+// SAH cost of splitting the primitives in [start, end) after each of the
+// first bucket_count - 1 buckets along dim. The unions of either side come
+// from a prefix and a suffix sweep over the buckets
+static void
+wr_binned_split_costs(const std::vector<wr_primitive>& primitives, int start,
+                      int end, const wr_bounds& bounds,
+                      const wr_bounds& centroid_bounds, int dim,
+                      int bucket_count, float* cost)
+{
+  wr_bounds4 buckets[WR_MAX_BUCKETS];
+  int        counts[WR_MAX_BUCKETS] = {};
+  for (int i = start; i < end; ++i) {
+    const wr_primitive& primitive = primitives[i];
+    const float         offset =
+      wr_bounds_offset(centroid_bounds, primitive.centroid).at[dim];
+    int b = int(bucket_count * offset);
+    if (b == bucket_count)
+      b = bucket_count - 1;
+    counts[b]++;
+    buckets[b].min =
+      wr_f4_min(buckets[b].min, wr_vec3_to_float4(primitive.bounds.min));
+    buckets[b].max =
+      wr_f4_max(buckets[b].max, wr_vec3_to_float4(primitive.bounds.max));
+  }
+
+  float      right_area[WR_MAX_BUCKETS - 1];
+  int        right_count[WR_MAX_BUCKETS - 1];
+  wr_bounds4 right;
+  int        count = 0;
+  for (int i = bucket_count - 1; i > 0; --i) {
+    wr_bounds4_union(&right, buckets[i]);
+    count += counts[i];
+    right_area[i - 1]  = wr_bounds_surface_area(wr_bounds4_to_bounds(right));
+    right_count[i - 1] = count;
+  }
+
+  const float area = wr_bounds_surface_area(bounds);
+  wr_bounds4  left;
+  count = 0;
+  for (int i = 0; i < bucket_count - 1; ++i) {
+    wr_bounds4_union(&left, buckets[i]);
+    count += counts[i];
+    const float left_area = wr_bounds_surface_area(wr_bounds4_to_bounds(left));
+    cost[i] =
+      1.0f + (count * left_area + right_count[i] * right_area[i]) / area;
+  }
+}
+
+bvh_node*
+rg_build_bvh_recursive(std::vector<wr_primitive>& primitiveInfo, int start,
+                       int end, std::vector<ivec4>& orderedPrims,
+                       int* total_nodes, const std::vector<ivec4>& m_triangles,
+                       const wr_build_params& params);
+static bvh_node*
+wr_sah_bvh_build_spatial(const SAHBVH*               bvh,
+                         std::vector<wr_primitive>& primitives,
+                         std::vector<ivec4>& orderedPrims, int* total_nodes);
+int
+flattenBVHTree(bvh_node* node, int* offset, wr_linear_bvh_node* nodes);
+static void
+wr_bvh_optimize(bvh_node* root, float budget_ms, std::vector<ivec4>* faces);
+
+static float
+wr_elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<float, std::milli>(
+           std::chrono::steady_clock::now() - start)
+    .count();
+}
+
+static void
+wr_ads_stats_memory(const ADS* ads, wr_size node_bytes, wr_ads_stats* stats)
+{
+  stats->vertex_bytes   = (wr_size)(ads->m_vertex_data.size() * sizeof(vec4));
+  stats->normal_bytes   = (wr_size)(ads->m_normal_data.size() * sizeof(vec4));
+  stats->triangle_bytes =
+    (wr_size)(ads->m_triangles.size() * sizeof(ivec4) +
+              ads->m_intersection_triangles.size() * sizeof(vec4));
+  stats->node_bytes     = node_bytes;
+}
+
+static int
+wr_linear_bvh_stats(const wr_linear_bvh_node* nodes, int index, int depth,
+                    float root_area, wr_ads_stats* stats)
+{
+  const wr_linear_bvh_node* node = &nodes[index];
+  const float area = wr_bounds_surface_area(node->bounds) / root_area;
+
+  stats->node_count++;
+  stats->max_depth = wrays_maxi(stats->max_depth, depth);
+
+  if (node->nPrimitives > 0) {
+    // A quad is one primitive test
+    const int primitives = node->nPrimitives - node->axis;
+    stats->leaf_count++;
+    stats->sah_cost += area * primitives;
+    return primitives;
+  }
+
+  // Same unit costs as the binned SAH in rg_build_bvh_recursive
+  stats->sah_cost += area;
+  return wr_linear_bvh_stats(nodes, index + 1, depth + 1, root_area, stats) +
+         wr_linear_bvh_stats(nodes, node->secondChildOffset, depth + 1,
+                             root_area, stats);
+}
+
+// Power of two scale of the quantized child boxes of a wide node
+static void
+wr_wide_bvh_scale(const wr_wide_bvh_node* node, float* scale)
+{
+  uint32_t exponent[3] = { (uint32_t)(unsigned char)node->ex << 23,
+                           (uint32_t)(unsigned char)node->ey << 23,
+                           (uint32_t)(unsigned char)node->ez << 23 };
+  std::memcpy(scale, exponent, 3 * sizeof(float));
+}
+
+static wr_bounds
+wr_wide_bvh_child_bounds(const wr_wide_bvh_node* node, int child)
+{
+  const int index = child / 4;
+  const int shift = (child % 4) * 8;
+
+  float scale[3];
+  wr_wide_bvh_scale(node, scale);
+
+  const float origin[3] = { node->px, node->py, node->pz };
+
+  wr_bounds bounds;
+  for (int axis = 0; axis < 3; ++axis) {
+    bounds.min.at[axis] =
+      origin[axis] +
+      ((node->childBBOX[index + 2 * axis] >> shift) & 0xFF) * scale[axis];
+    bounds.max.at[axis] =
+      origin[axis] +
+      ((node->childBBOX[index + 2 * axis + 6] >> shift) & 0xFF) * scale[axis];
+  }
+  return bounds;
+}
+
+static int
+wr_wide_bvh_stats(const wr_wide_bvh_node* nodes, int index, int depth,
+                  float root_area, float node_cost, float triangle_cost,
+                  wr_ads_stats* stats)
+{
+  const wr_wide_bvh_node* node = &nodes[index];
+
+  wr_bounds node_bounds;
+  int       primitives = 0;
+
+  stats->node_count++;
+  stats->max_depth = wrays_maxi(stats->max_depth, depth);
+
+  for (int child = 0; child < 8; ++child) {
+    const int meta = (node->meta[child / 4] >> ((child % 4) * 8)) & 0xFF;
+    if (0 == meta) // empty slot
+      continue;
+
+    const wr_bounds child_bounds = wr_wide_bvh_child_bounds(node, child);
+    node_bounds                  = wr_bounds_union(node_bounds, child_bounds);
+
+    if ((node->imask >> child) & 1) {
+      primitives += wr_wide_bvh_stats(
+        nodes, node->child_node_base_index + (meta & 31) - 24, depth + 1,
+        root_area, node_cost, triangle_cost, stats);
+    } else {
+      // xxxyyyyy, the triangle count is stored in unary format
+      int count = 0;
+      for (int bits = meta >> 5; bits != 0; bits >>= 1)
+        count += bits & 1;
+
+      stats->leaf_count++;
+      stats->sah_cost += wr_bounds_surface_area(child_bounds) / root_area *
+                         count * triangle_cost;
+      primitives += count;
+    }
+  }
+
+  stats->sah_cost +=
+    wr_bounds_surface_area(node_bounds) / root_area * node_cost;
+
+  return primitives;
+}
+
+// Treelet layout
+//
+// Both hierarchies are flattened depth-first, so the nodes near the root,
+// which every ray visits, end up spread over the whole node texture. The
+// layout pass below reorders the nodes into treelets of about
+// WR_TREELET_NODES nodes. A treelet is grown greedily from its root by
+// always taking the block with the largest surface area, i.e. the block most
+// likely to be visited next; the blocks left over seed the treelets that
+// follow, which are emitted depth first.
+//
+// A block is a run of nodes that the node format requires to stay adjacent:
+// the siblings of a wide node, and for the binary BVH the chain of left
+// children starting at a node, since the left child is implicitly next to
+// its parent. Blocks are contiguous in the depth-first order too, so
+// reordering them only needs the child offsets to be remapped.
+#define WR_TREELET_NODES 32
+
+struct wr_layout_block
+{
+  int   first; // depth-first index of the first node
+  int   count;
+  float area;
 };
 
+// children(block, push) calls push(child_block) for every block referenced by
+// the nodes of block. Returns the new index of each depth-first index
+template <typename Children>
+static std::vector<int>
+wr_treelet_layout(int node_count, wr_layout_block root, Children&& children)
+{
+  std::vector<int> new_index(node_count, -1);
+
+  auto by_area = [](const wr_layout_block& a, const wr_layout_block& b) {
+    return a.area < b.area;
+  };
+
+  int                          next = 0;
+  std::vector<wr_layout_block> treelet_roots(1, root);
+  std::vector<wr_layout_block> frontier;
+  while (!treelet_roots.empty()) {
+    frontier.assign(1, treelet_roots.back());
+    treelet_roots.pop_back();
+
+    int size = 0;
+    while (!frontier.empty()) {
+      std::pop_heap(frontier.begin(), frontier.end(), by_area);
+      const wr_layout_block block = frontier.back();
+      if (size > 0 && size + block.count > WR_TREELET_NODES)
+        break;
+      frontier.pop_back();
+
+      for (int i = 0; i < block.count; ++i)
+        new_index[block.first + i] = next++;
+      size += block.count;
+
+      children(block, [&](const wr_layout_block& child) {
+        frontier.push_back(child);
+        std::push_heap(frontier.begin(), frontier.end(), by_area);
+      });
+    }
+
+    // Largest first, so the likeliest subtree follows its parent treelet
+    std::sort(frontier.begin(), frontier.end(), by_area);
+    treelet_roots.insert(treelet_roots.end(), frontier.begin(),
+                         frontier.end());
+  }
+
+  // Slots that no node references keep their order at the end
+  for (int& index : new_index)
+    if (index < 0)
+      index = next++;
+
+  return new_index;
+}
+
+static void
+wr_linear_bvh_treelet_layout(wr_linear_bvh_node* nodes, int node_count)
+{
+  // The chain of left children starting at first
+  auto block_at = [nodes](int first) {
+    int last = first;
+    while (nodes[last].nPrimitives == 0)
+      ++last;
+    return wr_layout_block{ first, last - first + 1,
+                            wr_bounds_surface_area(nodes[first].bounds) };
+  };
+
+  const std::vector<int> new_index = wr_treelet_layout(
+    node_count, block_at(0), [&](const wr_layout_block& block, auto&& push) {
+      for (int i = block.first; i < block.first + block.count; ++i)
+        if (nodes[i].nPrimitives == 0)
+          push(block_at(nodes[i].secondChildOffset));
+    });
+
+  std::vector<wr_linear_bvh_node> reordered(node_count);
+  for (int i = 0; i < node_count; ++i) {
+    wr_linear_bvh_node node = nodes[i];
+    if (node.nPrimitives == 0)
+      node.secondChildOffset = new_index[node.secondChildOffset];
+    reordered[new_index[i]] = node;
+  }
+  std::copy(reordered.begin(), reordered.end(), nodes);
+}
+
+// Links of the stackless traversal. A node is left for its sibling or its
+// parent, and whether the sibling is still to be visited depends on which of
+// the two children the ray entered first, i.e. on the split axis of the
+// parent and on which child the node is
+static void
+wr_linear_bvh_links(const wr_linear_bvh_node* nodes, int node_count,
+                    std::vector<ivec4>* links)
+{
+  links->assign(node_count, { -1, -1, 0, 0 });
+  for (int i = 0; i < node_count; ++i) {
+    if (nodes[i].nPrimitives > 0)
+      continue;
+
+    const int first  = i + 1;
+    const int second = nodes[i].secondChildOffset;
+    (*links)[first]  = { i, second, (nodes[i].axis << 1) | 1, 0 };
+    (*links)[second] = { i, first, (nodes[i].axis << 1) | 0, 0 };
+  }
+}
+
+static void
+wr_wide_bvh_treelet_layout(wr_wide_bvh_node* nodes, int node_count)
+{
+  // The internal children of parent, stored contiguously
+  auto block_of = [nodes](int parent) {
+    const wr_wide_bvh_node* node = &nodes[parent];
+
+    wr_bounds bounds;
+    int       count = 0;
+    for (int child = 0; child < 8; ++child) {
+      if (0 == ((node->meta[child / 4] >> ((child % 4) * 8)) & 0xFF))
+        continue;
+      bounds = wr_bounds_union(bounds, wr_wide_bvh_child_bounds(node, child));
+      count += (node->imask >> child) & 1;
+    }
+    return wr_layout_block{ (int)node->child_node_base_index, count,
+                            wr_bounds_surface_area(bounds) };
+  };
+
+  // The collapse counts one slot past its last node and leaves it
+  // uninitialized, so only the child indices of reached nodes are remapped
+  std::vector<bool> reached(node_count, false);
+
+  // Node 0 only holds the real root, keep both in front
+  const std::vector<int> new_index = wr_treelet_layout(
+    node_count, { 0, 1, 0.0f },
+    [&](const wr_layout_block& block, auto&& push) {
+      for (int i = block.first; i < block.first + block.count; ++i) {
+        reached[i] = true;
+        if (nodes[i].imask != 0)
+          push(block_of(i));
+      }
+    });
+
+  std::vector<wr_wide_bvh_node> reordered(node_count);
+  for (int i = 0; i < node_count; ++i) {
+    wr_wide_bvh_node node = nodes[i];
+    if (reached[i] && node.imask != 0)
+      node.child_node_base_index = new_index[node.child_node_base_index];
+    reordered[new_index[i]] = node;
+  }
+  std::copy(reordered.begin(), reordered.end(), nodes);
+}
+
+// Query the host-side traversals and primitive tests are specialized for,
+// like wr_query_shape_intersection and wr_query_shape_occlusion. Any-hit
+// queries visit children unordered, stop at the first hit and never compute
+// the hit attributes, so their result is left untouched
+typedef enum
+{
+  WR_QUERY_CLOSEST_HIT,
+  WR_QUERY_ANY_HIT,
+} wr_query_kind;
+
+// Host-side port of wr_fast_intersect_triangle_edges and
+// wr_fast_occlude_triangle_edges. Returns (b1, b2, t) in result on a hit
+// closer than t_max
+template <wr_query_kind kind>
+static bool
+wr_intersect_triangle_edges(vec3 direction, vec3 origin, vec3 v1, vec3 e1,
+                            vec3 e2, float t_max, vec3* result)
+{
+  vec3  s1   = wrays_vec3_cross(direction, e2);
+  float invd = 1.0f / wrays_vec3_dot(s1, e1);
+
+  vec3  d  = wrays_vec3_sub(origin, v1);
+  float b1 = wrays_vec3_dot(d, s1) * invd;
+  if (WR_QUERY_ANY_HIT == kind && (b1 < 0.0f || b1 > 1.0f))
+    return false;
+  vec3  s2   = wrays_vec3_cross(d, e1);
+  float b2   = wrays_vec3_dot(direction, s2) * invd;
+  float temp = wrays_vec3_dot(e2, s2) * invd;
+
+  if (b1 < 0.0f || b1 > 1.0f || b2 < 0.0f || b1 + b2 > 1.0f || temp < 0.0f ||
+      temp >= t_max)
+    return false;
+
+  if (WR_QUERY_CLOSEST_HIT == kind)
+    *result = { b1, b2, temp };
+  return true;
+}
+
+// Host-side port of wr_fast_intersect_triangle
+template <wr_query_kind kind>
+static bool
+wr_intersect_triangle(vec3 direction, vec3 origin, vec3 v1, vec3 v2, vec3 v3,
+                      float t_max, vec3* result)
+{
+  return wr_intersect_triangle_edges<kind>(direction, origin, v1,
+                                           wrays_vec3_sub(v2, v1),
+                                           wrays_vec3_sub(v3, v1), t_max,
+                                           result);
+}
+
+// Host-side port of wr_fast_intersect_quad and wr_fast_occlude_quad. Returns
+// the triangle hit, 0 or 1, in second
+template <wr_query_kind kind>
+static bool
+wr_intersect_quad(vec3 direction, vec3 origin, vec3 v0, vec3 v1, vec3 v2,
+                  vec3 v3, float t_max, vec3* result, int* second)
+{
+  const vec3  d    = wrays_vec3_sub(origin, v0);
+  const vec3  e    = wrays_vec3_sub(v2, v0);
+  const vec3  s    = wrays_vec3_cross(direction, e);
+  const vec3  c    = wrays_vec3_cross(d, e);
+  const float side = wrays_vec3_dot(direction, c);
+  bool        hit  = false;
+
+  const vec3  e1    = wrays_vec3_sub(v1, v0);
+  const float inv_a = 1.0f / wrays_vec3_dot(s, e1);
+  const float a1    = -side * inv_a;
+  if (a1 >= 0.0f && a1 <= 1.0f) {
+    const vec3  c1 = wrays_vec3_cross(d, e1);
+    const float a2 = wrays_vec3_dot(direction, c1) * inv_a;
+    const float ta = wrays_vec3_dot(e, c1) * inv_a;
+    if (a2 >= 0.0f && a1 + a2 <= 1.0f && ta >= 0.0f && ta < t_max) {
+      if (WR_QUERY_ANY_HIT == kind)
+        return true;
+      *result = { a1, a2, ta };
+      *second = 0;
+      t_max   = ta;
+      hit     = true;
+    }
+  }
+
+  const vec3  e3    = wrays_vec3_sub(v3, v0);
+  const float inv_b = -1.0f / wrays_vec3_dot(s, e3);
+  const float b2    = side * inv_b;
+  if (b2 >= 0.0f && b2 <= 1.0f) {
+    const float b1 =
+      wrays_vec3_dot(d, wrays_vec3_cross(direction, e3)) * inv_b;
+    const float tb = wrays_vec3_dot(e3, c) * inv_b;
+    if (b1 >= 0.0f && b1 + b2 <= 1.0f && tb >= 0.0f && tb < t_max) {
+      if (WR_QUERY_CLOSEST_HIT == kind) {
+        *result = { b1, b2, tb };
+        *second = 1;
+      }
+      hit = true;
+    }
+  }
+  return hit;
+}
+
+// Host-side port of wr_fast_intersect_sphere. Returns the spherical
+// coordinates (phi, theta) of the hit normal, scaled to [0, 1], and t in
+// result
+template <wr_query_kind kind>
+static bool
+wr_intersect_sphere(vec3 direction, vec3 origin, vec3 center, float radius,
+                    float t_max, vec3* result)
+{
+  vec3  oc   = wrays_vec3_sub(origin, center);
+  float a    = wrays_vec3_dot(direction, direction);
+  float b    = wrays_vec3_dot(oc, direction);
+  float c    = wrays_vec3_dot(oc, oc) - radius * radius;
+  float disc = b * b - a * c;
+  if (disc < 0.0f)
+    return false;
+
+  float s = sqrtf(disc);
+  float t = (-b - s) / a;
+  if (t < 0.0f)
+    t = (-b + s) / a;
+  if (t < 0.0f || t >= t_max)
+    return false;
+  if (WR_QUERY_ANY_HIT == kind)
+    return true;
+
+  vec3 n = { (oc.x + t * direction.x) / radius,
+             (oc.y + t * direction.y) / radius,
+             (oc.z + t * direction.z) / radius };
+  *result = { atan2f(n.y, n.x) * 0.15915494f + 0.5f,
+              acosf(std::min(std::max(n.z, -1.0f), 1.0f)) * 0.31830989f, t };
+  return true;
+}
+
+// Host-side port of wr_BoundsIntersect
+static bool
+wr_intersect_bounds(const wr_bounds& bounds, vec3 origin, vec3 inv_direction,
+                    float t_max)
+{
+  float t0 = 0.0f, t1 = t_max;
+  for (int i = 0; i < 3; ++i) {
+    float t_near = (bounds.min.at[i] - origin.at[i]) * inv_direction.at[i];
+    float t_far  = (bounds.max.at[i] - origin.at[i]) * inv_direction.at[i];
+    if (inv_direction.at[i] < 0.0f)
+      std::swap(t_near, t_far);
+    t0 = t_near > t0 ? t_near : t0;
+    t1 = t_far < t1 ? t_far : t1;
+    if (t0 > t1)
+      return false;
+  }
+  return true;
+}
+
+// Host-side port of wr_IntersectPrimitive and wr_OccludedPrimitive
+template <wr_query_kind kind>
+static bool
+wr_intersect_primitive(const ADS* ads, int triangle, vec3 origin,
+                       vec3 direction, float t_max, vec3* result)
+{
+  if (!ads->m_intersection_triangles.empty()) {
+    const vec4* t = &ads->m_intersection_triangles[3 * triangle];
+    if (t[0].w > 0.0f)
+      return wr_intersect_sphere<kind>(direction, origin,
+                                       { t[0].x, t[0].y, t[0].z }, t[0].w,
+                                       t_max, result);
+    return wr_intersect_triangle_edges<kind>(
+      direction, origin, { t[0].x, t[0].y, t[0].z }, { t[1].x, t[1].y, t[1].z },
+      { t[2].x, t[2].y, t[2].z }, t_max, result);
+  }
+
+  const ivec4 indices = ads->m_triangles[triangle];
+  const vec4& v0      = ads->m_vertex_data[indices.x];
+  if (WR_SPHERE_INDEX == indices.y)
+    return wr_intersect_sphere<kind>(direction, origin, { v0.x, v0.y, v0.z },
+                                     wr_sphere_radius(indices), t_max, result);
+
+  const vec4& v1 = ads->m_vertex_data[indices.y];
+  const vec4& v2 = ads->m_vertex_data[indices.z];
+
+  return wr_intersect_triangle<kind>(direction, origin, { v0.x, v0.y, v0.z },
+                                     { v1.x, v1.y, v1.z }, { v2.x, v2.y, v2.z },
+                                     t_max, result);
+}
+
+// Fills m_intersection_triangles from the triangles, which must already be
+// in their final (leaf) order. Each triangle takes 3 texels, v0 and the two
+// edges, so a test needs no index fetch and 3 independent position fetches.
+// Spheres store (center, radius) in the first texel; triangles keep w at 0
+static void
+wr_build_intersection_triangles(ADS* ads)
+{
+  ads->m_intersection_triangles.clear();
+  if (WR_TRIANGLE_FORMAT_PRECOMPUTED != ads->m_triangle_format)
+    return;
+
+  ads->m_intersection_triangles.resize(3 * ads->m_triangles.size());
+  for (size_t i = 0; i < ads->m_triangles.size(); ++i) {
+    const ivec4 indices = ads->m_triangles[i];
+    const vec4& v0      = ads->m_vertex_data[indices.x];
+    if (WR_SPHERE_INDEX == indices.y) {
+      ads->m_intersection_triangles[3 * i + 0] = { v0.x, v0.y, v0.z,
+                                                   wr_sphere_radius(indices) };
+      ads->m_intersection_triangles[3 * i + 1] = {};
+      ads->m_intersection_triangles[3 * i + 2] = {};
+      continue;
+    }
+
+    const vec4& v1 = ads->m_vertex_data[indices.y];
+    const vec4& v2 = ads->m_vertex_data[indices.z];
+
+    ads->m_intersection_triangles[3 * i + 0] = { v0.x, v0.y, v0.z, 0.0f };
+    ads->m_intersection_triangles[3 * i + 1] = { v1.x - v0.x, v1.y - v0.y,
+                                                 v1.z - v0.z, 0.0f };
+    ads->m_intersection_triangles[3 * i + 2] = { v2.x - v0.x, v2.y - v0.y,
+                                                 v2.z - v0.z, 0.0f };
+  }
+}
+
+int
+wr_compact_face_bits(const ADS* ads)
+{
+  if (WR_TRIANGLE_FORMAT_COMPACT != ads->m_triangle_format ||
+      ads->m_sphere_count > 0)
+    return 0;
+
+  // Largest offset from the base of a block, or user ID
+  int range = 0;
+  for (size_t first = 0; first < ads->m_triangles.size();
+       first += WR_FACE_BLOCK_SIZE) {
+    const size_t last =
+      std::min(first + WR_FACE_BLOCK_SIZE, ads->m_triangles.size());
+    int base = std::numeric_limits<int>::max();
+    for (size_t i = first; i < last; ++i) {
+      const ivec4& face = ads->m_triangles[i];
+      base = wrays_mini(base, wrays_mini(face.x, wrays_mini(face.y, face.z)));
+    }
+    for (size_t i = first; i < last; ++i) {
+      const ivec4& face = ads->m_triangles[i];
+      if (face.w < 0)
+        return 0;
+      range = wrays_maxi(range, wrays_maxi(face.x, face.y) - base);
+      range = wrays_maxi(range, wrays_maxi(face.z - base, face.w));
+    }
+  }
+  if (range < (1 << 8))
+    return 8;
+  if (range < (1 << 16))
+    return 16;
+  return 0;
+}
+
+int
+wr_face_texel_count(const ADS* ads, int face_bits)
+{
+  const int face_count = (int)ads->m_triangles.size();
+  if (32 == face_bits)
+    return face_count;
+  return face_count + (face_count + WR_FACE_BLOCK_SIZE - 1) / WR_FACE_BLOCK_SIZE;
+}
+
+void
+wr_compact_faces(const ADS* ads, int face_bits,
+                 std::vector<unsigned char>* texels)
+{
+  const int texel_bytes = face_bits / 2;
+  texels->assign((size_t)wr_face_texel_count(ads, face_bits) * texel_bytes, 0);
+
+  auto store = [&](size_t texel, const unsigned int components[4]) {
+    unsigned char* dst = texels->data() + texel * texel_bytes;
+    for (int k = 0; k < 4; ++k) {
+      if (8 == face_bits) {
+        dst[k] = (unsigned char)components[k];
+      } else {
+        const uint16_t value = (uint16_t)components[k];
+        std::memcpy(dst + 2 * k, &value, sizeof(value));
+      }
+    }
+  };
+
+  size_t texel = 0;
+  for (size_t first = 0; first < ads->m_triangles.size();
+       first += WR_FACE_BLOCK_SIZE) {
+    const size_t last =
+      std::min(first + WR_FACE_BLOCK_SIZE, ads->m_triangles.size());
+    int base = std::numeric_limits<int>::max();
+    for (size_t i = first; i < last; ++i) {
+      const ivec4& face = ads->m_triangles[i];
+      base = wrays_mini(base, wrays_mini(face.x, wrays_mini(face.y, face.z)));
+    }
+
+    // The base is split over the components, lowest bits first
+    const unsigned int bits = (unsigned int)base;
+    const unsigned int mask = (1u << face_bits) - 1;
+    unsigned int       base_components[4] = {};
+    for (int k = 0; k * face_bits < 32; ++k)
+      base_components[k] = (bits >> (k * face_bits)) & mask;
+    store(texel++, base_components);
+
+    for (size_t i = first; i < last; ++i) {
+      const ivec4&       face          = ads->m_triangles[i];
+      const unsigned int components[4] = { (unsigned int)(face.x - base),
+                                           (unsigned int)(face.y - base),
+                                           (unsigned int)(face.z - base),
+                                           (unsigned int)face.w };
+      store(texel++, components);
+    }
+  }
+}
+
+// GLSL wr_scene_indices and wr_FetchFace(blas, i), the face i of a BLAS as
+// (v0, v1, v2, ID) in any of the uploaded formats
+static std::string
+wr_face_fetch_code(const ADS* ads)
+{
+  if (32 == ads->m_face_bits)
+    return "uniform isampler2DArray wr_scene_indices;\n"
+           "ivec4 wr_FetchFace(int blas, int i) { return "
+           "texelFetch(wr_scene_indices, ivec3(i % WR_PRIMITIVE_TEXTURE_SIZE, "
+           "i / WR_PRIMITIVE_TEXTURE_SIZE, blas), 0); }\n";
+
+  const std::string block = std::to_string(WR_FACE_BLOCK_SIZE);
+  const std::string base =
+    (8 == ads->m_face_bits)
+      ? "int(b.x | (b.y << 8) | (b.z << 16) | (b.w << 24))"
+      : "int(b.x | (b.y << 16))";
+  return "uniform usampler2DArray wr_scene_indices;\n"
+         "ivec4 wr_FetchFace(int blas, int i) { int b0 = (i / " +
+         block + ") * " + std::to_string(WR_FACE_BLOCK_SIZE + 1) +
+         "; int t = b0 + 1 + i % " + block +
+         "; uvec4 b = texelFetch(wr_scene_indices, ivec3(b0 % "
+         "WR_PRIMITIVE_TEXTURE_SIZE, b0 / WR_PRIMITIVE_TEXTURE_SIZE, blas), "
+         "0); uvec4 f = texelFetch(wr_scene_indices, ivec3(t % "
+         "WR_PRIMITIVE_TEXTURE_SIZE, t / WR_PRIMITIVE_TEXTURE_SIZE, blas), "
+         "0); return ivec4(ivec3(f.xyz) + " +
+         base + ", int(f.w)); }\n";
+}
+
+// GLSL wr_IntersectPrimitive(ads, i, direction, origin, t_max) used by the
+// closest-hit leaf loops and its any-hit counterpart wr_OccludedPrimitive
+// used by the occlusion ones. Spheres are told apart per primitive, by a
+// negative second index or, in the precomputed format, by a non-zero radius
+// in the first texel, which reads 3 layers per BLAS of wr_scene_triangles
+// addressed like wr_scene_indices. The sphere test is compiled out when
+// WR_SCENE_SPHERES is 0. With quads, wr_IntersectQuad and wr_OccludedQuad
+// test the two faces of a quad from four vertex fetches
+static std::string
+wr_primitive_test_code(const ADS* ads, const char* indices_func,
+                       const char* position_func)
+{
+  std::string str;
+  if (WR_TRIANGLE_FORMAT_PRECOMPUTED == ads->m_triangle_format) {
+    str += "uniform sampler2DArray wr_scene_triangles;\n";
+    str += "vec3 wr_IntersectPrimitive(int ads, int i, vec3 direction, vec3 "
+           "origin, float t_max) { ivec2 p = ivec2(i % "
+           "WR_PRIMITIVE_TEXTURE_SIZE, i / WR_PRIMITIVE_TEXTURE_SIZE); vec4 "
+           "v0 = texelFetch(wr_scene_triangles, ivec3(p, ads * 3 + 0), 0);\n"
+           "#if WR_SCENE_SPHERES\n"
+           "if (v0.w > 0.0) return wr_fast_intersect_sphere(direction, "
+           "origin, v0.xyz, v0.w, t_max);\n"
+           "#endif\n"
+           "return wr_fast_intersect_triangle_edges(direction, origin, "
+           "v0.xyz, texelFetch(wr_scene_triangles, ivec3(p, ads * 3 + 1), "
+           "0).xyz, texelFetch(wr_scene_triangles, ivec3(p, ads * 3 + 2), "
+           "0).xyz, t_max); }\n";
+    str += "bool wr_OccludedPrimitive(int ads, int i, vec3 direction, vec3 "
+           "origin, float t_max) { ivec2 p = ivec2(i % "
+           "WR_PRIMITIVE_TEXTURE_SIZE, i / WR_PRIMITIVE_TEXTURE_SIZE); vec4 "
+           "v0 = texelFetch(wr_scene_triangles, ivec3(p, ads * 3 + 0), 0);\n"
+           "#if WR_SCENE_SPHERES\n"
+           "if (v0.w > 0.0) return wr_fast_occlude_sphere(direction, origin, "
+           "v0.xyz, v0.w, t_max);\n"
+           "#endif\n"
+           "return wr_fast_occlude_triangle_edges(direction, origin, v0.xyz, "
+           "texelFetch(wr_scene_triangles, ivec3(p, ads * 3 + 1), 0).xyz, "
+           "texelFetch(wr_scene_triangles, ivec3(p, ads * 3 + 2), 0).xyz, "
+           "t_max); }\n";
+  } else {
+    str += std::string("vec3 wr_IntersectPrimitive(int ads, int i, vec3 "
+                       "direction, vec3 origin, float t_max) { ivec4 indices "
+                       "= ") +
+           indices_func + "(ads, i); vec3 v0 = " + position_func +
+           "(ads, indices.x);\n"
+           "#if WR_SCENE_SPHERES\n"
+           "if (indices.y < 0) return wr_fast_intersect_sphere(direction, "
+           "origin, v0, intBitsToFloat(indices.z), t_max);\n"
+           "#endif\n"
+           "return wr_fast_intersect_triangle(direction, origin, v0, " +
+           position_func + "(ads, indices.y), " + position_func +
+           "(ads, indices.z), t_max); }\n";
+    str += std::string("bool wr_OccludedPrimitive(int ads, int i, vec3 "
+                       "direction, vec3 origin, float t_max) { ivec4 indices "
+                       "= ") +
+           indices_func + "(ads, i); vec3 v0 = " + position_func +
+           "(ads, indices.x);\n"
+           "#if WR_SCENE_SPHERES\n"
+           "if (indices.y < 0) return wr_fast_occlude_sphere(direction, "
+           "origin, v0, intBitsToFloat(indices.z), t_max);\n"
+           "#endif\n"
+           "return wr_fast_occlude_triangle(direction, origin, v0, " +
+           position_func + "(ads, indices.y), " + position_func +
+           "(ads, indices.z), t_max); }\n";
+  }
+
+  // The faces i and i + 1 of a quad are (q0, q1, q2) and (q0, q2, q3)
+  if (ads->m_quads) {
+    auto quad_test = [&](const char* signature, const char* test) {
+      return std::string(signature) +
+             "(int ads, int i, vec3 direction, vec3 origin, float t_max) { "
+             "ivec4 a = " +
+             indices_func + "(ads, i); int q3 = " + indices_func +
+             "(ads, i + 1).z; return " + test + "(direction, origin, " +
+             position_func + "(ads, a.x), " + position_func + "(ads, a.y), " +
+             position_func + "(ads, a.z), " + position_func +
+             "(ads, q3), t_max); }\n";
+    };
+    str += g_ray_quad_intersection_func;
+    str += quad_test("vec4 wr_IntersectQuad", "wr_fast_intersect_quad");
+    str += quad_test("bool wr_OccludedQuad", "wr_fast_occlude_quad");
+  }
+  return str;
+}
+
+static void
+wr_pack_intersection(int triangle, vec3 hit, ivec4* intersection)
+{
+  intersection->x = triangle;
+  std::memcpy(&intersection->y, &hit.x, sizeof(float));
+  std::memcpy(&intersection->z, &hit.y, sizeof(float));
+  std::memcpy(&intersection->w, &hit.z, sizeof(float));
+}
+
+// Tests the faces of a leaf, the first 2 * axis of them as quads, like the
+// leaf loops of the generated code. Closest hits shrink min_distance and are
+// written to intersection
+template <wr_query_kind kind>
+static bool
+wr_intersect_leaf(const ADS* ads, const wr_linear_bvh_node* node, vec3 origin,
+                  vec3 direction, float* min_distance, ivec4* intersection,
+                  wr_traversal_counters* work)
+{
+  auto position = [ads](int i) {
+    const vec4& p = ads->m_vertex_data[i];
+    return vec3{ p.x, p.y, p.z };
+  };
+
+  bool hit = false;
+  for (int i = 0; i < node->nPrimitives; ++i) {
+    const int triangle = node->primitivesOffset + i;
+    vec3      ret;
+    int       second = 0;
+    bool      found;
+    ++work->triangles_tested;
+    if (i < 2 * node->axis) {
+      const ivec4& a  = ads->m_triangles[triangle];
+      const int    q3 = ads->m_triangles[triangle + 1].z;
+
+      found = wr_intersect_quad<kind>(direction, origin, position(a.x),
+                                      position(a.y), position(a.z),
+                                      position(q3), *min_distance, &ret,
+                                      &second);
+      ++i;
+    } else {
+      found = wr_intersect_primitive<kind>(ads, triangle, origin, direction,
+                                           *min_distance, &ret);
+    }
+    if (!found)
+      continue;
+
+    hit = true;
+    if (WR_QUERY_ANY_HIT == kind)
+      break;
+    *min_distance = ret.z;
+    wr_pack_intersection(triangle + second, ret, intersection);
+  }
+  return hit;
+}
+
+SAHBVH::SAHBVH()
+  : m_shape_id_generator(0)
+  , m_material_id_generator(0)
+{
+  std::memset(&m_webgl_textures, 0, sizeof(m_webgl_textures));
+  m_need_update         = true;
+  m_linear_nodes        = nullptr;
+  intersection_code     = nullptr;
+  m_total_nodes         = 0;
+  m_vertex_texture_size = 0;
+  m_index_texture_size  = 0;
+  m_node_texture_size   = 0;
+  m_webgl_binding_count = 3;
+  m_streaming           = false;
+  m_streamed_triangles  = 0;
+  m_spatial_splits      = false;
+  m_split_budget        = 0.3f;
+  m_reference_count     = 0;
+}
+
+SAHBVH::~SAHBVH()
+{
+  delete[] intersection_code;
+  delete[] m_linear_nodes;
+}
+
+int
+SAHBVH::AddSpheres(float* spheres, int sphere_stride, int* user_data,
+                   int num_spheres)
+{
+  int ID = ++m_shape_id_generator;
+  wr_append_spheres(this, spheres, sphere_stride, user_data, num_spheres);
+
+  m_need_update = true;
+
+  return ID;
+}
+
 int
 SAHBVH::AddTriangularMesh(float* positions, int position_stride, float* normals,
                           int normal_stride, float* uvs, int uv_stride,
@@ -1356,21 +2645,314 @@ SAHBVH::AddTriangularMesh(float* positions, int position_stride, float* normals,
   // * sizeof(float));
 
   mesh.num_triangles = num_triangles;
-  m_triangles.resize(m_triangles.size() + mesh.num_triangles);
   int materialID = m_material_id_generator++;
-  for (int i = 0; i < mesh.num_triangles; ++i) {
-    m_triangles[i + mesh.triangle_offset] = {
-      indices[4 * i + 0] + mesh.vertex_offset,
-      indices[4 * i + 1] + mesh.vertex_offset,
-      indices[4 * i + 2] + mesh.vertex_offset, indices[4 * i + 3]
-    };
-  }
+  wr_append_triangles(this, indices, num_triangles, mesh.vertex_offset);
 
   m_need_update = true;
 
   return ID;
 }
 
+// Rotates the paired faces a and b to (q0, q1, q2) and (q0, q2, q3), where
+// q0 q2 is the edge they share with opposite windings
+static void
+wr_rotate_quad(ivec4* a, ivec4* b)
+{
+  const int va[3] = { a->x, a->y, a->z };
+  const int vb[3] = { b->x, b->y, b->z };
+  for (int e = 0; e < 3; ++e) {
+    for (int k = 0; k < 3; ++k) {
+      if (vb[k] != va[(e + 1) % 3] || vb[(k + 1) % 3] != va[e])
+        continue;
+      *a = { va[(e + 1) % 3], va[(e + 2) % 3], va[e], a->w };
+      *b = { vb[k], vb[(k + 1) % 3], vb[(k + 2) % 3], b->w };
+      return;
+    }
+  }
+}
+
+// Build primitives of the faces from first on. With m_quads, a triangle is
+// paired with the unpaired neighbor across one of its edges that gives the
+// smallest bounds, as long as the neighbor has the same winding and the
+// bounds of the pair are no larger than the two apart. The faces are then
+// rewritten with the pairs first, see wr_rotate_quad, and the rest after
+static void
+wr_sah_bvh_primitives(SAHBVH* bvh, int first,
+                      std::vector<wr_primitive>* primitives)
+{
+  std::vector<ivec4>& faces = bvh->m_triangles;
+  const int           count = (int)faces.size() - first;
+
+  primitives->clear();
+  primitives->reserve(count);
+  if (!bvh->m_quads) {
+    for (int i = 0; i < count; ++i)
+      primitives->push_back(
+        { first + i, wr_primitive_bounds(bvh, faces[first + i]) });
+    return;
+  }
+
+  auto pairable = [](const ivec4& f) {
+    return WR_SPHERE_INDEX != f.y && f.x != f.y && f.y != f.z && f.z != f.x;
+  };
+  auto edge_key = [](int a, int b) {
+    return ((uint64_t)(uint32_t)a << 32) | (uint32_t)b;
+  };
+
+  // Directed edges of the triangles, to find the neighbor across each edge
+  std::vector<wr_bounds>            bounds(count);
+  std::unordered_map<uint64_t, int> edges;
+  edges.reserve(3 * count);
+  for (int i = 0; i < count; ++i) {
+    const ivec4& f = faces[first + i];
+    bounds[i]      = wr_primitive_bounds(bvh, f);
+    if (!pairable(f))
+      continue;
+    edges.emplace(edge_key(f.x, f.y), i);
+    edges.emplace(edge_key(f.y, f.z), i);
+    edges.emplace(edge_key(f.z, f.x), i);
+  }
+
+  std::vector<int> pair(count, -1);
+  for (int i = 0; i < count; ++i) {
+    const ivec4& f = faces[first + i];
+    if (pair[i] >= 0 || !pairable(f))
+      continue;
+
+    const int   v[3]    = { f.x, f.y, f.z };
+    const float area    = wr_bounds_surface_area(bounds[i]);
+    int         best    = -1;
+    float       best_sa = 0.0f;
+    for (int e = 0; e < 3; ++e) {
+      const auto it = edges.find(edge_key(v[(e + 1) % 3], v[e]));
+      if (it == edges.end() || it->second == i || pair[it->second] >= 0)
+        continue;
+      const int   j  = it->second;
+      const float sa =
+        wr_bounds_surface_area(wr_bounds_union(bounds[i], bounds[j]));
+      if (sa > area + wr_bounds_surface_area(bounds[j]))
+        continue;
+      if (best < 0 || sa < best_sa) {
+        best    = j;
+        best_sa = sa;
+      }
+    }
+    if (best >= 0) {
+      pair[i]    = best;
+      pair[best] = i;
+    }
+  }
+
+  std::vector<ivec4> ordered;
+  ordered.reserve(count);
+  for (int i = 0; i < count; ++i) {
+    const int j = pair[i];
+    if (j < i)
+      continue;
+    ivec4 a = faces[first + i];
+    ivec4 b = faces[first + j];
+    wr_rotate_quad(&a, &b);
+    primitives->push_back({ first + (int)ordered.size(),
+                            wr_bounds_union(bounds[i], bounds[j]), 2 });
+    ordered.push_back(a);
+    ordered.push_back(b);
+  }
+  for (int i = 0; i < count; ++i) {
+    if (pair[i] >= 0)
+      continue;
+    primitives->push_back({ first + (int)ordered.size(), bounds[i] });
+    ordered.push_back(faces[first + i]);
+  }
+  std::copy(ordered.begin(), ordered.end(), faces.begin() + first);
+}
+
+// Build a hierarchy over the triangles appended since the previous chunk.
+// Only these triangles are reordered, so the earlier chunks stay valid
+static void
+wr_sah_bvh_add_chunk(SAHBVH* bvh)
+{
+  const int first = bvh->m_streamed_triangles;
+  const int count = (int)bvh->m_triangles.size() - first;
+  if (count == 0)
+    return;
+
+  std::vector<wr_primitive> primitiveInfo;
+  wr_sah_bvh_primitives(bvh, first, &primitiveInfo);
+
+  int                node_count = 0;
+  std::vector<ivec4> orderedPrim;
+  orderedPrim.reserve(count);
+  bvh_node* root = rg_build_bvh_recursive(
+    primitiveInfo, 0, (int)primitiveInfo.size(), orderedPrim, &node_count,
+    bvh->m_triangles, bvh->m_params);
+  std::copy(orderedPrim.begin(), orderedPrim.end(),
+            bvh->m_triangles.begin() + first);
+
+  SAHBVH::Chunk chunk;
+  chunk.nodes.resize(node_count);
+  int offset = 0;
+  flattenBVHTree(root, &offset, chunk.nodes.data());
+  for (wr_linear_bvh_node& node : chunk.nodes)
+    if (node.nPrimitives > 0)
+      node.primitivesOffset += first;
+
+  bvh->m_chunks.push_back(std::move(chunk));
+  bvh->m_streamed_triangles = (int)bvh->m_triangles.size();
+}
+
+// Median split of the chunk roots, flattened depth-first with the nodes of
+// every chunk copied in place of its leaf
+static void
+wr_sah_bvh_join_chunks(const SAHBVH* bvh, int* chunks, int count,
+                       std::vector<wr_linear_bvh_node>* nodes)
+{
+  if (count == 1) {
+    const int base = (int)nodes->size();
+    for (wr_linear_bvh_node node : bvh->m_chunks[chunks[0]].nodes) {
+      if (node.nPrimitives == 0)
+        node.secondChildOffset += base;
+      nodes->push_back(node);
+    }
+    return;
+  }
+
+  wr_bounds bounds, centroid_bounds;
+  for (int i = 0; i < count; ++i) {
+    const wr_bounds& root = bvh->m_chunks[chunks[i]].nodes[0].bounds;
+    const vec3       centroid =
+      wrays_vec3_scalef(wrays_vec3_add(root.max, root.min), 0.5f);
+    bounds          = wr_bounds_union(bounds, root);
+    centroid_bounds = wr_bounds_union(centroid_bounds, { centroid, centroid });
+  }
+
+  const int dim = wr_bounds_maximum_extent(centroid_bounds);
+  const int mid = count / 2;
+  std::nth_element(chunks, chunks + mid, chunks + count, [=](int a, int b) {
+    const wr_bounds& ba = bvh->m_chunks[a].nodes[0].bounds;
+    const wr_bounds& bb = bvh->m_chunks[b].nodes[0].bounds;
+    return ba.min.at[dim] + ba.max.at[dim] < bb.min.at[dim] + bb.max.at[dim];
+  });
+
+  const int          index = (int)nodes->size();
+  wr_linear_bvh_node node  = {};
+  node.bounds              = bounds;
+  node.axis                = (uint8_t)dim;
+  node.nPrimitives         = 0;
+  nodes->push_back(node);
+  wr_sah_bvh_join_chunks(bvh, chunks, mid, nodes);
+  (*nodes)[index].secondChildOffset = (int)nodes->size();
+  wr_sah_bvh_join_chunks(bvh, chunks + mid, count - mid, nodes);
+}
+
+// Sample rays of the "tune" ADS option
+#define WR_TUNE_RAYS 4096
+
+// Candidates of the "tune" ADS option around params. The binned SAH leaves
+// try the bucket count and the leaf size, the wide collapse the leaf size
+// and the ratio of the triangle to the node test cost
+static std::vector<wr_build_params>
+wr_tune_candidates(const wr_build_params& params, bool wide)
+{
+  std::vector<wr_build_params> candidates;
+  if (wide) {
+    for (const int leaf_size : { 2, 3 }) {
+      for (const float ratio : { 0.15f, 0.3f, 0.6f }) {
+        wr_build_params candidate = params;
+        candidate.leaf_size       = leaf_size;
+        candidate.triangle_cost   = ratio * params.node_cost;
+        candidates.push_back(candidate);
+      }
+    }
+  } else {
+    for (const int bucket_count : { 16, 64 }) {
+      for (const int leaf_size : { 2, 3, 4, 6 }) {
+        wr_build_params candidate = params;
+        candidate.bucket_count    = bucket_count;
+        candidate.leaf_size       = leaf_size;
+        candidates.push_back(candidate);
+      }
+    }
+  }
+  return candidates;
+}
+
+// Builds the ads with every candidate and keeps the parameters that trace
+// the sample rays the fastest on the host. The rays start at points spread
+// over the bounds of the primitives, in directions spread over the sphere.
+// The candidates are compared without the reinsertion passes of the
+// "optimize" option, which only the final build runs.
+// Tuning runs once, later builds keep the parameters it picked
+template <class T>
+static bool
+wr_ads_tune(T* ads, const std::vector<wr_build_params>& candidates)
+{
+  WR_PROFILE_ZONE("BLAS tune");
+  const auto start = std::chrono::steady_clock::now();
+  ads->m_tune      = false;
+
+  wr_bounds bounds;
+  for (const ivec4& face : ads->m_triangles)
+    bounds = wr_bounds_union(bounds, wr_primitive_bounds(ads, face));
+
+  // xorshift, so that every build traces the same rays
+  unsigned int state  = 2463534242u;
+  auto         random = [&state]() {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (float)(state >> 8) / 16777216.0f;
+  };
+  std::vector<vec3> origins(WR_TUNE_RAYS), directions(WR_TUNE_RAYS);
+  for (int i = 0; i < WR_TUNE_RAYS; ++i) {
+    vec3 direction;
+    do {
+      for (int k = 0; k < 3; ++k)
+        direction.at[k] = 2.0f * random() - 1.0f;
+    } while (wrays_vec3_dot(direction, direction) > 1.0f ||
+             wrays_vec3_dot(direction, direction) < 1.0e-4f);
+    directions[i] = wrays_vec3_normalize(direction);
+    for (int k = 0; k < 3; ++k)
+      origins[i].at[k] = bounds.min.at[k] +
+                         random() * (bounds.max.at[k] - bounds.min.at[k]);
+  }
+
+  const float optimize_budget = ads->m_optimize_budget;
+  ads->m_optimize_budget      = 0.0f;
+
+  float best_time = std::numeric_limits<float>::max();
+  int   best      = 0;
+  for (size_t c = 0; c < candidates.size(); ++c) {
+    ads->m_params      = candidates[c];
+    ads->m_need_update = true;
+    ads->Build();
+
+    // The faster of two runs, to keep out the first touch of the nodes
+    float time = std::numeric_limits<float>::max();
+    for (int run = 0; run < 2; ++run) {
+      const auto trace_start = std::chrono::steady_clock::now();
+      for (int i = 0; i < WR_TUNE_RAYS; ++i) {
+        ivec4 intersection;
+        ads->QueryIntersection(origins[i], directions[i],
+                               std::numeric_limits<float>::max(),
+                               &intersection, nullptr);
+      }
+      time = std::min(time, wr_elapsed_ms(trace_start));
+    }
+    if (time < best_time) {
+      best_time = time;
+      best      = (int)c;
+    }
+  }
+
+  ads->m_params          = candidates[best];
+  ads->m_optimize_budget = optimize_budget;
+  ads->m_need_update     = true;
+  ads->Build();
+  ads->m_stats.build_time = wr_elapsed_ms(start);
+
+  return true;
+}
+
 bool
 SAHBVH::Build()
 {
@@ -1382,33 +2964,98 @@ SAHBVH::Build()
     return true;
   }
 
-  std::vector<wr_primitive> primitiveInfo(m_triangles.size());
-  for (size_t i = 0; i < m_triangles.size(); ++i) {
-    vec3 v0          = { m_vertex_data[m_triangles[i].x].x,
-                m_vertex_data[m_triangles[i].x].y,
-                m_vertex_data[m_triangles[i].x].z };
-    vec3 v1          = { m_vertex_data[m_triangles[i].y].x,
-                m_vertex_data[m_triangles[i].y].y,
-                m_vertex_data[m_triangles[i].y].z };
-    vec3 v2          = { m_vertex_data[m_triangles[i].z].x,
-                m_vertex_data[m_triangles[i].z].y,
-                m_vertex_data[m_triangles[i].z].z };
-    primitiveInfo[i] = { (int)i, wr_triangle_bounds(v0, v1, v2) };
-  }
+  // Streamed chunks are built as they come, the first full build tunes
+  if (m_tune && !m_streaming)
+    return wr_ads_tune(this, wr_tune_candidates(m_params, false));
 
-  m_total_nodes = 0;
-  std::vector<ivec4> orderedPrim;
-  orderedPrim.reserve(m_triangles.size());
-  bvh_node* root =
-    rg_build_bvh_recursive(primitiveInfo, 0, (int)m_triangles.size(),
-                           orderedPrim, &m_total_nodes, m_triangles);
+  WR_PROFILE_ZONE("BLAS build");
+  const auto build_start = std::chrono::steady_clock::now();
 
-  m_triangles.swap(orderedPrim);
-  // primitiveInfo.clear(); primitiveInfo.shrink_to_fit();
+  delete[] m_linear_nodes;
+  if (m_streaming) {
+    WR_PROFILE_BEGIN("chunk build");
+    wr_sah_bvh_add_chunk(this);
+    WR_PROFILE_END();
+
+    WR_PROFILE_BEGIN("join chunks");
+    std::vector<int> chunks(m_chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i)
+      chunks[i] = (int)i;
+    std::vector<wr_linear_bvh_node> nodes;
+    wr_sah_bvh_join_chunks(this, chunks.data(), (int)chunks.size(), &nodes);
+    m_total_nodes  = (int)nodes.size();
+    m_linear_nodes = new wr_linear_bvh_node[m_total_nodes];
+    std::copy(nodes.begin(), nodes.end(), m_linear_nodes);
+    WR_PROFILE_END();
+  } else {
+    // A full build replaces the chunks of an earlier streaming ingestion
+    m_chunks.clear();
+    m_streamed_triangles = 0;
+
+    // Back to unique faces if the previous build duplicated any
+    if (!m_faces.empty()) {
+      m_faces.insert(m_faces.end(), m_triangles.begin() + m_reference_count,
+                     m_triangles.end());
+      m_triangles.swap(m_faces);
+      m_faces.clear();
+    }
+
+    std::vector<wr_primitive> primitiveInfo;
+    WR_PROFILE_BEGIN("primitives");
+    wr_sah_bvh_primitives(this, 0, &primitiveInfo);
+    WR_PROFILE_END();
+
+    m_total_nodes = 0;
+    std::vector<ivec4> orderedPrim;
+    orderedPrim.reserve(m_triangles.size());
+    WR_PROFILE_BEGIN("SAH build");
+    bvh_node* root =
+      m_spatial_splits
+        ? wr_sah_bvh_build_spatial(this, primitiveInfo, orderedPrim,
+                                   &m_total_nodes)
+        : rg_build_bvh_recursive(primitiveInfo, 0, (int)primitiveInfo.size(),
+                                 orderedPrim, &m_total_nodes, m_triangles,
+                                 m_params);
+    WR_PROFILE_END();
+    wr_bvh_optimize(root, m_optimize_budget, &orderedPrim);
+
+    m_triangles.swap(orderedPrim);
+    if (m_triangles.size() != orderedPrim.size()) {
+      m_faces.swap(orderedPrim);
+      m_reference_count = (int)m_triangles.size();
+    }
+    // primitiveInfo.clear(); primitiveInfo.shrink_to_fit();
 
-  m_linear_nodes = new wr_linear_bvh_node[m_total_nodes];
-  int offset     = 0;
-  flattenBVHTree(root, &offset, m_linear_nodes);
+    WR_PROFILE_BEGIN("flatten");
+    m_linear_nodes = new wr_linear_bvh_node[m_total_nodes];
+    int offset     = 0;
+    flattenBVHTree(root, &offset, m_linear_nodes);
+    WR_PROFILE_END();
+  }
+
+  if (WR_NODE_LAYOUT_TREELET == m_node_layout) {
+    WR_PROFILE_ZONE("treelet layout");
+    wr_linear_bvh_treelet_layout(m_linear_nodes, m_total_nodes);
+  }
+
+  m_node_links.clear();
+  if (WR_TRAVERSAL_STACKLESS == m_traversal)
+    wr_linear_bvh_links(m_linear_nodes, m_total_nodes, &m_node_links);
+
+  wr_build_intersection_triangles(this);
+
+  m_stats = {};
+  wr_ads_stats_memory(this,
+                      m_total_nodes * sizeof(wr_linear_bvh_node) +
+                        m_node_links.size() * sizeof(ivec4),
+                      &m_stats);
+  m_stats.triangle_bytes += (wr_size)(m_faces.size() * sizeof(ivec4));
+  const float root_area = wr_bounds_surface_area(m_linear_nodes[0].bounds);
+  const int   leaf_primitives =
+    wr_linear_bvh_stats(m_linear_nodes, 0, 0,
+                        (root_area > 0.0f) ? root_area : 1.0f, &m_stats);
+  m_stats.average_leaf_size = (float)leaf_primitives / m_stats.leaf_count;
+  m_stats.build_time        = wr_elapsed_ms(build_start);
 
 #if 0
 	// Upload to the GPU
@@ -1547,17 +3194,26 @@ SAHBVH::GetIntersectionCode()
   str += "#define WR_TRAVERSE_STACK_SIZE " + std::to_string(32) + "\n";
   str += "#define WR_NODES_TEXTURE_SIZE " +
          std::to_string(m_node_texture_size) + "\n";
+  str += "#define WR_NODE_TEXELS " + std::to_string(GetNodeTexels()) + "\n";
+  if (WR_TRAVERSAL_STACKLESS == m_traversal)
+    str += "#define WR_TRAVERSAL_STACKLESS 1\n";
+  if (m_quads)
+    str += "#define WR_QUADS 1\n";
   str += "#define WR_SCENE_TEXTURE_SIZE " +
          std::to_string(m_vertex_texture_size) + "\n";
   str += "#define wr_InstanceCount " + std::to_string(0) + "\n";
-  str += "#define wr_SphereCount " + std::to_string(0) + "\n";
-  str +=
-    "#define wr_TriangleCount " + std::to_string(m_triangles.size()) + "\n";
-  str += "#define wr_BVHNodeCount " + std::to_string(m_total_nodes) + "\n";
+  str += "#define wr_SphereCount " + std::to_string(m_sphere_count) + "\n";
+  str += "#define wr_TriangleCount " +
+         std::to_string(
+           std::max((int)m_triangles.size(), m_scene_triangle_count)) +
+         "\n";
+  str += "#define wr_BVHNodeCount " +
+         std::to_string(std::max(m_total_nodes, m_scene_node_count)) + "\n";
   str += "#define WR_RAY_MAX_DISTANCE 1.e27\n";
+  str += g_scene_config_defaults;
 
   str += "uniform sampler2DArray wr_scene_vertices;\n";
-  str += "uniform isampler2DArray wr_scene_indices;\n";
+  str += wr_face_fetch_code(this);
   str += "uniform sampler2DArray wr_bvh_nodes;\n";
 
   /* Maybe we need this for instancing */
@@ -1567,12 +3223,9 @@ SAHBVH::GetIntersectionCode()
   // ivec2(0,0) );\n";
 
   str += "ivec4 wr_GetFace(int ads, ivec4 intersection) { return "
-         "texelFetch(wr_scene_indices, ivec3(intersection.x % "
-         "WR_PRIMITIVE_TEXTURE_SIZE, intersection.x / "
-         "WR_PRIMITIVE_TEXTURE_SIZE, ads), 0); }\n";
-  str += "ivec4 wr_GetIndices(int ads, int i) { return "
-         "texelFetch(wr_scene_indices, ivec3(i % WR_PRIMITIVE_TEXTURE_SIZE, i "
-         "/ WR_PRIMITIVE_TEXTURE_SIZE, ads), 0); }\n";
+         "wr_FetchFace(ads, intersection.x); }\n";
+  str += "ivec4 wr_GetIndices(int ads, int i) { return wr_FetchFace(ads, i); "
+         "}\n";
   str += "vec3 wr_GetNormal(int ads, int i) { return "
          "texelFetch(wr_scene_vertices, ivec3(i % WR_SCENE_TEXTURE_SIZE, i / "
          "WR_SCENE_TEXTURE_SIZE, ads * 2 + 1), 0).xyz; }\n";
@@ -1584,21 +3237,218 @@ SAHBVH::GetIntersectionCode()
          "i / WR_SCENE_TEXTURE_SIZE, ads * 2 + 0), 0).w, "
          "texelFetch(wr_scene_vertices, ivec3(i % WR_SCENE_TEXTURE_SIZE, i / "
          "WR_SCENE_TEXTURE_SIZE, ads * 2 + 1), 0).w); }\n";
-  str += "vec4 wr_GetPackedBoundMin(int ads, int i) { int b = 2 * i + 0; "
-         "return texelFetch(wr_bvh_nodes, ivec3(b % WR_NODES_TEXTURE_SIZE, b / "
-         "WR_NODES_TEXTURE_SIZE, ads), 0); }\n";
-  str += "vec4 wr_GetPackedBoundMax(int ads, int i) { int b = 2 * i + 1; "
-         "return texelFetch(wr_bvh_nodes, ivec3(b % WR_NODES_TEXTURE_SIZE, b / "
-         "WR_NODES_TEXTURE_SIZE, ads), 0); }\n";
+  str += "vec4 wr_GetPackedBoundMin(int ads, int i) { int b = "
+         "WR_NODE_TEXELS * i + 0; return texelFetch(wr_bvh_nodes, ivec3(b % "
+         "WR_NODES_TEXTURE_SIZE, b / WR_NODES_TEXTURE_SIZE, ads), 0); }\n";
+  str += "vec4 wr_GetPackedBoundMax(int ads, int i) { int b = "
+         "WR_NODE_TEXELS * i + 1; return texelFetch(wr_bvh_nodes, ivec3(b % "
+         "WR_NODES_TEXTURE_SIZE, b / WR_NODES_TEXTURE_SIZE, ads), 0); }\n";
+  if (WR_TRAVERSAL_STACKLESS == m_traversal)
+    str += "ivec4 wr_GetNodeLinks(int ads, int i) { int b = WR_NODE_TEXELS * "
+           "i + 2; return floatBitsToInt(texelFetch(wr_bvh_nodes, ivec3(b % "
+           "WR_NODES_TEXTURE_SIZE, b / WR_NODES_TEXTURE_SIZE, ads), 0)); }\n";
   str += g_copysign_func;
+  str += g_traversal_stats_func;
+  str += g_hit_attributes_func;
   str += g_ray_triangle_intersection_func;
+  str += g_ray_sphere_intersection_func;
+  str += wr_primitive_test_code(this, "wr_GetIndices", "wr_GetPosition");
   str += g_ray_sahbvh_intersect_fragment_shader;
 
-  intersection_code             = new char[str.size() + 1];
-  intersection_code[str.size()] = 0;
-  std::memcpy(intersection_code, str.data(), str.size() * sizeof(char));
+  intersection_code             = new char[str.size() + 1];
+  intersection_code[str.size()] = 0;
+  std::memcpy(intersection_code, str.data(), str.size() * sizeof(char));
+
+  return intersection_code;
+}
+
+// Host-side port of wr_query_shape_intersection (closest hit) and
+// wr_query_shape_occlusion (any hit). The intersection, if any, is written
+// for closest-hit queries only
+template <wr_query_kind kind>
+static bool
+wr_sah_bvh_traverse(const SAHBVH* bvh, vec3 origin, vec3 direction,
+                    float t_max, ivec4* intersection,
+                    wr_traversal_counters* counters)
+{
+  if (WR_NULL != counters)
+    *counters = {};
+
+  if (0 == bvh->m_total_nodes)
+    return false;
+
+  const vec3 inv_direction = { 1.0f / direction.x, 1.0f / direction.y,
+                               1.0f / direction.z };
+  const int  dir_is_neg[3] = { inv_direction.x < 0.0f, inv_direction.y < 0.0f,
+                               inv_direction.z < 0.0f };
+
+  wr_traversal_counters work = {};
+
+  // A push per level below the root at most, hierarchies deeper than the
+  // local stack get one on the heap
+  int              local_nodes_to_visit[64];
+  std::vector<int> heap_nodes_to_visit;
+  int*             nodes_to_visit = local_nodes_to_visit;
+  if (bvh->m_stats.max_depth > 64) {
+    heap_nodes_to_visit.resize(bvh->m_stats.max_depth);
+    nodes_to_visit = heap_nodes_to_visit.data();
+  }
+
+  float min_distance = t_max;
+  int   to_visit_offset = 0, current_node_index = 0;
+  bool  hit             = false;
+  while (true) {
+    const wr_linear_bvh_node* node = &bvh->m_linear_nodes[current_node_index];
+    ++work.nodes_visited;
+    if (wr_intersect_bounds(node->bounds, origin, inv_direction,
+                            min_distance)) {
+      if (node->nPrimitives > 0) {
+        hit |= wr_intersect_leaf<kind>(bvh, node, origin, direction,
+                                       &min_distance, intersection, &work);
+        if ((WR_QUERY_ANY_HIT == kind && hit) || to_visit_offset == 0)
+          break;
+        current_node_index = nodes_to_visit[--to_visit_offset];
+      } else {
+        if (WR_QUERY_CLOSEST_HIT == kind && dir_is_neg[node->axis]) {
+          nodes_to_visit[to_visit_offset++] = current_node_index + 1;
+          current_node_index                = node->secondChildOffset;
+        } else {
+          nodes_to_visit[to_visit_offset++] = node->secondChildOffset;
+          current_node_index                = current_node_index + 1;
+        }
+        work.stack_depth = wrays_maxi(work.stack_depth, to_visit_offset);
+      }
+    } else {
+      if (to_visit_offset == 0)
+        break;
+      current_node_index = nodes_to_visit[--to_visit_offset];
+    }
+  }
+
+  work.terminated = WR_QUERY_ANY_HIT == kind && hit;
+  if (WR_NULL != counters)
+    *counters = work;
+
+  return hit;
+}
+
+// How a node is entered by the stackless traversal
+typedef enum
+{
+  WR_STACKLESS_FROM_PARENT,
+  WR_STACKLESS_FROM_SIBLING,
+  WR_STACKLESS_FROM_CHILD, // its subtree is done
+} wr_stackless_state;
+
+// Host-side port of the WR_TRAVERSAL_STACKLESS variants of
+// wr_query_shape_intersection and wr_query_shape_occlusion. The nodes left to
+// visit are recovered from the parent and sibling links instead of a stack
+template <wr_query_kind kind>
+static bool
+wr_sah_bvh_traverse_stackless(const SAHBVH* bvh, vec3 origin, vec3 direction,
+                              float t_max, ivec4* intersection,
+                              wr_traversal_counters* counters)
+{
+  if (WR_NULL != counters)
+    *counters = {};
+
+  if (0 == bvh->m_total_nodes)
+    return false;
+
+  const vec3 inv_direction = { 1.0f / direction.x, 1.0f / direction.y,
+                               1.0f / direction.z };
+  const int  dir_is_neg[3] = { inv_direction.x < 0.0f, inv_direction.y < 0.0f,
+                               inv_direction.z < 0.0f };
+
+  // Closest-hit queries enter the child on the near side of the split first,
+  // any-hit ones the first child
+  auto is_near_child = [&dir_is_neg](const ivec4& links) {
+    const bool first = 0 != (links.z & 1);
+    if (WR_QUERY_ANY_HIT == kind)
+      return first;
+    return first != (0 != dir_is_neg[links.z >> 1]);
+  };
+
+  wr_traversal_counters work = {};
+
+  float              min_distance = t_max;
+  int                current      = 0;
+  wr_stackless_state state        = WR_STACKLESS_FROM_SIBLING; // the root
+  bool               hit          = false;
+  while (true) {
+    if (WR_STACKLESS_FROM_CHILD == state) {
+      if (current <= 0) // back at the root
+        break;
+      const ivec4& links = bvh->m_node_links[current];
+      if (is_near_child(links)) {
+        current = links.y;
+        state   = WR_STACKLESS_FROM_SIBLING;
+      } else {
+        current = links.x;
+      }
+      continue;
+    }
+
+    const wr_linear_bvh_node* node = &bvh->m_linear_nodes[current];
+    ++work.nodes_visited;
+    const bool found =
+      wr_intersect_bounds(node->bounds, origin, inv_direction, min_distance);
+    if (found && node->nPrimitives == 0) {
+      current = (WR_QUERY_CLOSEST_HIT == kind && dir_is_neg[node->axis])
+                  ? node->secondChildOffset
+                  : current + 1;
+      state = WR_STACKLESS_FROM_PARENT;
+      continue;
+    }
+
+    if (found) {
+      hit |= wr_intersect_leaf<kind>(bvh, node, origin, direction,
+                                     &min_distance, intersection, &work);
+      if (WR_QUERY_ANY_HIT == kind && hit)
+        break;
+    }
+
+    const ivec4& links = bvh->m_node_links[current];
+    if (WR_STACKLESS_FROM_PARENT == state) {
+      current = links.y;
+      state   = WR_STACKLESS_FROM_SIBLING;
+    } else {
+      current = links.x;
+      state   = WR_STACKLESS_FROM_CHILD;
+    }
+  }
+
+  work.terminated = WR_QUERY_ANY_HIT == kind && hit;
+  if (WR_NULL != counters)
+    *counters = work;
+
+  return hit;
+}
+
+bool
+SAHBVH::QueryIntersection(vec3 origin, vec3 direction, float t_max,
+                          ivec4*                 intersection,
+                          wr_traversal_counters* counters) const
+{
+  *intersection = { -1, 0, 0, 0 };
+  std::memcpy(&intersection->w, &t_max, sizeof(float));
+
+  if (WR_TRAVERSAL_STACKLESS == m_traversal)
+    return wr_sah_bvh_traverse_stackless<WR_QUERY_CLOSEST_HIT>(
+      this, origin, direction, t_max, intersection, counters);
+  return wr_sah_bvh_traverse<WR_QUERY_CLOSEST_HIT>(
+    this, origin, direction, t_max, intersection, counters);
+}
 
-  return intersection_code;
+bool
+SAHBVH::QueryOcclusion(vec3 origin, vec3 direction, float t_max,
+                       wr_traversal_counters* counters) const
+{
+  if (WR_TRAVERSAL_STACKLESS == m_traversal)
+    return wr_sah_bvh_traverse_stackless<WR_QUERY_ANY_HIT>(
+      this, origin, direction, t_max, WR_NULL, counters);
+  return wr_sah_bvh_traverse<WR_QUERY_ANY_HIT>(this, origin, direction, t_max,
+                                               WR_NULL, counters);
 }
 
 int
@@ -1611,6 +3461,7 @@ flattenBVHTree(bvh_node* node, int* offset, wr_linear_bvh_node* nodes)
   if (node->nPrimitives > 0) {
     linearNode->primitivesOffset = node->firstPrimOffset;
     linearNode->nPrimitives      = node->nPrimitives;
+    linearNode->axis             = node->nQuads;
   } else {
     linearNode->axis        = node->splitAxis;
     linearNode->nPrimitives = 0;
@@ -1621,10 +3472,346 @@ flattenBVHTree(bvh_node* node, int* offset, wr_linear_bvh_node* nodes)
   return myOffset;
 }
 
+// Makes node a leaf over the primitives in [start, end), appending their
+// faces with the quads first. The flattened leaf counts its quads in 8 bits,
+// so the faces of any further quads are tested one by one
+static void
+wr_init_leaf(bvh_node* node, const std::vector<wr_primitive>& primitiveInfo,
+             int start, int end, const wr_bounds& bounds,
+             std::vector<ivec4>& orderedPrims,
+             const std::vector<ivec4>& m_triangles)
+{
+  const int first = (int)orderedPrims.size();
+  int       quads = 0;
+  for (int i = start; i < end && quads < 255; ++i) {
+    const wr_primitive& primitive = primitiveInfo[i];
+    if (2 != primitive.faces)
+      continue;
+    orderedPrims.push_back(m_triangles[primitive.index]);
+    orderedPrims.push_back(m_triangles[primitive.index + 1]);
+    ++quads;
+  }
+
+  int skipped = 0;
+  for (int i = start; i < end; ++i) {
+    const wr_primitive& primitive = primitiveInfo[i];
+    if (2 == primitive.faces && skipped++ < quads)
+      continue;
+    for (int f = 0; f < primitive.faces; ++f)
+      orderedPrims.push_back(m_triangles[primitive.index + f]);
+  }
+
+  node->init_leaf(first, (int)orderedPrims.size() - first, bounds, quads);
+}
+
+// Spatial split BVH, after Stich et al., "Spatial Splits in Bounding Volume
+// Hierarchies". On top of the binned object splits of rg_build_bvh_recursive
+// a node may split space at a plane, clipping the references that straddle
+// it into both children. A reference is a wr_primitive whose bounds may be
+// clipped, so the faces of the duplicated ones end up more than once in the
+// ordered faces. The duplicates are capped by the split budget
+
+#define WR_SBVH_BINS 32
+// Spatial splits are only tried where the children of the best object split
+// overlap by more than this fraction of the root area
+#define WR_SBVH_MIN_OVERLAP 1.0e-5f
+
+struct wr_sbvh_state
+{
+  const ADS*          ads;
+  float               root_area;
+  int                 budget; // references that may still be duplicated
+  std::vector<ivec4>* ordered;
+  int*                total_nodes;
+};
+
+struct wr_sbvh_split
+{
+  float cost = std::numeric_limits<float>::max();
+  int   dim  = 0;
+  int   bin  = 0; // the plane is after this bin
+};
+
+static bool
+wr_bounds_empty(const wr_bounds& b)
+{
+  return b.min.x > b.max.x || b.min.y > b.max.y || b.min.z > b.max.z;
+}
+
+static wr_bounds
+wr_bounds_intersection(const wr_bounds& b1, const wr_bounds& b2)
+{
+  wr_bounds b;
+  for (int i = 0; i < 3; ++i) {
+    b.min.at[i] = std::max(b1.min.at[i], b2.min.at[i]);
+    b.max.at[i] = std::min(b1.max.at[i], b2.max.at[i]);
+  }
+  return b;
+}
+
+// Bounds of the part of the faces of a reference between lo and hi along
+// dim, within the reference bounds. These are the bounds of the vertices in
+// the slab and of the edge crossings of its planes. Spheres are clipped as
+// boxes
+static wr_bounds
+wr_sbvh_clip(const ADS* ads, const wr_primitive& ref, int dim, float lo,
+             float hi)
+{
+  wr_bounds bounds;
+  for (int f = 0; f < ref.faces; ++f) {
+    const ivec4& face = ads->m_triangles[ref.index + f];
+    if (WR_SPHERE_INDEX == face.y) {
+      bounds = wr_bounds_union(bounds, wr_primitive_bounds(ads, face));
+      continue;
+    }
+
+    vec3 v[3];
+    for (int k = 0; k < 3; ++k) {
+      const vec4& p = ads->m_vertex_data[face.at[k]];
+      v[k]          = { p.x, p.y, p.z };
+    }
+    for (int e = 0; e < 3; ++e) {
+      const vec3& a = v[e];
+      const vec3& b = v[(e + 1) % 3];
+      if (a.at[dim] >= lo && a.at[dim] <= hi)
+        bounds = wr_bounds_union(bounds, { a, a });
+      for (const float plane : { lo, hi }) {
+        if ((a.at[dim] < plane) == (b.at[dim] < plane))
+          continue;
+        const float t = (plane - a.at[dim]) / (b.at[dim] - a.at[dim]);
+        vec3        c = wrays_vec3_add(
+          a, wrays_vec3_scalef(wrays_vec3_sub(b, a), t));
+        c.at[dim] = plane;
+        bounds    = wr_bounds_union(bounds, { c, c });
+      }
+    }
+  }
+
+  wr_bounds slab = ref.bounds;
+  slab.min.at[dim] = std::max(slab.min.at[dim], lo);
+  slab.max.at[dim] = std::min(slab.max.at[dim], hi);
+  return wr_bounds_intersection(bounds, slab);
+}
+
+static int
+wr_sbvh_bin(const wr_bounds& bounds, int dim, float x)
+{
+  const float extent = bounds.max.at[dim] - bounds.min.at[dim];
+  const int   bin = int(WR_SBVH_BINS * (x - bounds.min.at[dim]) / extent);
+  return wrays_maxi(0, wrays_mini(bin, WR_SBVH_BINS - 1));
+}
+
+// Position of the plane after bin
+static float
+wr_sbvh_plane(const wr_bounds& bounds, int dim, int bin)
+{
+  const float extent = bounds.max.at[dim] - bounds.min.at[dim];
+  return bounds.min.at[dim] + extent * (bin + 1) / WR_SBVH_BINS;
+}
+
+// Keeps in best the cheapest spatial split of the references along dim that
+// fits the budget. A reference enters the bin of its minimum and exits the
+// one of its maximum, and adds its clipped bounds to every bin in between
+static void
+wr_sbvh_spatial_split(const wr_sbvh_state* state,
+                      const std::vector<wr_primitive>& refs,
+                      const wr_bounds& bounds, int dim, wr_sbvh_split* best)
+{
+  if (bounds.max.at[dim] <= bounds.min.at[dim])
+    return;
+
+  wr_bounds bins[WR_SBVH_BINS];
+  int       entries[WR_SBVH_BINS] = {};
+  int       exits[WR_SBVH_BINS]   = {};
+  for (const wr_primitive& ref : refs) {
+    const int b0 = wr_sbvh_bin(bounds, dim, ref.bounds.min.at[dim]);
+    const int b1 = wr_sbvh_bin(bounds, dim, ref.bounds.max.at[dim]);
+    entries[b0]++;
+    exits[b1]++;
+    if (b0 == b1) {
+      bins[b0] = wr_bounds_union(bins[b0], ref.bounds);
+      continue;
+    }
+    for (int b = b0; b <= b1; ++b) {
+      const float lo = (b == b0) ? std::numeric_limits<float>::lowest()
+                                 : wr_sbvh_plane(bounds, dim, b - 1);
+      const float hi = (b == b1) ? std::numeric_limits<float>::max()
+                                 : wr_sbvh_plane(bounds, dim, b);
+      const wr_bounds clipped = wr_sbvh_clip(state->ads, ref, dim, lo, hi);
+      if (!wr_bounds_empty(clipped))
+        bins[b] = wr_bounds_union(bins[b], clipped);
+    }
+  }
+
+  float     right_area[WR_SBVH_BINS - 1];
+  int       right_count[WR_SBVH_BINS - 1];
+  wr_bounds right;
+  int       count = 0;
+  for (int i = WR_SBVH_BINS - 1; i > 0; --i) {
+    right = wr_bounds_union(right, bins[i]);
+    count += exits[i];
+    right_area[i - 1]  = wr_bounds_surface_area(right);
+    right_count[i - 1] = count;
+  }
+
+  const int   n    = (int)refs.size();
+  const float area = wr_bounds_surface_area(bounds);
+  wr_bounds   left;
+  count = 0;
+  for (int i = 0; i < WR_SBVH_BINS - 1; ++i) {
+    left = wr_bounds_union(left, bins[i]);
+    count += entries[i];
+    const int duplicates = count + right_count[i] - n;
+    if (0 == count || 0 == right_count[i] || duplicates > state->budget ||
+        (count == n && right_count[i] == n))
+      continue;
+    const float cost =
+      1.0f + (count * wr_bounds_surface_area(left) +
+              right_count[i] * right_area[i]) /
+               area;
+    if (cost < best->cost) {
+      best->cost = cost;
+      best->dim  = dim;
+      best->bin  = i;
+    }
+  }
+}
+
+static bvh_node*
+wr_sbvh_build(wr_sbvh_state* state, std::vector<wr_primitive>& refs)
+{
+  const int nBuckets       = state->ads->m_params.bucket_count;
+  const int maxPrimsInNode = state->ads->m_params.leaf_size;
+
+  bvh_node* node = new bvh_node();
+  (*state->total_nodes)++;
+  const int n = (int)refs.size();
+  wr_bounds bounds, centroid_bounds;
+  wr_primitive_range_bounds(refs, 0, n, &bounds, &centroid_bounds);
+
+  // Binned object split, as in rg_build_bvh_recursive
+  const int object_dim = wr_bounds_maximum_extent(centroid_bounds);
+  auto      object_bucket = [&](const wr_primitive& ref) {
+    int b = int(nBuckets *
+                wr_bounds_offset(centroid_bounds, ref.centroid).at[object_dim]);
+    return (b == nBuckets) ? nBuckets - 1 : b;
+  };
+  float     object_cost  = std::numeric_limits<float>::max();
+  int       object_split = 0;
+  wr_bounds object_left, object_right;
+  if (n > 1 && centroid_bounds.max.at[object_dim] >
+                 centroid_bounds.min.at[object_dim]) {
+    float cost[WR_MAX_BUCKETS - 1];
+    wr_binned_split_costs(refs, 0, n, bounds, centroid_bounds, object_dim,
+                          nBuckets, cost);
+    for (int i = 0; i < nBuckets - 1; ++i) {
+      if (cost[i] < object_cost) {
+        object_cost  = cost[i];
+        object_split = i;
+      }
+    }
+    for (const wr_primitive& ref : refs) {
+      wr_bounds& side =
+        (object_bucket(ref) <= object_split) ? object_left : object_right;
+      side = wr_bounds_union(side, ref.bounds);
+    }
+  }
+
+  // Spatial splits where the object split leaves overlapping children, or
+  // none was found
+  wr_sbvh_split   spatial;
+  const wr_bounds overlap = wr_bounds_intersection(object_left, object_right);
+  if (n > 1 && state->budget > 0 &&
+      (object_cost == std::numeric_limits<float>::max() ||
+       (!wr_bounds_empty(overlap) &&
+        wr_bounds_surface_area(overlap) >
+          WR_SBVH_MIN_OVERLAP * state->root_area))) {
+    for (int dim = 0; dim < 3; ++dim)
+      wr_sbvh_spatial_split(state, refs, bounds, dim, &spatial);
+  }
+
+  const float min_cost = std::min(object_cost, spatial.cost);
+  if (min_cost == std::numeric_limits<float>::max() ||
+      (n <= maxPrimsInNode && min_cost >= (float)n)) {
+    wr_init_leaf(node, refs, 0, n, bounds, *state->ordered,
+                 state->ads->m_triangles);
+    return node;
+  }
+
+  std::vector<wr_primitive> left, right;
+  int                       dim;
+  if (spatial.cost < object_cost) {
+    dim               = spatial.dim;
+    const float plane = wr_sbvh_plane(bounds, dim, spatial.bin);
+    for (const wr_primitive& ref : refs) {
+      const int b0 = wr_sbvh_bin(bounds, dim, ref.bounds.min.at[dim]);
+      const int b1 = wr_sbvh_bin(bounds, dim, ref.bounds.max.at[dim]);
+      if (b1 <= spatial.bin) {
+        left.push_back(ref);
+      } else if (b0 > spatial.bin) {
+        right.push_back(ref);
+      } else {
+        const wr_bounds l = wr_sbvh_clip(
+          state->ads, ref, dim, std::numeric_limits<float>::lowest(), plane);
+        const wr_bounds r = wr_sbvh_clip(state->ads, ref, dim, plane,
+                                         std::numeric_limits<float>::max());
+        if (!wr_bounds_empty(l))
+          left.push_back({ ref.index, l, ref.faces });
+        if (!wr_bounds_empty(r))
+          right.push_back({ ref.index, r, ref.faces });
+        if (wr_bounds_empty(l) && wr_bounds_empty(r))
+          left.push_back(ref);
+      }
+    }
+    state->budget -= (int)(left.size() + right.size()) - n;
+  } else {
+    dim = object_dim;
+    for (const wr_primitive& ref : refs)
+      (object_bucket(ref) <= object_split ? left : right).push_back(ref);
+  }
+
+  // A clipped straddling reference may still fall on a single side
+  if (left.empty() || right.empty()) {
+    std::vector<wr_primitive>& all = left.empty() ? right : left;
+    wr_init_leaf(node, all, 0, (int)all.size(), bounds, *state->ordered,
+                 state->ads->m_triangles);
+    return node;
+  }
+
+  refs.clear();
+  refs.shrink_to_fit();
+  bvh_node* c0 = wr_sbvh_build(state, left);
+  bvh_node* c1 = wr_sbvh_build(state, right);
+  node->init_interior(dim, c0, c1);
+
+  return node;
+}
+
+// Spatial split build over the primitives, which may duplicate up to
+// m_split_budget references per primitive
+static bvh_node*
+wr_sah_bvh_build_spatial(const SAHBVH*               bvh,
+                         std::vector<wr_primitive>& primitives,
+                         std::vector<ivec4>& orderedPrims, int* total_nodes)
+{
+  wr_bounds bounds, centroid_bounds;
+  wr_primitive_range_bounds(primitives, 0, (int)primitives.size(), &bounds,
+                            &centroid_bounds);
+
+  wr_sbvh_state state;
+  state.ads         = bvh;
+  state.root_area   = wr_bounds_surface_area(bounds);
+  state.budget      = (int)(bvh->m_split_budget * primitives.size());
+  state.ordered     = &orderedPrims;
+  state.total_nodes = total_nodes;
+  return wr_sbvh_build(&state, primitives);
+}
+
 bvh_node*
 rg_build_bvh_recursive(std::vector<wr_primitive>& primitiveInfo, int start,
                        int end, std::vector<ivec4>& orderedPrims,
-                       int* total_nodes, const std::vector<ivec4>& m_triangles)
+                       int* total_nodes, const std::vector<ivec4>& m_triangles,
+                       const wr_build_params& params)
 {
   // use a memory arena
   // webrays->scene.bvh_node_arena.push_back({});
@@ -1632,39 +3819,26 @@ rg_build_bvh_recursive(std::vector<wr_primitive>& primitiveInfo, int start,
   // &webrays->scene.bvh_node_arena[webrays->scene.bvh_node_arena.size() - 1];
   bvh_node* node = new bvh_node();
   (*total_nodes)++;
-  wr_bounds bounds;
-  for (int i = start; i < end; ++i)
-    bounds = wr_bounds_union(bounds, primitiveInfo[i].bounds);
+  wr_bounds bounds, centroid_bounds;
+  wr_primitive_range_bounds(primitiveInfo, start, end, &bounds,
+                            &centroid_bounds);
 
   int nPrimitives = end - start;
 
   if (nPrimitives == 1) {
-    int firstPrimOffset = (int)orderedPrims.size();
-    for (int i = start; i < end; ++i) {
-      int primNum = primitiveInfo[i].index;
-      orderedPrims.push_back(m_triangles[primNum]);
-    }
-    node->init_leaf(firstPrimOffset, nPrimitives, bounds);
+    wr_init_leaf(node, primitiveInfo, start, end, bounds, orderedPrims,
+                 m_triangles);
 
     return node;
   } else {
-    wr_bounds centroid_bounds;
-    for (int i = start; i < end; ++i)
-      centroid_bounds =
-        wr_bounds_union_point(centroid_bounds, primitiveInfo[i].centroid);
-
     int dim = wr_bounds_maximum_extent(centroid_bounds);
 
     int mid = (start + end) / 2;
     // if (centroid_bounds.max[dim] == centroid_bounds.min[dim]) {
     if (std::abs(centroid_bounds.max.at[dim] - centroid_bounds.min.at[dim]) <
         0.01f) {
-      int firstPrimOffset = (int)orderedPrims.size();
-      for (int i = start; i < end; ++i) {
-        int primNum = primitiveInfo[i].index;
-        orderedPrims.push_back(m_triangles[primNum]);
-      }
-      node->init_leaf(firstPrimOffset, nPrimitives, bounds);
+      wr_init_leaf(node, primitiveInfo, start, end, bounds, orderedPrims,
+                   m_triangles);
 
       return node;
     } else {
@@ -1676,45 +3850,12 @@ rg_build_bvh_recursive(std::vector<wr_primitive>& primitiveInfo, int start,
                            return a.centroid.at[dim] < b.centroid.at[dim];
                          });
       } else {
-        constexpr int nBuckets       = 64;
-        constexpr int maxPrimsInNode = 3;
-
-        struct BucketInfo
-        {
-          int       count = 0;
-          wr_bounds bounds;
-        };
-        BucketInfo buckets[nBuckets];
-        for (int i = start; i < end; ++i) {
-          int b = int(nBuckets * wr_bounds_offset(centroid_bounds,
-                                                  primitiveInfo[i].centroid)
-                                   .at[dim]);
-          if (b == nBuckets)
-            b = nBuckets - 1;
-          buckets[b].count++;
-          buckets[b].bounds =
-            wr_bounds_union(buckets[b].bounds, primitiveInfo[i].bounds);
-        }
-        float cost[nBuckets - 1];
-        for (int i = 0; i < nBuckets - 1; ++i) {
-          wr_bounds b0, b1;
-          int       count0 = 0, count1 = 0;
-          for (int j = 0; j <= i; ++j) {
-            b0 = wr_bounds_union(b0, buckets[j].bounds);
-            count0 += buckets[j].count;
-          }
-          for (int j = i + 1; j < nBuckets; ++j) {
-            b1 = wr_bounds_union(b1, buckets[j].bounds);
-            count1 += buckets[j].count;
-          }
-          /*cost[i] =
-            .125f + (count0 * rg_bounds_surface_area(b0) +
-            count1 * rg_bounds_surface_area(b1))
-            / rg_bounds_surface_area(bounds);*/
-          cost[i] = 1.0f + (count0 * wr_bounds_surface_area(b0) +
-                            count1 * wr_bounds_surface_area(b1)) /
-                             wr_bounds_surface_area(bounds);
-        }
+        const int nBuckets       = params.bucket_count;
+        const int maxPrimsInNode = params.leaf_size;
+
+        float cost[WR_MAX_BUCKETS - 1];
+        wr_binned_split_costs(primitiveInfo, start, end, bounds,
+                              centroid_bounds, dim, nBuckets, cost);
 
         float minCost            = cost[0];
         int   minCostSplitBucket = 0;
@@ -1739,21 +3880,18 @@ rg_build_bvh_recursive(std::vector<wr_primitive>& primitiveInfo, int start,
             });
           mid = int(pmid - &primitiveInfo[0]);
         } else {
-          int firstPrimOffset = int(orderedPrims.size());
-          for (int i = start; i < end; ++i) {
-            int primNum = primitiveInfo[i].index;
-            orderedPrims.push_back(m_triangles[primNum]);
-          }
-
-          node->init_leaf(firstPrimOffset, nPrimitives, bounds);
+          wr_init_leaf(node, primitiveInfo, start, end, bounds, orderedPrims,
+                       m_triangles);
 
           return node;
         }
       }
-      bvh_node* c0 = rg_build_bvh_recursive(
-        primitiveInfo, start, mid, orderedPrims, total_nodes, m_triangles);
-      bvh_node* c1 = rg_build_bvh_recursive(
-        primitiveInfo, mid, end, orderedPrims, total_nodes, m_triangles);
+      bvh_node* c0 =
+        rg_build_bvh_recursive(primitiveInfo, start, mid, orderedPrims,
+                               total_nodes, m_triangles, params);
+      bvh_node* c1 =
+        rg_build_bvh_recursive(primitiveInfo, mid, end, orderedPrims,
+                               total_nodes, m_triangles, params);
       node->init_interior(dim, c0, c1);
     }
   }
@@ -1765,7 +3903,8 @@ bvh_node*
 rg_build_bvh_recursive_1prim(std::vector<wr_primitive>& primitiveInfo,
                              int start, int end,
                              std::vector<ivec4>& orderedPrims, int* total_nodes,
-                             const std::vector<ivec4>& m_triangles)
+                             const std::vector<ivec4>& m_triangles,
+                             const wr_build_params&    params)
 {
   constexpr int maxPrimsInNode = 1;
 
@@ -1775,9 +3914,9 @@ rg_build_bvh_recursive_1prim(std::vector<wr_primitive>& primitiveInfo,
   // &webrays->scene.bvh_node_arena[webrays->scene.bvh_node_arena.size() - 1];
   bvh_node* node = new bvh_node();
   (*total_nodes)++;
-  wr_bounds bounds;
-  for (int i = start; i < end; ++i)
-    bounds = wr_bounds_union(bounds, primitiveInfo[i].bounds);
+  wr_bounds bounds, centroid_bounds;
+  wr_primitive_range_bounds(primitiveInfo, start, end, &bounds,
+                            &centroid_bounds);
 
   int nPrimitives = end - start;
 
@@ -1789,11 +3928,6 @@ rg_build_bvh_recursive_1prim(std::vector<wr_primitive>& primitiveInfo,
 
     return node;
   } else {
-    wr_bounds centroid_bounds;
-    for (int i = start; i < end; ++i)
-      centroid_bounds =
-        wr_bounds_union_point(centroid_bounds, primitiveInfo[i].centroid);
-
     int dim = wr_bounds_maximum_extent(centroid_bounds);
 
     int mid = (start + end) / 2;
@@ -1813,44 +3947,11 @@ rg_build_bvh_recursive_1prim(std::vector<wr_primitive>& primitiveInfo,
                            return a.centroid.at[dim] < b.centroid.at[dim];
                          });
       } else {
-        constexpr int nBuckets = 64;
-
-        struct BucketInfo
-        {
-          int       count = 0;
-          wr_bounds bounds;
-        };
-        BucketInfo buckets[nBuckets];
-        for (int i = start; i < end; ++i) {
-          int b = int(nBuckets * wr_bounds_offset(centroid_bounds,
-                                                  primitiveInfo[i].centroid)
-                                   .at[dim]);
-          if (b == nBuckets)
-            b = nBuckets - 1;
-          buckets[b].count++;
-          buckets[b].bounds =
-            wr_bounds_union(buckets[b].bounds, primitiveInfo[i].bounds);
-        }
-        float cost[nBuckets - 1];
-        for (int i = 0; i < nBuckets - 1; ++i) {
-          wr_bounds b0, b1;
-          int       count0 = 0, count1 = 0;
-          for (int j = 0; j <= i; ++j) {
-            b0 = wr_bounds_union(b0, buckets[j].bounds);
-            count0 += buckets[j].count;
-          }
-          for (int j = i + 1; j < nBuckets; ++j) {
-            b1 = wr_bounds_union(b1, buckets[j].bounds);
-            count1 += buckets[j].count;
-          }
-          /*cost[i] =
-            .125f + (count0 * rg_bounds_surface_area(b0) +
-            count1 * rg_bounds_surface_area(b1))
-            / rg_bounds_surface_area(bounds);*/
-          cost[i] = 1.0f + (count0 * wr_bounds_surface_area(b0) +
-                            count1 * wr_bounds_surface_area(b1)) /
-                             wr_bounds_surface_area(bounds);
-        }
+        const int nBuckets = params.bucket_count;
+
+        float cost[WR_MAX_BUCKETS - 1];
+        wr_binned_split_costs(primitiveInfo, start, end, bounds,
+                              centroid_bounds, dim, nBuckets, cost);
 
         float minCost            = cost[0];
         int   minCostSplitBucket = 0;
@@ -1887,16 +3988,287 @@ rg_build_bvh_recursive_1prim(std::vector<wr_primitive>& primitiveInfo,
         }
       }
     }
-    bvh_node* c0 = rg_build_bvh_recursive_1prim(
-      primitiveInfo, start, mid, orderedPrims, total_nodes, m_triangles);
-    bvh_node* c1 = rg_build_bvh_recursive_1prim(
-      primitiveInfo, mid, end, orderedPrims, total_nodes, m_triangles);
+    bvh_node* c0 =
+      rg_build_bvh_recursive_1prim(primitiveInfo, start, mid, orderedPrims,
+                                   total_nodes, m_triangles, params);
+    bvh_node* c1 =
+      rg_build_bvh_recursive_1prim(primitiveInfo, mid, end, orderedPrims,
+                                   total_nodes, m_triangles, params);
     node->init_interior(dim, c0, c1);
   }
 
   return node;
 }
 
+// Post-build optimization of a binary hierarchy by reinsertion, after
+// Bittner et al., "Fast Insertion-Based Optimization of Bounding Volume
+// Hierarchies". Each round takes the nodes that waste the most area, removes
+// them with their parent and reinserts them where they add the least area
+// to the tree, which is kept when that is less than their removal saved.
+// The subtrees below the top of the tree are optimized first, in parallel,
+// for half the budget, and then the whole tree until the budget runs out or
+// a pass over every node finds nothing to improve.
+
+struct wr_bvh_opt_node
+{
+  wr_bounds bounds;
+  float     area;
+  int       parent;
+  int       children[2]; // -1 for leaves
+  bvh_node* node;
+};
+
+struct wr_bvh_opt_tree
+{
+  std::vector<wr_bvh_opt_node>          nodes;
+  std::chrono::steady_clock::time_point start;
+};
+
+static int
+wr_bvh_opt_add(wr_bvh_opt_tree* tree, bvh_node* node, int parent)
+{
+  const int index = (int)tree->nodes.size();
+  tree->nodes.push_back({ node->bounds, wr_bounds_surface_area(node->bounds),
+                          parent, { -1, -1 }, node });
+  if (nullptr != node->children[0]) {
+    const int c0 = wr_bvh_opt_add(tree, node->children[0], index);
+    const int c1 = wr_bvh_opt_add(tree, node->children[1], index);
+    tree->nodes[index].children[0] = c0;
+    tree->nodes[index].children[1] = c1;
+  }
+  return index;
+}
+
+// Refits the bounds from node up to top and returns the area they lost
+static float
+wr_bvh_opt_refit(wr_bvh_opt_tree* tree, int node, int top)
+{
+  float saved = 0.0f;
+  for (;;) {
+    wr_bvh_opt_node& n = tree->nodes[node];
+    n.bounds = wr_bounds_union(tree->nodes[n.children[0]].bounds,
+                               tree->nodes[n.children[1]].bounds);
+    const float area = wr_bounds_surface_area(n.bounds);
+    saved += n.area - area;
+    n.area = area;
+    if (node == top)
+      return saved;
+    node = n.parent;
+  }
+}
+
+static void
+wr_bvh_opt_replace_child(wr_bvh_opt_tree* tree, int parent, int child,
+                         int replacement)
+{
+  wr_bvh_opt_node& p = tree->nodes[parent];
+  p.children[p.children[0] == child ? 0 : 1] = replacement;
+  tree->nodes[replacement].parent           = parent;
+}
+
+// The node below top where inserting node adds the least area, found by
+// branch and bound over the area the insertion adds to the ancestors
+static int
+wr_bvh_opt_find_sibling(const wr_bvh_opt_tree* tree, int node, int top,
+                        float* cost)
+{
+  const wr_bounds& bounds = tree->nodes[node].bounds;
+  const float      area   = tree->nodes[node].area;
+
+  typedef std::pair<float, int> entry; // (area added above, node)
+  std::priority_queue<entry, std::vector<entry>, std::greater<entry>> queue;
+  queue.push({ 0.0f, top });
+  int best = -1;
+  *cost    = std::numeric_limits<float>::max();
+  while (!queue.empty()) {
+    const entry e = queue.top();
+    queue.pop();
+    if (e.first + area >= *cost)
+      break;
+
+    const wr_bvh_opt_node& n = tree->nodes[e.second];
+    const float            merged =
+      wr_bounds_surface_area(wr_bounds_union(n.bounds, bounds));
+    if (e.second != top && e.first + merged < *cost) {
+      *cost = e.first + merged;
+      best  = e.second;
+    }
+    const float added = e.first + merged - n.area;
+    if (n.children[0] >= 0 && added + area < *cost) {
+      queue.push({ added, n.children[0] });
+      queue.push({ added, n.children[1] });
+    }
+  }
+  return best;
+}
+
+// Removes node and its parent from below top and reinserts them at the best
+// place, or where they were if that saves nothing. Returns the area saved
+static float
+wr_bvh_opt_reinsert(wr_bvh_opt_tree* tree, int node, int top)
+{
+  const int parent = tree->nodes[node].parent;
+  if (parent == top || parent < 0)
+    return 0.0f;
+  const wr_bvh_opt_node& p           = tree->nodes[parent];
+  const int              grandparent = p.parent;
+  const int sibling = p.children[p.children[0] == node ? 1 : 0];
+
+  wr_bvh_opt_replace_child(tree, grandparent, parent, sibling);
+  const float removed = p.area + wr_bvh_opt_refit(tree, grandparent, top);
+
+  float     cost;
+  const int best   = wr_bvh_opt_find_sibling(tree, node, top, &cost);
+  const int target = (best >= 0 && cost < removed) ? best : sibling;
+
+  wr_bvh_opt_replace_child(tree, tree->nodes[target].parent, target, parent);
+  wr_bvh_opt_node& q         = tree->nodes[parent];
+  q.children[0]              = target;
+  q.children[1]              = node;
+  q.area                     = 0.0f;
+  tree->nodes[target].parent = parent;
+  tree->nodes[node].parent   = parent;
+  const float added          = -wr_bvh_opt_refit(tree, parent, top);
+  return (target == sibling) ? 0.0f : removed - added;
+}
+
+static void
+wr_bvh_opt_subtree(wr_bvh_opt_tree* tree, int top, float deadline_ms)
+{
+  // The nodes of the subtree with a grandparent inside it
+  std::vector<int> candidates;
+  std::vector<int> stack = { top };
+  while (!stack.empty()) {
+    const int n = stack.back();
+    stack.pop_back();
+    const wr_bvh_opt_node& node = tree->nodes[n];
+    if (n != top && node.parent != top)
+      candidates.push_back(n);
+    if (node.children[0] >= 0) {
+      stack.push_back(node.children[0]);
+      stack.push_back(node.children[1]);
+    }
+  }
+  if (candidates.empty())
+    return;
+
+  // Rounds over the nodes that waste the most area, the area of the node
+  // times its ratios to the sum and the minimum of the areas of its children
+  std::vector<std::pair<float, int>> waste(candidates.size());
+  size_t batch = std::max<size_t>(64, candidates.size() / 100);
+  while (wr_elapsed_ms(tree->start) < deadline_ms) {
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      const wr_bvh_opt_node& node = tree->nodes[candidates[i]];
+      waste[i]                    = { node.area, candidates[i] };
+      if (node.children[0] < 0)
+        continue;
+      const float a0 = tree->nodes[node.children[0]].area;
+      const float a1 = tree->nodes[node.children[1]].area;
+      waste[i].first = node.area * node.area * node.area /
+                       std::max((a0 + a1) * std::min(a0, a1), FLT_MIN);
+    }
+    batch = std::min(batch, waste.size());
+    std::partial_sort(waste.begin(), waste.begin() + batch, waste.end(),
+                      std::greater<std::pair<float, int>>());
+
+    int improved = 0;
+    for (size_t i = 0; i < batch; ++i) {
+      if (wr_bvh_opt_reinsert(tree, waste[i].second, top) > 0.0f)
+        improved++;
+      if (wr_elapsed_ms(tree->start) >= deadline_ms)
+        return;
+    }
+    // Widen the rounds that found nothing until they cover every node
+    if (0 == improved) {
+      if (batch == candidates.size())
+        return;
+      batch *= 2;
+    }
+  }
+}
+
+static void
+wr_bvh_optimize(bvh_node* root, float budget_ms, std::vector<ivec4>* faces)
+{
+  if (budget_ms <= 0.0f || nullptr == root->children[0])
+    return;
+
+  WR_PROFILE_ZONE("optimize");
+  wr_bvh_opt_tree tree;
+  tree.start = std::chrono::steady_clock::now();
+  wr_bvh_opt_add(&tree, root, -1);
+
+#if WR_OPTIMIZE_THREADS
+  // Disjoint subtrees keep their bounds through the reinsertions below them,
+  // so each of them is optimized on its own
+  const int workers = std::max(
+    1, std::min((int)std::thread::hardware_concurrency(), WRAYS_BUILD_THREADS));
+  std::vector<int> subtrees = { 0 };
+  std::vector<int> sizes(tree.nodes.size(), 1);
+  for (int n = (int)tree.nodes.size() - 1; n > 0; --n)
+    sizes[tree.nodes[n].parent] += sizes[n];
+  while ((int)subtrees.size() < 4 * workers) {
+    auto largest = std::max_element(
+      subtrees.begin(), subtrees.end(),
+      [&sizes](int a, int b) { return sizes[a] < sizes[b]; });
+    const wr_bvh_opt_node& node = tree.nodes[*largest];
+    if (node.children[0] < 0 || sizes[*largest] < 1024)
+      break;
+    *largest = node.children[0];
+    subtrees.push_back(node.children[1]);
+  }
+  if (workers > 1 && subtrees.size() > 1) {
+    std::atomic<int>         next(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < workers; ++i)
+      threads.emplace_back([&]() {
+        int s;
+        while ((s = next++) < (int)subtrees.size())
+          wr_bvh_opt_subtree(&tree, subtrees[s], 0.5f * budget_ms);
+      });
+    for (std::thread& thread : threads)
+      thread.join();
+  }
+#endif
+  wr_bvh_opt_subtree(&tree, 0, budget_ms);
+
+  // Back to the bvh_nodes, with the faces in depth-first order of the leaves
+  // so that every subtree covers a contiguous range again
+  for (const wr_bvh_opt_node& n : tree.nodes)
+    n.node->bounds = n.bounds;
+  std::vector<ivec4> ordered;
+  ordered.reserve(faces->size());
+  std::vector<int> stack = { 0 };
+  while (!stack.empty()) {
+    const wr_bvh_opt_node& n = tree.nodes[stack.back()];
+    stack.pop_back();
+    bvh_node* node = n.node;
+    if (n.children[0] < 0) {
+      const int first = (int)ordered.size();
+      const auto leaf = faces->begin() + node->firstPrimOffset;
+      ordered.insert(ordered.end(), leaf, leaf + node->nPrimitives);
+      node->firstPrimOffset = first;
+      continue;
+    }
+    // The traversal orders the children by the split axis, so the first
+    // child has to be the lower one along it
+    int        c0        = n.children[0];
+    int        c1        = n.children[1];
+    const vec3 centroid0 = wrays_vec3_add(tree.nodes[c0].bounds.min,
+                                          tree.nodes[c0].bounds.max);
+    const vec3 centroid1 = wrays_vec3_add(tree.nodes[c1].bounds.min,
+                                          tree.nodes[c1].bounds.max);
+    const int  axis      = wr_bounds_maximum_extent(
+      wr_bounds_union({ centroid0, centroid0 }, { centroid1, centroid1 }));
+    if (centroid1.at[axis] < centroid0.at[axis])
+      std::swap(c0, c1);
+    node->init_interior(axis, tree.nodes[c0].node, tree.nodes[c1].node);
+    stack.push_back(c1);
+    stack.push_back(c0);
+  }
+  faces->swap(ordered);
+}
+
 LinearNodes::LinearNodes()
   : intersection_code(nullptr)
 {
@@ -1910,10 +4282,12 @@ LinearNodes::~LinearNodes()
   delete[] intersection_code;
 }
 
+// The brute-force loop only handles triangles
 int
-LinearNodes::AddSphere(float* position, float radius, int materialID)
+LinearNodes::AddSpheres(float* spheres, int sphere_stride, int* user_data,
+                        int num_spheres)
 {
-  return 0;
+  return -1;
 }
 
 int
@@ -1936,15 +4310,8 @@ LinearNodes::AddTriangularMesh(float* positions, int position_stride,
               4 * num_vertices * sizeof(float));
 
   mesh.num_triangles = num_triangles;
-  m_triangles.resize(m_triangles.size() + mesh.num_triangles);
   int materialID = m_material_id_generator++;
-  for (int i = 0; i < mesh.num_triangles; ++i) {
-    m_triangles[i + mesh.triangle_offset] = {
-      indices[4 * i + 0] + mesh.vertex_offset,
-      indices[4 * i + 1] + mesh.vertex_offset,
-      indices[4 * i + 2] + mesh.vertex_offset, indices[4 * i + 3]
-    };
-  }
+  wr_append_triangles(this, indices, num_triangles, mesh.vertex_offset);
 
   m_need_update = true;
 
@@ -2041,6 +4408,8 @@ LinearNodes::GetIntersectionCode()
   str +=
     "#define wr_TriangleCount " + std::to_string(m_triangles.size()) + "\n";
   str += "#define WR_RAY_MAX_DISTANCE 1.e27\n";
+  str += g_traversal_stats_func;
+  str += g_hit_attributes_func;
   str += g_ray_triangle_intersection_func;
   str += g_linear_nodes_ray_intersect_fragment_shader;
 
@@ -2051,9 +4420,53 @@ LinearNodes::GetIntersectionCode()
   return intersection_code;
 }
 
+bool
+LinearNodes::QueryIntersection(vec3 origin, vec3 direction, float t_max,
+                               ivec4*                 intersection,
+                               wr_traversal_counters* counters) const
+{
+  float min_distance = t_max;
+  bool  hit          = false;
+  *intersection      = { -1, 0, 0, 0 };
+  std::memcpy(&intersection->w, &t_max, sizeof(float));
+
+  for (int triangle = 0; triangle < (int)m_triangles.size(); ++triangle) {
+    vec3 ret;
+    if (wr_intersect_primitive<WR_QUERY_CLOSEST_HIT>(
+          this, triangle, origin, direction, min_distance, &ret)) {
+      min_distance = ret.z;
+      wr_pack_intersection(triangle, ret, intersection);
+      hit = true;
+    }
+  }
+
+  if (WR_NULL != counters)
+    *counters = { 0, (int)m_triangles.size(), 0, 0 };
+
+  return hit;
+}
+
+bool
+LinearNodes::QueryOcclusion(vec3 origin, vec3 direction, float t_max,
+                            wr_traversal_counters* counters) const
+{
+  int triangle = 0;
+  for (; triangle < (int)m_triangles.size(); ++triangle) {
+    vec3 ret;
+    if (wr_intersect_primitive<WR_QUERY_ANY_HIT>(this, triangle, origin,
+                                                 direction, t_max, &ret))
+      break;
+  }
+
+  if (WR_NULL != counters)
+    *counters = { 0, wrays_mini(triangle + 1, (int)m_triangles.size()), 0,
+                  triangle < (int)m_triangles.size() };
+
+  return triangle < (int)m_triangles.size();
+}
+
 WideBVH::WideBVH()
-  : maxPrimsInNode(5)
-  , m_shape_id_generator(0)
+  : m_shape_id_generator(0)
 {
   std::memset(&m_webgl_textures, 0, sizeof(m_webgl_textures));
   m_need_update         = true;
@@ -2072,10 +4485,16 @@ WideBVH::~WideBVH()
 }
 
 int
-WideBVH::AddSphere(float* position, float radius, int materialID)
+WideBVH::AddSpheres(float* spheres, int sphere_stride, int* user_data,
+                    int num_spheres)
 {
-  return 0;
-};
+  int ID = ++m_shape_id_generator;
+  wr_append_spheres(this, spheres, sphere_stride, user_data, num_spheres);
+
+  m_need_update = true;
+
+  return ID;
+}
 
 int
 WideBVH::AddTriangularMesh(float* positions, int position_stride,
@@ -2108,14 +4527,7 @@ WideBVH::AddTriangularMesh(float* positions, int position_stride,
   }
 
   mesh.num_triangles = num_triangles;
-  m_triangles.resize(m_triangles.size() + mesh.num_triangles);
-  for (int i = 0; i < mesh.num_triangles; ++i) {
-    m_triangles[i + mesh.triangle_offset] = {
-      indices[4 * i + 0] + mesh.vertex_offset,
-      indices[4 * i + 1] + mesh.vertex_offset,
-      indices[4 * i + 2] + mesh.vertex_offset, indices[4 * i + 3]
-    };
-  }
+  wr_append_triangles(this, indices, num_triangles, mesh.vertex_offset);
 
   m_need_update = true;
 
@@ -2133,26 +4545,26 @@ WideBVH::Build()
     return true;
   }
 
+  if (m_tune)
+    return wr_ads_tune(this, wr_tune_candidates(m_params, true));
+
+  WR_PROFILE_ZONE("BLAS build");
+  const auto build_start = std::chrono::steady_clock::now();
+
   std::vector<wr_primitive> primitiveInfo(m_triangles.size());
-  for (size_t i = 0; i < m_triangles.size(); ++i) {
-    vec3 v0          = { m_vertex_data[m_triangles[i].x].x,
-                m_vertex_data[m_triangles[i].x].y,
-                m_vertex_data[m_triangles[i].x].z };
-    vec3 v1          = { m_vertex_data[m_triangles[i].y].x,
-                m_vertex_data[m_triangles[i].y].y,
-                m_vertex_data[m_triangles[i].y].z };
-    vec3 v2          = { m_vertex_data[m_triangles[i].z].x,
-                m_vertex_data[m_triangles[i].z].y,
-                m_vertex_data[m_triangles[i].z].z };
-    primitiveInfo[i] = { (int)i, wr_triangle_bounds(v0, v1, v2) };
-  }
+  for (size_t i = 0; i < m_triangles.size(); ++i)
+    primitiveInfo[i] = { (int)i, wr_primitive_bounds(this, m_triangles[i]) };
 
   m_total_nodes = 0;
   std::vector<ivec4> orderedPrim;
   orderedPrim.reserve(m_triangles.size());
+  WR_PROFILE_BEGIN("SAH build");
   bvh_node* root =
     rg_build_bvh_recursive_1prim(primitiveInfo, 0, (int)primitiveInfo.size(),
-                                 orderedPrim, &m_total_nodes, m_triangles);
+                                 orderedPrim, &m_total_nodes, m_triangles,
+                                 m_params);
+  WR_PROFILE_END();
+  wr_bvh_optimize(root, m_optimize_budget, &orderedPrim);
   m_triangles.swap(orderedPrim);
 
   float rootSurfaceArea = wr_bounds_surface_area(root->bounds);
@@ -2161,9 +4573,9 @@ WideBVH::Build()
   int   Nd = 4;
   float Rt = 0.2f;
 
-  const float rayNodeTestCost     = 1.f;
-  const float rayTriangleTestCost = 0.3f;
-  const int   Pmax                = 3;
+  const float rayNodeTestCost     = m_params.node_cost;
+  const float rayTriangleTestCost = m_params.triangle_cost;
+  const int   Pmax                = m_params.leaf_size;
 
   struct Cost
   {
@@ -2273,9 +4685,9 @@ WideBVH::Build()
     }
   };
 
-  auto Fetch8Nodes = [](Cost* node, std::vector<Cost*>& rnodes, int size,
-                        auto&& Fetch8Nodes) {
-    if (node->numPrimitives <= 3) {
+  auto Fetch8Nodes = [Pmax](Cost* node, std::vector<Cost*>& rnodes, int size,
+                            auto&& Fetch8Nodes) {
+    if (node->numPrimitives <= Pmax && node->selection[0] == 0) {
       rnodes.push_back(node);
       return;
     }
@@ -2748,12 +5160,31 @@ WideBVH::Build()
     m_triangles.swap(orderedPrims);
   };
 
+  WR_PROFILE_BEGIN("wide collapse");
+  delete[] m_linear_nodes;
   Cost cost;
   cost.node = root;
   buildRec(root, &cost, rootSurfaceArea, buildRec);
   collapseRecNext(root, &cost);
+  WR_PROFILE_END();
+
+  if (WR_NODE_LAYOUT_TREELET == m_node_layout) {
+    WR_PROFILE_ZONE("treelet layout");
+    wr_wide_bvh_treelet_layout(m_linear_nodes, m_total_nodes);
+  }
   // collapseRecTrivial(root, &cost);
 
+  wr_build_intersection_triangles(this);
+
+  m_stats = {};
+  wr_ads_stats_memory(this, m_total_nodes * sizeof(wr_wide_bvh_node),
+                      &m_stats);
+  const int leaf_primitives = wr_wide_bvh_stats(
+    m_linear_nodes, 0, 0, (rootSurfaceArea > 0.0f) ? rootSurfaceArea : 1.0f,
+    rayNodeTestCost, rayTriangleTestCost, &m_stats);
+  m_stats.average_leaf_size = (float)leaf_primitives / m_stats.leaf_count;
+  m_stats.build_time        = wr_elapsed_ms(build_start);
+
   m_need_update = false;
 
   return true;
@@ -2779,16 +5210,20 @@ WideBVH::GetIntersectionCode()
 
   int instance_count = m_instance_texture_size / 4;
   str += "#define wr_InstanceCount " + std::to_string(instance_count) + "\n";
-  str += "#define wr_SphereCount " + std::to_string(0) + "\n";
-  str +=
-    "#define wr_TriangleCount " + std::to_string(m_triangles.size()) + "\n";
-  str += "#define wr_BVHNodeCount " + std::to_string(m_total_nodes) + "\n";
+  str += "#define wr_SphereCount " + std::to_string(m_sphere_count) + "\n";
+  str += "#define wr_TriangleCount " +
+         std::to_string(
+           std::max((int)m_triangles.size(), m_scene_triangle_count)) +
+         "\n";
+  str += "#define wr_BVHNodeCount " +
+         std::to_string(std::max(m_total_nodes, m_scene_node_count)) + "\n";
   str += "#define WR_RAY_MAX_DISTANCE 1.e27\n";
   str += "#define WR_IS_TLAS(x) (((x) & WR_TLAS_ID_MASK) == WR_TLAS_ID_MASK)\n";
+  str += g_scene_config_defaults;
 
   str += "uniform sampler2DArray wr_scene_vertices;\n";
   str += "uniform sampler2DArray wr_scene_instances;\n";
-  str += "uniform isampler2DArray wr_scene_indices;\n";
+  str += wr_face_fetch_code(this);
   str += "uniform sampler2DArray wr_bvh_nodes;\n";
 
   /* Maybe we need this for instancing */
@@ -2839,9 +5274,14 @@ WideBVH::GetIntersectionCode()
          "return floatBitsToInt(texelFetch(wr_bvh_nodes, ivec3(b % "
          "WR_NODES_TEXTURE_SIZE, b / WR_NODES_TEXTURE_SIZE, ads), 0)); }\n";
   str += g_copysign_func;
+  str += g_traversal_stats_func;
+  str += g_hit_attributes_func;
   str += g_ray_triangle_intersection_func;
+  str += g_ray_sphere_intersection_func;
 
   str += g_widebvh_attribute_accessors;
+  str += wr_primitive_test_code(this, "wr_GetIndicesBLAS",
+                                "wr_GetPositionBLAS");
   str += g_ray_widebvh_intersect_fragment_shader;
 
   intersection_code             = new char[str.size() + 1];
@@ -2850,3 +5290,175 @@ WideBVH::GetIntersectionCode()
 
   return intersection_code;
 }
+
+#if WR_SIMD
+// Entry and exit distances of children 4 * group to 4 * group + 3 of a wide
+// node, tested 4-wide. Same as wr_intersect_bounds except that t_max is left
+// to the caller, as it shrinks while the earlier children are visited: a
+// child is hit unless t_near > min(t_far, t_max)
+static void
+wr_wide_bvh_intersect_children(const wr_wide_bvh_node* node, int group,
+                               vec3 origin, vec3 inv_direction, float* t_near,
+                               float* t_far)
+{
+  float scale[3];
+  wr_wide_bvh_scale(node, scale);
+
+  const float node_origin[3] = { node->px, node->py, node->pz };
+
+  wr_float4 t0 = wr_f4_splat(0.0f);
+  wr_float4 t1 = wr_f4_splat(std::numeric_limits<float>::infinity());
+  for (int axis = 0; axis < 3; ++axis) {
+    const uint32_t* quantized = &node->childBBOX[group + 2 * axis];
+    const wr_float4 base      = wr_f4_splat(node_origin[axis]);
+    const wr_float4 step      = wr_f4_splat(scale[axis]);
+    const wr_float4 lo =
+      wr_f4_add(base, wr_f4_mul(wr_f4_from_bytes(quantized[0]), step));
+    const wr_float4 hi =
+      wr_f4_add(base, wr_f4_mul(wr_f4_from_bytes(quantized[6]), step));
+
+    const bool      negative = inv_direction.at[axis] < 0.0f;
+    const wr_float4 o        = wr_f4_splat(origin.at[axis]);
+    const wr_float4 inv      = wr_f4_splat(inv_direction.at[axis]);
+    t0 = wr_f4_max(wr_f4_mul(wr_f4_sub(negative ? hi : lo, o), inv), t0);
+    t1 = wr_f4_min(wr_f4_mul(wr_f4_sub(negative ? lo : hi, o), inv), t1);
+  }
+  wr_f4_store(t_near, t0);
+  wr_f4_store(t_far, t1);
+}
+#endif
+
+// Visit the non-empty children of a wide node whose quantized boxes are hit.
+// Internal children are pushed to the stack, leaf triangles are handed to
+// visit_triangle which returns true to terminate the traversal. max_depth is
+// that of the build statistics
+template <typename F>
+static void
+wr_wide_bvh_traverse(const wr_wide_bvh_node* nodes, int max_depth,
+                     vec3 origin, vec3 direction, const float* t_max,
+                     F visit_triangle, wr_traversal_counters* counters)
+{
+  const vec3 inv_direction = { 1.0f / direction.x, 1.0f / direction.y,
+                               1.0f / direction.z };
+
+  wr_traversal_counters work = {};
+
+  // Every level above the current node leaves at most 7 siblings behind and
+  // the node itself pushes 8 children
+  const int        stack_size = 7 * max_depth + 1;
+  int              local_nodes_to_visit[256];
+  std::vector<int> heap_nodes_to_visit;
+  int*             nodes_to_visit = local_nodes_to_visit;
+  if (stack_size > 256) {
+    heap_nodes_to_visit.resize(stack_size);
+    nodes_to_visit = heap_nodes_to_visit.data();
+  }
+
+  int  to_visit_offset              = 0;
+  bool terminated                   = false;
+  nodes_to_visit[to_visit_offset++] = 0;
+  while (to_visit_offset > 0 && !terminated) {
+    const wr_wide_bvh_node* node = &nodes[nodes_to_visit[--to_visit_offset]];
+    ++work.nodes_visited;
+#if WR_SIMD
+    float t_near[4], t_far[4];
+#endif
+    for (int child = 0; child < 8 && !terminated; ++child) {
+      const int meta = (node->meta[child / 4] >> ((child % 4) * 8)) & 0xFF;
+#if WR_SIMD
+      if (0 == child % 4)
+        wr_wide_bvh_intersect_children(node, child / 4, origin, inv_direction,
+                                       t_near, t_far);
+#endif
+      if (0 == meta) // empty slot
+        continue;
+
+#if WR_SIMD
+      if (t_near[child % 4] > wrays_minf(t_far[child % 4], *t_max))
+        continue;
+#else
+      if (!wr_intersect_bounds(wr_wide_bvh_child_bounds(node, child), origin,
+                               inv_direction, *t_max))
+        continue;
+#endif
+
+      if ((node->imask >> child) & 1) {
+        nodes_to_visit[to_visit_offset++] =
+          node->child_node_base_index + (meta & 31) - 24;
+        work.stack_depth = wrays_maxi(work.stack_depth, to_visit_offset);
+        continue;
+      }
+
+      const int first = node->triangle_base_index + (meta & 31);
+      for (int bits = meta >> 5, i = 0; bits != 0 && !terminated;
+           bits >>= 1, ++i) {
+        ++work.triangles_tested;
+        terminated = visit_triangle(first + i);
+      }
+    }
+  }
+
+  if (WR_NULL != counters)
+    *counters = work;
+}
+
+bool
+WideBVH::QueryIntersection(vec3 origin, vec3 direction, float t_max,
+                           ivec4*                 intersection,
+                           wr_traversal_counters* counters) const
+{
+  float min_distance = t_max;
+  bool  hit          = false;
+  *intersection      = { -1, 0, 0, 0 };
+  std::memcpy(&intersection->w, &t_max, sizeof(float));
+
+  if (WR_NULL != counters)
+    *counters = {};
+
+  if (0 == m_total_nodes)
+    return false;
+
+  wr_wide_bvh_traverse(
+    m_linear_nodes, m_stats.max_depth, origin, direction, &min_distance,
+    [&](int triangle) {
+      vec3 ret;
+      if (wr_intersect_primitive<WR_QUERY_CLOSEST_HIT>(
+            this, triangle, origin, direction, min_distance, &ret)) {
+        min_distance = ret.z;
+        wr_pack_intersection(triangle, ret, intersection);
+        hit = true;
+      }
+      return false;
+    },
+    counters);
+
+  return hit;
+}
+
+bool
+WideBVH::QueryOcclusion(vec3 origin, vec3 direction, float t_max,
+                        wr_traversal_counters* counters) const
+{
+  bool hit = false;
+
+  if (WR_NULL != counters)
+    *counters = {};
+
+  if (0 == m_total_nodes)
+    return false;
+
+  wr_wide_bvh_traverse(
+    m_linear_nodes, m_stats.max_depth, origin, direction, &t_max,
+    [&](int triangle) {
+      vec3 ret;
+      hit = wr_intersect_primitive<WR_QUERY_ANY_HIT>(this, triangle, origin,
+                                                     direction, t_max, &ret);
+      return hit;
+    },
+    counters);
+
+  if (WR_NULL != counters)
+    counters->terminated = hit;
+
+  return hit;
+}
@@ -43,12 +43,64 @@ struct wr_linear_bvh_node
     int secondChildOffset; // interior
   };
   uint16_t nPrimitives; // 0 -> interior node
-  uint8_t  axis;        // interior node: xyz
+  uint8_t  axis;        // interior node: xyz, leaf: quads, see m_quads
   uint8_t  pad[1];      // ensure 32 byte total size
 };
 
+// Work done by a single host-side query, see wrays_set_traversal_stats
+struct wr_traversal_counters
+{
+  int nodes_visited;
+  int triangles_tested;
+  int stack_depth; // deepest the traversal stack got
+  int terminated;  // occlusion query stopped at its first hit
+};
+
+// Order of the flattened hierarchy nodes, see the "layout" ADS option
+typedef enum
+{
+  WR_NODE_LAYOUT_DFS,     // depth-first, as flattened
+  WR_NODE_LAYOUT_TREELET, // surface-area ordered treelets
+} wr_node_layout;
+
+// Data read by the triangle tests, see the "triangles" ADS option
+typedef enum
+{
+  WR_TRIANGLE_FORMAT_INDEXED,     // indices, then vertex positions
+  WR_TRIANGLE_FORMAT_PRECOMPUTED, // (v0, v1 - v0, v2 - v0) in leaf order
+  WR_TRIANGLE_FORMAT_COMPACT,     // 8 or 16 bit faces, see wr_compact_faces
+} wr_triangle_format;
+
+// Faces per block of the compact format, which stores the smallest index of
+// the block in the texel before it and the faces relative to it
+#define WR_FACE_BLOCK_SIZE 16
+
+// Hierarchy traversal of the generated code, see the "traversal" ADS option
+typedef enum
+{
+  WR_TRAVERSAL_STACK,     // per-ray stack of the nodes left to visit
+  WR_TRAVERSAL_STACKLESS, // parent and sibling links, SAH BVH only
+} wr_traversal_kind;
+
+// Spheres share m_triangles with the triangles, as (center, WR_SPHERE_INDEX,
+// floatBitsToInt(radius), user data). The center is a regular vertex
+#define WR_SPHERE_INDEX -1
+
 #define WR_MAX_BINDINGS 8
 
+// Most SAH buckets of the binned builders
+#define WR_MAX_BUCKETS 256
+
+// Cost model of the builders, see the "buckets", "leaf_size", "node_cost"
+// and "triangle_cost" ADS options
+struct wr_build_params
+{
+  int   bucket_count  = 64;   // binned SAH buckets, 2 to WR_MAX_BUCKETS
+  int   leaf_size     = 3;    // most primitives per leaf, 3 for wide nodes
+  float node_cost     = 1.0f; // of a ray-node test, wide collapse only
+  float triangle_cost = 0.3f; // of a ray-triangle test, wide collapse only
+};
+
 class ADS
 {
 
@@ -69,7 +121,8 @@ public:
                     int normal_stride, float* uvs, int uv_stride,
                     int num_vertices, int* indices, int num_indices) = 0;
   virtual int
-  AddSphere(float* position, float radius, int materialID) = 0;
+  AddSpheres(float* spheres, int sphere_stride, int* user_data,
+             int num_spheres) = 0;
 
   virtual bool
   Build() = 0;
@@ -77,17 +130,73 @@ public:
   virtual const char*
   GetIntersectionCode() = 0;
 
+  // Host-side queries, mirroring wr_query_shape_intersection and
+  // wr_query_shape_occlusion of the generated accessor code. The traversal
+  // work is reported in counters unless it is null
+  virtual bool
+  QueryIntersection(vec3 origin, vec3 direction, float t_max,
+                    ivec4*                 intersection,
+                    wr_traversal_counters* counters) const = 0;
+  virtual bool
+  QueryOcclusion(vec3 origin, vec3 direction, float t_max,
+                 wr_traversal_counters* counters) const = 0;
+
   std::vector<vec4>  m_normal_data;
   std::vector<vec4>  m_vertex_data;
   std::vector<ivec4> m_triangles; // Triangles (v0, v1, v2, ID)
+  std::vector<vec4>  m_intersection_triangles; // 3 per triangle, see
+                                               // WR_TRIANGLE_FORMAT_PRECOMPUTED
+  int m_sphere_count = 0; // WR_SPHERE_INDEX entries of m_triangles
 
   wr_binding m_webgl_bindings[WR_MAX_BINDINGS];
   int        m_webgl_binding_count;
   int        m_vertex_texture_size;
   int        m_index_texture_size;
   int        m_instance_texture_size;
+  // Largest triangle and node counts of the BLASes. The GPU kernels are
+  // compiled from the code of one BLAS and their loops are bounded by these
+  int m_scene_triangle_count = 0;
+  int m_scene_node_count     = 0;
+
+  wr_ads_stats m_stats = {}; // filled on Build (host) and upload (device)
+
+  wr_node_layout     m_node_layout     = WR_NODE_LAYOUT_DFS;
+  wr_triangle_format m_triangle_format = WR_TRIANGLE_FORMAT_INDEXED;
+  wr_traversal_kind  m_traversal       = WR_TRAVERSAL_STACK;
+  int                m_face_bits       = 32; // of the uploaded faces
+
+  // Triangles sharing an edge are paired into quads, see the "quads" ADS
+  // option. The two faces of a quad, (q0, q1, q2) and (q0, q2, q3), are
+  // stored next to each other, and a leaf tests the faces of its first axis
+  // primitives two at a time
+  bool m_quads = false;
+
+  // Milliseconds of reinsertion passes over the binary hierarchy of a full
+  // build, see the "optimize" ADS option
+  float m_optimize_budget = 0.0f;
+
+  wr_build_params m_params;
+  // The first full build picks m_params by tracing sample rays through
+  // candidate builds, see the "tune" ADS option
+  bool m_tune = false;
 };
 
+// Bits per component of the compact faces of the ads, 8 or 16, or 0 when the
+// format is not compact or the faces do not fit. Spheres never fit
+int
+wr_compact_face_bits(const ADS* ads);
+
+// Texels of the faces as uploaded, one per face plus the block bases of the
+// compact format
+int
+wr_face_texel_count(const ADS* ads, int face_bits);
+
+// RGBA texels of face_bits per component, blocks of a base texel followed by
+// WR_FACE_BLOCK_SIZE faces relative to it
+void
+wr_compact_faces(const ADS* ads, int face_bits,
+                 std::vector<unsigned char>* texels);
+
 class SAHBVH : public ADS
 {
 
@@ -113,9 +222,33 @@ public:
 
   std::vector<TriangleMesh> m_triangle_meshes;
 
-  const int           maxPrimsInNode;
   int                 m_total_nodes;
   wr_linear_bvh_node* m_linear_nodes;
+  std::vector<ivec4>  m_node_links; // (parent, sibling, parent axis << 1 |
+                                    // first child), stackless traversal only
+
+  // Streaming ingestion, see the "streaming" ADS option. Each Build adds a
+  // hierarchy over the triangles appended since the previous one and joins
+  // the chunks under a small top tree, until wrays_finish_streaming turns
+  // the next Build into a full one
+  struct Chunk
+  {
+    std::vector<wr_linear_bvh_node> nodes; // primitive offsets are global
+  };
+
+  bool               m_streaming;
+  int                m_streamed_triangles; // covered by m_chunks
+  std::vector<Chunk> m_chunks;
+
+  // Spatial splits, see the "SBVH" builder. A split face is referenced by
+  // more than one leaf, so m_triangles holds the faces in leaf order with
+  // repeats. m_faces then keeps the faces of the last full build for the
+  // next one, which also takes the faces appended after the first
+  // m_reference_count entries of m_triangles
+  bool               m_spatial_splits;
+  float              m_split_budget; // extra references per face
+  std::vector<ivec4> m_faces;
+  int                m_reference_count;
 
   int m_shape_id_generator;
   int m_material_id_generator;
@@ -136,18 +269,36 @@ public:
                     int num_vertices, int* indices,
                     int num_indices) final override;
   int
-  AddSphere(float* position, float radius, int materialID) final override;
+  AddSpheres(float* spheres, int sphere_stride, int* user_data,
+             int num_spheres) final override;
 
   bool
   Build() final override;
 
   const char*
   GetIntersectionCode() final override;
+
+  bool
+  QueryIntersection(vec3 origin, vec3 direction, float t_max,
+                    ivec4*                 intersection,
+                    wr_traversal_counters* counters) const final override;
+  bool
+  QueryOcclusion(vec3 origin, vec3 direction, float t_max,
+                 wr_traversal_counters* counters) const final override;
+
   const Textures
   GetBVHTexture()
   {
     return m_webgl_textures;
   }
+
+  // RGBA32F texels per node in wr_bvh_nodes, the stackless traversal adds
+  // the node links
+  int
+  GetNodeTexels() const
+  {
+    return (WR_TRAVERSAL_STACKLESS == m_traversal) ? 3 : 2;
+  }
 };
 
 class LinearNodes : public ADS
@@ -192,13 +343,23 @@ public:
                     int num_vertices, int* indices,
                     int num_indices) final override;
   int
-  AddSphere(float* position, float radius, int materialID) final override;
+  AddSpheres(float* spheres, int sphere_stride, int* user_data,
+             int num_spheres) final override;
 
   bool
   Build() final override;
 
   const char*
   GetIntersectionCode() final override;
+
+  bool
+  QueryIntersection(vec3 origin, vec3 direction, float t_max,
+                    ivec4*                 intersection,
+                    wr_traversal_counters* counters) const final override;
+  bool
+  QueryOcclusion(vec3 origin, vec3 direction, float t_max,
+                 wr_traversal_counters* counters) const final override;
+
   const Textures
   GetBVHTexture()
   {
@@ -250,7 +411,6 @@ public:
 
   std::vector<TriangleMesh> m_triangle_meshes;
 
-  const int         maxPrimsInNode;
   int               m_total_nodes;
   wr_wide_bvh_node* m_linear_nodes;
 
@@ -272,13 +432,23 @@ public:
                     int num_vertices, int* indices,
                     int num_indices) final override;
   int
-  AddSphere(float* position, float radius, int materialID) final override;
+  AddSpheres(float* spheres, int sphere_stride, int* user_data,
+             int num_spheres) final override;
 
   bool
   Build() final override;
 
   const char*
   GetIntersectionCode() final override;
+
+  bool
+  QueryIntersection(vec3 origin, vec3 direction, float t_max,
+                    ivec4*                 intersection,
+                    wr_traversal_counters* counters) const final override;
+  bool
+  QueryOcclusion(vec3 origin, vec3 direction, float t_max,
+                 wr_traversal_counters* counters) const final override;
+
   const Textures
   GetBVHTexture()
   {
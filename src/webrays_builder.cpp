@@ -0,0 +1,129 @@
+/* Copyright 2021 Phasmatic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "webrays_builder.h"
+#include "webrays_ads.h"
+
+#if WRAYS_THREADS
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Upper bound on the workers, CMake sets it to the Emscripten pthread pool
+// size so that starting a build never waits for a new web worker to load
+#ifndef WRAYS_BUILD_THREADS
+#define WRAYS_BUILD_THREADS 4
+#endif
+
+struct wr_builder
+{
+  std::vector<std::thread> workers;
+  int                      count;   // BLASes of the build, fixed at start
+  std::atomic<int>         next;    // next BLAS to build
+  std::atomic<int>         running; // workers that have not finished yet
+};
+
+static void
+wr_builder_work(wr_context* webrays, wr_builder* builder)
+{
+  int i;
+  while ((i = builder->next++) < builder->count) {
+    ADS* ads = (ADS*)webrays->scene.blas_handles[i];
+    if (ads != nullptr)
+      ads->Build();
+  }
+  --builder->running;
+}
+
+void
+wr_builder_start(wr_context* webrays)
+{
+  if (WR_NULL == webrays->builder)
+    webrays->builder = new wr_builder;
+
+  wr_builder* builder = (wr_builder*)webrays->builder;
+  if (!builder->workers.empty())
+    return;
+
+  const int hardware_threads = (int)std::thread::hardware_concurrency();
+  const int worker_count =
+    std::min({ std::max(hardware_threads, 1), WRAYS_BUILD_THREADS,
+               webrays->scene.blas_count });
+
+  builder->count   = webrays->scene.blas_count;
+  builder->next    = 0;
+  builder->running = worker_count;
+  for (int i = 0; i < worker_count; ++i)
+    builder->workers.emplace_back(wr_builder_work, webrays, builder);
+}
+
+bool
+wr_builder_done(wr_context* webrays)
+{
+  const wr_builder* builder = (const wr_builder*)webrays->builder;
+  return WR_NULL == builder || 0 == builder->running;
+}
+
+void
+wr_builder_wait(wr_context* webrays)
+{
+  wr_builder* builder = (wr_builder*)webrays->builder;
+  if (WR_NULL == builder)
+    return;
+
+  for (std::thread& worker : builder->workers)
+    worker.join();
+  builder->workers.clear();
+}
+
+void
+wr_builder_destroy(wr_context* webrays)
+{
+  wr_builder_wait(webrays);
+  delete (wr_builder*)webrays->builder;
+  webrays->builder = WR_NULL;
+}
+
+#else
+
+void
+wr_builder_start(wr_context* webrays)
+{
+  for (int i = 0; i < webrays->scene.blas_count; ++i) {
+    ADS* ads = (ADS*)webrays->scene.blas_handles[i];
+    if (ads != nullptr)
+      ads->Build();
+  }
+}
+
+bool
+wr_builder_done(wr_context* webrays)
+{
+  return true;
+}
+
+void
+wr_builder_wait(wr_context* webrays)
+{
+}
+
+void
+wr_builder_destroy(wr_context* webrays)
+{
+}
+
+#endif /* WRAYS_THREADS */
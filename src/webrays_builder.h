@@ -0,0 +1,48 @@
+/* Copyright 2021 Phasmatic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WRAYS_BUILDER_H_
+#define _WRAYS_BUILDER_H_
+
+/* Background BLAS builds for wrays_update_async. With WRAYS_THREADS
+ * (ENABLE_THREADS in CMake) the dirty BLASes are built on a pool of worker
+ * threads, one BLAS at a time per worker, and the calling thread returns
+ * right away. On the web the workers are Emscripten pthreads backed by a
+ * SharedArrayBuffer. Without WRAYS_THREADS wr_builder_start builds in place.
+ *
+ * Only the builds run on the workers. The texture upload and the kernel
+ * generation still happen in wrays_update on the thread that owns the GL
+ * context, which first waits for the workers to finish. The BLASes must not
+ * be modified or read while a build is running, so the ADS functions and
+ * the CPU queries wait for it too. The workers only build the BLASes that
+ * existed when the build started.
+ */
+
+#include "webrays_context.h"
+
+void
+wr_builder_start(wr_context* webrays);
+
+// Non-blocking, true when no build is running
+bool
+wr_builder_done(wr_context* webrays);
+
+void
+wr_builder_wait(wr_context* webrays);
+
+void
+wr_builder_destroy(wr_context* webrays);
+
+#endif /* _WRAYS_BUILDER_H_ */
@@ -72,6 +72,27 @@ typedef struct
 
   int             needs_update;
   wr_update_flags update_flags;
+
+  /* Traversal statistics (opt-in) */
+  wr_bool            traversal_stats_enabled;
+  wr_traversal_stats traversal_stats;
+
+  /* Output of wrays_query_occlusion and wrays_query_intersection */
+  wr_occlusion_format    occlusion_format;
+  wr_intersection_format intersection_format;
+
+  /* Tiles of the 2D queries in rays, see wrays_set_query_tiling */
+  wr_size query_tile_width;
+  wr_size query_tile_height;
+
+  /* Coherence ordering of the host-side queries, see wrays_set_ray_sorting */
+  wr_bool ray_sorting;
+
+  /* Worker threads of wrays_update_async, see webrays_builder.h */
+  wr_handle builder;
+
+  /* Timing zones, see webrays_profile.h */
+  wr_handle profiler;
 } wr_context;
 
 #ifdef WRAYS_WIN32
@@ -130,4 +151,9 @@ wr_string_buffer_data(wr_string_buffer string_buffer);
 void
 wr_string_buffer_pretty_print(wr_string_buffer string_buffer);
 
+void
+wr_traversal_stats_accumulate(wr_traversal_stats* stats, int nodes_visited,
+                              int triangles_tested, int stack_depth,
+                              int terminated);
+
 #endif /* _WRAYS_CONTEXT_H_ */
\ No newline at end of file
@@ -19,6 +19,7 @@
 #include "webrays_math.h"
 #include "webrays_ads.h"
 
+#include <algorithm>
 #include <cstring> // memset
 
 typedef struct
@@ -67,6 +68,25 @@ wrays_cpu_add_shape(wr_handle handle, wr_handle ads_id, float* positions,
   return WR_SUCCESS;
 }
 
+wr_error
+wrays_cpu_add_spheres(wr_handle handle, wr_handle ads_id, float* spheres,
+                      int sphere_stride, int* user_data, int num_spheres,
+                      int* shape_id)
+{
+  wr_context* webrays = (wr_context*)handle;
+  if (WR_NULL == webrays)
+    return WR_NULL;
+  wr_cpu_context* webrays_cpu = (wr_cpu_context*)webrays->cpu;
+  if (WR_NULL == webrays_cpu)
+    return WR_NULL;
+
+  ADS* ads = webrays->scene.blas_handles[(int)(size_t)ads_id];
+
+  *shape_id = ads->AddSpheres(spheres, sphere_stride, user_data, num_spheres);
+
+  return WR_SUCCESS;
+}
+
 wr_error
 wrays_cpu_ads_create(wr_handle handle, wr_handle ads,
                      wr_ads_descriptor* descriptor)
@@ -107,9 +127,12 @@ WR_INTERNAL wr_error
   if (WR_NULL == webrays_cpu)
     return (wr_error) "Invalid CPU WebRays context";
 
-  ADS* ads = (ADS*)webrays->scene.blas_handles[0];
-
-  ads->Build();
+  // Build the BLASes...
+  for (int i = 0; i < webrays->scene.blas_count; ++i) {
+    ADS* ads = (ADS*)webrays->scene.blas_handles[i];
+    if (ads != nullptr)
+      ads->Build();
+  }
 
   return WR_SUCCESS;
 }
@@ -126,7 +149,19 @@ wrays_cpu_update(wr_handle handle)
 
   wrays_cpu_ads_build(handle);
 
-  SAHBVH* ads = (SAHBVH*)webrays->scene.blas_handles[0];
+  if (0 == webrays->scene.blas_count)
+    return WR_SUCCESS;
+
+  ADS*        ads        = webrays->scene.blas_handles[0];
+  const void* node_data  = WR_NULL;
+  int         node_count = 0;
+  if (webrays->scene.blas_type == wr_blas_type::WR_BLAS_TYPE_SAH) {
+    node_data  = ((SAHBVH*)ads)->m_linear_nodes;
+    node_count = ((SAHBVH*)ads)->m_total_nodes;
+  } else if (webrays->scene.blas_type == wr_blas_type::WR_BLAS_TYPE_WIDEBVH) {
+    node_data  = ((WideBVH*)ads)->m_linear_nodes;
+    node_count = ((WideBVH*)ads)->m_total_nodes;
+  }
 
   webrays_cpu->intersection_bindings[0] = { "wr_scene_vertices",
                                             WR_BINDING_TYPE_CPU_BUFFER, 0 };
@@ -142,13 +177,397 @@ wrays_cpu_update(wr_handle handle)
     ads->m_triangles.data();
   webrays_cpu->intersection_bindings[1].data.cpu_buffer.size =
     (unsigned int)ads->m_triangles.size();
-  webrays_cpu->intersection_bindings[2].data.cpu_buffer.buffer =
-    ads->m_linear_nodes;
+  webrays_cpu->intersection_bindings[2].data.cpu_buffer.buffer = node_data;
   webrays_cpu->intersection_bindings[2].data.cpu_buffer.size =
-    (unsigned int)ads->m_total_nodes;
+    (unsigned int)node_count;
   webrays_cpu->binding_count =
     (int)(sizeof(webrays_cpu->intersection_bindings) /
           sizeof(webrays_cpu->intersection_bindings[0]));
 
+  return WR_SUCCESS;
+}
+
+#define WR_CPU_INVALID_ADS_HANDLE ((wr_error) "Invalid ADS handle")
+#define WR_CPU_INVALID_RAY_BUFFERS ((wr_error) "Invalid ray buffers")
+WR_INTERNAL ADS*
+            wrays_cpu_get_blas(wr_context* webrays, wr_handle ads)
+{
+  int ads_id = WR_PTR2INT(ads);
+
+  // Instanced (TLAS) queries are only supported on the GLES backend
+  if ((ads_id & WR_TLAS_ID_MASK) == WR_TLAS_ID_MASK)
+    return WR_NULL;
+  if (ads_id < 0 || ads_id >= webrays->scene.blas_count)
+    return WR_NULL;
+
+  return webrays->scene.blas_handles[ads_id];
+}
+
+WR_INTERNAL wr_size
+wrays_cpu_ray_count(wr_size* dimensions, wr_size dimension_count)
+{
+  wr_size ray_count = (dimension_count > 0) ? 1 : 0;
+  for (wr_size i = 0; i < dimension_count; ++i)
+    ray_count *= dimensions[i];
+  return ray_count;
+}
+
+// Spread the low 9 bits of v three bits apart
+static uint32_t
+wrays_cpu_morton_expand(uint32_t v)
+{
+  v = (v | (v << 16)) & 0x030000FFu;
+  v = (v | (v << 8)) & 0x0300F00Fu;
+  v = (v | (v << 4)) & 0x030C30C3u;
+  v = (v | (v << 2)) & 0x09249249u;
+  return v;
+}
+
+// Reorder the ray indices of a batch for wrays_set_ray_sorting. The key of a
+// ray is its direction octant above the 27 bit Morton code of its origin,
+// quantized within the origin bounds of the batch. The (key, index) pairs are
+// sorted with a stable 4 pass LSD radix sort over the key bytes
+static void
+wrays_cpu_sort_rays(const vec4* origins, const vec4* directions,
+                    std::vector<uint64_t>& rays, std::vector<uint64_t>& scratch)
+{
+  vec3 lo = { std::numeric_limits<float>::max(),
+              std::numeric_limits<float>::max(),
+              std::numeric_limits<float>::max() };
+  vec3 hi = { std::numeric_limits<float>::lowest(),
+              std::numeric_limits<float>::lowest(),
+              std::numeric_limits<float>::lowest() };
+  for (uint64_t index : rays) {
+    const vec4 o = origins[index];
+    lo = { std::min(lo.x, o.x), std::min(lo.y, o.y), std::min(lo.z, o.z) };
+    hi = { std::max(hi.x, o.x), std::max(hi.y, o.y), std::max(hi.z, o.z) };
+  }
+
+  const float extent[3] = { hi.x - lo.x, hi.y - lo.y, hi.z - lo.z };
+  float       scale[3];
+  for (int axis = 0; axis < 3; ++axis)
+    scale[axis] = (extent[axis] > 0.0f) ? 511.0f / extent[axis] : 0.0f;
+
+  for (uint64_t& ray : rays) {
+    const vec4     o = origins[ray];
+    const vec4     d = directions[ray];
+    const uint32_t octant =
+      (d.x < 0.0f ? 1u : 0u) | (d.y < 0.0f ? 2u : 0u) | (d.z < 0.0f ? 4u : 0u);
+    const uint32_t morton =
+      wrays_cpu_morton_expand((uint32_t)((o.x - lo.x) * scale[0])) |
+      (wrays_cpu_morton_expand((uint32_t)((o.y - lo.y) * scale[1])) << 1) |
+      (wrays_cpu_morton_expand((uint32_t)((o.z - lo.z) * scale[2])) << 2);
+    ray |= (uint64_t)((octant << 27) | morton) << 32;
+  }
+
+  scratch.resize(rays.size());
+  for (int shift = 32; shift < 64; shift += 8) {
+    size_t offsets[256] = {};
+    for (uint64_t ray : rays)
+      ++offsets[(ray >> shift) & 0xFF];
+    size_t sum = 0;
+    for (size_t& offset : offsets) {
+      const size_t count = offset;
+      offset             = sum;
+      sum += count;
+    }
+    for (uint64_t ray : rays)
+      scratch[offsets[(ray >> shift) & 0xFF]++] = ray;
+    rays.swap(scratch);
+  }
+}
+
+// Visit the rays of a query in the tile order of wrays_set_query_tiling, the
+// same tiles the GLES backend draws. Only 2D queries are tiled. With
+// wrays_set_ray_sorting, the rays of each tile (or of the whole query) are
+// visited in the coherence order of their origins and directions
+template <typename F>
+static void
+wrays_cpu_for_each_ray(wr_context* webrays, const vec4* origins,
+                       const vec4* directions, wr_size* dimensions,
+                       wr_size dimension_count, F visit)
+{
+  std::vector<uint64_t> batch;
+  std::vector<uint64_t> scratch;
+
+  auto emit = [&](wr_size i) {
+    if (webrays->ray_sorting)
+      batch.push_back(i);
+    else
+      visit(i);
+  };
+  auto flush = [&]() {
+    if (batch.empty())
+      return;
+    wrays_cpu_sort_rays(origins, directions, batch, scratch);
+    for (uint64_t ray : batch)
+      visit((wr_size)(ray & 0xFFFFFFFFu));
+    batch.clear();
+  };
+
+  wr_size tile_width  = webrays->query_tile_width;
+  wr_size tile_height = webrays->query_tile_height;
+  if (2 != dimension_count || (0 == tile_width && 0 == tile_height)) {
+    const wr_size ray_count = wrays_cpu_ray_count(dimensions, dimension_count);
+    for (wr_size i = 0; i < ray_count; ++i)
+      emit(i);
+    flush();
+    return;
+  }
+
+  const wr_size width  = dimensions[0];
+  const wr_size height = dimensions[1];
+  tile_width  = (0 == tile_width) ? width : std::min(tile_width, width);
+  tile_height = (0 == tile_height) ? height : std::min(tile_height, height);
+  for (wr_size tile_y = 0; tile_y < height; tile_y += tile_height) {
+    for (wr_size tile_x = 0; tile_x < width; tile_x += tile_width) {
+      const wr_size end_y = std::min(tile_y + tile_height, height);
+      const wr_size end_x = std::min(tile_x + tile_width, width);
+      for (wr_size y = tile_y; y < end_y; ++y)
+        for (wr_size x = tile_x; x < end_x; ++x)
+          emit(y * width + x);
+      flush();
+    }
+  }
+}
+
+// GLSL packUnorm2x16 of the (float bits) hit attributes of an intersection
+static int
+wrays_cpu_pack_unorm2x16(int x, int y)
+{
+  float    v[2] = {};
+  uint32_t packed[2];
+  memcpy(&v[0], &x, sizeof(float));
+  memcpy(&v[1], &y, sizeof(float));
+  for (int i = 0; i < 2; ++i)
+    packed[i] =
+      (uint32_t)(std::min(std::max(v[i], 0.0f), 1.0f) * 65535.0f + 0.5f);
+  return (int)(packed[0] | (packed[1] << 16));
+}
+
+// Rays follow the layout of the GLES ray buffers. ray_buffers[0] holds
+// vec4(origin, t_min) and ray_buffers[1] vec4(direction, t_max). Rays with a
+// zero t_max are skipped and leave their result untouched. With
+// WR_INTERSECTION_FORMAT_COMPACT, intersections holds int[2] per ray
+wr_error
+wrays_cpu_query_intersection(wr_handle handle, wr_handle ads,
+                             wr_handle* ray_buffers, wr_size ray_buffer_count,
+                             wr_handle intersections, wr_size* dimensions,
+                             wr_size dimension_count)
+{
+  wr_context* webrays = (wr_context*)handle;
+  if (WR_NULL == webrays)
+    return (wr_error) "Invalid WebRays context";
+
+  ADS* blas = wrays_cpu_get_blas(webrays, ads);
+  if (WR_NULL == blas)
+    return WR_CPU_INVALID_ADS_HANDLE;
+  if (ray_buffer_count < 2 || WR_NULL == ray_buffers[0] ||
+      WR_NULL == ray_buffers[1] || WR_NULL == intersections)
+    return WR_CPU_INVALID_RAY_BUFFERS;
+
+  const vec4* origins    = (const vec4*)ray_buffers[0];
+  const vec4* directions = (const vec4*)ray_buffers[1];
+  ivec4*      results    = (ivec4*)intersections;
+  int*        compact    = (int*)intersections;
+  const bool  is_compact =
+    WR_INTERSECTION_FORMAT_COMPACT == webrays->intersection_format;
+
+  wr_traversal_counters  counters;
+  wr_traversal_counters* counters_ptr =
+    webrays->traversal_stats_enabled ? &counters : WR_NULL;
+
+  wrays_cpu_for_each_ray(webrays, origins, directions, dimensions,
+                         dimension_count, [&](wr_size i) {
+    const vec4 o = origins[i];
+    const vec4 d = directions[i];
+    if (0.0f == d.w)
+      return;
+
+    ivec4 intersection;
+    blas->QueryIntersection(
+      { o.x + o.w * d.x, o.y + o.w * d.y, o.z + o.w * d.z }, { d.x, d.y, d.z },
+      d.w, &intersection, counters_ptr);
+    if (is_compact) {
+      compact[2 * i + 0] = intersection.x;
+      compact[2 * i + 1] =
+        wrays_cpu_pack_unorm2x16(intersection.y, intersection.z);
+    } else
+      results[i] = intersection;
+
+    if (WR_NULL != counters_ptr)
+      wr_traversal_stats_accumulate(&webrays->traversal_stats,
+                                    counters.nodes_visited,
+                                    counters.triangles_tested,
+                                    counters.stack_depth,
+                                    counters.terminated);
+  });
+
+  return WR_SUCCESS;
+}
+
+// With WR_OCCLUSION_FORMAT_PACKED, occlusion is an uint32_t bitset laid out
+// like the packed GLES buffers: each row of dimensions[0] rays starts a new
+// word. The bitset is cleared first, so skipped rays read as not occluded
+wr_error
+wrays_cpu_query_occlusion(wr_handle handle, wr_handle ads,
+                          wr_handle* ray_buffers, wr_size ray_buffer_count,
+                          wr_handle occlusion, wr_size* dimensions,
+                          wr_size dimension_count)
+{
+  wr_context* webrays = (wr_context*)handle;
+  if (WR_NULL == webrays)
+    return (wr_error) "Invalid WebRays context";
+
+  ADS* blas = wrays_cpu_get_blas(webrays, ads);
+  if (WR_NULL == blas)
+    return WR_CPU_INVALID_ADS_HANDLE;
+  if (ray_buffer_count < 2 || WR_NULL == ray_buffers[0] ||
+      WR_NULL == ray_buffers[1] || WR_NULL == occlusion)
+    return WR_CPU_INVALID_RAY_BUFFERS;
+
+  const vec4* origins    = (const vec4*)ray_buffers[0];
+  const vec4* directions = (const vec4*)ray_buffers[1];
+  int*        results    = (int*)occlusion;
+  uint32_t*   bits       = (uint32_t*)occlusion;
+
+  wr_traversal_counters  counters;
+  wr_traversal_counters* counters_ptr =
+    webrays->traversal_stats_enabled ? &counters : WR_NULL;
+
+  const wr_size ray_count = wrays_cpu_ray_count(dimensions, dimension_count);
+  if (0 == ray_count)
+    return WR_SUCCESS;
+
+  const bool packed =
+    WR_OCCLUSION_FORMAT_PACKED == webrays->occlusion_format;
+  const wr_size row_width = dimensions[0];
+  const wr_size row_words = (row_width + 31) / 32;
+  if (packed)
+    memset(bits, 0, row_words * (ray_count / row_width) * sizeof(uint32_t));
+
+  wrays_cpu_for_each_ray(webrays, origins, directions, dimensions,
+                         dimension_count, [&](wr_size i) {
+    const vec4 o = origins[i];
+    const vec4 d = directions[i];
+    if (0.0f == d.w)
+      return;
+
+    const bool occluded = blas->QueryOcclusion(
+      { o.x + o.w * d.x, o.y + o.w * d.y, o.z + o.w * d.z }, { d.x, d.y, d.z },
+      d.w, counters_ptr);
+    if (!packed)
+      results[i] = occluded ? 1 : 0;
+    else if (occluded)
+      bits[(i / row_width) * row_words + (i % row_width) / 32] |=
+        1u << ((i % row_width) % 32);
+
+    if (WR_NULL != counters_ptr)
+      wr_traversal_stats_accumulate(&webrays->traversal_stats,
+                                    counters.nodes_visited,
+                                    counters.triangles_tested,
+                                    counters.stack_depth,
+                                    counters.terminated);
+  });
+
+  return WR_SUCCESS;
+}
+
+// Both ray sets are traced in the same loop, so that the second query of
+// each ray finds the nodes visited by the first still in cache. The results
+// match wrays_cpu_query_intersection and wrays_cpu_query_occlusion
+wr_error
+wrays_cpu_query_intersection_occlusion(
+  wr_handle handle, wr_handle ads, wr_handle* ray_buffers,
+  wr_size ray_buffer_count, wr_handle intersections,
+  wr_handle* occlusion_ray_buffers, wr_size occlusion_ray_buffer_count,
+  wr_handle occlusion, wr_size* dimensions, wr_size dimension_count)
+{
+  wr_context* webrays = (wr_context*)handle;
+  if (WR_NULL == webrays)
+    return (wr_error) "Invalid WebRays context";
+
+  ADS* blas = wrays_cpu_get_blas(webrays, ads);
+  if (WR_NULL == blas)
+    return WR_CPU_INVALID_ADS_HANDLE;
+  if (ray_buffer_count < 2 || WR_NULL == ray_buffers[0] ||
+      WR_NULL == ray_buffers[1] || WR_NULL == intersections)
+    return WR_CPU_INVALID_RAY_BUFFERS;
+  if (occlusion_ray_buffer_count < 2 || WR_NULL == occlusion_ray_buffers[0] ||
+      WR_NULL == occlusion_ray_buffers[1] || WR_NULL == occlusion)
+    return WR_CPU_INVALID_RAY_BUFFERS;
+
+  const vec4* origins              = (const vec4*)ray_buffers[0];
+  const vec4* directions           = (const vec4*)ray_buffers[1];
+  const vec4* occlusion_origins    = (const vec4*)occlusion_ray_buffers[0];
+  const vec4* occlusion_directions = (const vec4*)occlusion_ray_buffers[1];
+  ivec4*      results              = (ivec4*)intersections;
+  int*        compact              = (int*)intersections;
+  int*        occlusion_results    = (int*)occlusion;
+  uint32_t*   bits                 = (uint32_t*)occlusion;
+  const bool  is_compact =
+    WR_INTERSECTION_FORMAT_COMPACT == webrays->intersection_format;
+
+  wr_traversal_counters  counters;
+  wr_traversal_counters* counters_ptr =
+    webrays->traversal_stats_enabled ? &counters : WR_NULL;
+
+  const wr_size ray_count = wrays_cpu_ray_count(dimensions, dimension_count);
+  if (0 == ray_count)
+    return WR_SUCCESS;
+
+  const bool packed =
+    WR_OCCLUSION_FORMAT_PACKED == webrays->occlusion_format;
+  const wr_size row_width = dimensions[0];
+  const wr_size row_words = (row_width + 31) / 32;
+  if (packed)
+    memset(bits, 0, row_words * (ray_count / row_width) * sizeof(uint32_t));
+
+  wrays_cpu_for_each_ray(webrays, origins, directions, dimensions,
+                         dimension_count, [&](wr_size i) {
+    const vec4 o = origins[i];
+    const vec4 d = directions[i];
+    if (0.0f != d.w) {
+      ivec4 intersection;
+      blas->QueryIntersection({ o.x + o.w * d.x, o.y + o.w * d.y,
+                                o.z + o.w * d.z },
+                              { d.x, d.y, d.z }, d.w, &intersection,
+                              counters_ptr);
+      if (is_compact) {
+        compact[2 * i + 0] = intersection.x;
+        compact[2 * i + 1] =
+          wrays_cpu_pack_unorm2x16(intersection.y, intersection.z);
+      } else
+        results[i] = intersection;
+
+      if (WR_NULL != counters_ptr)
+        wr_traversal_stats_accumulate(&webrays->traversal_stats,
+                                      counters.nodes_visited,
+                                      counters.triangles_tested,
+                                      counters.stack_depth,
+                                      counters.terminated);
+    }
+
+    const vec4 so = occlusion_origins[i];
+    const vec4 sd = occlusion_directions[i];
+    if (0.0f != sd.w) {
+      const bool occluded = blas->QueryOcclusion(
+        { so.x + so.w * sd.x, so.y + so.w * sd.y, so.z + so.w * sd.z },
+        { sd.x, sd.y, sd.z }, sd.w, counters_ptr);
+      if (!packed)
+        occlusion_results[i] = occluded ? 1 : 0;
+      else if (occluded)
+        bits[(i / row_width) * row_words + (i % row_width) / 32] |=
+          1u << ((i % row_width) % 32);
+
+      if (WR_NULL != counters_ptr)
+        wr_traversal_stats_accumulate(&webrays->traversal_stats,
+                                      counters.nodes_visited,
+                                      counters.triangles_tested,
+                                      counters.stack_depth,
+                                      counters.terminated);
+    }
+  });
+
   return WR_SUCCESS;
 }
\ No newline at end of file
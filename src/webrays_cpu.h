@@ -34,8 +34,30 @@ wrays_cpu_add_shape(wr_handle handle, wr_handle ads, float* positions,
                     float* uvs, int uv_stride, int attr_count, int* faces,
                     int num_triangles, int* shape_id);
 
+wr_error
+wrays_cpu_add_spheres(wr_handle handle, wr_handle ads, float* spheres,
+                      int sphere_stride, int* user_data, int num_spheres,
+                      int* shape_id);
+
 wr_error
 wrays_cpu_ads_create(wr_handle handle, wr_handle ads,
                      wr_ads_descriptor* descriptor);
 
+wr_error
+wrays_cpu_query_intersection(wr_handle handle, wr_handle ads,
+                             wr_handle* ray_buffers, wr_size ray_buffer_count,
+                             wr_handle intersections, wr_size* dimensions,
+                             wr_size dimension_count);
+wr_error
+wrays_cpu_query_occlusion(wr_handle handle, wr_handle ads,
+                          wr_handle* ray_buffers, wr_size ray_buffer_count,
+                          wr_handle occlusion, wr_size* dimensions,
+                          wr_size dimension_count);
+wr_error
+wrays_cpu_query_intersection_occlusion(
+  wr_handle handle, wr_handle ads, wr_handle* ray_buffers,
+  wr_size ray_buffer_count, wr_handle intersections,
+  wr_handle* occlusion_ray_buffers, wr_size occlusion_ray_buffer_count,
+  wr_handle occlusion, wr_size* dimensions, wr_size dimension_count);
+
 #endif /* _WRAYS_CPU_H_ */
@@ -0,0 +1,163 @@
+/* Copyright 2021 Phasmatic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "webrays_dedup.h"
+#include "webrays_ads.h"
+#include "webrays_tlas.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+// FNV-1a
+static void
+wr_dedup_hash(uint64_t* hash, const void* data, size_t size)
+{
+  const unsigned char* bytes = (const unsigned char*)data;
+  for (size_t i = 0; i < size; ++i) {
+    *hash ^= bytes[i];
+    *hash *= 1099511628211ull;
+  }
+}
+
+// The positions take no part in the hash since translated copies round
+// differently, they are compared by wr_dedup_matches instead
+static uint64_t
+wr_dedup_key(const float* normals, int normal_stride, const float* uvs,
+             int uv_stride, int num_vertices, const int* indices,
+             int num_triangles)
+{
+  uint64_t hash = 14695981039346656037ull;
+  wr_dedup_hash(&hash, &num_vertices, sizeof(num_vertices));
+  wr_dedup_hash(&hash, indices, 4 * num_triangles * sizeof(int));
+  for (int i = 0; normals != WR_NULL && i < num_vertices; ++i)
+    wr_dedup_hash(&hash, &normals[i * normal_stride], 3 * sizeof(float));
+  for (int i = 0; uvs != WR_NULL && i < num_vertices; ++i)
+    wr_dedup_hash(&hash, &uvs[i * uv_stride], 2 * sizeof(float));
+  return hash;
+}
+
+// Compares with the vertex data of the mesh BLAS, which keeps the uvs in the
+// w components and zeros for missing attributes
+static bool
+wr_dedup_matches(const ADS* blas, const wr_unique_mesh& mesh,
+                 const float* positions, float tolerance, const float* normals,
+                 int normal_stride, const float* uvs, int uv_stride,
+                 int num_vertices, const int* indices, int num_triangles)
+{
+  if ((int)blas->m_vertex_data.size() != num_vertices ||
+      (int)mesh.faces.size() != 4 * num_triangles ||
+      !std::equal(mesh.faces.begin(), mesh.faces.end(), indices))
+    return false;
+
+  for (int i = 0; i < num_vertices; ++i) {
+    const vec4& vertex = blas->m_vertex_data[i];
+    const vec4& normal = blas->m_normal_data[i];
+    for (int k = 0; k < 3; ++k) {
+      if (std::abs(vertex.at[k] - positions[3 * i + k]) > tolerance)
+        return false;
+      if (normal.at[k] !=
+          ((normals != WR_NULL) ? normals[i * normal_stride + k] : 0.0f))
+        return false;
+    }
+    if (vertex.w != ((uvs != WR_NULL) ? uvs[i * uv_stride + 0] : 0.0f) ||
+        normal.w != ((uvs != WR_NULL) ? uvs[i * uv_stride + 1] : 0.0f))
+      return false;
+  }
+  return true;
+}
+
+// A BLAS with the options the TLAS was created with
+static wr_error
+wr_dedup_create_blas(wr_context* webrays, const TLAS* ads, wr_handle* blas)
+{
+  std::vector<wr_ads_descriptor> options(1, { "type", "BLAS" });
+  for (const auto& option : ads->m_blas_options)
+    options.push_back({ option.first.c_str(), option.second.c_str() });
+  return wrays_create_ads((wr_handle)webrays, blas, options.data(),
+                          (int)options.size());
+}
+
+wr_error
+wr_dedup_add_shape(wr_context* webrays, wr_handle tlas, float* positions,
+                   int position_stride, float* normals, int normal_stride,
+                   float* uvs, int uv_stride, int num_vertices, int* indices,
+                   int num_triangles, int* shape_id)
+{
+  TLAS* ads = webrays->scene.tlas_handles[WR_PTR2INT(tlas) & ~WR_TLAS_ID_MASK];
+
+  // Translated copies are stored relative to their first vertex. They match
+  // up to the rounding of the subtraction, a few ulps of the largest
+  // coordinate
+  float origin[3] = { 0.0f, 0.0f, 0.0f };
+  if (WR_DEDUP_TRANSLATION == ads->m_dedup && num_vertices > 0)
+    std::memcpy(origin, positions, sizeof(origin));
+  std::vector<float> local(3 * num_vertices);
+  float              magnitude = 0.0f;
+  for (int i = 0; i < num_vertices; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      const float p    = positions[i * position_stride + k];
+      local[3 * i + k] = p - origin[k];
+      magnitude        = std::max(magnitude, std::abs(p));
+    }
+  }
+  const float tolerance = (WR_DEDUP_TRANSLATION == ads->m_dedup)
+                            ? 4.0f * FLT_EPSILON * magnitude
+                            : 0.0f;
+
+  const uint64_t key = wr_dedup_key(normals, normal_stride, uvs, uv_stride,
+                                    num_vertices, indices, num_triangles);
+
+  int  blas  = -1;
+  auto range = ads->m_unique_meshes.equal_range(key);
+  for (auto it = range.first; it != range.second && blas < 0; ++it) {
+    if (wr_dedup_matches(webrays->scene.blas_handles[it->second.blas],
+                         it->second, local.data(), tolerance, normals,
+                         normal_stride, uvs, uv_stride, num_vertices, indices,
+                         num_triangles))
+      blas = it->second.blas;
+  }
+
+  // A distinct mesh needs a BLAS of its own, which fails once the BLAS
+  // table is full. Its shape ID could not be told apart from the others in
+  // the hits otherwise
+  wr_error error = WR_SUCCESS;
+  if (blas < 0) {
+    wr_handle blas_handle;
+    error = wr_dedup_create_blas(webrays, ads, &blas_handle);
+    if (WR_SUCCESS != error)
+      return error;
+
+    int blas_shape_id;
+    error = wrays_add_shape((wr_handle)webrays, blas_handle, local.data(), 3,
+                            normals, normal_stride, uvs, uv_stride,
+                            num_vertices, indices, num_triangles,
+                            &blas_shape_id);
+    if (WR_SUCCESS != error)
+      return error;
+
+    blas = WR_PTR2INT(blas_handle);
+    ads->m_unique_meshes.insert(
+      { key,
+        { blas, std::vector<int>(indices, indices + 4 * num_triangles) } });
+  }
+
+  // Identity, with the translation in the fourth element of every row
+  float transform[12] = { 1.0f, 0.0f, 0.0f, origin[0], 0.0f, 1.0f,
+                          0.0f, origin[1], 0.0f, 0.0f, 1.0f, origin[2] };
+  return wrays_add_instance((wr_handle)webrays, tlas, WR_INT2PTR(blas),
+                            transform, shape_id);
+}
@@ -0,0 +1,39 @@
+/* Copyright 2021 Phasmatic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WRAYS_DEDUP_H_
+#define _WRAYS_DEDUP_H_
+
+/* Geometry deduplication for shapes added to a TLAS created with the
+ * "deduplicate" option. Every distinct mesh is stored once, in a BLAS of its
+ * own, and each shape becomes an instance of that BLAS, so the shape ID is
+ * the instance ID reported by the hits. With WR_DEDUP_TRANSLATION the meshes
+ * are stored relative to their first vertex and the instance moves them back
+ * in place, so translated copies share a BLAS too.
+ *
+ * The BLASes count against WR_MAX_BLAS_COUNT and are created with the BLAS
+ * options of the TLAS. Once the table is full, a further distinct mesh fails
+ * to be added, while copies of the stored meshes still become instances.
+ */
+
+#include "webrays_context.h"
+
+wr_error
+wr_dedup_add_shape(wr_context* webrays, wr_handle tlas, float* positions,
+                   int position_stride, float* normals, int normal_stride,
+                   float* uvs, int uv_stride, int num_vertices, int* indices,
+                   int num_triangles, int* shape_id);
+
+#endif /* _WRAYS_DEDUP_H_ */
@@ -20,6 +20,7 @@
 #include "webrays_math.h"
 #include "webrays_ads.h"
 #include "webrays_tlas.h"
+#include "webrays_profile.h"
 
 #include <algorithm>
 
@@ -44,6 +45,24 @@ typedef struct
   int    height;
 } wr_buffer_2d;
 
+// Framebuffer of wrays_query_intersection_occlusion, with the intersection
+// and occlusion buffers as its first two color attachments
+typedef struct
+{
+  GLuint intersections;
+  GLuint occlusion;
+  GLuint fbo;
+} wr_fused_buffer_2d;
+
+// Query kernels are specialized on the kind of ADS a query starts from, so
+// the TLAS/BLAS branch of the traversal is resolved at compile time
+typedef enum
+{
+  WR_GL_KERNEL_ENTRY_BLAS,
+  WR_GL_KERNEL_ENTRY_TLAS,
+  WR_GL_KERNEL_ENTRY_MAX
+} wr_gl_kernel_entry;
+
 typedef struct
 {
   const void* gles_library;
@@ -52,14 +71,19 @@ typedef struct
   wr_binding intersection_bindings[8];
 
   /* Caches */
-  wr_buffer_2d* isect_buffers_2d;
-  wr_buffer_2d* occlusion_buffers_2d;
+  wr_buffer_2d*       isect_buffers_2d;
+  wr_buffer_2d*       occlusion_buffers_2d;
+  wr_fused_buffer_2d* intersection_occlusion_buffers_2d;
 
   wr_string_buffer scene_accessor_shader;
   wr_string_buffer shader_scratch;
 
-  GLuint intersection_program;
-  GLuint occlusion_program;
+  GLuint intersection_program[WR_GL_KERNEL_ENTRY_MAX];
+  GLuint occlusion_program[WR_GL_KERNEL_ENTRY_MAX];
+  GLuint intersection_occlusion_program[WR_GL_KERNEL_ENTRY_MAX]; // on demand
+
+  /* Defines and ADS code the kernels of each entry were stitched from */
+  wr_string_buffer kernel_prelude[WR_GL_KERNEL_ENTRY_MAX];
 
   GLuint screen_fill_vao;
   GLuint screen_fill_vbo;
@@ -81,6 +105,7 @@ typedef struct
   GLuint bounds_texture; // {min, max}
   GLuint scene_texture;
   GLuint indices_texture;
+  GLuint triangles_texture; // (v0, e1, e2) layers, precomputed triangles only
 
   GLint indices_texture_size;
   GLint scene_texture_size;
@@ -89,12 +114,89 @@ typedef struct
   wr_size binding_count;
 
   GLuint gpu_timers[5];
+
+  /* Traversal Statistics (nodes, triangles, stack depth, traced) per ray */
+  wr_bool traversal_stats_kernels; // programs were built with the counters
+  GLuint  traversal_stats_texture;
+  int     traversal_stats_width;
+  int     traversal_stats_height;
+  int*    traversal_stats_data;
+
+  /* Format the occlusion program was built for */
+  wr_occlusion_format occlusion_kernel_format;
+
+  /* Signaled when the GPU finishes the last query, see wrays_query_complete */
+  GLsync query_fence;
+
+  /* Profiling, see webrays_profile.h */
+  wr_bool timer_query_available; // EXT_disjoint_timer_query
+  int     timer_query_depth;     // GL timer queries do not nest
+  int     timer_query_event;
 } wr_gl_context;
 
+#if WRAYS_PROFILE
+// GPU zones time the commands issued between begin and end with a
+// GL_TIME_ELAPSED_EXT query, resolved by wrays_gl_profile_resolve. Only the
+// outermost of nested zones is recorded
+WR_INTERNAL void
+wrays_gl_profile_gpu_begin(wr_gl_context* webrays_webgl, const char* name)
+{
+  if (0 != webrays_webgl->timer_query_depth++)
+    return;
+
+  webrays_webgl->timer_query_event = -1;
+  if (!webrays_webgl->timer_query_available ||
+      nullptr == wr_profiler_current())
+    return;
+
+  GLuint query = 0;
+  glGenQueries(1, &query);
+  webrays_webgl->timer_query_event = wr_profile_gpu_event(name, query);
+  if (webrays_webgl->timer_query_event < 0) {
+    glDeleteQueries(1, &query);
+    return;
+  }
+  glBeginQuery(GL_TIME_ELAPSED_EXT, query);
+}
+
+WR_INTERNAL void
+wrays_gl_profile_gpu_end(wr_gl_context* webrays_webgl)
+{
+  if (0 != --webrays_webgl->timer_query_depth)
+    return;
+
+  if (webrays_webgl->timer_query_event >= 0)
+    glEndQuery(GL_TIME_ELAPSED_EXT);
+  webrays_webgl->timer_query_event = -1;
+}
+
+class wr_gl_profile_zone
+{
+public:
+  wr_gl_profile_zone(wr_gl_context* webrays_webgl, const char* name)
+    : m_webgl(webrays_webgl)
+  {
+    wrays_gl_profile_gpu_begin(m_webgl, name);
+  }
+  ~wr_gl_profile_zone() { wrays_gl_profile_gpu_end(m_webgl); }
+
+private:
+  wr_gl_context* m_webgl;
+};
+
+#define WR_PROFILE_GPU_ZONE(webrays_webgl, name)                               \
+  wr_gl_profile_zone WR_PROFILE_CONCAT(wr_gl_profile_zone_,                    \
+                                       __LINE__)(webrays_webgl, name)
+#else
+#define WR_PROFILE_GPU_ZONE(webrays_webgl, name)
+#endif /* WRAYS_PROFILE */
+
 WR_INTERNAL wr_error
             wrays_gl_shader_create(GLuint* shader_handle, const char* shader_source,
                                    GLenum shader_type)
 {
+  WR_PROFILE_ZONE("shader compile");
+
   *shader_handle = -1;
   GLint compiled = GL_FALSE;
 
@@ -123,6 +225,8 @@ WR_INTERNAL wr_error
             wrays_gl_program_create(GLuint* program_handle, GLuint vertex_shader,
                                     GLuint fragment_shader)
 {
+  WR_PROFILE_ZONE("program link");
+
   *program_handle = glCreateProgram();
   glAttachShader(*program_handle, vertex_shader);
   glAttachShader(*program_handle, fragment_shader);
@@ -185,6 +289,22 @@ wrays_gl_add_shape(wr_handle handle, wr_handle ads, float* positions,
   return WR_SUCCESS;
 }
 
+wr_error
+wrays_gl_add_spheres(wr_handle handle, wr_handle ads, float* spheres,
+                     int sphere_stride, int* user_data, int num_spheres,
+                     int* shape_id)
+{
+  wr_context* webrays = (wr_context*)handle;
+  int         ads_id  = (int)(size_t)(ads);
+
+  ADS* ads_impl = webrays->scene.blas_handles[ads_id];
+
+  *shape_id =
+    ads_impl->AddSpheres(spheres, sphere_stride, user_data, num_spheres);
+
+  return WR_SUCCESS;
+}
+
 wr_error
 wrays_gl_init(wr_handle handle)
 {
@@ -436,12 +556,24 @@ wrays_gl_init(wr_handle handle)
   wrCopyBufferSubData = (PFNGLCOPYBUFFERSUBDATAPROC)wrays_dlsym(
     gles_library, "glCopyBufferSubData");
   wrViewport = (PFNGLVIEWPORTPROC)wrays_dlsym(gles_library, "glViewport");
+  wrEnable   = (PFNGLENABLEPROC)wrays_dlsym(gles_library, "glEnable");
+  wrDisable  = (PFNGLDISABLEPROC)wrays_dlsym(gles_library, "glDisable");
+  wrScissor  = (PFNGLSCISSORPROC)wrays_dlsym(gles_library, "glScissor");
+  wrFlush    = (PFNGLFLUSHPROC)wrays_dlsym(gles_library, "glFlush");
+  wrFenceSync = (PFNGLFENCESYNCPROC)wrays_dlsym(gles_library, "glFenceSync");
+  wrClientWaitSync =
+    (PFNGLCLIENTWAITSYNCPROC)wrays_dlsym(gles_library, "glClientWaitSync");
+  wrDeleteSync = (PFNGLDELETESYNCPROC)wrays_dlsym(gles_library, "glDeleteSync");
+  wrTexStorage2D =
+    (PFNGLTEXSTORAGE2DPROC)wrays_dlsym(gles_library, "glTexStorage2D");
   wrTexStorage3D =
     (PFNGLTEXSTORAGE3DPROC)wrays_dlsym(gles_library, "glTexStorage3D");
   wrTexParameteri =
     (PFNGLTEXPARAMETERIPROC)wrays_dlsym(gles_library, "glTexParameteri");
   wrGetIntegerv =
     (PFNGLGETINTEGERVPROC)wrays_dlsym(gles_library, "glGetIntegerv");
+  wrReadBuffer = (PFNGLREADBUFFERPROC)wrays_dlsym(gles_library, "glReadBuffer");
+  wrReadPixels = (PFNGLREADPIXELSPROC)wrays_dlsym(gles_library, "glReadPixels");
   wrGenVertexArrays =
     (PFNGLGENVERTEXARRAYSPROC)wrays_dlsym(gles_library, "glGenVertexArrays");
   wrIsTexture = (PFNGLISTEXTUREPROC)wrays_dlsym(gles_library, "glIsTexture");
@@ -500,12 +632,15 @@ wrays_gl_init(wr_handle handle)
 
   wrays_queue_init(webrays_webgl->isect_buffers_2d, 1);
   wrays_queue_init(webrays_webgl->occlusion_buffers_2d, 1);
+  wrays_queue_init(webrays_webgl->intersection_occlusion_buffers_2d, 1);
 
   webrays_webgl->gles_library = gles_library;
   webrays->webgl              = webrays_webgl;
 
   webrays_webgl->shader_scratch        = wr_string_buffer_create(1024);
   webrays_webgl->scene_accessor_shader = wr_string_buffer_create(1024);
+  for (int entry = 0; entry < WR_GL_KERNEL_ENTRY_MAX; ++entry)
+    webrays_webgl->kernel_prelude[entry] = wr_string_buffer_create(1024);
 
   WR_GL_CHECK(glGenVertexArrays(1, &webrays_webgl->screen_fill_vao));
   glBindVertexArray(webrays_webgl->screen_fill_vao);
@@ -546,6 +681,131 @@ wrays_gl_init(wr_handle handle)
 
   // glGenQueries(5, webrays_webgl->gpu_timers);
 
+#if WRAYS_PROFILE
+  // Matches EXT_disjoint_timer_query and WebGL 2's
+  // EXT_disjoint_timer_query_webgl2
+  GLint extension_count = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &extension_count);
+  for (GLint i = 0; i < extension_count; ++i) {
+    const char* extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+    if (WR_NULL != extension && strstr(extension, "EXT_disjoint_timer_query"))
+      webrays_webgl->timer_query_available = WR_TRUE;
+  }
+#endif
+
+  return WR_SUCCESS;
+}
+
+// Attach the per-ray traversal statistics target as the second color
+// attachment of the bound query framebuffer
+WR_INTERNAL wr_error
+            wrays_gl_traversal_stats_attach(wr_gl_context* webrays_webgl, wr_size width,
+                                            wr_size height)
+{
+  if (webrays_webgl->traversal_stats_width != (int)width ||
+      webrays_webgl->traversal_stats_height != (int)height) {
+    if (glIsTexture(webrays_webgl->traversal_stats_texture))
+      glDeleteTextures(1, &webrays_webgl->traversal_stats_texture);
+    WR_FREE(webrays_webgl->traversal_stats_data);
+    // Nothing is cached until the target is complete, so that a failed
+    // attach is retried by the next query
+    webrays_webgl->traversal_stats_width  = 0;
+    webrays_webgl->traversal_stats_height = 0;
+
+    WR_GL_CHECK(glGenTextures(1, &webrays_webgl->traversal_stats_texture));
+    WR_GL_CHECK(
+      glBindTexture(GL_TEXTURE_2D, webrays_webgl->traversal_stats_texture));
+    WR_GL_CHECK(glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32I, width, height));
+    WR_GL_CHECK(
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    WR_GL_CHECK(
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    WR_GL_CHECK(glBindTexture(GL_TEXTURE_2D, 0));
+
+    webrays_webgl->traversal_stats_data =
+      (int*)malloc(width * height * 4 * sizeof(int));
+    if (WR_NULL == webrays_webgl->traversal_stats_data)
+      return (wr_error) "Failed to allocate the traversal statistics buffer";
+    webrays_webgl->traversal_stats_width  = (int)width;
+    webrays_webgl->traversal_stats_height = (int)height;
+  }
+
+  WR_GL_CHECK(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + 1,
+                                     GL_TEXTURE_2D,
+                                     webrays_webgl->traversal_stats_texture, 0));
+
+  GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0 + 0,
+                           GL_COLOR_ATTACHMENT0 + 1 };
+  glDrawBuffers(sizeof(drawBuffers) / sizeof(drawBuffers[0]), drawBuffers);
+
+  return WR_SUCCESS;
+}
+
+// Read back the per-ray counters of the last query, accumulate them and
+// detach the statistics target so that the cached framebuffer is left as it
+// was created
+WR_INTERNAL wr_error
+            wrays_gl_traversal_stats_collect(wr_context* webrays, wr_size width,
+                                             wr_size height)
+{
+  wr_gl_context* webrays_webgl = (wr_gl_context*)webrays->webgl;
+  int*           data          = webrays_webgl->traversal_stats_data;
+
+  if (WR_NULL == data)
+    return (wr_error) "Traversal statistics target is not attached";
+
+  WR_GL_CHECK(glReadBuffer(GL_COLOR_ATTACHMENT0 + 1));
+  WR_GL_CHECK(glReadPixels(0, 0, width, height, GL_RGBA_INTEGER, GL_INT, data));
+  WR_GL_CHECK(glReadBuffer(GL_COLOR_ATTACHMENT0 + 0));
+
+  WR_GL_CHECK(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + 1,
+                                     GL_TEXTURE_2D, 0, 0));
+
+  for (wr_size i = 0; i < width * height; ++i) {
+    if (0 == data[4 * i + 3]) // ray was not traced
+      continue;
+    wr_traversal_stats_accumulate(&webrays->traversal_stats, data[4 * i + 0],
+                                  data[4 * i + 1], data[4 * i + 2],
+                                  data[4 * i + 3] > 1);
+  }
+
+  return WR_SUCCESS;
+}
+
+// Issue the screen-filling draw of a 2D query of width x height texels. With
+// tiling enabled, every tile is a scissored draw of its own, flushed right
+// away so that the driver submits bounded amounts of work instead of a
+// single long-running command
+WR_INTERNAL wr_error
+            wrays_gl_query_draw(wr_context* webrays, wr_size width, wr_size height,
+                                wr_size tile_width, wr_size tile_height)
+{
+  wr_gl_context* webrays_webgl = (wr_gl_context*)webrays->webgl;
+
+  if (0 == tile_width && 0 == tile_height) {
+    WR_GL_CHECK(glDrawArrays(GL_TRIANGLES, 0, 3));
+  } else {
+    // A zero tile size spans the whole buffer along that axis
+    tile_width  = (0 == tile_width) ? width : std::min(tile_width, width);
+    tile_height = (0 == tile_height) ? height : std::min(tile_height, height);
+
+    glEnable(GL_SCISSOR_TEST);
+    for (wr_size y = 0; y < height; y += tile_height) {
+      for (wr_size x = 0; x < width; x += tile_width) {
+        glScissor((GLint)x, (GLint)y,
+                  (GLsizei)std::min(tile_width, width - x),
+                  (GLsizei)std::min(tile_height, height - y));
+        WR_GL_CHECK(glDrawArrays(GL_TRIANGLES, 0, 3));
+        glFlush();
+      }
+    }
+    glDisable(GL_SCISSOR_TEST);
+  }
+
+  if (WR_NULL != webrays_webgl->query_fence)
+    glDeleteSync(webrays_webgl->query_fence);
+  webrays_webgl->query_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
   return WR_SUCCESS;
 }
 
@@ -558,6 +818,10 @@ WR_INTERNAL wr_error
   wr_gl_context* webrays_webgl = (wr_gl_context*)webrays->webgl;
   GLuint         gl_occlusion  = (GLuint)(size_t)occlusion;
 
+  // Each texel of the packed kernel traces 32 rays of a row
+  if (WR_OCCLUSION_FORMAT_PACKED == webrays_webgl->occlusion_kernel_format)
+    width = (width + 31) / 32;
+
   /* This might be slow but it is robust and safe */
   GLuint  fbo          = 0;
   wr_size buffer_count = wrays_queue_size(webrays_webgl->occlusion_buffers_2d);
@@ -593,29 +857,41 @@ WR_INTERNAL wr_error
   glBindFramebuffer(GL_FRAMEBUFFER, fbo);
   GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0 + 0 };
   glDrawBuffers(sizeof(drawBuffers) / sizeof(drawBuffers[0]), drawBuffers);
+  if (webrays_webgl->traversal_stats_kernels) {
+    wr_error error =
+      wrays_gl_traversal_stats_attach(webrays_webgl, width, height);
+    if (WR_SUCCESS != error) {
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+      return error;
+    }
+  }
 
-  glUseProgram(webrays_webgl->occlusion_program);
+  // Kernels are specialized on whether the query starts from a TLAS
+  const wr_gl_kernel_entry entry =
+    ((WR_PTR2INT(ads) & WR_TLAS_ID_MASK) == WR_TLAS_ID_MASK)
+      ? WR_GL_KERNEL_ENTRY_TLAS
+      : WR_GL_KERNEL_ENTRY_BLAS;
+  const GLuint program = webrays_webgl->occlusion_program[entry];
+  glUseProgram(program);
 
-  GLuint index =
-    glGetUniformLocation(webrays_webgl->occlusion_program, "wr_RayOrigins");
+  GLuint index = glGetUniformLocation(program, "wr_RayOrigins");
   glActiveTexture(GL_TEXTURE0 + 0);
   glBindTexture(GL_TEXTURE_2D, (GLuint)(size_t)ray_buffers[0]);
   glUniform1i(index, 0);
-  index =
-    glGetUniformLocation(webrays_webgl->occlusion_program, "wr_RayDirections");
+  index = glGetUniformLocation(program, "wr_RayDirections");
   glActiveTexture(GL_TEXTURE0 + 1);
   glBindTexture(GL_TEXTURE_2D, (GLuint)(size_t)ray_buffers[1]);
   glUniform1i(index, 1);
 
-  index = glGetUniformLocation(webrays_webgl->occlusion_program, "wr_ADS");
+  index = glGetUniformLocation(program, "wr_ADS");
   glUniform1i(index, (int)(size_t)ads);
 
   int current_texture_unit = 1;
   for (wr_size i = 0; i < webrays_webgl->binding_count; ++i) {
-    index = glGetUniformLocation(webrays_webgl->occlusion_program,
-                                 webrays_webgl->intersection_bindings[i].name);
+    index = glGetUniformLocation(
+      program, webrays_webgl->intersection_bindings[i].name);
     if (webrays_webgl->intersection_bindings[i].type ==
-        wr_binding_type::WR_BINDING_TYPE_GL_TEXTURE_2D_ARRAY) {
+        wr_binding_type::WR_BINDING_TYPE_GL_TEXTURE_2D) {
       ++current_texture_unit;
       glActiveTexture(GL_TEXTURE0 + current_texture_unit);
       glBindTexture(GL_TEXTURE_2D,
@@ -631,11 +907,23 @@ WR_INTERNAL wr_error
     }
   }
 
-  WR_GL_CHECK(glDrawArrays(GL_TRIANGLES, 0, 3));
+  // Tiles are given in rays, a packed texel holds 32 of them
+  wr_size tile_width = webrays->query_tile_width;
+  if (WR_OCCLUSION_FORMAT_PACKED == webrays_webgl->occlusion_kernel_format)
+    tile_width = (tile_width + 31) / 32;
+
+  WR_PROFILE_GPU_ZONE(webrays_webgl, "occlusion kernel");
+  wr_error error = wrays_gl_query_draw(webrays, width, height, tile_width,
+                                       webrays->query_tile_height);
+
+  // Collect even if the draw failed, which also detaches the statistics
+  // target from the cached framebuffer
+  if (webrays_webgl->traversal_stats_kernels)
+    wrays_gl_traversal_stats_collect(webrays, width, height);
 
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-  return WR_SUCCESS;
+  return error;
 }
 
 wr_error
@@ -705,27 +993,39 @@ WR_INTERNAL wr_error
 
   GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0 + 0 };
   glDrawBuffers(sizeof(drawBuffers) / sizeof(drawBuffers[0]), drawBuffers);
+  if (webrays_webgl->traversal_stats_kernels) {
+    wr_error error =
+      wrays_gl_traversal_stats_attach(webrays_webgl, width, height);
+    if (WR_SUCCESS != error) {
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+      return error;
+    }
+  }
 
-  glUseProgram(webrays_webgl->intersection_program);
+  // Kernels are specialized on whether the query starts from a TLAS
+  const wr_gl_kernel_entry entry =
+    ((WR_PTR2INT(ads) & WR_TLAS_ID_MASK) == WR_TLAS_ID_MASK)
+      ? WR_GL_KERNEL_ENTRY_TLAS
+      : WR_GL_KERNEL_ENTRY_BLAS;
+  const GLuint program = webrays_webgl->intersection_program[entry];
+  glUseProgram(program);
 
-  GLuint index =
-    glGetUniformLocation(webrays_webgl->intersection_program, "wr_RayOrigins");
+  GLuint index = glGetUniformLocation(program, "wr_RayOrigins");
   glActiveTexture(GL_TEXTURE0 + 0);
   glBindTexture(GL_TEXTURE_2D, (GLuint)(size_t)ray_buffers[0]);
   glUniform1i(index, 0);
-  index = glGetUniformLocation(webrays_webgl->intersection_program,
-                               "wr_RayDirections");
+  index = glGetUniformLocation(program, "wr_RayDirections");
   glActiveTexture(GL_TEXTURE0 + 1);
   glBindTexture(GL_TEXTURE_2D, (GLuint)(size_t)ray_buffers[1]);
   glUniform1i(index, 1);
 
-  index = glGetUniformLocation(webrays_webgl->intersection_program, "wr_ADS");
+  index = glGetUniformLocation(program, "wr_ADS");
   glUniform1i(index, (int)(size_t)ads);
 
   int current_texture_unit = 1;
   for (wr_size i = 0; i < webrays_webgl->binding_count; ++i) {
-    index = glGetUniformLocation(webrays_webgl->intersection_program,
-                                 webrays_webgl->intersection_bindings[i].name);
+    index = glGetUniformLocation(
+      program, webrays_webgl->intersection_bindings[i].name);
     if (webrays_webgl->intersection_bindings[i].type ==
         wr_binding_type::WR_BINDING_TYPE_GL_TEXTURE_2D) {
       ++current_texture_unit;
@@ -745,19 +1045,26 @@ WR_INTERNAL wr_error
 
   /*WR_GL_CHECK(glBindBufferBase(GL_UNIFORM_BUFFER, 0,
   webrays_webgl->instances_UBO)); index =
-  glGetUniformBlockIndex(webrays_webgl->intersection_program,
+  glGetUniformBlockIndex(program,
   "wr_InstancesUBO"); if (index != GL_INVALID_INDEX) {
           WR_GL_CHECK(glBindBuffer(GL_UNIFORM_BUFFER,
   webrays_webgl->instances_UBO));
-          WR_GL_CHECK(glUniformBlockBinding(webrays_webgl->intersection_program,
+          WR_GL_CHECK(glUniformBlockBinding(program,
   index, 0));
   }*/
 
-  WR_GL_CHECK(glDrawArrays(GL_TRIANGLES, 0, 3));
+  WR_PROFILE_GPU_ZONE(webrays_webgl, "intersection kernel");
+  wr_error error =
+    wrays_gl_query_draw(webrays, width, height, webrays->query_tile_width,
+                        webrays->query_tile_height);
+
+  // Collect even if the draw failed, see wrays_gl_query_occlusion_2d
+  if (webrays_webgl->traversal_stats_kernels)
+    wrays_gl_traversal_stats_collect(webrays, width, height);
 
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-  return WR_SUCCESS;
+  return error;
 }
 
 wr_error
@@ -815,6 +1122,125 @@ wr_next_power_of_2(unsigned int number)
   return (number > 15) ? number : 16;
 }
 
+/* Each BLAS owns one layer of the node/index textures and two layers of the
+ * vertex texture. Layers are sized to fit the largest BLAS */
+WR_INTERNAL void
+wrays_gl_ads_device_stats(ADS* ads, wr_size node_layer_bytes,
+                          wr_size attr_layer_bytes, wr_size face_layer_bytes)
+{
+  wr_ads_stats* stats = &ads->m_stats;
+  const wr_size payload_bytes = stats->vertex_bytes + stats->normal_bytes +
+                                stats->triangle_bytes + stats->node_bytes;
+
+  stats->gpu_bytes = node_layer_bytes + 2 * attr_layer_bytes + face_layer_bytes;
+  if (!ads->m_intersection_triangles.empty())
+    stats->gpu_bytes += 3 * face_layer_bytes;
+  stats->gpu_padding_bytes =
+    (stats->gpu_bytes > payload_bytes) ? stats->gpu_bytes - payload_bytes : 0;
+}
+
+/* Bits per component of the faces of all BLASes. The "COMPACT" triangle
+ * format uses the narrowest size that fits every BLAS, and the 32-bit faces
+ * when one of them does not fit */
+WR_INTERNAL int
+wrays_gl_face_bits(wr_context* webrays)
+{
+  int face_bits = 8;
+  for (int i = 0; i < webrays->scene.blas_count; ++i) {
+    const int bits = wr_compact_face_bits(webrays->scene.blas_handles[i]);
+    if (0 == bits)
+      return 32;
+    face_bits = wrays_maxi(face_bits, bits);
+  }
+  return (webrays->scene.blas_count > 0) ? face_bits : 32;
+}
+
+WR_INTERNAL GLenum
+wrays_gl_face_format(int face_bits)
+{
+  return (8 == face_bits)    ? GL_RGBA8UI
+         : (16 == face_bits) ? GL_RGBA16UI
+                             : GL_RGBA32I;
+}
+
+/* Fill the layer of a BLAS in the bound index texture */
+WR_INTERNAL wr_error
+            wrays_gl_ads_upload_faces(const ADS* ads, int layer, int face_bits,
+                          int faces_width, int faces_height)
+{
+  const size_t               texel_bytes = face_bits / 2;
+  std::vector<unsigned char> texels;
+  if (32 == face_bits)
+    texels.assign((const unsigned char*)ads->m_triangles.data(),
+                  (const unsigned char*)(ads->m_triangles.data() +
+                                         ads->m_triangles.size()));
+  else
+    wr_compact_faces(ads, face_bits, &texels);
+  texels.resize(faces_width * faces_height * texel_bytes, 0);
+
+  const GLenum type = (8 == face_bits)    ? GL_UNSIGNED_BYTE
+                      : (16 == face_bits) ? GL_UNSIGNED_SHORT
+                                          : GL_INT;
+  WR_GL_CHECK(glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer,
+                              faces_width, faces_height, 1, GL_RGBA_INTEGER,
+                              type, (const void*)texels.data()));
+
+  return WR_SUCCESS;
+}
+
+/* Precomputed triangles take three layers per BLAS, one for each of v0, e1
+ * and e2, with the same dimensions as the index texture. That way a triangle
+ * is addressed exactly like its face in wr_scene_indices */
+WR_INTERNAL wr_error
+            wrays_gl_ads_upload_triangles(wr_context* webrays, int faces_width,
+                              int faces_height)
+{
+  wr_gl_context* webrays_webgl = (wr_gl_context*)webrays->webgl;
+
+  if (glIsTexture(webrays_webgl->triangles_texture))
+    glDeleteTextures(1, &webrays_webgl->triangles_texture);
+  webrays_webgl->triangles_texture = 0;
+
+  if (0 == webrays->scene.blas_count ||
+      WR_TRIANGLE_FORMAT_PRECOMPUTED !=
+        webrays->scene.blas_handles[0]->m_triangle_format)
+    return WR_SUCCESS;
+
+  WR_GL_CHECK(glGenTextures(1, &webrays_webgl->triangles_texture));
+  WR_GL_CHECK(
+    glBindTexture(GL_TEXTURE_2D_ARRAY, webrays_webgl->triangles_texture));
+  WR_GL_CHECK(glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA32F, faces_width,
+                             faces_height, webrays->scene.blas_count * 3));
+
+  WR_GL_CHECK(
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+  WR_GL_CHECK(
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+  WR_GL_CHECK(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S,
+                              GL_CLAMP_TO_EDGE));
+  WR_GL_CHECK(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T,
+                              GL_CLAMP_TO_EDGE));
+
+  std::vector<vec4> temp_data(faces_width * faces_height);
+  for (int ads_index = 0; ads_index < webrays->scene.blas_count; ads_index++) {
+    const ADS* ads        = webrays->scene.blas_handles[ads_index];
+    const int  num_pixels = (int)ads->m_triangles.size();
+    for (int k = 0; k < 3; ++k) {
+      std::fill(temp_data.begin(), temp_data.end(), vec4{});
+      for (int i = 0; i < num_pixels; ++i)
+        temp_data[i] = ads->m_intersection_triangles[3 * i + k];
+      WR_GL_CHECK(glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0,
+                                  ads_index * 3 + k, faces_width, faces_height,
+                                  1, GL_RGBA, GL_FLOAT,
+                                  (const void*)temp_data.data()));
+    }
+  }
+
+  WR_GL_CHECK(glBindTexture(GL_TEXTURE_2D_ARRAY, 0));
+
+  return WR_SUCCESS;
+}
+
 WR_INTERNAL wr_error
             wrays_gl_ads_build(wr_handle handle)
 {
@@ -832,6 +1258,8 @@ WR_INTERNAL wr_error
       ads->Build();
   }
 
+  WR_PROFILE_GPU_ZONE(webrays_webgl, "texture upload");
+
   if (webrays->scene.blas_type == wr_blas_type::WR_BLAS_TYPE_SAH) {
 
     int bvh_nodes_texture_size = 0;
@@ -850,11 +1278,13 @@ WR_INTERNAL wr_error
     int faces_height = 0;
     int faces_layers = webrays->scene.blas_count;
 
+    const int face_bits = wrays_gl_face_bits(webrays);
+
     int ads_index = 0;
     for (ads_index = 0; ads_index < webrays->scene.blas_count; ads_index++) {
       SAHBVH* sahbvh = (SAHBVH*)webrays->scene.blas_handles[ads_index];
 
-      int num_pixels         = 2 * sahbvh->m_total_nodes;
+      int num_pixels = sahbvh->GetNodeTexels() * sahbvh->m_total_nodes;
       bvh_nodes_texture_size = wrays_maxi(
         bvh_nodes_texture_size,
         (int)wr_next_power_of_2(1 + (unsigned int)sqrtf((float)num_pixels)));
@@ -877,7 +1307,7 @@ WR_INTERNAL wr_error
       attrs_height =
         wrays_maxi(attrs_height, (num_pixels - 1) / attrs_texture_size + 1);
 
-      num_pixels         = (int)sahbvh->m_triangles.size();
+      num_pixels         = wr_face_texel_count(sahbvh, face_bits);
       faces_texture_size = wrays_maxi(
         faces_texture_size,
         (int)wr_next_power_of_2(1 + (unsigned int)sqrtf((float)num_pixels)));
@@ -890,6 +1320,7 @@ WR_INTERNAL wr_error
     }
 
     // Allocate on the GPU
+    WR_PROFILE_BEGIN("texture allocation");
     if (glIsTexture(webrays_webgl->bounds_texture))
       glDeleteTextures(1, &webrays_webgl->bounds_texture);
     glGenTextures(1, &webrays_webgl->bounds_texture);
@@ -923,8 +1354,8 @@ WR_INTERNAL wr_error
     glGenTextures(1, &webrays_webgl->indices_texture);
 
     glBindTexture(GL_TEXTURE_2D_ARRAY, webrays_webgl->indices_texture);
-    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA32I, faces_width,
-                   faces_height, faces_layers);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, wrays_gl_face_format(face_bits),
+                   faces_width, faces_height, faces_layers);
 
     glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -932,7 +1363,10 @@ WR_INTERNAL wr_error
     glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
 
+    WR_PROFILE_END();
+
     /* Populate GPU memory */
+    WR_PROFILE_BEGIN("texture upload");
     for (ads_index = 0; ads_index < webrays->scene.blas_count; ads_index++) {
       SAHBVH* sahbvh = (SAHBVH*)webrays->scene.blas_handles[ads_index];
 
@@ -952,15 +1386,23 @@ WR_INTERNAL wr_error
           uint8_t  axis;        // interior node: xyz
           uint8_t  pad[1];      // ensure 32 byte total size
         };
-        constexpr int node_size = sizeof(GPU_NODE);
-        GPU_NODE* temp_data = new GPU_NODE[bvh_nodes_width * bvh_nodes_height];
+        static_assert(sizeof(GPU_NODE) == 2 * sizeof(vec4),
+                      "GPU_NODE size is not 2 texels");
+        // The links of the stackless traversal follow as a third texel
+        const int node_texels = sahbvh->GetNodeTexels();
+        vec4*     temp_data   = new vec4[bvh_nodes_width * bvh_nodes_height];
         for (int i = 0; i < sahbvh->m_total_nodes; ++i) {
-          temp_data[i].minValue = sahbvh->m_linear_nodes[i].bounds.min;
-          temp_data[i].primitivesOffset =
-            sahbvh->m_linear_nodes[i].primitivesOffset;
-          temp_data[i].maxValue    = sahbvh->m_linear_nodes[i].bounds.max;
-          temp_data[i].nPrimitives = sahbvh->m_linear_nodes[i].nPrimitives;
-          temp_data[i].axis        = sahbvh->m_linear_nodes[i].axis;
+          GPU_NODE node;
+          node.minValue         = sahbvh->m_linear_nodes[i].bounds.min;
+          node.primitivesOffset = sahbvh->m_linear_nodes[i].primitivesOffset;
+          node.maxValue         = sahbvh->m_linear_nodes[i].bounds.max;
+          node.nPrimitives      = sahbvh->m_linear_nodes[i].nPrimitives;
+          node.axis             = sahbvh->m_linear_nodes[i].axis;
+          node.pad[0]           = 0;
+          std::memcpy(&temp_data[node_texels * i], &node, sizeof(node));
+          if (3 == node_texels)
+            std::memcpy(&temp_data[node_texels * i + 2],
+                        &sahbvh->m_node_links[i], sizeof(ivec4));
         }
         glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, ads_index,
                         bvh_nodes_width, bvh_nodes_height, 1, GL_RGBA, GL_FLOAT,
@@ -994,22 +1436,10 @@ WR_INTERNAL wr_error
       }
 
       glBindTexture(GL_TEXTURE_2D_ARRAY, webrays_webgl->indices_texture);
-      num_pixels = (int)sahbvh->m_triangles.size();
-
-      if (faces_width * faces_height == num_pixels) // no need to realocate
-        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, ads_index, faces_width,
-                        faces_height, 1, GL_RGBA_INTEGER, GL_INT,
-                        (const void*)sahbvh->m_triangles.data());
-      else {
-        unsigned char* temp_data =
-          new unsigned char[faces_width * faces_height * 4 * 4];
-        std::memcpy(temp_data, sahbvh->m_triangles.data(),
-                    sahbvh->m_triangles.size() * 4 * 4);
-        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, ads_index, faces_width,
-                        faces_height, 1, GL_RGBA_INTEGER, GL_INT,
-                        (const void*)temp_data);
-        delete[] temp_data;
-      }
+      wr_error error = wrays_gl_ads_upload_faces(sahbvh, ads_index, face_bits,
+                                                 faces_width, faces_height);
+      if (WR_SUCCESS != error)
+        return error;
 
       sahbvh->m_webgl_bindings[0] = { "wr_scene_vertices",
                                       WR_BINDING_TYPE_GL_TEXTURE_2D_ARRAY,
@@ -1021,6 +1451,11 @@ WR_INTERNAL wr_error
                                       WR_BINDING_TYPE_GL_TEXTURE_2D_ARRAY,
                                       { webrays_webgl->bounds_texture } };
     }
+    wr_error error =
+      wrays_gl_ads_upload_triangles(webrays, faces_width, faces_height);
+    WR_PROFILE_END();
+    if (WR_SUCCESS != error)
+      return error;
 
     webrays_webgl->bounds_texture_size  = bvh_nodes_texture_size;
     webrays_webgl->scene_texture_size   = attrs_texture_size;
@@ -1041,15 +1476,28 @@ WR_INTERNAL wr_error
       WR_BINDING_TYPE_GL_TEXTURE_2D_ARRAY,
       { webrays_webgl->bounds_texture }
     };
-    webrays_webgl->binding_count =
-      (int)(sizeof(webrays_webgl->intersection_bindings) /
-            sizeof(webrays_webgl->intersection_bindings[0]));
+    webrays_webgl->binding_count = 3;
+    if (0 != webrays_webgl->triangles_texture) {
+      webrays_webgl->intersection_bindings[3] = {
+        "wr_scene_triangles",
+        WR_BINDING_TYPE_GL_TEXTURE_2D_ARRAY,
+        { webrays_webgl->triangles_texture }
+      };
+      webrays_webgl->binding_count = 4;
+    }
 
     for (ads_index = 0; ads_index < webrays->scene.blas_count; ads_index++) {
       SAHBVH* sahbvh = (SAHBVH*)webrays->scene.blas_handles[ads_index];
+      sahbvh->m_webgl_binding_count = (int)webrays_webgl->binding_count;
+      sahbvh->m_webgl_bindings[3]   = webrays_webgl->intersection_bindings[3];
       sahbvh->m_node_texture_size   = webrays_webgl->bounds_texture_size;
       sahbvh->m_index_texture_size  = webrays_webgl->indices_texture_size;
       sahbvh->m_vertex_texture_size = webrays_webgl->scene_texture_size;
+      sahbvh->m_face_bits           = face_bits;
+      wrays_gl_ads_device_stats(
+        sahbvh, bvh_nodes_width * bvh_nodes_height * 4 * sizeof(float),
+        attrs_width * attrs_height * 4 * sizeof(float),
+        faces_width * faces_height * face_bits / 2);
     }
   } else if (webrays->scene.blas_type == wr_blas_type::WR_BLAS_TYPE_WIDEBVH) {
     int bvh_nodes_texture_size = 0;
@@ -1067,6 +1515,7 @@ WR_INTERNAL wr_error
     int       max_faces_width  = 0;
     int       max_faces_height = 0;
     const int faces_layers     = webrays->scene.blas_count;
+    const int face_bits        = wrays_gl_face_bits(webrays);
 
     int ads_index = 0;
     for (ads_index = 0; ads_index < webrays->scene.blas_count; ads_index++) {
@@ -1095,7 +1544,7 @@ WR_INTERNAL wr_error
       max_attrs_height =
         wrays_maxi(max_attrs_height, (num_pixels - 1) / attrs_texture_size + 1);
 
-      num_pixels         = (int)widebvh->m_triangles.size();
+      num_pixels         = wr_face_texel_count(widebvh, face_bits);
       faces_texture_size = wrays_maxi(
         faces_texture_size,
         (int)wr_next_power_of_2(1 + (unsigned int)sqrtf((float)num_pixels)));
@@ -1108,6 +1557,7 @@ WR_INTERNAL wr_error
     }
 
     // Allocate on the GPU
+    WR_PROFILE_BEGIN("texture allocation");
     if (glIsTexture(webrays_webgl->bounds_texture))
       glDeleteTextures(1, &webrays_webgl->bounds_texture);
     WR_GL_CHECK(glGenTextures(1, &webrays_webgl->bounds_texture));
@@ -1154,7 +1604,8 @@ WR_INTERNAL wr_error
 
     WR_GL_CHECK(
       glBindTexture(GL_TEXTURE_2D_ARRAY, webrays_webgl->indices_texture));
-    WR_GL_CHECK(glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA32I,
+    WR_GL_CHECK(glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1,
+                               wrays_gl_face_format(face_bits),
                                max_faces_width, max_faces_height,
                                faces_layers));
 
@@ -1168,7 +1619,10 @@ WR_INTERNAL wr_error
                                 GL_CLAMP_TO_EDGE));
     WR_GL_CHECK(glBindTexture(GL_TEXTURE_2D_ARRAY, 0));
 
+    WR_PROFILE_END();
+
     /* Populate GPU memory */
+    WR_PROFILE_BEGIN("texture upload");
     for (ads_index = 0; ads_index < webrays->scene.blas_count; ads_index++) {
       WideBVH* widebvh = (WideBVH*)webrays->scene.blas_handles[ads_index];
 
@@ -1228,26 +1682,10 @@ WR_INTERNAL wr_error
 
       WR_GL_CHECK(
         glBindTexture(GL_TEXTURE_2D_ARRAY, webrays_webgl->indices_texture));
-      num_pixels = (int)widebvh->m_triangles.size();
-
-      if (max_faces_width * max_faces_height ==
-          num_pixels) // no need to realocate
-        WR_GL_CHECK(glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, ads_index,
-                                    max_faces_width, max_faces_height, 1,
-                                    GL_RGBA_INTEGER, GL_INT,
-                                    (const void*)widebvh->m_triangles.data()));
-      else {
-        unsigned char* temp_data =
-          new unsigned char[max_faces_width * max_faces_height * 4 * 4];
-        std::memset(temp_data, 0, max_faces_width * max_faces_height * 4 * 4);
-        std::memcpy(temp_data, widebvh->m_triangles.data(),
-                    widebvh->m_triangles.size() * 4 * 4);
-        WR_GL_CHECK(glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, ads_index,
-                                    max_faces_width, max_faces_height, 1,
-                                    GL_RGBA_INTEGER, GL_INT,
-                                    (const void*)temp_data));
-        delete[] temp_data;
-      }
+      wr_error error = wrays_gl_ads_upload_faces(
+        widebvh, ads_index, face_bits, max_faces_width, max_faces_height);
+      if (WR_SUCCESS != error)
+        return error;
 
       widebvh->m_webgl_bindings[0]   = { "wr_scene_vertices",
                                        WR_BINDING_TYPE_GL_TEXTURE_2D_ARRAY,
@@ -1266,6 +1704,11 @@ WR_INTERNAL wr_error
         widebvh->m_webgl_binding_count = 4;
       }
     }
+    wr_error error =
+      wrays_gl_ads_upload_triangles(webrays, max_faces_width, max_faces_height);
+    WR_PROFILE_END();
+    if (WR_SUCCESS != error)
+      return error;
 
     webrays_webgl->bounds_texture_size  = bvh_nodes_texture_size;
     webrays_webgl->scene_texture_size   = attrs_texture_size;
@@ -1295,20 +1738,251 @@ WR_INTERNAL wr_error
       };
       webrays_webgl->binding_count = 4;
     }
+    if (0 != webrays_webgl->triangles_texture) {
+      webrays_webgl->intersection_bindings[webrays_webgl->binding_count++] = {
+        "wr_scene_triangles",
+        WR_BINDING_TYPE_GL_TEXTURE_2D_ARRAY,
+        { webrays_webgl->triangles_texture }
+      };
+    }
 
     /* Update all ADS to have the same dimensions for scene textures */
     for (ads_index = 0; ads_index < webrays->scene.blas_count; ads_index++) {
       WideBVH* sahbvh = (WideBVH*)webrays->scene.blas_handles[ads_index];
+      if (0 != webrays_webgl->triangles_texture)
+        sahbvh->m_webgl_bindings[sahbvh->m_webgl_binding_count++] =
+          webrays_webgl->intersection_bindings[webrays_webgl->binding_count -
+                                               1];
       sahbvh->m_node_texture_size     = webrays_webgl->bounds_texture_size;
       sahbvh->m_index_texture_size    = webrays_webgl->indices_texture_size;
       sahbvh->m_vertex_texture_size   = webrays_webgl->scene_texture_size;
       sahbvh->m_instance_texture_size = 0;
+      sahbvh->m_face_bits             = face_bits;
+      wrays_gl_ads_device_stats(
+        sahbvh, max_bvh_nodes_width * max_bvh_nodes_height * 4 * sizeof(float),
+        max_attrs_width * max_attrs_height * 4 * sizeof(float),
+        max_faces_width * max_faces_height * face_bits / 2);
     }
   }
 
   return WR_SUCCESS;
 }
 
+// Stitch and build one query kernel, the fragment shader of a screen-filling
+// pass. The defines configure the ADS code that precedes the kernel
+WR_INTERNAL void
+wrays_gl_kernel_create(wr_gl_context* webrays_webgl, GLuint* program,
+                       const char* const* defines, int define_count,
+                       const char* intersection_code, const char* kernel)
+{
+  GLuint vertex_shader;
+  GLuint fragment_shader;
+
+  WR_PROFILE_BEGIN("shader generation");
+  wr_string_buffer_appendln(webrays_webgl->shader_scratch, "#version 300 es");
+  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
+                            "precision highp float;");
+  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
+                            "precision highp int;");
+  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
+                            "precision highp isampler2DArray;");
+  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
+                            "precision highp usampler2DArray;");
+  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
+                            "precision highp sampler2DArray;");
+  // The ray buffers are float 2D textures, which fragment shaders would
+  // otherwise sample at lowp
+  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
+                            "precision highp sampler2D;");
+  for (int i = 0; i < define_count; ++i)
+    wr_string_buffer_appendln(webrays_webgl->shader_scratch, defines[i]);
+  wr_string_buffer_appendln(webrays_webgl->shader_scratch, intersection_code);
+  wr_string_buffer_appendln(webrays_webgl->shader_scratch, kernel);
+  WR_PROFILE_END();
+
+  // rg_string_buffer_pretty_print(webrays_webgl->shader_scratch);
+
+  wrays_gl_shader_create(&vertex_shader, wr_screen_fill_vertex_shader,
+                         GL_VERTEX_SHADER);
+  wrays_gl_shader_create(&fragment_shader,
+                         wr_string_buffer_data(webrays_webgl->shader_scratch),
+                         GL_FRAGMENT_SHADER);
+  wrays_gl_program_create(program, vertex_shader, fragment_shader);
+
+  wr_string_buffer_clear(webrays_webgl->shader_scratch);
+}
+
+// The combined kernel is only needed by wrays_query_intersection_occlusion,
+// so it is stitched from the prelude of its entry the first time it is used
+WR_INTERNAL GLuint
+wrays_gl_intersection_occlusion_kernel(wr_gl_context*     webrays_webgl,
+                                       wr_gl_kernel_entry entry)
+{
+  if (0 == webrays_webgl->intersection_occlusion_program[entry] &&
+      0 != webrays_webgl->intersection_program[entry]) {
+    WR_PROFILE_ZONE("intersection occlusion kernel");
+    wrays_gl_kernel_create(
+      webrays_webgl, &webrays_webgl->intersection_occlusion_program[entry],
+      WR_NULL, 0,
+      wr_string_buffer_data(webrays_webgl->kernel_prelude[entry]),
+      wr_intersection_occlusion_fragment_shader);
+  }
+
+  return webrays_webgl->intersection_occlusion_program[entry];
+}
+
+WR_INTERNAL wr_error
+            wrays_gl_query_intersection_occlusion_2d(
+              wr_handle handle, wr_handle ads, wr_handle* ray_buffers,
+              wr_handle intersections, wr_handle* occlusion_ray_buffers,
+              wr_handle occlusion, wr_size width, wr_size height)
+{
+  wr_context*    webrays          = (wr_context*)handle;
+  wr_gl_context* webrays_webgl    = (wr_gl_context*)webrays->webgl;
+  GLuint         gl_intersections = (GLuint)(size_t)intersections;
+  GLuint         gl_occlusion     = (GLuint)(size_t)occlusion;
+
+  GLuint  fbo = 0;
+  wr_size buffer_count =
+    wrays_queue_size(webrays_webgl->intersection_occlusion_buffers_2d);
+  wr_size buffer_index = 0;
+
+  for (buffer_index = 0; buffer_index < buffer_count; ++buffer_index) {
+    const wr_fused_buffer_2d& buffer =
+      webrays_webgl->intersection_occlusion_buffers_2d[buffer_index];
+    if (buffer.intersections == gl_intersections &&
+        buffer.occlusion == gl_occlusion) {
+      fbo = buffer.fbo;
+    }
+  }
+
+  if ((0 == fbo) && glIsTexture(gl_intersections) &&
+      glIsTexture(gl_occlusion)) {
+    glGenFramebuffers(1, &fbo);
+
+    WR_GL_CHECK(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+    WR_GL_CHECK(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + 0,
+                                       GL_TEXTURE_2D, gl_intersections, 0));
+    WR_GL_CHECK(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + 1,
+                                       GL_TEXTURE_2D, gl_occlusion, 0));
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+      return (wr_error) "Invalid intersection or occlusion buffer";
+    }
+
+    wr_fused_buffer_2d buffer = { gl_intersections, gl_occlusion, fbo };
+    wrays_queue_push(webrays_webgl->intersection_occlusion_buffers_2d, buffer);
+  }
+
+  // Kernels are specialized on whether the query starts from a TLAS
+  const wr_gl_kernel_entry entry =
+    ((WR_PTR2INT(ads) & WR_TLAS_ID_MASK) == WR_TLAS_ID_MASK)
+      ? WR_GL_KERNEL_ENTRY_TLAS
+      : WR_GL_KERNEL_ENTRY_BLAS;
+  const GLuint program =
+    wrays_gl_intersection_occlusion_kernel(webrays_webgl, entry);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glBindVertexArray(webrays_webgl->screen_fill_vao);
+  glViewport(0, 0, width, height);
+
+  GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0 + 0,
+                           GL_COLOR_ATTACHMENT0 + 1 };
+  glDrawBuffers(sizeof(drawBuffers) / sizeof(drawBuffers[0]), drawBuffers);
+
+  glUseProgram(program);
+
+  GLuint index = glGetUniformLocation(program, "wr_RayOrigins");
+  glActiveTexture(GL_TEXTURE0 + 0);
+  glBindTexture(GL_TEXTURE_2D, (GLuint)(size_t)ray_buffers[0]);
+  glUniform1i(index, 0);
+  index = glGetUniformLocation(program, "wr_RayDirections");
+  glActiveTexture(GL_TEXTURE0 + 1);
+  glBindTexture(GL_TEXTURE_2D, (GLuint)(size_t)ray_buffers[1]);
+  glUniform1i(index, 1);
+  index = glGetUniformLocation(program, "wr_OcclusionRayOrigins");
+  glActiveTexture(GL_TEXTURE0 + 2);
+  glBindTexture(GL_TEXTURE_2D, (GLuint)(size_t)occlusion_ray_buffers[0]);
+  glUniform1i(index, 2);
+  index = glGetUniformLocation(program, "wr_OcclusionRayDirections");
+  glActiveTexture(GL_TEXTURE0 + 3);
+  glBindTexture(GL_TEXTURE_2D, (GLuint)(size_t)occlusion_ray_buffers[1]);
+  glUniform1i(index, 3);
+
+  index = glGetUniformLocation(program, "wr_ADS");
+  glUniform1i(index, (int)(size_t)ads);
+
+  int current_texture_unit = 3;
+  for (wr_size i = 0; i < webrays_webgl->binding_count; ++i) {
+    index = glGetUniformLocation(
+      program, webrays_webgl->intersection_bindings[i].name);
+    if (webrays_webgl->intersection_bindings[i].type ==
+        wr_binding_type::WR_BINDING_TYPE_GL_TEXTURE_2D) {
+      ++current_texture_unit;
+      glActiveTexture(GL_TEXTURE0 + current_texture_unit);
+      glBindTexture(GL_TEXTURE_2D,
+                    webrays_webgl->intersection_bindings[i].data.texture);
+      glUniform1i(index, current_texture_unit);
+    } else if (webrays_webgl->intersection_bindings[i].type ==
+               wr_binding_type::WR_BINDING_TYPE_GL_TEXTURE_2D_ARRAY) {
+      ++current_texture_unit;
+      glActiveTexture(GL_TEXTURE0 + current_texture_unit);
+      glBindTexture(GL_TEXTURE_2D_ARRAY,
+                    webrays_webgl->intersection_bindings[i].data.texture);
+      glUniform1i(index, current_texture_unit);
+    }
+  }
+
+  WR_PROFILE_GPU_ZONE(webrays_webgl, "intersection occlusion kernel");
+  wr_error error =
+    wrays_gl_query_draw(webrays, width, height, webrays->query_tile_width,
+                        webrays->query_tile_height);
+  if (WR_SUCCESS != error)
+    return error;
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  return WR_SUCCESS;
+}
+
+// One draw writes both result sets through two color attachments. The
+// packed occlusion format has a different buffer size and the traversal
+// statistics take the second attachment, so both fall back to two queries
+wr_error
+wrays_gl_query_intersection_occlusion(
+  wr_handle handle, wr_handle ads, wr_handle* ray_buffers,
+  wr_size ray_buffer_count, wr_handle intersections,
+  wr_handle* occlusion_ray_buffers, wr_size occlusion_ray_buffer_count,
+  wr_handle occlusion, wr_size* dimensions, wr_size dimension_count)
+{
+  wr_context*    webrays       = (wr_context*)handle;
+  wr_gl_context* webrays_webgl = (wr_gl_context*)webrays->webgl;
+
+  if (WR_OCCLUSION_FORMAT_PACKED == webrays_webgl->occlusion_kernel_format ||
+      webrays_webgl->traversal_stats_kernels) {
+    wr_error error = wrays_gl_query_intersection(
+      handle, ads, ray_buffers, ray_buffer_count, intersections, dimensions,
+      dimension_count);
+    if (WR_SUCCESS != error)
+      return error;
+    return wrays_gl_query_occlusion(handle, ads, occlusion_ray_buffers,
+                                    occlusion_ray_buffer_count, occlusion,
+                                    dimensions, dimension_count);
+  }
+
+  switch (dimension_count) {
+    case 1: break;
+    case 2:
+      return wrays_gl_query_intersection_occlusion_2d(
+        handle, ads, ray_buffers, intersections, occlusion_ray_buffers,
+        occlusion, dimensions[0], dimensions[1]);
+    default: break;
+  }
+
+  return WR_SUCCESS;
+}
+
 wr_error
 wrays_gl_update(wr_handle handle, wr_update_flags* flags)
 {
@@ -1363,6 +2037,8 @@ wrays_gl_update(wr_handle handle, wr_update_flags* flags)
   if (max_allocation_per_tlas > 0 &&
       (webrays->update_flags &
        (WR_UPDATE_FLAG_INSTANCE_UPDATE | WR_UPDATE_FLAG_INSTANCE_ADD))) {
+    WR_PROFILE_ZONE("TLAS upload");
+    WR_PROFILE_GPU_ZONE(webrays_webgl, "TLAS upload");
     static_assert(sizeof(Instance) == 64,
                   "Instance size is not 64 bytes (mat4)");
     Instance* data =
@@ -1408,20 +2084,38 @@ wrays_gl_update(wr_handle handle, wr_update_flags* flags)
   // same shader code)
   ADS* ads                     = (ADS*)webrays->scene.blas_handles[0];
   ads->m_instance_texture_size = tlas_texture_width;
+  // The loops of that code are bounded by the counts of the largest BLAS
+  ads->m_scene_triangle_count = 0;
+  ads->m_scene_node_count     = 0;
+  for (int i = 0; i < webrays->scene.blas_count; ++i) {
+    const ADS* blas = webrays->scene.blas_handles[i];
+    const int  node_count =
+      (WR_BLAS_TYPE_SAH == webrays->scene.blas_type)
+        ? ((const SAHBVH*)blas)->m_total_nodes
+        : ((const WideBVH*)blas)->m_total_nodes;
+    ads->m_scene_triangle_count =
+      wrays_maxi(ads->m_scene_triangle_count, (int)blas->m_triangles.size());
+    ads->m_scene_node_count = wrays_maxi(ads->m_scene_node_count, node_count);
+  }
   /*if (webrays->scene.blas_count == 2) { // TODO: Maybe it should be converted
   to a FOR LOOP ads = (ADS*)webrays->scene.blas_handles[1];
           ads->m_instance_texture_size = tlas_texture_width;
   }*/
   ads = (ADS*)webrays->scene.blas_handles[0];
 
-  GLuint vertex_shader;
-  GLuint fragment_shader;
-
   /* Manage Programs */
-  if (glIsProgram(webrays_webgl->intersection_program))
-    glDeleteProgram(webrays_webgl->intersection_program);
-  if (glIsProgram(webrays_webgl->occlusion_program))
-    glDeleteProgram(webrays_webgl->occlusion_program);
+  for (int entry = 0; entry < WR_GL_KERNEL_ENTRY_MAX; ++entry) {
+    if (glIsProgram(webrays_webgl->intersection_program[entry]))
+      glDeleteProgram(webrays_webgl->intersection_program[entry]);
+    if (glIsProgram(webrays_webgl->occlusion_program[entry]))
+      glDeleteProgram(webrays_webgl->occlusion_program[entry]);
+    if (glIsProgram(webrays_webgl->intersection_occlusion_program[entry]))
+      glDeleteProgram(webrays_webgl->intersection_occlusion_program[entry]);
+    webrays_webgl->intersection_program[entry]           = 0;
+    webrays_webgl->occlusion_program[entry]              = 0;
+    webrays_webgl->intersection_occlusion_program[entry] = 0;
+    wr_string_buffer_clear(webrays_webgl->kernel_prelude[entry]);
+  }
 
   static const int node_upper_bound = 100000;
 
@@ -1436,73 +2130,80 @@ wrays_gl_update(wr_handle handle, wr_update_flags* flags)
   char tlas_texture_size_str[64];
   sprintf(tlas_texture_size_str, "#define WR_TLAS_TEXTURE_SIZE %d\n",
           tlas_texture_width);
-
-  /* Stitch intersection program */
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch, "#version 300 es");
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
-                            "precision highp float;");
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
-                            "precision highp int;");
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
-                            "precision highp isampler2DArray;");
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
-                            "precision highp sampler2DArray;");
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch, tlas_node_count_str);
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
-                            tlas_texture_size_str);
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
-                            ads->GetIntersectionCode());
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
-                            wr_intersection_fragment_shader);
-
-  wrays_gl_shader_create(&vertex_shader, wr_screen_fill_vertex_shader,
-                         GL_VERTEX_SHADER);
-  wrays_gl_shader_create(&fragment_shader,
-                         wr_string_buffer_data(webrays_webgl->shader_scratch),
-                         GL_FRAGMENT_SHADER);
-  wrays_gl_program_create(&webrays_webgl->intersection_program, vertex_shader,
-                          fragment_shader);
-
-  wr_string_buffer_clear(webrays_webgl->shader_scratch);
-
-  /* Stitch occlusion program */
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch, "#version 300 es");
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
-                            "precision highp float;");
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
-                            "precision highp int;");
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
-                            "precision highp isampler2DArray;");
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
-                            "precision highp sampler2DArray;");
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch, tlas_node_count_str);
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
-                            tlas_texture_size_str);
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
-                            ads->GetIntersectionCode());
-  wr_string_buffer_appendln(webrays_webgl->shader_scratch,
-                            wr_occlusion_fragment_shader);
-
-  // rg_string_buffer_pretty_print(webrays_webgl->shader_scratch);
-
-  wrays_gl_shader_create(&vertex_shader, wr_screen_fill_vertex_shader,
-                         GL_VERTEX_SHADER);
-  wrays_gl_shader_create(&fragment_shader,
-                         wr_string_buffer_data(webrays_webgl->shader_scratch),
-                         GL_FRAGMENT_SHADER);
-  wrays_gl_program_create(&webrays_webgl->occlusion_program, vertex_shader,
-                          fragment_shader);
-
-  wr_string_buffer_clear(webrays_webgl->shader_scratch);
+  const char* traversal_stats_str =
+    webrays->traversal_stats_enabled ? "#define WR_TRAVERSAL_STATS 1" : "";
+  const char* intersection_format_str =
+    (WR_INTERSECTION_FORMAT_COMPACT == webrays->intersection_format)
+      ? "#define WR_INTERSECTION_COMPACT 1"
+      : "";
+  webrays_webgl->traversal_stats_kernels = webrays->traversal_stats_enabled;
+  webrays_webgl->occlusion_kernel_format = webrays->occlusion_format;
+
+  // Scene configuration the ADS code is specialized on. Without spheres the
+  // per-primitive sphere test is compiled out and with a single BLAS the
+  // instances need not fetch their BLAS ID
+  int scene_sphere_count = 0;
+  for (int i = 0; i < webrays->scene.blas_count; ++i)
+    scene_sphere_count += webrays->scene.blas_handles[i]->m_sphere_count;
+  char scene_config_str[96];
+  sprintf(scene_config_str,
+          "#define WR_SCENE_BLAS_COUNT %d\n#define WR_SCENE_SPHERES %d\n",
+          webrays->scene.blas_count, scene_sphere_count > 0 ? 1 : 0);
+
+  /* Stitch the intersection and occlusion programs of each entry */
+  const char* intersection_code = ads->GetIntersectionCode();
+  for (int entry = 0; entry < WR_GL_KERNEL_ENTRY_MAX; ++entry) {
+    const bool is_tlas_entry = (WR_GL_KERNEL_ENTRY_TLAS == entry);
+    const int  entry_count =
+      is_tlas_entry ? webrays->scene.tlas_count : webrays->scene.blas_count;
+    if (0 == entry_count)
+      continue;
+
+    // A kernel that can only be entered from one ADS takes its handle as a
+    // constant instead of the wr_ADS uniform
+    char entry_str[96];
+    sprintf(entry_str, "#define %s 1\n",
+            is_tlas_entry ? "WR_ENTRY_TLAS" : "WR_ENTRY_BLAS");
+    if (1 == entry_count)
+      sprintf(entry_str + strlen(entry_str), "#define WR_ENTRY_ADS 0x%x\n",
+              is_tlas_entry ? (unsigned int)WR_TLAS_ID_MASK : 0u);
+
+    const char* defines[] = { tlas_node_count_str, tlas_texture_size_str,
+                              scene_config_str,    entry_str,
+                              traversal_stats_str, intersection_format_str };
+    const int define_count = sizeof(defines) / sizeof(defines[0]);
+
+    wrays_gl_kernel_create(webrays_webgl,
+                           &webrays_webgl->intersection_program[entry],
+                           defines, define_count, intersection_code,
+                           wr_intersection_fragment_shader);
+    wrays_gl_kernel_create(
+      webrays_webgl, &webrays_webgl->occlusion_program[entry], defines,
+      define_count, intersection_code,
+      WR_OCCLUSION_FORMAT_PACKED == webrays_webgl->occlusion_kernel_format
+        ? wr_packed_occlusion_fragment_shader
+        : wr_occlusion_fragment_shader);
+
+    // Kept for the kernels that are only built when first used
+    for (int i = 0; i < define_count; ++i)
+      wr_string_buffer_appendln(webrays_webgl->kernel_prelude[entry],
+                                defines[i]);
+    wr_string_buffer_appendln(webrays_webgl->kernel_prelude[entry],
+                              intersection_code);
+  }
 
   // wr_string_buffer_appendln(webrays_webgl->scene_accessor_shader, "#version
   // 300 es");
+  WR_PROFILE_BEGIN("shader generation");
+  wr_string_buffer_clear(webrays_webgl->scene_accessor_shader);
   wr_string_buffer_appendln(webrays_webgl->scene_accessor_shader,
                             "precision highp float;");
   wr_string_buffer_appendln(webrays_webgl->scene_accessor_shader,
                             "precision highp int;");
   wr_string_buffer_appendln(webrays_webgl->scene_accessor_shader,
                             "precision highp isampler2DArray;");
+  wr_string_buffer_appendln(webrays_webgl->scene_accessor_shader,
+                            "precision highp usampler2DArray;");
   wr_string_buffer_appendln(webrays_webgl->scene_accessor_shader,
                             "precision highp sampler2DArray;");
   wr_string_buffer_appendln(webrays_webgl->scene_accessor_shader,
@@ -1510,7 +2211,77 @@ wrays_gl_update(wr_handle handle, wr_update_flags* flags)
   wr_string_buffer_appendln(webrays_webgl->scene_accessor_shader,
                             tlas_texture_size_str);
   wr_string_buffer_appendln(webrays_webgl->scene_accessor_shader,
-                            ads->GetIntersectionCode());
+                            scene_config_str);
+  wr_string_buffer_appendln(webrays_webgl->scene_accessor_shader,
+                            traversal_stats_str);
+  wr_string_buffer_appendln(webrays_webgl->scene_accessor_shader,
+                            intersection_format_str);
+  wr_string_buffer_appendln(webrays_webgl->scene_accessor_shader,
+                            intersection_code);
+  wr_string_buffer_appendln(webrays_webgl->scene_accessor_shader,
+                            wr_packed_occlusion_accessor);
+  WR_PROFILE_END();
+
+  return WR_SUCCESS;
+}
+
+// Poll the fence of the last query without waiting on it
+wr_error
+wrays_gl_query_complete(wr_handle handle, wr_bool* complete)
+{
+  wr_context*    webrays       = (wr_context*)handle;
+  wr_gl_context* webrays_webgl = (wr_gl_context*)webrays->webgl;
+
+  *complete = WR_TRUE;
+  if (WR_NULL == webrays_webgl->query_fence)
+    return WR_SUCCESS;
+
+  const GLenum status =
+    glClientWaitSync(webrays_webgl->query_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+  if (GL_WAIT_FAILED == status)
+    return (wr_error) "Failed to poll the query fence";
+  if (GL_TIMEOUT_EXPIRED == status) {
+    *complete = WR_FALSE;
+    return WR_SUCCESS;
+  }
+
+  glDeleteSync(webrays_webgl->query_fence);
+  webrays_webgl->query_fence = WR_NULL;
+
+  return WR_SUCCESS;
+}
+
+// Read back the GPU zones recorded since the last dump. GL_QUERY_RESULT
+// waits for the queries to complete
+wr_error
+wrays_gl_profile_resolve(wr_handle handle)
+{
+#if WRAYS_PROFILE
+  wr_context* webrays = (wr_context*)handle;
+  if (WR_NULL == webrays)
+    return (wr_error) "Invalid WebRays context";
+  wr_gl_context* webrays_webgl = (wr_gl_context*)webrays->webgl;
+  if (WR_NULL == webrays_webgl)
+    return (wr_error) "Invalid WebGL WebRays context";
+
+  // Timings are meaningless if the GPU was disjoint (e.g. frequency change)
+  GLint disjoint = GL_FALSE;
+  if (webrays_webgl->timer_query_available)
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+
+  wr_profiler* profiler = wr_profiler_get(webrays);
+  for (wr_profile_event& event : profiler->events) {
+    if (0 == event.gpu_query)
+      continue;
+
+    GLuint elapsed = 0; // nanoseconds
+    glGetQueryObjectuiv(event.gpu_query, GL_QUERY_RESULT, &elapsed);
+    if (!disjoint)
+      event.duration = elapsed / 1000.0;
+    glDeleteQueries(1, &event.gpu_query);
+    event.gpu_query = 0;
+  }
+#endif
 
   return WR_SUCCESS;
 }
@@ -1536,7 +2307,8 @@ _wrays_gl_internal_get_intersection_kernel(wr_handle     handle,
   if (WR_NULL == webrays_webgl)
     return (wr_error) "Invalid WebGL WebRays context";
 
-  *program = webrays_webgl->intersection_program;
+  // The Javascript queries always start from the first BLAS
+  *program = webrays_webgl->intersection_program[WR_GL_KERNEL_ENTRY_BLAS];
 
   return WR_SUCCESS;
 }
@@ -1551,7 +2323,26 @@ _wrays_gl_internal_get_occlusion_kernel(wr_handle handle, unsigned int* program)
   if (WR_NULL == webrays_webgl)
     return (wr_error) "Invalid WebGL WebRays context";
 
-  *program = webrays_webgl->occlusion_program;
+  // The Javascript queries always start from the first BLAS
+  *program = webrays_webgl->occlusion_program[WR_GL_KERNEL_ENTRY_BLAS];
+
+  return WR_SUCCESS;
+}
+
+wr_error
+_wrays_gl_internal_get_intersection_occlusion_kernel(wr_handle     handle,
+                                                     unsigned int* program)
+{
+  wr_context* webrays = (wr_context*)handle;
+  if (WR_NULL == webrays)
+    return (wr_error) "Invalid WebRays context";
+  wr_gl_context* webrays_webgl = (wr_gl_context*)webrays->webgl;
+  if (WR_NULL == webrays_webgl)
+    return (wr_error) "Invalid WebGL WebRays context";
+
+  // The Javascript queries always start from the first BLAS
+  *program = wrays_gl_intersection_occlusion_kernel(webrays_webgl,
+                                                    WR_GL_KERNEL_ENTRY_BLAS);
 
   return WR_SUCCESS;
 }
@@ -1608,8 +2399,11 @@ WR_INTERNAL wr_error
 
   buffer_info->data.as_texture_2d.width           = width;
   buffer_info->data.as_texture_2d.height          = height;
-  buffer_info->data.as_texture_2d.internal_format = GL_RGBA32I;
-  buffer_info->data.as_texture_2d.target          = GL_TEXTURE_2D;
+  buffer_info->data.as_texture_2d.internal_format =
+    (WR_INTERSECTION_FORMAT_COMPACT == webrays->intersection_format)
+      ? GL_RG32I
+      : GL_RGBA32I;
+  buffer_info->data.as_texture_2d.target = GL_TEXTURE_2D;
 
   return WR_SUCCESS;
 }
@@ -1644,6 +2438,10 @@ WR_INTERNAL wr_error
 
   buffer_info->type = WR_BUFFER_TYPE_TEXTURE_2D;
 
+  // The packed format holds the results of 32 rays of a row per texel
+  if (WR_OCCLUSION_FORMAT_PACKED == webrays->occlusion_format)
+    width = (width + 31) / 32;
+
   buffer_info->data.as_texture_2d.width           = width;
   buffer_info->data.as_texture_2d.height          = height;
   buffer_info->data.as_texture_2d.internal_format = GL_R32I;
@@ -1816,9 +2614,19 @@ PFNGLSHADERBINARYPROC             wrShaderBinary             = WR_NULL;
 PFNGLCOPYBUFFERSUBDATAPROC wrCopyBufferSubData = WR_NULL;
 
 PFNGLVIEWPORTPROC        wrViewport        = WR_NULL;
+PFNGLENABLEPROC          wrEnable          = WR_NULL;
+PFNGLDISABLEPROC         wrDisable         = WR_NULL;
+PFNGLSCISSORPROC         wrScissor         = WR_NULL;
+PFNGLFLUSHPROC           wrFlush           = WR_NULL;
+PFNGLFENCESYNCPROC       wrFenceSync       = WR_NULL;
+PFNGLCLIENTWAITSYNCPROC  wrClientWaitSync  = WR_NULL;
+PFNGLDELETESYNCPROC      wrDeleteSync      = WR_NULL;
+PFNGLTEXSTORAGE2DPROC    wrTexStorage2D    = WR_NULL;
 PFNGLTEXSTORAGE3DPROC    wrTexStorage3D    = WR_NULL;
 PFNGLTEXPARAMETERIPROC   wrTexParameteri   = WR_NULL;
 PFNGLGETINTEGERVPROC     wrGetIntegerv     = WR_NULL;
+PFNGLREADBUFFERPROC      wrReadBuffer      = WR_NULL;
+PFNGLREADPIXELSPROC      wrReadPixels      = WR_NULL;
 PFNGLGENVERTEXARRAYSPROC wrGenVertexArrays = WR_NULL;
 PFNGLISTEXTUREPROC       wrIsTexture       = WR_NULL;
 PFNGLGENTEXTURESPROC     wrGenTextures     = WR_NULL;
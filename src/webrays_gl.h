@@ -32,7 +32,7 @@ extern "C"
 #define GL_APIENTRY
 #endif
 #include <GLES3/gl3.h>
-#ifdef USE_TIMERS
+#if defined(USE_TIMERS) || WRAYS_PROFILE
 #include <GLES2/gl2ext.h>
 #endif
 #ifdef __cplusplus
@@ -83,12 +83,19 @@ _wrays_gl_internal_get_intersection_kernel(wr_handle     handle,
 wr_error
 _wrays_gl_internal_get_occlusion_kernel(wr_handle     handle,
                                         unsigned int* program);
+wr_error
+_wrays_gl_internal_get_intersection_occlusion_kernel(wr_handle     handle,
+                                                     unsigned int* program);
 
 #ifdef WEBRAYS_PROTOTYPE_API
 wr_error
 wrays_gl_init(wr_handle handle);
 wr_error
 wrays_gl_update(wr_handle handle, wr_update_flags* flags);
+wr_error
+wrays_gl_profile_resolve(wr_handle handle);
+wr_error
+wrays_gl_query_complete(wr_handle handle, wr_bool* complete);
 const char*
 wrays_gl_get_scene_accessor(wr_handle handle);
 const wr_binding*
@@ -103,6 +110,12 @@ wrays_gl_query_intersection(wr_handle handle, wr_handle ads,
                             wr_handle* ray_buffers, wr_size ray_buffer_count,
                             wr_handle intersections, wr_size* dimensions,
                             wr_size dimension_count);
+wr_error
+wrays_gl_query_intersection_occlusion(
+  wr_handle handle, wr_handle ads, wr_handle* ray_buffers,
+  wr_size ray_buffer_count, wr_handle intersections,
+  wr_handle* occlusion_ray_buffers, wr_size occlusion_ray_buffer_count,
+  wr_handle occlusion, wr_size* dimensions, wr_size dimension_count);
 
 wr_error
 wrays_gl_add_shape(wr_handle handle, wr_handle ads, float* positions,
@@ -110,6 +123,11 @@ wrays_gl_add_shape(wr_handle handle, wr_handle ads, float* positions,
                    float* uvs, int uv_stride, int attr_count, int* faces,
                    int num_triangles, int* shape_id);
 
+wr_error
+wrays_gl_add_spheres(wr_handle handle, wr_handle ads, float* spheres,
+                     int sphere_stride, int* user_data, int num_spheres,
+                     int* shape_id);
+
 wr_error
 wrays_gl_ray_buffer_destroy(wr_handle handle, wr_handle buffer);
 wr_error
@@ -289,9 +307,19 @@ WR_FUN_EXPORT PFNGLSHADERBINARYPROC wrShaderBinary;
 WR_FUN_EXPORT PFNGLCOPYBUFFERSUBDATAPROC wrCopyBufferSubData;
 
 WR_FUN_EXPORT PFNGLVIEWPORTPROC wrViewport;
+WR_FUN_EXPORT PFNGLENABLEPROC wrEnable;
+WR_FUN_EXPORT PFNGLDISABLEPROC wrDisable;
+WR_FUN_EXPORT PFNGLSCISSORPROC wrScissor;
+WR_FUN_EXPORT PFNGLFLUSHPROC wrFlush;
+WR_FUN_EXPORT PFNGLFENCESYNCPROC wrFenceSync;
+WR_FUN_EXPORT PFNGLCLIENTWAITSYNCPROC wrClientWaitSync;
+WR_FUN_EXPORT PFNGLDELETESYNCPROC wrDeleteSync;
+WR_FUN_EXPORT PFNGLTEXSTORAGE2DPROC wrTexStorage2D;
 WR_FUN_EXPORT PFNGLTEXSTORAGE3DPROC wrTexStorage3D;
 WR_FUN_EXPORT PFNGLTEXPARAMETERIPROC wrTexParameteri;
 WR_FUN_EXPORT PFNGLGETINTEGERVPROC wrGetIntegerv;
+WR_FUN_EXPORT PFNGLREADBUFFERPROC wrReadBuffer;
+WR_FUN_EXPORT PFNGLREADPIXELSPROC wrReadPixels;
 WR_FUN_EXPORT PFNGLGENVERTEXARRAYSPROC wrGenVertexArrays;
 WR_FUN_EXPORT PFNGLISTEXTUREPROC wrIsTexture;
 WR_FUN_EXPORT PFNGLGENTEXTURESPROC wrGenTextures;
@@ -457,9 +485,19 @@ WR_FUN_EXPORT PFNGLRENDERBUFFERSTORAGEMULTISAMPLEPROC
 #define glShaderBinary wrShaderBinary
 #define glCopyBufferSubData wrCopyBufferSubData
 #define glViewport wrViewport
+#define glEnable wrEnable
+#define glDisable wrDisable
+#define glScissor wrScissor
+#define glFlush wrFlush
+#define glFenceSync wrFenceSync
+#define glClientWaitSync wrClientWaitSync
+#define glDeleteSync wrDeleteSync
+#define glTexStorage2D wrTexStorage2D
 #define glTexStorage3D wrTexStorage3D
 #define glTexParameteri wrTexParameteri
 #define glGetIntegerv wrGetIntegerv
+#define glReadBuffer wrReadBuffer
+#define glReadPixels wrReadPixels
 #define glGenVertexArrays wrGenVertexArrays
 #define glIsTexture wrIsTexture
 #define glGenTextures wrGenTextures
@@ -122,40 +122,169 @@ wr_GetHitDistance(ivec4 intersection) {
 static char const* const wr_intersection_fragment_shader =
   R"glsl(
 layout(location = 0) out ivec4 wr_Intersection;
+#ifdef WR_TRAVERSAL_STATS
+layout(location = 1) out ivec4 wr_TraversalStats; /* nodes, triangles, stack depth, traced */
+#endif
 
 uniform sampler2D wr_RayOrigins;
 uniform sampler2D wr_RayDirections;
 
+#ifdef WR_ENTRY_ADS
+const int wr_ADS = WR_ENTRY_ADS;
+#else
 uniform int wr_ADS;
+#endif
 
 void main() {
   vec4 ray_direction = texelFetch(wr_RayDirections, ivec2(gl_FragCoord.xy), 0);
   vec4 ray_origin = texelFetch(wr_RayOrigins, ivec2(gl_FragCoord.xy), 0);
   
+#ifdef WR_TRAVERSAL_STATS
+  wr_TraversalStats = ivec4(0);
+#endif
   if (0.0 == ray_direction.w) return;
   ray_origin.xyz = ray_origin.xyz + ray_origin.w * ray_direction.xyz;
 
-  wr_Intersection = wr_query_intersection(wr_ADS, ray_origin.xyz, ray_direction.xyz, ray_direction.w);
+  ivec4 intersection = wr_query_intersection(wr_ADS, ray_origin.xyz, ray_direction.xyz, ray_direction.w);
+#ifdef WR_INTERSECTION_COMPACT
+  wr_Intersection = ivec4(intersection.x, int(packUnorm2x16(intBitsToFloat(intersection.yz))), 0, 0);
+#else
+  wr_Intersection = intersection;
+#endif
+#ifdef WR_TRAVERSAL_STATS
+  wr_TraversalStats = ivec4(wr_GetTraversalStats().xyz, 1);
+#endif
 }
 )glsl";
 
 static char const* const wr_occlusion_fragment_shader =
   R"glsl(
 layout(location = 0) out int wr_Occlusion;
+#ifdef WR_TRAVERSAL_STATS
+layout(location = 1) out ivec4 wr_TraversalStats; /* nodes, triangles, stack depth, traced (2 if terminated) */
+#endif
 
 uniform sampler2D wr_RayOrigins;
 uniform sampler2D wr_RayDirections;
 
+#ifdef WR_ENTRY_ADS
+const int wr_ADS = WR_ENTRY_ADS;
+#else
 uniform int wr_ADS;
+#endif
 
 void main() {
   vec4 ray_direction = texelFetch(wr_RayDirections, ivec2(gl_FragCoord.xy), 0);
   vec4 ray_origin = texelFetch(wr_RayOrigins, ivec2(gl_FragCoord.xy), 0);
   
+#ifdef WR_TRAVERSAL_STATS
+  wr_TraversalStats = ivec4(0);
+#endif
   if (0.0 == ray_direction.w) return;
   ray_origin.xyz = ray_origin.xyz + ray_origin.w * ray_direction.xyz;
 
   wr_Occlusion = wr_query_occlusion(wr_ADS, ray_origin.xyz, ray_direction.xyz, ray_direction.w) ? 1 : 0;
+#ifdef WR_TRAVERSAL_STATS
+  wr_TraversalStats = ivec4(wr_GetTraversalStats().xyz, 1 + wr_GetTraversalStats().w);
+#endif
+}
+)glsl";
+
+// Intersection and occlusion kernel of wrays_query_intersection_occlusion.
+// Each fragment traces one ray of both sets, sharing the scene data fetched by
+// the first query with the second. Inactive rays are skipped as in the
+// separate kernels
+static char const* const wr_intersection_occlusion_fragment_shader =
+  R"glsl(
+layout(location = 0) out ivec4 wr_Intersection;
+layout(location = 1) out int wr_Occlusion;
+
+uniform sampler2D wr_RayOrigins;
+uniform sampler2D wr_RayDirections;
+uniform sampler2D wr_OcclusionRayOrigins;
+uniform sampler2D wr_OcclusionRayDirections;
+
+#ifdef WR_ENTRY_ADS
+const int wr_ADS = WR_ENTRY_ADS;
+#else
+uniform int wr_ADS;
+#endif
+
+void main() {
+  vec4 ray_direction = texelFetch(wr_RayDirections, ivec2(gl_FragCoord.xy), 0);
+  vec4 ray_origin = texelFetch(wr_RayOrigins, ivec2(gl_FragCoord.xy), 0);
+  if (0.0 != ray_direction.w) {
+    ray_origin.xyz = ray_origin.xyz + ray_origin.w * ray_direction.xyz;
+
+    ivec4 intersection = wr_query_intersection(wr_ADS, ray_origin.xyz, ray_direction.xyz, ray_direction.w);
+#ifdef WR_INTERSECTION_COMPACT
+    wr_Intersection = ivec4(intersection.x, int(packUnorm2x16(intBitsToFloat(intersection.yz))), 0, 0);
+#else
+    wr_Intersection = intersection;
+#endif
+  }
+
+  ray_direction = texelFetch(wr_OcclusionRayDirections, ivec2(gl_FragCoord.xy), 0);
+  ray_origin = texelFetch(wr_OcclusionRayOrigins, ivec2(gl_FragCoord.xy), 0);
+  if (0.0 != ray_direction.w) {
+    ray_origin.xyz = ray_origin.xyz + ray_origin.w * ray_direction.xyz;
+
+    wr_Occlusion = wr_query_occlusion(wr_ADS, ray_origin.xyz, ray_direction.xyz, ray_direction.w) ? 1 : 0;
+  }
+}
+)glsl";
+
+// Occlusion kernel of WR_OCCLUSION_FORMAT_PACKED. Each fragment traces 32
+// consecutive rays of a row and writes their results as a bitmask
+static char const* const wr_packed_occlusion_fragment_shader =
+  R"glsl(
+layout(location = 0) out int wr_Occlusion;
+#ifdef WR_TRAVERSAL_STATS
+layout(location = 1) out ivec4 wr_TraversalStats; /* nodes, triangles, stack depth, traced (2 if terminated) */
+#endif
+
+uniform sampler2D wr_RayOrigins;
+uniform sampler2D wr_RayDirections;
+
+#ifdef WR_ENTRY_ADS
+const int wr_ADS = WR_ENTRY_ADS;
+#else
+uniform int wr_ADS;
+#endif
+
+void main() {
+  int ray_width = textureSize(wr_RayDirections, 0).x;
+  ivec2 ray = ivec2(32 * int(gl_FragCoord.x), int(gl_FragCoord.y));
+  int occlusion = 0;
+  bool traced = false;
+
+#ifdef WR_TRAVERSAL_STATS
+  wr_TraversalStats = ivec4(0);
+#endif
+  for (int i = 0; i < 32 && ray.x < ray_width; ++i, ++ray.x) {
+    vec4 ray_direction = texelFetch(wr_RayDirections, ray, 0);
+    vec4 ray_origin = texelFetch(wr_RayOrigins, ray, 0);
+    if (0.0 == ray_direction.w) continue;
+    ray_origin.xyz = ray_origin.xyz + ray_origin.w * ray_direction.xyz;
+
+    traced = true;
+    if (wr_query_occlusion(wr_ADS, ray_origin.xyz, ray_direction.xyz, ray_direction.w))
+      occlusion |= 1 << i;
+  }
+
+  wr_Occlusion = occlusion;
+#ifdef WR_TRAVERSAL_STATS
+  if (traced) wr_TraversalStats = ivec4(wr_GetTraversalStats().xyz, 1 + wr_GetTraversalStats().w);
+#endif
+}
+)glsl";
+
+// Reads WR_OCCLUSION_FORMAT_PACKED results, part of the accessor code
+static char const* const wr_packed_occlusion_accessor =
+  R"glsl(
+bool
+wr_GetPackedOcclusion(highp isampler2D occlusion, ivec2 ray) {
+  return 0 != ((texelFetch(occlusion, ivec2(ray.x >> 5, ray.y), 0).r >> (ray.x & 31)) & 1);
 }
 )glsl";
 
@@ -84,6 +84,46 @@ function wrays_array_to_heap(typedArray){
   heapBytes.set(new Uint8Array(typedArray.buffer));
   return ptr;
 }
+// Geometry laid out directly in the WASM heap, see AllocGeometry. A single
+// block holds the positions (3 floats per vertex), the optional normals (3)
+// and texture coordinates (2), then the faces (4 ints per triangle). The
+// views are recreated on every access since growing the heap detaches them,
+// from the current ptr so that a freed geometry throws instead of handing
+// out views of memory that may have been reused
+function wrays_alloc_geometry(vertex_count, face_count, has_normals, has_uvs) {
+  const vertex_floats = 3 * vertex_count;
+  const normal_floats = has_normals ? 3 * vertex_count : 0;
+  const uv_floats     = has_uvs ? 2 * vertex_count : 0;
+  const face_ints     = 4 * face_count;
+  const ptr = WebRaysModule._malloc(Float32Array.BYTES_PER_ELEMENT * (vertex_floats + normal_floats + uv_floats + face_ints));
+  if (ptr === 0)
+  {
+    throw new WebRaysException("Out of memory allocating geometry for " + vertex_count + " vertices");
+  }
+
+  // Byte offsets of the arrays from ptr
+  const normals_offset = Float32Array.BYTES_PER_ELEMENT * vertex_floats;
+  const uvs_offset     = normals_offset + Float32Array.BYTES_PER_ELEMENT * normal_floats;
+  const faces_offset   = uvs_offset + Float32Array.BYTES_PER_ELEMENT * uv_floats;
+  return {
+    ptr: ptr,
+    vertex_count: vertex_count,
+    face_count: face_count,
+    get allocated_ptr() {
+      if (this.ptr === 0)
+        throw new WebRaysException("Geometry was freed by FreeGeometry or AddGeometry");
+      return this.ptr;
+    },
+    get vertices() { return new Float32Array(WebRaysModule.HEAPU8.buffer, this.allocated_ptr, vertex_floats); },
+    get normals() { const ptr = this.allocated_ptr; return has_normals ? new Float32Array(WebRaysModule.HEAPU8.buffer, ptr + normals_offset, normal_floats) : null; },
+    get uvs() { const ptr = this.allocated_ptr; return has_uvs ? new Float32Array(WebRaysModule.HEAPU8.buffer, ptr + uvs_offset, uv_floats) : null; },
+    get faces() { return new Int32Array(WebRaysModule.HEAPU8.buffer, this.allocated_ptr + faces_offset, face_ints); },
+    get vertices_ptr() { return this.allocated_ptr; },
+    get normals_ptr() { const ptr = this.allocated_ptr; return has_normals ? ptr + normals_offset : 0; },
+    get uvs_ptr() { const ptr = this.allocated_ptr; return has_uvs ? ptr + uvs_offset : 0; },
+    get faces_ptr() { return this.allocated_ptr + faces_offset; }
+  };
+}
 function wrays_count_options(options) {
   return Object.keys(options).length;
 }
@@ -138,6 +178,16 @@ function wrays_flag(x) {
     INSTANCE_UPDATE : wrays_flag(2),
   };
 
+  export const OcclusionFormat = { 
+    INT: 0, 
+    PACKED: 1
+  };
+
+  export const IntersectionFormat = { 
+    FULL: 0, 
+    COMPACT: 1
+  };
+
   export function OnLoad(callback)
   {
     createWebRaysModule().then(instance => {
@@ -204,8 +254,15 @@ function wrays_flag(x) {
     this.Context = WebRaysModule['_wrays_init'](this.Backend);
     this.IsectProgram = null;
     this.OcclusionProgram = null;
+    this.IsectOcclusionProgram = null;
+    this.OcclusionFormat = OcclusionFormat.INT;
+    this.OcclusionKernelFormat = OcclusionFormat.INT;
     this.OcclusionBuffers = [];
     this.IsectBuffers = [];
+    this.IsectOcclusionBuffers = [];
+    this.TileWidth = 0;
+    this.TileHeight = 0;
+    this.TilesPerFrame = 0;
     this.Bindings = [];
     this.BindingPtr = wrays_alloc_int(5);
     this.BufferInfoPtr = wrays_alloc_int(5);
@@ -367,6 +424,8 @@ function wrays_flag(x) {
       
       this.IsectProgram = this.GL.programs[isect_program];
       this.OcclusionProgram = this.GL.programs[occlusion_program];
+      this.IsectOcclusionProgram = null; // built by the first QueryIntersectionOcclusion
+      this.OcclusionKernelFormat = this.OcclusionFormat;
       this.Bindings = this.GetSceneAccessorBindings();
 
       wrays_free(isect_program_ptr);
@@ -374,7 +433,108 @@ function wrays_flag(x) {
 
       return update_flags;
     };
-    this.QueryOcclusion = function(ray_buffers, occlusion_buffer, dims) {
+
+    // Build the pending BLASes on the worker threads of an ENABLE_THREADS
+    // build and resolve with the flags of Update, which uploads them on this
+    // thread once the workers are done. Polls with setTimeout rather than
+    // requestAnimationFrame so that it also runs under Node's worker_threads
+    this.UpdateAsync = function() {
+      const error = WebRaysModule['_wrays_update_async'](this.Context);
+      if(error !== 0)
+      {
+        const error_msg = wrays_create_string(error, 256);
+        return Promise.reject(new WebRaysException("Error in updating the intersection engine: " + error_msg));
+      }
+
+      return new Promise((resolve, reject) => {
+        const poll = () => {
+          let ready_ptr = wrays_alloc_int();
+          const ready_error = WebRaysModule['_wrays_update_ready'](this.Context, ready_ptr);
+          const ready = wrays_create_int(ready_ptr);
+          wrays_free(ready_ptr);
+
+          if(ready_error !== 0)
+          {
+            const error_msg = wrays_create_string(ready_error, 256);
+            reject(new WebRaysException("Error in updating the intersection engine: " + error_msg));
+            return;
+          }
+          if (ready === 0)
+          {
+            setTimeout(poll, 1);
+            return;
+          }
+
+          try {
+            resolve(this.Update());
+          } catch (e) {
+            reject(e);
+          }
+        };
+        poll();
+      });
+    };
+    // Draw a query that bind() set up over width x height texels, in the
+    // tiles of SetQueryTiling. A texel holds tile_divisor rays along x. With
+    // an on_complete callback the tiles are spread over animation frames,
+    // TilesPerFrame at a time, and on_complete is called once a fence shows
+    // that the GPU finished the last one
+    this.DispatchTiles = function(bind, width, height, tile_divisor, on_complete) {
+      const gl = WebRaysModule.GL.currentContext.GLctx;
+      const tiled = this.TileWidth > 0 || this.TileHeight > 0;
+      const tile_width = this.TileWidth > 0 ? Math.min(Math.ceil(this.TileWidth / tile_divisor), width) : width;
+      const tile_height = this.TileHeight > 0 ? Math.min(this.TileHeight, height) : height;
+      const tiles_x = Math.ceil(width / tile_width);
+      const tile_count = tiles_x * Math.ceil(height / tile_height);
+      const tiles_per_frame = (tiled && on_complete && this.TilesPerFrame > 0) ? this.TilesPerFrame : tile_count;
+      let next_tile = 0;
+
+      const wait_fence = (fence) => {
+        if (gl.TIMEOUT_EXPIRED === gl.clientWaitSync(fence, 0, 0)) {
+          requestAnimationFrame(() => wait_fence(fence));
+          return;
+        }
+        gl.deleteSync(fence);
+        on_complete();
+      };
+
+      const draw_tiles = () => {
+        const current_vao = gl.getParameter(gl.VERTEX_ARRAY_BINDING);
+        const scissor_test = gl.isEnabled(gl.SCISSOR_TEST);
+        const scissor_box = gl.getParameter(gl.SCISSOR_BOX);
+
+        bind();
+        if (tiled)
+          gl.enable(gl.SCISSOR_TEST);
+        const last_tile = Math.min(next_tile + tiles_per_frame, tile_count);
+        for (; next_tile < last_tile; ++next_tile) {
+          if (tiled) {
+            const x = (next_tile % tiles_x) * tile_width;
+            const y = Math.floor(next_tile / tiles_x) * tile_height;
+            gl.scissor(x, y, Math.min(tile_width, width - x), Math.min(tile_height, height - y));
+          }
+          gl.drawArrays(gl.TRIANGLES, 0, 3);
+          if (tiled)
+            gl.flush();
+        }
+        if (tiled) {
+          if (!scissor_test)
+            gl.disable(gl.SCISSOR_TEST);
+          gl.scissor(scissor_box[0], scissor_box[1], scissor_box[2], scissor_box[3]);
+        }
+
+        /* Rethink */
+        gl.bindVertexArray(current_vao);
+        gl.bindFramebuffer(gl.FRAMEBUFFER, null);
+
+        if (next_tile < tile_count)
+          requestAnimationFrame(draw_tiles);
+        else if (on_complete)
+          wait_fence(gl.fenceSync(gl.SYNC_GPU_COMMANDS_COMPLETE, 0));
+      };
+      draw_tiles();
+    };
+    this.QueryOcclusion = function(ray_buffers, occlusion_buffer, dims, on_complete) {
       if (!Array.isArray(dims) || !Array.isArray(ray_buffers)) {
         throw new WebRaysException("An array is expected for ray buffers and dimentions");
       }
@@ -402,58 +562,59 @@ function wrays_flag(x) {
         height = dims[1];
       }
 
-      gl.bindFramebuffer(gl.FRAMEBUFFER, fbo);
+      // Each texel of the packed kernel traces 32 rays of a row
+      if (this.OcclusionKernelFormat === OcclusionFormat.PACKED)
+        width = (width + 31) >> 5;
+
+      const bind = () => {
+        gl.bindFramebuffer(gl.FRAMEBUFFER, fbo);
 
-      const current_vao = gl.getParameter(gl.VERTEX_ARRAY_BINDING);
-      gl.bindVertexArray(this.VAO);
-	    gl.drawBuffers([gl.COLOR_ATTACHMENT0]);
-      gl.viewport(0, 0, width, height);
+        gl.bindVertexArray(this.VAO);
+        gl.drawBuffers([gl.COLOR_ATTACHMENT0]);
+        gl.viewport(0, 0, width, height);
       
-      gl.useProgram(this.OcclusionProgram);
-      let index = gl.getUniformLocation(this.OcclusionProgram, "wr_RayOrigins");
-	    gl.activeTexture(gl.TEXTURE0 + 0);
-	    gl.bindTexture(gl.TEXTURE_2D, ray_buffers[0]);
-	    gl.uniform1i(index, 0);
-	    index = gl.getUniformLocation(this.OcclusionProgram, "wr_RayDirections");
-	    gl.activeTexture(gl.TEXTURE0 + 1);
-	    gl.bindTexture(gl.TEXTURE_2D, ray_buffers[1]);
-	    gl.uniform1i(index, 1);
-      index = gl.getUniformLocation(this.OcclusionProgram, "wr_ADS");
-      gl.uniform1i(index, 0);
+        gl.useProgram(this.OcclusionProgram);
+        let index = gl.getUniformLocation(this.OcclusionProgram, "wr_RayOrigins");
+        gl.activeTexture(gl.TEXTURE0 + 0);
+        gl.bindTexture(gl.TEXTURE_2D, ray_buffers[0]);
+        gl.uniform1i(index, 0);
+        index = gl.getUniformLocation(this.OcclusionProgram, "wr_RayDirections");
+        gl.activeTexture(gl.TEXTURE0 + 1);
+        gl.bindTexture(gl.TEXTURE_2D, ray_buffers[1]);
+        gl.uniform1i(index, 1);
+        index = gl.getUniformLocation(this.OcclusionProgram, "wr_ADS");
+        gl.uniform1i(index, 0);
       
-      const bindings = this.Bindings;
-      let next_texture_unit = 2;
-      for (let binding_index = 0; binding_index < bindings.length; ++binding_index) {		
-        const binding = bindings[binding_index];
+        const bindings = this.Bindings;
+        let next_texture_unit = 2;
+        for (let binding_index = 0; binding_index < bindings.length; ++binding_index) {		
+          const binding = bindings[binding_index];
     
-        /* if UBO */
-        if (binding.Type == BindingType.GL_UNIFORM_BLOCK) {
-          console.error("Binding type of UBO is not implemented yet.");
-          return "Wrong binding type";
-        /* if Texture 2D */
-        } else if (binding.Type == BindingType.GL_TEXTURE_2D) {
-          index = gl.getUniformLocation(this.OcclusionProgram, binding.Name);
-          gl.activeTexture(gl.TEXTURE0 + next_texture_unit);
-          gl.bindTexture(gl.TEXTURE_2D, binding.Texture);
-          gl.uniform1i(index, next_texture_unit);
-          next_texture_unit++;
-        /* if Texture Array 2D */
-        } else if (binding.Type == BindingType.GL_TEXTURE_2D_ARRAY) {
-          index = gl.getUniformLocation(this.OcclusionProgram, binding.Name);
-          gl.activeTexture(gl.TEXTURE0 + next_texture_unit);
-          gl.bindTexture(gl.TEXTURE_2D_ARRAY, binding.Texture);
-          gl.uniform1i(index, next_texture_unit);
-          next_texture_unit++;
+          /* if UBO */
+          if (binding.Type == BindingType.GL_UNIFORM_BLOCK) {
+            console.error("Binding type of UBO is not implemented yet.");
+            return "Wrong binding type";
+          /* if Texture 2D */
+          } else if (binding.Type == BindingType.GL_TEXTURE_2D) {
+            index = gl.getUniformLocation(this.OcclusionProgram, binding.Name);
+            gl.activeTexture(gl.TEXTURE0 + next_texture_unit);
+            gl.bindTexture(gl.TEXTURE_2D, binding.Texture);
+            gl.uniform1i(index, next_texture_unit);
+            next_texture_unit++;
+          /* if Texture Array 2D */
+          } else if (binding.Type == BindingType.GL_TEXTURE_2D_ARRAY) {
+            index = gl.getUniformLocation(this.OcclusionProgram, binding.Name);
+            gl.activeTexture(gl.TEXTURE0 + next_texture_unit);
+            gl.bindTexture(gl.TEXTURE_2D_ARRAY, binding.Texture);
+            gl.uniform1i(index, next_texture_unit);
+            next_texture_unit++;
+          }
         }
-      }
+      };
 
-      gl.drawArrays(gl.TRIANGLES, 0, 3);
-      
-      /* Rethink */
-      gl.bindVertexArray(current_vao);
-      gl.bindFramebuffer(gl.FRAMEBUFFER, null);
+      this.DispatchTiles(bind, width, height, this.OcclusionKernelFormat === OcclusionFormat.PACKED ? 32 : 1, on_complete);
     };
-    this.QueryIntersection = function(ray_buffers, isect_buffer, dims) {
+    this.QueryIntersection = function(ray_buffers, isect_buffer, dims, on_complete) {
       if (!Array.isArray(dims) || !Array.isArray(ray_buffers)) {
         throw new WebRaysException("An array is expected for intersection buffers and dimentions");
       }
@@ -481,55 +642,137 @@ function wrays_flag(x) {
         height = dims[1];
       }
 
-      gl.bindFramebuffer(gl.FRAMEBUFFER, fbo);
+      const bind = () => {
+        gl.bindFramebuffer(gl.FRAMEBUFFER, fbo);
 
-      let current_vao = gl.getParameter(gl.VERTEX_ARRAY_BINDING);
-      gl.bindVertexArray(this.VAO);
-	    gl.drawBuffers([gl.COLOR_ATTACHMENT0]);
-      gl.viewport(0, 0, width, height);
+        gl.bindVertexArray(this.VAO);
+        gl.drawBuffers([gl.COLOR_ATTACHMENT0]);
+        gl.viewport(0, 0, width, height);
       
-      gl.useProgram(this.IsectProgram);
-      let index = gl.getUniformLocation(this.IsectProgram, "wr_RayOrigins");
-	    gl.activeTexture(gl.TEXTURE0 + 0);
-	    gl.bindTexture(gl.TEXTURE_2D, ray_buffers[0]);
-	    gl.uniform1i(index, 0);
-	    index = gl.getUniformLocation(this.IsectProgram, "wr_RayDirections");
-	    gl.activeTexture(gl.TEXTURE0 + 1);
-	    gl.bindTexture(gl.TEXTURE_2D, ray_buffers[1]);
-	    gl.uniform1i(index, 1);
-      index = gl.getUniformLocation(this.IsectProgram, "wr_ADS");
-      gl.uniform1i(index, 0);
+        gl.useProgram(this.IsectProgram);
+        let index = gl.getUniformLocation(this.IsectProgram, "wr_RayOrigins");
+        gl.activeTexture(gl.TEXTURE0 + 0);
+        gl.bindTexture(gl.TEXTURE_2D, ray_buffers[0]);
+        gl.uniform1i(index, 0);
+        index = gl.getUniformLocation(this.IsectProgram, "wr_RayDirections");
+        gl.activeTexture(gl.TEXTURE0 + 1);
+        gl.bindTexture(gl.TEXTURE_2D, ray_buffers[1]);
+        gl.uniform1i(index, 1);
+        index = gl.getUniformLocation(this.IsectProgram, "wr_ADS");
+        gl.uniform1i(index, 0);
       
-      let bindings = this.Bindings;
-      let next_texture_unit = 2;
-      for (let binding_index = 0; binding_index < bindings.length; ++binding_index) {		
-        let binding = bindings[binding_index];
+        let bindings = this.Bindings;
+        let next_texture_unit = 2;
+        for (let binding_index = 0; binding_index < bindings.length; ++binding_index) {		
+          let binding = bindings[binding_index];
     
-        /* if UBO */
-        if (binding.Type == BindingType.GL_UNIFORM_BLOCK) {
+          /* if UBO */
+          if (binding.Type == BindingType.GL_UNIFORM_BLOCK) {
           
-        /* if Texture 2D */
-        } else if (binding.Type == BindingType.GL_TEXTURE_2D) {
-          index = gl.getUniformLocation(this.IsectProgram, binding.Name);
-          gl.activeTexture(gl.TEXTURE0 + next_texture_unit);
-          gl.bindTexture(gl.TEXTURE_2D, binding.Texture);
-          gl.uniform1i(index, next_texture_unit);
-          next_texture_unit++;
-        /* if Texture Array 2D */
-        } else if (binding.Type == BindingType.GL_TEXTURE_2D_ARRAY) {
-          index = gl.getUniformLocation(this.IsectProgram, binding.Name);
-          gl.activeTexture(gl.TEXTURE0 + next_texture_unit);
-          gl.bindTexture(gl.TEXTURE_2D_ARRAY, binding.Texture);
-          gl.uniform1i(index, next_texture_unit);
-          next_texture_unit++;
+          /* if Texture 2D */
+          } else if (binding.Type == BindingType.GL_TEXTURE_2D) {
+            index = gl.getUniformLocation(this.IsectProgram, binding.Name);
+            gl.activeTexture(gl.TEXTURE0 + next_texture_unit);
+            gl.bindTexture(gl.TEXTURE_2D, binding.Texture);
+            gl.uniform1i(index, next_texture_unit);
+            next_texture_unit++;
+          /* if Texture Array 2D */
+          } else if (binding.Type == BindingType.GL_TEXTURE_2D_ARRAY) {
+            index = gl.getUniformLocation(this.IsectProgram, binding.Name);
+            gl.activeTexture(gl.TEXTURE0 + next_texture_unit);
+            gl.bindTexture(gl.TEXTURE_2D_ARRAY, binding.Texture);
+            gl.uniform1i(index, next_texture_unit);
+            next_texture_unit++;
+          }
         }
+      };
+
+      this.DispatchTiles(bind, width, height, 1, on_complete);
+    };
+    this.QueryIntersectionOcclusion = function(ray_buffers, isect_buffer, occlusion_ray_buffers, occlusion_buffer, dims, on_complete) {
+      if (!Array.isArray(dims) || !Array.isArray(ray_buffers) || !Array.isArray(occlusion_ray_buffers)) {
+        throw new WebRaysException("An array is expected for ray buffers and dimentions");
       }
 
-      gl.drawArrays(gl.TRIANGLES, 0, 3);
-      
-      /* Rethink */
-      gl.bindVertexArray(current_vao);
-      gl.bindFramebuffer(gl.FRAMEBUFFER, null);
+      // The packed occlusion buffers are narrower than the intersection buffers
+      if (this.OcclusionKernelFormat === OcclusionFormat.PACKED) {
+        let pending = 2;
+        const on_query_complete = on_complete ? () => { if (0 === --pending) on_complete(); } : undefined;
+        this.QueryIntersection(ray_buffers, isect_buffer, dims, on_query_complete);
+        this.QueryOcclusion(occlusion_ray_buffers, occlusion_buffer, dims, on_query_complete);
+        return;
+      }
+
+      if (null === this.IsectOcclusionProgram) {
+        let program_ptr = wrays_alloc_uint();
+        WebRaysModule['__wrays_internal_get_intersection_occlusion_kernel'](this.Context, program_ptr);
+        this.IsectOcclusionProgram = this.GL.programs[wrays_create_uint(program_ptr)];
+        wrays_free(program_ptr);
+      }
+
+      const gl = WebRaysModule.GL.currentContext.GLctx;
+      let fbo = null;
+      for (let buffer_index = 0; buffer_index < this.IsectOcclusionBuffers.length; ++buffer_index) {
+        const buffer = this.IsectOcclusionBuffers[buffer_index];
+        if (buffer.Intersections === isect_buffer && buffer.Occlusion === occlusion_buffer)
+          fbo = buffer.FBO;
+      }
+      if (null === fbo) {
+        fbo = gl.createFramebuffer();
+        gl.bindFramebuffer(gl.FRAMEBUFFER, fbo);
+        gl.framebufferTexture2D(gl.FRAMEBUFFER, gl.COLOR_ATTACHMENT0, gl.TEXTURE_2D, isect_buffer, 0);
+        gl.framebufferTexture2D(gl.FRAMEBUFFER, gl.COLOR_ATTACHMENT1, gl.TEXTURE_2D, occlusion_buffer, 0);
+        if (gl.FRAMEBUFFER_COMPLETE !== gl.checkFramebufferStatus(gl.FRAMEBUFFER)) {
+          throw new WebRaysException("Internal WebRays Error: failed to create Intersection Occlusion Buffer FBO");
+        }
+        this.IsectOcclusionBuffers.push({ Intersections : isect_buffer, Occlusion : occlusion_buffer, FBO : fbo });
+      }
+
+      const bind = () => {
+        gl.bindFramebuffer(gl.FRAMEBUFFER, fbo);
+
+        gl.bindVertexArray(this.VAO);
+        gl.drawBuffers([gl.COLOR_ATTACHMENT0, gl.COLOR_ATTACHMENT1]);
+        gl.viewport(0, 0, dims[0], dims[1]);
+
+        const program = this.IsectOcclusionProgram;
+        gl.useProgram(program);
+        const ray_textures = [ray_buffers[0], ray_buffers[1], occlusion_ray_buffers[0], occlusion_ray_buffers[1]];
+        const ray_names = ["wr_RayOrigins", "wr_RayDirections", "wr_OcclusionRayOrigins", "wr_OcclusionRayDirections"];
+        let index = null;
+        for (let ray_index = 0; ray_index < 4; ++ray_index) {
+          index = gl.getUniformLocation(program, ray_names[ray_index]);
+          gl.activeTexture(gl.TEXTURE0 + ray_index);
+          gl.bindTexture(gl.TEXTURE_2D, ray_textures[ray_index]);
+          gl.uniform1i(index, ray_index);
+        }
+        index = gl.getUniformLocation(program, "wr_ADS");
+        gl.uniform1i(index, 0);
+
+        const bindings = this.Bindings;
+        let next_texture_unit = 4;
+        for (let binding_index = 0; binding_index < bindings.length; ++binding_index) {
+          const binding = bindings[binding_index];
+
+          /* if Texture 2D */
+          if (binding.Type == BindingType.GL_TEXTURE_2D) {
+            index = gl.getUniformLocation(program, binding.Name);
+            gl.activeTexture(gl.TEXTURE0 + next_texture_unit);
+            gl.bindTexture(gl.TEXTURE_2D, binding.Texture);
+            gl.uniform1i(index, next_texture_unit);
+            next_texture_unit++;
+          /* if Texture Array 2D */
+          } else if (binding.Type == BindingType.GL_TEXTURE_2D_ARRAY) {
+            index = gl.getUniformLocation(program, binding.Name);
+            gl.activeTexture(gl.TEXTURE0 + next_texture_unit);
+            gl.bindTexture(gl.TEXTURE_2D_ARRAY, binding.Texture);
+            gl.uniform1i(index, next_texture_unit);
+            next_texture_unit++;
+          }
+        }
+      };
+
+      this.DispatchTiles(bind, dims[0], dims[1], 1, on_complete);
     };
     this.OcclusionBufferDestroy = function(buffer) {
     };
@@ -591,6 +834,74 @@ function wrays_flag(x) {
 
       return shape_id;
     };
+    // Geometry filled in place in the WASM heap, to be handed to AddGeometry
+    // without the copy of AddShape
+    this.AllocGeometry = function(vertex_count, face_count, has_normals, has_uvs) {
+      return wrays_alloc_geometry(vertex_count, face_count, has_normals === true, has_uvs === true);
+    };
+    this.FreeGeometry = function(geometry) {
+      if (geometry.ptr !== 0)
+        wrays_free(geometry.ptr);
+      geometry.ptr = 0;
+    };
+    // Takes ownership of geometry, which is freed once the shape has been
+    // added whether or not that succeeded
+    this.AddGeometry = function(ads, geometry) {
+      if ( geometry === null || geometry.ptr === 0 )
+      {
+        throw new WebRaysException("Geometry should be allocated with AllocGeometry");
+      }
+
+      const shape_id_ptr = wrays_alloc_int();
+      const error = WebRaysModule['_wrays_add_shape'](this.Context, ads, geometry.vertices_ptr, 3, geometry.normals_ptr, 3, geometry.uvs_ptr, 2, geometry.vertex_count, geometry.faces_ptr, geometry.face_count, shape_id_ptr);
+      const shape_id = wrays_create_int(shape_id_ptr);
+      wrays_free(shape_id_ptr);
+      this.FreeGeometry(geometry);
+
+      if(error !== 0)
+      {
+        const error_msg = wrays_create_string(error, 256);
+        throw new WebRaysException("Error in adding a shape: " + error_msg);
+      }
+
+      return shape_id;
+    };
+    this.AddSpheres = function(ads, spheres, sphere_stride, user_data) {
+      if ( spheres === null )
+      {
+        throw new WebRaysException("Sphere buffer should not be null");
+      }
+
+      sphere_stride = (sphere_stride === 0) ? 4 : sphere_stride;
+
+      const sphere_count = spheres.length / sphere_stride;
+
+      const spheres_ptr   = ( sphere_count > 0 ) ? wrays_array_to_heap(spheres) : 0;
+      const user_data_ptr = ( null != user_data && user_data.length > 0 ) ? wrays_array_to_heap(user_data) : 0;
+      const shape_id_ptr  = wrays_alloc_int();
+      const error = WebRaysModule['_wrays_add_spheres'](this.Context, ads, spheres_ptr, sphere_stride, user_data_ptr, sphere_count, shape_id_ptr);
+      const shape_id = wrays_create_int(shape_id_ptr);
+      wrays_free(shape_id_ptr);
+
+      if ( 0 != spheres_ptr)   wrays_free(spheres_ptr);
+      if ( 0 != user_data_ptr) wrays_free(user_data_ptr);
+
+      if(error !== 0)
+      {
+        const error_msg = wrays_create_string(error, 256);
+        throw new WebRaysException("Error in adding spheres: " + error_msg);
+      }
+
+      return shape_id;
+    };
+    this.FinishStreaming = function(ads) {
+      const error = WebRaysModule['_wrays_finish_streaming'](this.Context, ads);
+      if(error !== 0)
+      {
+        const error_msg = wrays_create_string(error, 256);
+        throw new WebRaysException("Error in finishing streaming: " + error_msg);
+      }
+    };
     this.AddInstance = function(tlas, blas, transform) {
       if(Array.isArray(transform))
             transform = new Float32Array(transform);
@@ -645,4 +956,143 @@ function wrays_flag(x) {
 
       return instance_id;
     };
+    this.GetAdsStats = function(ads) {
+      // wr_ads_stats: 6 x wr_size, 3 x int, 3 x float
+      const stats_ptr = wrays_alloc_ints(12);
+
+      const error = WebRaysModule['_wrays_ads_get_stats'](this.Context, ads, stats_ptr);
+      if(error !== 0)
+      {
+        wrays_free(stats_ptr);
+        const error_msg = wrays_create_string(error, 256);
+        throw new WebRaysException("Error in querying ADS statistics: " + error_msg);
+      }
+
+      const uints = new Uint32Array(WebRaysModule.HEAPU8.buffer, stats_ptr, 6);
+      const ints = new Int32Array(WebRaysModule.HEAPU8.buffer, stats_ptr + 24, 3);
+      const floats = new Float32Array(WebRaysModule.HEAPU8.buffer, stats_ptr + 36, 3);
+      const stats = {
+        vertex_bytes: uints[0],
+        normal_bytes: uints[1],
+        triangle_bytes: uints[2],
+        node_bytes: uints[3],
+        gpu_bytes: uints[4],
+        gpu_padding_bytes: uints[5],
+        node_count: ints[0],
+        leaf_count: ints[1],
+        max_depth: ints[2],
+        average_leaf_size: floats[0],
+        sah_cost: floats[1],
+        build_time: floats[2]
+      };
+      wrays_free(stats_ptr);
+
+      return stats;
+    };
+
+    this.SetTraversalStats = function(enable) {
+      const error = WebRaysModule['_wrays_set_traversal_stats'](this.Context, enable ? 1 : 0);
+      if(error !== 0)
+      {
+        const error_msg = wrays_create_string(error, 256);
+        throw new WebRaysException("Error in setting traversal statistics: " + error_msg);
+      }
+    };
+
+    this.SetOcclusionFormat = function(format) {
+      const error = WebRaysModule['_wrays_set_occlusion_format'](this.Context, format);
+      if(error !== 0)
+      {
+        const error_msg = wrays_create_string(error, 256);
+        throw new WebRaysException("Error in setting the occlusion format: " + error_msg);
+      }
+      this.OcclusionFormat = format;
+    };
+
+    this.SetQueryTiling = function(tile_width, tile_height, tiles_per_frame) {
+      const error = WebRaysModule['_wrays_set_query_tiling'](this.Context, tile_width, tile_height);
+      if(error !== 0)
+      {
+        const error_msg = wrays_create_string(error, 256);
+        throw new WebRaysException("Error in setting the query tiling: " + error_msg);
+      }
+      this.TileWidth = tile_width;
+      this.TileHeight = tile_height;
+      this.TilesPerFrame = tiles_per_frame || 0;
+    };
+
+    this.SetRaySorting = function(enable) {
+      const error = WebRaysModule['_wrays_set_ray_sorting'](this.Context, enable ? 1 : 0);
+      if(error !== 0)
+      {
+        const error_msg = wrays_create_string(error, 256);
+        throw new WebRaysException("Error in setting the ray sorting: " + error_msg);
+      }
+    };
+
+    this.SetIntersectionFormat = function(format) {
+      const error = WebRaysModule['_wrays_set_intersection_format'](this.Context, format);
+      if(error !== 0)
+      {
+        const error_msg = wrays_create_string(error, 256);
+        throw new WebRaysException("Error in setting the intersection format: " + error_msg);
+      }
+    };
+
+    this.ResetTraversalStats = function() {
+      WebRaysModule['_wrays_reset_traversal_stats'](this.Context);
+    };
+
+    this.GetTraversalStats = function() {
+      // wr_traversal_stats: 4 x u64, 16 x u64 histogram, 3 x int (+ padding)
+      const stats_ptr = wrays_alloc_ints(44);
+
+      const error = WebRaysModule['_wrays_get_traversal_stats'](this.Context, stats_ptr);
+      if(error !== 0)
+      {
+        wrays_free(stats_ptr);
+        const error_msg = wrays_create_string(error, 256);
+        throw new WebRaysException("Error in querying traversal statistics: " + error_msg);
+      }
+
+      const uints = new Uint32Array(WebRaysModule.HEAPU8.buffer, stats_ptr, 40);
+      const ints = new Int32Array(WebRaysModule.HEAPU8.buffer, stats_ptr + 160, 3);
+      const u64 = function(index) { return uints[2 * index] + uints[2 * index + 1] * 4294967296; };
+      const histogram = [];
+      for (let i = 0; i < 16; ++i)
+        histogram.push(u64(4 + i));
+      const stats = {
+        ray_count: u64(0),
+        nodes_visited: u64(1),
+        triangles_tested: u64(2),
+        terminated_rays: u64(3),
+        nodes_histogram: histogram,
+        max_nodes_visited: ints[0],
+        max_triangles_tested: ints[1],
+        max_stack_depth: ints[2]
+      };
+      wrays_free(stats_ptr);
+
+      return stats;
+    };
+
+    this.ProfileDump = function() {
+      // The trace goes through the in-memory file system and is returned as
+      // a Chrome trace-event JSON string
+      const path = '/webrays_trace.json';
+      const path_ptr = wrays_string_to_heap(path);
+
+      const error = WebRaysModule['_wrays_profile_dump'](this.Context, path_ptr);
+      wrays_free(path_ptr);
+      if(error !== 0)
+      {
+        const error_msg = wrays_create_string(error, 256);
+        throw new WebRaysException("Error in dumping the profile: " + error_msg);
+      }
+
+      const trace = WebRaysModule.FS.readFile(path, { encoding: 'utf8' });
+      WebRaysModule.FS.unlink(path);
+
+      return trace;
+    };
   }
@@ -0,0 +1,155 @@
+/* Copyright 2021 Phasmatic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "webrays_profile.h"
+
+#if WRAYS_PROFILE
+
+#include <cstdio>
+
+static thread_local wr_profiler* wr_current_profiler = nullptr;
+
+wr_profiler*
+wr_profiler_get(wr_context* webrays)
+{
+  if (WR_NULL == webrays->profiler) {
+    wr_profiler* profiler = new wr_profiler;
+    profiler->epoch       = std::chrono::steady_clock::now();
+    webrays->profiler     = profiler;
+  }
+
+  return (wr_profiler*)webrays->profiler;
+}
+
+void
+wr_profiler_destroy(wr_context* webrays)
+{
+  delete (wr_profiler*)webrays->profiler;
+  webrays->profiler = WR_NULL;
+}
+
+wr_profiler*
+wr_profiler_current()
+{
+  return wr_current_profiler;
+}
+
+double
+wr_profiler_now(wr_profiler* profiler)
+{
+  return std::chrono::duration<double, std::micro>(
+           std::chrono::steady_clock::now() - profiler->epoch)
+    .count();
+}
+
+wr_profile_bind::wr_profile_bind(wr_context* webrays)
+  : m_previous(wr_current_profiler)
+{
+  wr_current_profiler = wr_profiler_get(webrays);
+  m_open              = wr_current_profiler->open.size();
+}
+
+wr_profile_bind::~wr_profile_bind()
+{
+  while (wr_current_profiler->open.size() > m_open)
+    wr_profile_end();
+  wr_current_profiler = m_previous;
+}
+
+void
+wr_profile_begin(const char* name)
+{
+  wr_profiler* profiler = wr_current_profiler;
+  if (nullptr == profiler)
+    return;
+
+  // Keep the open stack balanced even when the event itself is dropped
+  int index = -1;
+  if (profiler->events.size() < WR_PROFILE_MAX_EVENTS) {
+    index = (int)profiler->events.size();
+    profiler->events.push_back(
+      { name, WR_PROFILE_TRACK_CPU, wr_profiler_now(profiler), -1.0, 0 });
+  }
+  profiler->open.push_back(index);
+}
+
+void
+wr_profile_end()
+{
+  wr_profiler* profiler = wr_current_profiler;
+  if (nullptr == profiler || profiler->open.empty())
+    return;
+
+  const int index = profiler->open.back();
+  profiler->open.pop_back();
+  if (index < 0)
+    return;
+
+  wr_profile_event& event = profiler->events[index];
+  event.duration          = wr_profiler_now(profiler) - event.begin;
+}
+
+int
+wr_profile_gpu_event(const char* name, unsigned int query)
+{
+  wr_profiler* profiler = wr_current_profiler;
+  if (nullptr == profiler || profiler->events.size() >= WR_PROFILE_MAX_EVENTS)
+    return -1;
+
+  const int index = (int)profiler->events.size();
+  profiler->events.push_back(
+    { name, WR_PROFILE_TRACK_GPU, wr_profiler_now(profiler), -1.0, query });
+
+  return index;
+}
+
+#define WR_PROFILE_WRITE_FAILED ((wr_error) "Unable to open the profile output")
+wr_error
+wr_profile_write(wr_profiler* profiler, const char* path)
+{
+  FILE* file = fopen(path, "w");
+  if (WR_NULL == file)
+    return WR_PROFILE_WRITE_FAILED;
+
+  fprintf(file, "{\"traceEvents\":[\n");
+  fprintf(file,
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"name\":\"CPU\"}},\n",
+          WR_PROFILE_TRACK_CPU);
+  fprintf(file,
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"name\":\"GPU\"}}",
+          WR_PROFILE_TRACK_GPU);
+
+  // Zones still open or GPU zones without a result are left out
+  for (const wr_profile_event& event : profiler->events) {
+    if (event.duration < 0.0)
+      continue;
+    fprintf(file,
+            ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":1,\"tid\":%d}",
+            event.name, event.begin, event.duration, event.track);
+  }
+  fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  fclose(file);
+
+  // Open zones refer to their index, so only forget closed events
+  if (profiler->open.empty())
+    profiler->events.clear();
+
+  return WR_SUCCESS;
+}
+
+#endif /* WRAYS_PROFILE */
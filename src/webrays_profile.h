@@ -0,0 +1,121 @@
+/* Copyright 2021 Phasmatic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WRAYS_PROFILE_H_
+#define _WRAYS_PROFILE_H_
+
+/* Scoped timing zones, written out by wrays_profile_dump as Chrome trace-event
+ * JSON (chrome://tracing, ui.perfetto.dev). Everything here compiles to
+ * nothing unless the library is built with WRAYS_PROFILE (ENABLE_PROFILING in
+ * CMake).
+ *
+ * Public entry points bind the context's profiler to the calling thread with
+ * WR_PROFILE_BIND, so code without access to the context (ADS builds, shader
+ * compilation) can still open zones with WR_PROFILE_ZONE. Zones opened while
+ * no profiler is bound are ignored, and zones left open by an early return are
+ * closed when the binding public call returns.
+ */
+
+#include "webrays_context.h"
+
+#if WRAYS_PROFILE
+
+#include <chrono>
+#include <vector>
+
+#define WR_PROFILE_TRACK_CPU 1
+#define WR_PROFILE_TRACK_GPU 2
+
+// Events past this are dropped until the next wrays_profile_dump
+#define WR_PROFILE_MAX_EVENTS (1 << 20)
+
+typedef struct
+{
+  const char*  name;  // must outlive the profiler, string literals only
+  int          track; // WR_PROFILE_TRACK_*
+  double       begin;     // microseconds since the profiler was created
+  double       duration;  // microseconds, -1 while open or unresolved
+  unsigned int gpu_query; // GPU zones, timer query holding the duration
+} wr_profile_event;
+
+struct wr_profiler
+{
+  std::chrono::steady_clock::time_point epoch;
+  std::vector<wr_profile_event>         events;
+  std::vector<int>                      open; // indices of open CPU zones
+};
+
+wr_profiler*
+wr_profiler_get(wr_context* webrays);
+void
+wr_profiler_destroy(wr_context* webrays);
+wr_profiler*
+wr_profiler_current();
+double
+wr_profiler_now(wr_profiler* profiler);
+
+// Explicit zones, must nest properly. Prefer WR_PROFILE_ZONE
+void
+wr_profile_begin(const char* name);
+void
+wr_profile_end();
+
+// Records a GPU zone starting now whose duration is resolved later from the
+// given timer query. Returns the event index, -1 if dropped
+int
+wr_profile_gpu_event(const char* name, unsigned int query);
+
+// Writes and clears the recorded events
+wr_error
+wr_profile_write(wr_profiler* profiler, const char* path);
+
+class wr_profile_bind
+{
+public:
+  wr_profile_bind(wr_context* webrays);
+  ~wr_profile_bind();
+
+private:
+  wr_profiler* m_previous;
+  size_t       m_open; // open zones of the enclosing binding
+};
+
+class wr_profile_zone
+{
+public:
+  wr_profile_zone(const char* name) { wr_profile_begin(name); }
+  ~wr_profile_zone() { wr_profile_end(); }
+};
+
+#define WR_PROFILE_CONCAT_(a, b) a##b
+#define WR_PROFILE_CONCAT(a, b) WR_PROFILE_CONCAT_(a, b)
+
+#define WR_PROFILE_BIND(webrays)                                               \
+  wr_profile_bind WR_PROFILE_CONCAT(wr_profile_bind_, __LINE__)(webrays)
+#define WR_PROFILE_ZONE(name)                                                  \
+  wr_profile_zone WR_PROFILE_CONCAT(wr_profile_zone_, __LINE__)(name)
+#define WR_PROFILE_BEGIN(name) wr_profile_begin(name)
+#define WR_PROFILE_END() wr_profile_end()
+
+#else
+
+#define WR_PROFILE_BIND(webrays)
+#define WR_PROFILE_ZONE(name)
+#define WR_PROFILE_BEGIN(name)
+#define WR_PROFILE_END()
+
+#endif /* WRAYS_PROFILE */
+
+#endif /* _WRAYS_PROFILE_H_ */
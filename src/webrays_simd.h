@@ -0,0 +1,328 @@
+/* Copyright 2021 Phasmatic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WRAYS_SIMD_H_
+#define _WRAYS_SIMD_H_
+
+/* 4-wide float and int vectors for the BLAS builders and the host-side
+ * traversal. With WRAYS_SIMD (ENABLE_SIMD in CMake) they map to WebAssembly
+ * SIMD128 when compiling with -msimd128 and to SSE2 on x86 native builds,
+ * otherwise to plain arrays that the compiler may or may not vectorize.
+ *
+ * WR_SIMD is set when the vectors map to SIMD registers, for code whose 4-wide
+ * form only pays off then.
+ *
+ * wr_f4_min and wr_f4_max follow wrays_minf and wrays_maxf exactly, NaN and
+ * signed zero included, so that all three paths build the same hierarchies
+ * and report the same hits.
+ */
+
+#include <cstdint>
+#include <cstring>
+
+#if WRAYS_SIMD && defined(__wasm_simd128__)
+#define WR_SIMD_WASM 1
+#define WR_SIMD 1
+#include <wasm_simd128.h>
+#elif WRAYS_SIMD && (defined(__SSE2__) || defined(_M_X64))
+#define WR_SIMD_SSE 1
+#define WR_SIMD 1
+#include <emmintrin.h>
+#endif
+
+#if WR_SIMD_WASM
+
+typedef v128_t wr_float4;
+typedef v128_t wr_int4;
+
+static inline wr_float4
+wr_f4_set(float x, float y, float z, float w)
+{
+  return wasm_f32x4_make(x, y, z, w);
+}
+
+static inline wr_float4
+wr_f4_splat(float s)
+{
+  return wasm_f32x4_splat(s);
+}
+
+static inline wr_float4
+wr_f4_add(wr_float4 a, wr_float4 b)
+{
+  return wasm_f32x4_add(a, b);
+}
+
+static inline wr_float4
+wr_f4_sub(wr_float4 a, wr_float4 b)
+{
+  return wasm_f32x4_sub(a, b);
+}
+
+static inline wr_float4
+wr_f4_mul(wr_float4 a, wr_float4 b)
+{
+  return wasm_f32x4_mul(a, b);
+}
+
+// a < b ? a : b
+static inline wr_float4
+wr_f4_min(wr_float4 a, wr_float4 b)
+{
+  return wasm_f32x4_pmin(b, a);
+}
+
+// a > b ? a : b
+static inline wr_float4
+wr_f4_max(wr_float4 a, wr_float4 b)
+{
+  return wasm_f32x4_pmax(b, a);
+}
+
+// Lanes of the 4 bytes of packed, lowest first
+static inline wr_float4
+wr_f4_from_bytes(uint32_t packed)
+{
+  const v128_t bytes = wasm_u32x4_make(packed, 0, 0, 0);
+  return wasm_f32x4_convert_u32x4(
+    wasm_u32x4_extend_low_u16x8(wasm_u16x8_extend_low_u8x16(bytes)));
+}
+
+static inline void
+wr_f4_store(float* p, wr_float4 v)
+{
+  wasm_v128_store(p, v);
+}
+
+static inline wr_int4
+wr_i4_load(const int* p)
+{
+  return wasm_v128_load(p);
+}
+
+static inline wr_int4
+wr_i4_set(int x, int y, int z, int w)
+{
+  return wasm_i32x4_make(x, y, z, w);
+}
+
+static inline wr_int4
+wr_i4_add(wr_int4 a, wr_int4 b)
+{
+  return wasm_i32x4_add(a, b);
+}
+
+static inline void
+wr_i4_store(int* p, wr_int4 v)
+{
+  wasm_v128_store(p, v);
+}
+
+#elif WR_SIMD_SSE
+
+typedef __m128  wr_float4;
+typedef __m128i wr_int4;
+
+static inline wr_float4
+wr_f4_set(float x, float y, float z, float w)
+{
+  return _mm_setr_ps(x, y, z, w);
+}
+
+static inline wr_float4
+wr_f4_splat(float s)
+{
+  return _mm_set1_ps(s);
+}
+
+static inline wr_float4
+wr_f4_add(wr_float4 a, wr_float4 b)
+{
+  return _mm_add_ps(a, b);
+}
+
+static inline wr_float4
+wr_f4_sub(wr_float4 a, wr_float4 b)
+{
+  return _mm_sub_ps(a, b);
+}
+
+static inline wr_float4
+wr_f4_mul(wr_float4 a, wr_float4 b)
+{
+  return _mm_mul_ps(a, b);
+}
+
+static inline wr_float4
+wr_f4_min(wr_float4 a, wr_float4 b)
+{
+  return _mm_min_ps(a, b);
+}
+
+static inline wr_float4
+wr_f4_max(wr_float4 a, wr_float4 b)
+{
+  return _mm_max_ps(a, b);
+}
+
+static inline wr_float4
+wr_f4_from_bytes(uint32_t packed)
+{
+  const __m128i zero  = _mm_setzero_si128();
+  const __m128i bytes = _mm_cvtsi32_si128((int)packed);
+  return _mm_cvtepi32_ps(
+    _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+}
+
+static inline void
+wr_f4_store(float* p, wr_float4 v)
+{
+  _mm_storeu_ps(p, v);
+}
+
+static inline wr_int4
+wr_i4_load(const int* p)
+{
+  return _mm_loadu_si128((const __m128i*)p);
+}
+
+static inline wr_int4
+wr_i4_set(int x, int y, int z, int w)
+{
+  return _mm_setr_epi32(x, y, z, w);
+}
+
+static inline wr_int4
+wr_i4_add(wr_int4 a, wr_int4 b)
+{
+  return _mm_add_epi32(a, b);
+}
+
+static inline void
+wr_i4_store(int* p, wr_int4 v)
+{
+  _mm_storeu_si128((__m128i*)p, v);
+}
+
+#else
+
+typedef struct
+{
+  float v[4];
+} wr_float4;
+
+typedef struct
+{
+  int v[4];
+} wr_int4;
+
+static inline wr_float4
+wr_f4_set(float x, float y, float z, float w)
+{
+  return { { x, y, z, w } };
+}
+
+static inline wr_float4
+wr_f4_splat(float s)
+{
+  return { { s, s, s, s } };
+}
+
+static inline wr_float4
+wr_f4_add(wr_float4 a, wr_float4 b)
+{
+  for (int i = 0; i < 4; ++i)
+    a.v[i] += b.v[i];
+  return a;
+}
+
+static inline wr_float4
+wr_f4_sub(wr_float4 a, wr_float4 b)
+{
+  for (int i = 0; i < 4; ++i)
+    a.v[i] -= b.v[i];
+  return a;
+}
+
+static inline wr_float4
+wr_f4_mul(wr_float4 a, wr_float4 b)
+{
+  for (int i = 0; i < 4; ++i)
+    a.v[i] *= b.v[i];
+  return a;
+}
+
+static inline wr_float4
+wr_f4_min(wr_float4 a, wr_float4 b)
+{
+  for (int i = 0; i < 4; ++i)
+    a.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+  return a;
+}
+
+static inline wr_float4
+wr_f4_max(wr_float4 a, wr_float4 b)
+{
+  for (int i = 0; i < 4; ++i)
+    a.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+  return a;
+}
+
+static inline wr_float4
+wr_f4_from_bytes(uint32_t packed)
+{
+  wr_float4 r;
+  for (int i = 0; i < 4; ++i)
+    r.v[i] = (float)((packed >> (8 * i)) & 0xFF);
+  return r;
+}
+
+static inline void
+wr_f4_store(float* p, wr_float4 v)
+{
+  std::memcpy(p, v.v, sizeof(v.v));
+}
+
+static inline wr_int4
+wr_i4_load(const int* p)
+{
+  wr_int4 r;
+  std::memcpy(r.v, p, sizeof(r.v));
+  return r;
+}
+
+static inline wr_int4
+wr_i4_set(int x, int y, int z, int w)
+{
+  return { { x, y, z, w } };
+}
+
+static inline wr_int4
+wr_i4_add(wr_int4 a, wr_int4 b)
+{
+  for (int i = 0; i < 4; ++i)
+    a.v[i] += b.v[i];
+  return a;
+}
+
+static inline void
+wr_i4_store(int* p, wr_int4 v)
+{
+  std::memcpy(p, v.v, sizeof(v.v));
+}
+
+#endif
+
+#endif /* _WRAYS_SIMD_H_ */
@@ -16,6 +16,10 @@
 #ifndef _WRAYS_TOP_LEVEL_ACCELERATION_DATA_STRUCTURE_H_
 #define _WRAYS_TOP_LEVEL_ACCELERATION_DATA_STRUCTURE_H_
 
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 struct Instance
@@ -27,11 +31,33 @@ struct Instance
   int   pad2;
 };
 
+// Shapes added to the TLAS itself, see the "deduplicate" ADS option
+typedef enum
+{
+  WR_DEDUP_OFF,
+  WR_DEDUP_EXACT,       // identical buffers
+  WR_DEDUP_TRANSLATION, // identical up to a translation
+} wr_dedup_mode;
+
+// A mesh stored once in a BLAS of its own. The vertices are compared with
+// those of the BLAS, the faces are kept here since the builders reorder them
+struct wr_unique_mesh
+{
+  int              blas;
+  std::vector<int> faces;
+};
+
 class TLAS
 {
 public:
   std::vector<Instance> m_instances;
 
+  wr_dedup_mode m_dedup = WR_DEDUP_OFF;
+  std::unordered_multimap<uint64_t, wr_unique_mesh>
+    m_unique_meshes; // by the hash of their faces, normals and uvs
+  // The BLAS options given to the TLAS, passed on to the unique meshes
+  std::vector<std::pair<std::string, std::string>> m_blas_options;
+
 protected:
 };
 
@@ -0,0 +1,239 @@
+/* Copyright 2021 Phasmatic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* webrays_async_test
+ * Checks wrays_update_async of an ENABLE_THREADS Emscripten build under
+ * Node, where the pthreads of the library are worker_threads sharing the
+ * WASM memory. The test itself runs on a worker thread, like a page that
+ * keeps WebRays off its main thread. A large BLAS is built asynchronously on
+ * the CPU backend while the event loop keeps polling wrays_update_ready,
+ * which must report the build as still running at least once, and the
+ * hits of the result must match those of a BLAS built by wrays_update.
+ *
+ * Usage: node webrays_async_test.mjs path/to/webrays.js
+ */
+
+import { Worker, isMainThread, parentPort, workerData } from 'node:worker_threads';
+import { pathToFileURL } from 'node:url';
+
+const BACKEND_TYPE_CPU = 5;
+const RAY_COUNT = 4096;
+const GRID = 300; // 2 x 300 x 300 triangles
+
+function check(condition, what) {
+  if (!condition)
+    throw new Error(what);
+}
+
+/* Helpers over the raw C API, the views are recreated on every access
+ * since growing the heap replaces its buffer */
+function heap_ints(m, ptr, count) {
+  return new Int32Array(m.HEAPU8.buffer, ptr, count);
+}
+function heap_floats(m, ptr, count) {
+  return new Float32Array(m.HEAPU8.buffer, ptr, count);
+}
+function heap_copy(m, typed_array) {
+  const ptr = m._malloc(typed_array.byteLength);
+  new Uint8Array(m.HEAPU8.buffer, ptr, typed_array.byteLength).set(new Uint8Array(typed_array.buffer));
+  return ptr;
+}
+function heap_string(m, str) {
+  const size = m.lengthBytesUTF8(str) + 1;
+  const ptr = m._malloc(size);
+  m.stringToUTF8(str, ptr, size);
+  return ptr;
+}
+function check_error(m, error, what) {
+  if (error !== 0)
+    throw new Error(what + ": " + m.UTF8ToString(error, 256));
+}
+
+/* A wavy height field over the unit square */
+function create_scene() {
+  const positions = new Float32Array(3 * (GRID + 1) * (GRID + 1));
+  for (let y = 0; y <= GRID; ++y) {
+    for (let x = 0; x <= GRID; ++x) {
+      const v = y * (GRID + 1) + x;
+      positions[3 * v + 0] = x / GRID;
+      positions[3 * v + 1] = y / GRID;
+      positions[3 * v + 2] = 0.2 * Math.sin(0.3 * x) * Math.cos(0.2 * y);
+    }
+  }
+  const faces = new Int32Array(8 * GRID * GRID);
+  let f = 0;
+  for (let y = 0; y < GRID; ++y) {
+    for (let x = 0; x < GRID; ++x) {
+      const v0 = y * (GRID + 1) + x;
+      faces.set([ v0, v0 + 1, v0 + GRID + 2, f / 4 ], f); f += 4;
+      faces.set([ v0, v0 + GRID + 2, v0 + GRID + 1, f / 4 ], f); f += 4;
+    }
+  }
+  return { positions: positions, faces: faces };
+}
+
+/* Rays from above the height field pointing down, (origin, t_min) and
+ * (direction, t_max) */
+function create_rays() {
+  const origins = new Float32Array(4 * RAY_COUNT);
+  const directions = new Float32Array(4 * RAY_COUNT);
+  let seed = 7;
+  const uniform = () => {
+    seed = (Math.imul(seed, 1664525) + 1013904223) >>> 0;
+    return seed / 4294967296;
+  };
+  for (let i = 0; i < RAY_COUNT; ++i) {
+    origins.set([ uniform(), uniform(), 1.0, 0.0 ], 4 * i);
+    const dx = 0.4 * uniform() - 0.2, dy = 0.4 * uniform() - 0.2;
+    const length = Math.sqrt(dx * dx + dy * dy + 1.0);
+    directions.set([ dx / length, dy / length, -1.0 / length, 100.0 ], 4 * i);
+  }
+  return { origins: origins, directions: directions };
+}
+
+/* A CPU context with the scene in a single BLAS, the update is left to the
+ * caller */
+function create_context(m, scene) {
+  const context = m._wrays_init(BACKEND_TYPE_CPU, 0);
+  check(context !== 0, "wrays_init failed");
+
+  const options = new Uint32Array([ heap_string(m, "type"), heap_string(m, "BLAS") ]);
+  const options_ptr = heap_copy(m, options);
+  const ads_ptr = m._malloc(4);
+  check_error(m, m._wrays_create_ads(context, ads_ptr, options_ptr, 1), "wrays_create_ads");
+  const ads = heap_ints(m, ads_ptr, 1)[0];
+  m._free(ads_ptr);
+  m._free(options_ptr);
+  m._free(options[0]);
+  m._free(options[1]);
+
+  const positions_ptr = heap_copy(m, scene.positions);
+  const faces_ptr = heap_copy(m, scene.faces);
+  const shape_ptr = m._malloc(4);
+  check_error(m, m._wrays_add_shape(context, ads, positions_ptr, 3, 0, 0, 0, 0,
+                                    scene.positions.length / 3, faces_ptr,
+                                    scene.faces.length / 4, shape_ptr),
+              "wrays_add_shape");
+  m._free(shape_ptr);
+  // The shape stays referenced by the BLAS until the context is destroyed
+  return { context: context, ads: ads, buffers: [ positions_ptr, faces_ptr ] };
+}
+
+function destroy_context(m, ctx) {
+  m._wrays_destroy(ctx.context);
+  for (const ptr of ctx.buffers)
+    m._free(ptr);
+}
+
+function update(m, ctx) {
+  const flags_ptr = m._malloc(4);
+  check_error(m, m._wrays_update(ctx.context, flags_ptr), "wrays_update");
+  m._free(flags_ptr);
+}
+
+/* Resolves with the number of polls once wrays_update_ready reports the
+ * builds started by wrays_update_async as done */
+function wait_ready(m, ctx) {
+  return new Promise((resolve, reject) => {
+    let polls = 0;
+    const poll = () => {
+      const ready_ptr = m._malloc(4);
+      const error = m._wrays_update_ready(ctx.context, ready_ptr);
+      const ready = heap_ints(m, ready_ptr, 1)[0];
+      m._free(ready_ptr);
+      ++polls;
+      if (error !== 0)
+        reject(new Error("wrays_update_ready: " + m.UTF8ToString(error, 256)));
+      else if (ready === 0)
+        setTimeout(poll, 1);
+      else
+        resolve(polls);
+    };
+    poll();
+  });
+}
+
+/* Primitive and distance of every ray, 4 ints per ray */
+function query(m, ctx, rays) {
+  const origins_ptr = heap_copy(m, rays.origins);
+  const directions_ptr = heap_copy(m, rays.directions);
+  const ray_buffers_ptr = heap_copy(m, new Uint32Array([ origins_ptr, directions_ptr ]));
+  const dimensions_ptr = heap_copy(m, new Uint32Array([ RAY_COUNT ]));
+  const intersections_ptr = m._malloc(16 * RAY_COUNT);
+  check_error(m, m._wrays_query_intersection(ctx.context, ctx.ads, ray_buffers_ptr, 2,
+                                             intersections_ptr, dimensions_ptr, 1),
+              "wrays_query_intersection");
+  const intersections = heap_ints(m, intersections_ptr, 4 * RAY_COUNT).slice();
+  for (const ptr of [ origins_ptr, directions_ptr, ray_buffers_ptr, dimensions_ptr, intersections_ptr ])
+    m._free(ptr);
+  return intersections;
+}
+
+async function run(module_path) {
+  const { default: createWebRaysModule } = await import(pathToFileURL(module_path).href);
+  const m = await createWebRaysModule();
+  check(m.HEAPU8.buffer instanceof SharedArrayBuffer,
+        "the module was not built with ENABLE_THREADS");
+
+  const scene = create_scene();
+  const rays = create_rays();
+
+  const reference = create_context(m, scene);
+  update(m, reference);
+  const expected = query(m, reference, rays);
+  destroy_context(m, reference);
+
+  const ctx = create_context(m, scene);
+  check_error(m, m._wrays_update_async(ctx.context), "wrays_update_async");
+  const polls = await wait_ready(m, ctx);
+  update(m, ctx);
+  const intersections = query(m, ctx, rays);
+  destroy_context(m, ctx);
+
+  let hits = 0, mismatches = 0;
+  for (let i = 0; i < 4 * RAY_COUNT; i += 4) {
+    hits += (expected[i] !== -1) ? 1 : 0;
+    for (let c = 0; c < 4; ++c)
+      mismatches += (expected[i + c] !== intersections[i + c]) ? 1 : 0;
+  }
+  console.log("webrays_async_test: ready after " + polls + " polls, " + hits +
+              " of " + RAY_COUNT + " rays hit, " + mismatches + " mismatches");
+  check(polls > 1, "wrays_update_async built on the calling thread");
+  check(hits > 0, "no hits");
+  check(mismatches === 0, "asynchronous build hits differ");
+}
+
+if (isMainThread) {
+  if (process.argv.length < 3) {
+    console.error("Usage: node webrays_async_test.mjs path/to/webrays.js");
+    process.exit(1);
+  }
+  const worker = new Worker(new URL(import.meta.url), { workerData: process.argv[2] });
+  worker.on('message', (message) => {
+    if (message !== true) {
+      console.error("webrays_async_test: " + message);
+      process.exitCode = 1;
+    }
+    // The pthread pool keeps the worker alive
+    worker.terminate();
+  });
+  worker.on('error', (e) => {
+    console.error("webrays_async_test: " + e.message);
+    process.exitCode = 1;
+  });
+} else {
+  run(workerData).then(() => parentPort.postMessage(true),
+                       (e) => parentPort.postMessage(e.message));
+}
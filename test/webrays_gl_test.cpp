@@ -0,0 +1,1369 @@
+/* Copyright 2021 Phasmatic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* webrays_gl_test
+ * Regression tests of the GLES backend. Each test builds a small procedural
+ * scene, traces it on the GLES backend and compares the results against the
+ * CPU backend, or against another GLES configuration that must agree with
+ * it. The context is created on ANGLE's SwiftShader device when available
+ * and on Mesa's surfaceless platform (llvmpipe without a window system) or
+ * the default EGL display otherwise. Tests exit with 77, which CTest
+ * reports as skipped, when no OpenGL ES 3 context can be created.
+ *
+ * Usage: webrays_gl_test [test]
+ */
+
+/* Embeded GL */
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <EGL/eglext_angle.h>
+#include <EGL/eglplatform.h>
+
+/* Embeded GL Version 3 */
+#define GL_GLEXT_PROTOTYPES
+#include <GLES3/gl3.h>
+
+#include <webrays/webrays.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#define TEST_SKIPPED 77
+#define TEST_WIDTH 150
+#define TEST_HEIGHT 90
+
+typedef struct
+{
+  EGLDisplay display;
+  EGLContext context;
+  EGLSurface surface;
+} test_gl;
+
+typedef struct
+{
+  std::vector<float> positions; // xyz
+  std::vector<int>   faces;     // v0, v1, v2, w
+} test_scene;
+
+typedef struct
+{
+  std::vector<float> origins;    // (origin, t_min)
+  std::vector<float> directions; // (direction, t_max)
+} test_rays;
+
+typedef struct
+{
+  GLuint origins;
+  GLuint directions;
+} test_gl_rays;
+
+typedef bool (*test_function)(const test_scene*);
+
+/* GLES context */
+
+static EGLDisplay
+test_gl_display()
+{
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+      "eglGetPlatformDisplayEXT");
+  const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (get_platform_display && extensions &&
+      strstr(extensions, "EGL_ANGLE_platform_angle")) {
+    EGLint display_attributes[] = {
+      EGL_PLATFORM_ANGLE_TYPE_ANGLE,
+      EGL_PLATFORM_ANGLE_TYPE_VULKAN_ANGLE,
+      EGL_PLATFORM_ANGLE_DEVICE_TYPE_ANGLE,
+      EGL_PLATFORM_ANGLE_DEVICE_TYPE_SWIFTSHADER_ANGLE,
+      EGL_NONE
+    };
+    return get_platform_display(EGL_PLATFORM_ANGLE_ANGLE, EGL_DEFAULT_DISPLAY,
+                                display_attributes);
+  }
+  if (get_platform_display && extensions &&
+      strstr(extensions, "EGL_MESA_platform_surfaceless"))
+    return get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                EGL_DEFAULT_DISPLAY, WR_NULL);
+  return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+static bool
+test_gl_init(test_gl* gl)
+{
+  gl->display = test_gl_display();
+  gl->context = EGL_NO_CONTEXT;
+  gl->surface = EGL_NO_SURFACE;
+  if (EGL_NO_DISPLAY == gl->display)
+    return false;
+
+  EGLint major, minor;
+  if (!eglInitialize(gl->display, &major, &minor) ||
+      !eglBindAPI(EGL_OPENGL_ES_API))
+    return false;
+
+  EGLint    config_attributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+                                 EGL_SURFACE_TYPE,    EGL_PBUFFER_BIT,
+                                 EGL_NONE };
+  EGLint    config_count        = 0;
+  EGLConfig config;
+  if (!eglChooseConfig(gl->display, config_attributes, &config, 1,
+                       &config_count) ||
+      0 == config_count)
+    return false;
+
+  EGLint surface_attributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+  gl->surface =
+    eglCreatePbufferSurface(gl->display, config, surface_attributes);
+  EGLint context_attributes[] = { EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE };
+  gl->context =
+    eglCreateContext(gl->display, config, EGL_NO_CONTEXT, context_attributes);
+  if (EGL_NO_SURFACE == gl->surface || EGL_NO_CONTEXT == gl->context)
+    return false;
+
+  return eglMakeCurrent(gl->display, gl->surface, gl->surface, gl->context);
+}
+
+static void
+test_gl_destroy(test_gl* gl)
+{
+  if (EGL_NO_DISPLAY == gl->display)
+    return;
+  eglMakeCurrent(gl->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  if (EGL_NO_CONTEXT != gl->context)
+    eglDestroyContext(gl->display, gl->context);
+  if (EGL_NO_SURFACE != gl->surface)
+    eglDestroySurface(gl->display, gl->surface);
+  eglTerminate(gl->display);
+}
+
+static GLuint
+test_gl_texture(const wr_buffer_info* info, GLenum format, GLenum type,
+                const void* data)
+{
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, info->data.as_texture_2d.internal_format,
+               info->data.as_texture_2d.width, info->data.as_texture_2d.height,
+               0, format, type, data);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  return texture;
+}
+
+/* Integer color buffers are always readable as RGBA_INTEGER. Returns the
+ * first components channels of every texel */
+static std::vector<int>
+test_gl_read(GLuint texture, int width, int height, int components)
+{
+  GLuint fbo;
+  glGenFramebuffers(1, &fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                         texture, 0);
+
+  std::vector<int> texels(4 * width * height);
+  glReadPixels(0, 0, width, height, GL_RGBA_INTEGER, GL_INT, texels.data());
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glDeleteFramebuffers(1, &fbo);
+
+  std::vector<int> values(components * width * height);
+  for (int i = 0; i < width * height; ++i)
+    for (int c = 0; c < components; ++c)
+      values[components * i + c] = texels[4 * i + c];
+  return values;
+}
+
+static GLuint
+test_gl_shader(GLenum type, const char* source)
+{
+  GLuint shader = glCreateShader(type);
+  glShaderSource(shader, 1, &source, WR_NULL);
+  glCompileShader(shader);
+
+  GLint compiled;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+  if (!compiled) {
+    char log[1024];
+    glGetShaderInfoLog(shader, sizeof(log), WR_NULL, log);
+    fprintf(stderr, "webrays_gl_test: %s\n", log);
+  }
+  return shader;
+}
+
+/* Draws fragment_source over a width x height R32I texture, the vertices
+ * come from gl_VertexID. Returns the first channel of every texel */
+static std::vector<int>
+test_gl_draw(const char* fragment_source, GLuint input, int width,
+             int height)
+{
+  const char* vertex_source =
+    "#version 300 es\n"
+    "void main() {\n"
+    "  vec2 uv = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+    "  gl_Position = vec4(uv * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\n";
+  GLuint vertex_shader   = test_gl_shader(GL_VERTEX_SHADER, vertex_source);
+  GLuint fragment_shader = test_gl_shader(GL_FRAGMENT_SHADER, fragment_source);
+  GLuint program         = glCreateProgram();
+  glAttachShader(program, vertex_shader);
+  glAttachShader(program, fragment_shader);
+  glLinkProgram(program);
+
+  wr_buffer_info info;
+  info.data.as_texture_2d.internal_format = GL_R32I;
+  info.data.as_texture_2d.width           = width;
+  info.data.as_texture_2d.height          = height;
+  GLuint target = test_gl_texture(&info, GL_RED_INTEGER, GL_INT, WR_NULL);
+
+  GLuint fbo, vao;
+  glGenFramebuffers(1, &fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                         target, 0);
+  glGenVertexArrays(1, &vao);
+  glBindVertexArray(vao);
+  glViewport(0, 0, width, height);
+  glUseProgram(program);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, input);
+  glUniform1i(glGetUniformLocation(program, "test_Input"), 0);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glUseProgram(0);
+  glBindVertexArray(0);
+  glDeleteVertexArrays(1, &vao);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glDeleteFramebuffers(1, &fbo);
+  glDeleteProgram(program);
+  glDeleteShader(vertex_shader);
+  glDeleteShader(fragment_shader);
+
+  std::vector<int> values = test_gl_read(target, width, height, 1);
+  glDeleteTextures(1, &target);
+  return values;
+}
+
+static test_gl_rays
+test_gl_rays_upload(wr_handle webrays, const test_rays* rays)
+{
+  wr_size        dimensions[] = { TEST_WIDTH, TEST_HEIGHT };
+  wr_buffer_info info;
+  wrays_ray_buffer_requirements(webrays, &info, dimensions, 2);
+
+  test_gl_rays gl_rays;
+  gl_rays.origins =
+    test_gl_texture(&info, GL_RGBA, GL_FLOAT, rays->origins.data());
+  gl_rays.directions =
+    test_gl_texture(&info, GL_RGBA, GL_FLOAT, rays->directions.data());
+  return gl_rays;
+}
+
+static void
+test_gl_rays_destroy(test_gl_rays* gl_rays)
+{
+  glDeleteTextures(1, &gl_rays->origins);
+  glDeleteTextures(1, &gl_rays->directions);
+}
+
+/* Scene */
+
+static void
+test_scene_add_vertex(test_scene* scene, float x, float y, float z)
+{
+  scene->positions.push_back(x);
+  scene->positions.push_back(y);
+  scene->positions.push_back(z);
+}
+
+static void
+test_scene_add_face(test_scene* scene, int v0, int v1, int v2)
+{
+  scene->faces.push_back(v0);
+  scene->faces.push_back(v1);
+  scene->faces.push_back(v2);
+  scene->faces.push_back((int)scene->faces.size() / 4);
+}
+
+/* A wavy height field over the unit square with small triangles scattered
+ * above and below it, so that rays see both large and thin geometry */
+static test_scene
+test_scene_create()
+{
+  test_scene scene;
+
+  const int grid = 48;
+  for (int y = 0; y <= grid; ++y)
+    for (int x = 0; x <= grid; ++x)
+      test_scene_add_vertex(&scene, x / (float)grid, y / (float)grid,
+                            0.2f * sinf(0.3f * x) * cosf(0.2f * y));
+  for (int y = 0; y < grid; ++y) {
+    for (int x = 0; x < grid; ++x) {
+      int v0 = y * (grid + 1) + x;
+      test_scene_add_face(&scene, v0, v0 + 1, v0 + grid + 2);
+      test_scene_add_face(&scene, v0, v0 + grid + 2, v0 + grid + 1);
+    }
+  }
+
+  std::mt19937                          rng(7);
+  std::uniform_real_distribution<float> position(0.0f, 1.0f);
+  std::uniform_real_distribution<float> offset(-0.05f, 0.05f);
+  for (int i = 0; i < 3000; ++i) {
+    float      cx = position(rng), cy = position(rng);
+    float      cz = position(rng) - 0.5f;
+    const int  v0 = (int)scene.positions.size() / 3;
+    for (int v = 0; v < 3; ++v)
+      test_scene_add_vertex(&scene, cx + offset(rng), cy + offset(rng),
+                            cz + offset(rng));
+    test_scene_add_face(&scene, v0, v0 + 1, v0 + 2);
+  }
+
+  return scene;
+}
+
+/* A square based pyramid of the given size, standing at (x, y, z) */
+static test_scene
+test_tent_create(float x, float y, float z, float size)
+{
+  test_scene tent;
+  test_scene_add_vertex(&tent, x, y, z + 0.5f * size);
+  test_scene_add_vertex(&tent, x - 0.5f * size, y - 0.5f * size, z);
+  test_scene_add_vertex(&tent, x + 0.5f * size, y - 0.5f * size, z);
+  test_scene_add_vertex(&tent, x + 0.5f * size, y + 0.5f * size, z);
+  test_scene_add_vertex(&tent, x - 0.5f * size, y + 0.5f * size, z);
+  for (int i = 0; i < 4; ++i)
+    test_scene_add_face(&tent, 0, 1 + i, 1 + (i + 1) % 4);
+  test_scene_add_face(&tent, 1, 3, 2);
+  test_scene_add_face(&tent, 1, 4, 3);
+  return tent;
+}
+
+/* Translated copies of one tent on a grid over the unit square, followed
+ * by a few distinct ones of other sizes */
+static std::vector<test_scene>
+test_tents_create()
+{
+  std::mt19937                          rng(8);
+  std::uniform_real_distribution<float> height(-0.3f, 0.3f);
+
+  std::vector<test_scene> tents;
+  const int               grid = 8;
+  for (int y = 0; y < grid; ++y)
+    for (int x = 0; x < grid; ++x)
+      tents.push_back(test_tent_create((x + 0.5f) / grid, (y + 0.5f) / grid,
+                                       height(rng), 0.08f));
+  for (int i = 0; i < 8; ++i)
+    tents.push_back(test_tent_create((i + 0.5f) / 8, 0.5f, height(rng),
+                                     0.02f + 0.01f * i));
+  return tents;
+}
+
+/* Rays start inside the bounds of the scene and go in random directions,
+ * t_max shortens them so that about half of the rays hit */
+static test_rays
+test_rays_create(unsigned int seed, float t_max)
+{
+  test_rays rays;
+  rays.origins.resize(4 * TEST_WIDTH * TEST_HEIGHT);
+  rays.directions.resize(4 * TEST_WIDTH * TEST_HEIGHT);
+
+  std::mt19937                          rng(seed);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  for (int i = 0; i < TEST_WIDTH * TEST_HEIGHT; ++i) {
+    float d[3], length;
+    do {
+      for (int k = 0; k < 3; ++k)
+        d[k] = 2.0f * uniform(rng) - 1.0f;
+      length = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    } while (length > 1.0f || length < 1e-3f);
+
+    float* origin    = &rays.origins[4 * i];
+    float* direction = &rays.directions[4 * i];
+    origin[0]        = uniform(rng);
+    origin[1]        = uniform(rng);
+    origin[2]        = uniform(rng) - 0.5f;
+    origin[3]        = 0.0f;
+    for (int k = 0; k < 3; ++k)
+      direction[k] = d[k] / length;
+    direction[3] = t_max;
+  }
+
+  return rays;
+}
+
+/* Contexts */
+
+static wr_handle
+test_context_create(wr_backend_type backend, const test_scene* scene,
+                    wr_ads_descriptor* options, int options_count,
+                    wr_handle* ads)
+{
+  wr_handle webrays = wrays_init(backend, WR_NULL);
+  if (WR_NULL == webrays)
+    return WR_NULL;
+
+  wr_error err = wrays_create_ads(webrays, ads, options, options_count);
+  int      shape_id;
+  if (WR_SUCCESS == err)
+    err = wrays_add_shape(webrays, *ads, (float*)scene->positions.data(), 3,
+                          WR_NULL, 0, WR_NULL, 0,
+                          (int)scene->positions.size() / 3,
+                          (int*)scene->faces.data(),
+                          (int)scene->faces.size() / 4, &shape_id);
+  wr_update_flags flags;
+  if (WR_SUCCESS == err)
+    err = wrays_update(webrays, &flags);
+  if (WR_SUCCESS != err) {
+    fprintf(stderr, "webrays_gl_test: %s\n", wrays_error_string(webrays, err));
+    wrays_destroy(webrays);
+    return WR_NULL;
+  }
+
+  return webrays;
+}
+
+static wr_error
+test_add_shape(wr_handle webrays, wr_handle ads, const test_scene* shape)
+{
+  int shape_id;
+  return wrays_add_shape(webrays, ads, (float*)shape->positions.data(), 3,
+                         WR_NULL, 0, WR_NULL, 0,
+                         (int)shape->positions.size() / 3,
+                         (int*)shape->faces.data(),
+                         (int)shape->faces.size() / 4, &shape_id);
+}
+
+/* A TLAS of the given options that takes the shapes itself. The first
+ * filler_count BLASes are taken by single triangles, which are not part of
+ * the TLAS */
+static wr_handle
+test_dedup_context_create(const std::vector<test_scene>& shapes,
+                          wr_ads_descriptor* options, int options_count,
+                          int filler_count, wr_handle* ads)
+{
+  wr_handle webrays = wrays_init(WR_BACKEND_TYPE_GLES, WR_NULL);
+  if (WR_NULL == webrays)
+    return WR_NULL;
+
+  wr_ads_descriptor filler_options[] = { { "type", "BLAS" } };
+  test_scene        filler = test_tent_create(-2.0f, -2.0f, 0.0f, 0.1f);
+  wr_error          err    = WR_SUCCESS;
+  int               shape_id;
+  for (int i = 0; WR_SUCCESS == err && i < filler_count; ++i) {
+    wr_handle blas;
+    err = wrays_create_ads(webrays, &blas, filler_options, 1);
+    if (WR_SUCCESS == err)
+      err = wrays_add_shape(webrays, blas, filler.positions.data(), 3,
+                            WR_NULL, 0, WR_NULL, 0,
+                            (int)filler.positions.size() / 3,
+                            filler.faces.data(), 1, &shape_id);
+  }
+
+  if (WR_SUCCESS == err)
+    err = wrays_create_ads(webrays, ads, options, options_count);
+  for (size_t i = 0; WR_SUCCESS == err && i < shapes.size(); ++i)
+    err = wrays_add_shape(
+      webrays, *ads, (float*)shapes[i].positions.data(), 3, WR_NULL, 0,
+      WR_NULL, 0, (int)shapes[i].positions.size() / 3,
+      (int*)shapes[i].faces.data(), (int)shapes[i].faces.size() / 4,
+      &shape_id);
+  wr_update_flags flags;
+  if (WR_SUCCESS == err)
+    err = wrays_update(webrays, &flags);
+  if (WR_SUCCESS != err) {
+    fprintf(stderr, "webrays_gl_test: %s\n", wrays_error_string(webrays, err));
+    wrays_destroy(webrays);
+    return WR_NULL;
+  }
+
+  return webrays;
+}
+
+/* Runs a 2D GLES occlusion query, returns false if the query failed */
+static bool
+test_gl_occlusion(wr_handle webrays, wr_handle ads, const test_rays* rays,
+                  std::vector<int>* occlusion)
+{
+  wr_size        dimensions[] = { TEST_WIDTH, TEST_HEIGHT };
+  wr_buffer_info info;
+  wrays_occlusion_buffer_requirements(webrays, &info, dimensions, 2);
+
+  test_gl_rays gl_rays = test_gl_rays_upload(webrays, rays);
+  GLuint       result =
+    test_gl_texture(&info, GL_RED_INTEGER, GL_INT, WR_NULL);
+  wr_handle    ray_buffers[] = { (wr_handle)(size_t)gl_rays.origins,
+                              (wr_handle)(size_t)gl_rays.directions };
+
+  wr_error err =
+    wrays_query_occlusion(webrays, ads, ray_buffers, 2,
+                          (wr_handle)(size_t)result, dimensions, 2);
+  if (WR_SUCCESS != err)
+    fprintf(stderr, "webrays_gl_test: %s\n", wrays_error_string(webrays, err));
+  else
+    *occlusion = test_gl_read(result, info.data.as_texture_2d.width,
+                              info.data.as_texture_2d.height, 1);
+
+  glDeleteTextures(1, &result);
+  test_gl_rays_destroy(&gl_rays);
+  return WR_SUCCESS == err;
+}
+
+/* Ints per ray of an intersection buffer, 2 in the compact format */
+static int
+test_intersection_components(const wr_buffer_info* info)
+{
+  return (GL_RG32I == info->data.as_texture_2d.internal_format) ? 2 : 4;
+}
+
+/* Runs a 2D GLES intersection query, returns false if the query failed.
+ * The results hold 4 ints per ray, or 2 in the compact format */
+static bool
+test_gl_intersection(wr_handle webrays, wr_handle ads, const test_rays* rays,
+                     std::vector<int>* intersections)
+{
+  wr_size        dimensions[] = { TEST_WIDTH, TEST_HEIGHT };
+  wr_buffer_info info;
+  wrays_intersection_buffer_requirements(webrays, &info, dimensions, 2);
+  const int components = test_intersection_components(&info);
+
+  test_gl_rays gl_rays = test_gl_rays_upload(webrays, rays);
+  GLuint       result  = test_gl_texture(
+    &info, (2 == components) ? GL_RG_INTEGER : GL_RGBA_INTEGER, GL_INT,
+    WR_NULL);
+  wr_handle    ray_buffers[] = { (wr_handle)(size_t)gl_rays.origins,
+                              (wr_handle)(size_t)gl_rays.directions };
+
+  wr_error err =
+    wrays_query_intersection(webrays, ads, ray_buffers, 2,
+                             (wr_handle)(size_t)result, dimensions, 2);
+  if (WR_SUCCESS != err)
+    fprintf(stderr, "webrays_gl_test: %s\n", wrays_error_string(webrays, err));
+  else
+    *intersections = test_gl_read(result, info.data.as_texture_2d.width,
+                                  info.data.as_texture_2d.height, components);
+
+  glDeleteTextures(1, &result);
+  test_gl_rays_destroy(&gl_rays);
+  return WR_SUCCESS == err;
+}
+
+/* Runs a 2D GLES wrays_query_intersection_occlusion, the occlusion buffer
+ * is in the current occlusion format */
+static bool
+test_gl_intersection_occlusion(wr_handle webrays, wr_handle ads,
+                               const test_rays* rays,
+                               const test_rays* occlusion_rays,
+                               std::vector<int>* intersections,
+                               std::vector<int>* occlusion)
+{
+  wr_size        dimensions[] = { TEST_WIDTH, TEST_HEIGHT };
+  wr_buffer_info intersection_info, occlusion_info;
+  wrays_intersection_buffer_requirements(webrays, &intersection_info,
+                                         dimensions, 2);
+  wrays_occlusion_buffer_requirements(webrays, &occlusion_info, dimensions,
+                                      2);
+
+  test_gl_rays gl_rays           = test_gl_rays_upload(webrays, rays);
+  test_gl_rays gl_occlusion_rays = test_gl_rays_upload(webrays, occlusion_rays);
+  GLuint       intersection_result =
+    test_gl_texture(&intersection_info, GL_RGBA_INTEGER, GL_INT, WR_NULL);
+  GLuint occlusion_result =
+    test_gl_texture(&occlusion_info, GL_RED_INTEGER, GL_INT, WR_NULL);
+  wr_handle ray_buffers[]           = { (wr_handle)(size_t)gl_rays.origins,
+                              (wr_handle)(size_t)gl_rays.directions };
+  wr_handle occlusion_ray_buffers[] = {
+    (wr_handle)(size_t)gl_occlusion_rays.origins,
+    (wr_handle)(size_t)gl_occlusion_rays.directions
+  };
+
+  wr_error err = wrays_query_intersection_occlusion(
+    webrays, ads, ray_buffers, 2, (wr_handle)(size_t)intersection_result,
+    occlusion_ray_buffers, 2, (wr_handle)(size_t)occlusion_result, dimensions,
+    2);
+  if (WR_SUCCESS != err) {
+    fprintf(stderr, "webrays_gl_test: %s\n", wrays_error_string(webrays, err));
+  } else {
+    *intersections = test_gl_read(
+      intersection_result, intersection_info.data.as_texture_2d.width,
+      intersection_info.data.as_texture_2d.height, 4);
+    *occlusion = test_gl_read(occlusion_result,
+                              occlusion_info.data.as_texture_2d.width,
+                              occlusion_info.data.as_texture_2d.height, 1);
+  }
+
+  glDeleteTextures(1, &intersection_result);
+  glDeleteTextures(1, &occlusion_result);
+  test_gl_rays_destroy(&gl_rays);
+  test_gl_rays_destroy(&gl_occlusion_rays);
+  return WR_SUCCESS == err;
+}
+
+/* Runs a CPU occlusion query over the same rays, one int per ray */
+static bool
+test_cpu_occlusion(wr_handle webrays, wr_handle ads, const test_rays* rays,
+                   std::vector<int>* occlusion)
+{
+  wr_size   dimensions[]  = { TEST_WIDTH * TEST_HEIGHT };
+  wr_handle ray_buffers[] = { (wr_handle)rays->origins.data(),
+                              (wr_handle)rays->directions.data() };
+  occlusion->assign(TEST_WIDTH * TEST_HEIGHT, 0);
+
+  wr_error err = wrays_query_occlusion(webrays, ads, ray_buffers, 2,
+                                       occlusion->data(), dimensions, 1);
+  if (WR_SUCCESS != err)
+    fprintf(stderr, "webrays_gl_test: %s\n", wrays_error_string(webrays, err));
+  return WR_SUCCESS == err;
+}
+
+/* Runs a CPU intersection query over the same rays, with components ints
+ * per ray as in the GLES buffer */
+static bool
+test_cpu_intersection(wr_handle webrays, wr_handle ads, const test_rays* rays,
+                      int components, std::vector<int>* intersections)
+{
+  wr_size   dimensions[]  = { TEST_WIDTH * TEST_HEIGHT };
+  wr_handle ray_buffers[] = { (wr_handle)rays->origins.data(),
+                              (wr_handle)rays->directions.data() };
+  intersections->assign(components * TEST_WIDTH * TEST_HEIGHT, -1);
+
+  wr_error err = wrays_query_intersection(webrays, ads, ray_buffers, 2,
+                                          intersections->data(), dimensions,
+                                          1);
+  if (WR_SUCCESS != err)
+    fprintf(stderr, "webrays_gl_test: %s\n", wrays_error_string(webrays, err));
+  return WR_SUCCESS == err;
+}
+
+/* Comparisons */
+
+/* One int per ray, 1 if the ray is occluded, of any occlusion buffer */
+static std::vector<int>
+test_unpack_occlusion(const std::vector<int>& occlusion, bool packed)
+{
+  std::vector<int> rays(TEST_WIDTH * TEST_HEIGHT);
+  const int        packed_width = (TEST_WIDTH + 31) / 32;
+  for (int y = 0; y < TEST_HEIGHT; ++y) {
+    for (int x = 0; x < TEST_WIDTH; ++x) {
+      const int i = y * TEST_WIDTH + x;
+      if (packed)
+        rays[i] = ((unsigned)occlusion[y * packed_width + x / 32] >> (x % 32)) &
+                  1u;
+      else
+        rays[i] = occlusion[i] ? 1 : 0;
+    }
+  }
+  return rays;
+}
+
+static int
+test_count_mismatches(const std::vector<int>& a, const std::vector<int>& b)
+{
+  if (a.size() != b.size())
+    return (int)std::max(a.size(), b.size());
+  int mismatches = 0;
+  for (size_t i = 0; i < a.size(); ++i)
+    mismatches += (a[i] != b[i]) ? 1 : 0;
+  return mismatches;
+}
+
+static int
+test_count_occluded(const std::vector<int>& occlusion)
+{
+  int occluded = 0;
+  for (size_t i = 0; i < occlusion.size(); ++i)
+    occluded += occlusion[i] ? 1 : 0;
+  return occluded;
+}
+
+static bool
+test_check(bool condition, const char* test, const char* what)
+{
+  if (!condition)
+    fprintf(stderr, "webrays_gl_test: %s: %s\n", test, what);
+  return condition;
+}
+
+/* Tests */
+
+/* Tiled draws must write every tile, with the same results as one draw.
+ * The tiles do not divide the buffer, so the last row and column are
+ * partial. The queries run once first in their context, so that no earlier
+ * query has left the scene textures bound, and once more after an
+ * intersection query */
+static bool
+test_tiled_occlusion(const test_scene* scene)
+{
+  wr_ads_descriptor options[] = { { "type", "BLAS" } };
+  wr_handle         ads;
+  wr_handle         webrays =
+    test_context_create(WR_BACKEND_TYPE_GLES, scene, options, 1, &ads);
+  if (WR_NULL == webrays)
+    return false;
+
+  test_rays        rays = test_rays_create(1, 0.25f);
+  std::vector<int> untiled, tiled;
+  bool             ok = test_gl_occlusion(webrays, ads, &rays, &untiled);
+  wrays_set_query_tiling(webrays, 64, 32);
+  ok = ok && test_gl_occlusion(webrays, ads, &rays, &tiled);
+
+  const int mismatches = test_count_mismatches(untiled, tiled);
+  printf("tiled_occlusion: %d of %d rays occluded, %d tiled mismatches\n",
+         test_count_occluded(untiled), TEST_WIDTH * TEST_HEIGHT, mismatches);
+
+  ok = ok && test_check(test_count_occluded(untiled) > 0, "tiled_occlusion",
+                        "no rays occluded");
+  ok = ok && test_check(0 == mismatches, "tiled_occlusion",
+                        "tiled results differ");
+
+  std::vector<int> intersections;
+  wrays_set_query_tiling(webrays, 0, 0);
+  ok = ok && test_gl_intersection(webrays, ads, &rays, &intersections);
+  wrays_set_query_tiling(webrays, 64, 32);
+  ok = ok && test_gl_occlusion(webrays, ads, &rays, &tiled);
+  ok = ok && test_check(0 == test_count_mismatches(untiled, tiled),
+                        "tiled_occlusion",
+                        "tiled results differ after an intersection query");
+
+  wrays_destroy(webrays);
+  return ok;
+}
+
+/* The combined query draws both result sets at once, or issues the two
+ * queries when the occlusion format is packed or the traversal statistics
+ * are enabled. Every path must match the separate queries */
+static bool
+test_intersection_occlusion(const test_scene* scene)
+{
+  wr_ads_descriptor options[] = { { "type", "BLAS" } };
+  wr_handle         ads;
+  wr_handle         webrays =
+    test_context_create(WR_BACKEND_TYPE_GLES, scene, options, 1, &ads);
+  if (WR_NULL == webrays)
+    return false;
+
+  test_rays        rays           = test_rays_create(2, 100.0f);
+  test_rays        occlusion_rays = test_rays_create(3, 0.25f);
+  std::vector<int> intersections, occlusion;
+  bool ok = test_gl_intersection_occlusion(webrays, ads, &rays, &occlusion_rays,
+                                           &intersections, &occlusion);
+
+  std::vector<int> expected_intersections, expected_occlusion;
+  ok = ok && test_gl_intersection(webrays, ads, &rays, &expected_intersections);
+  ok = ok && test_gl_occlusion(webrays, ads, &occlusion_rays,
+                               &expected_occlusion);
+  ok = ok && test_check(test_count_occluded(expected_occlusion) > 0,
+                        "intersection_occlusion", "no rays occluded");
+  ok = ok && test_check(0 == test_count_mismatches(expected_intersections,
+                                                    intersections) &&
+                          0 == test_count_mismatches(expected_occlusion,
+                                                     occlusion),
+                        "intersection_occlusion",
+                        "combined results differ from separate queries");
+
+  wr_update_flags flags;
+  wrays_set_traversal_stats(webrays, WR_TRUE);
+  wrays_update(webrays, &flags);
+  ok = ok && test_gl_intersection_occlusion(webrays, ads, &rays,
+                                            &occlusion_rays, &intersections,
+                                            &occlusion);
+  ok = ok && test_check(0 == test_count_mismatches(expected_intersections,
+                                                    intersections) &&
+                          0 == test_count_mismatches(expected_occlusion,
+                                                     occlusion),
+                        "intersection_occlusion",
+                        "results with traversal statistics differ");
+  wrays_set_traversal_stats(webrays, WR_FALSE);
+
+  wrays_set_occlusion_format(webrays, WR_OCCLUSION_FORMAT_PACKED);
+  wrays_update(webrays, &flags);
+  ok = ok && test_gl_intersection_occlusion(webrays, ads, &rays,
+                                            &occlusion_rays, &intersections,
+                                            &occlusion);
+  ok = ok &&
+       test_check(0 == test_count_mismatches(expected_intersections,
+                                             intersections) &&
+                    0 == test_count_mismatches(
+                           test_unpack_occlusion(expected_occlusion, false),
+                           test_unpack_occlusion(occlusion, true)),
+                  "intersection_occlusion", "packed results differ");
+
+  printf("intersection_occlusion: %d of %d rays occluded\n",
+         test_count_occluded(expected_occlusion), TEST_WIDTH * TEST_HEIGHT);
+
+  wrays_destroy(webrays);
+  return ok;
+}
+
+/* The counters of occlusion queries are read back like those of
+ * intersection queries, every ray of the buffer is traced. Any-hit
+ * traversal ends at the first hit, so the terminated rays are the occluded
+ * ones */
+static bool
+test_traversal_stats(const test_scene* scene)
+{
+  wr_ads_descriptor options[] = { { "type", "BLAS" } };
+  wr_handle         ads;
+  wr_handle         webrays =
+    test_context_create(WR_BACKEND_TYPE_GLES, scene, options, 1, &ads);
+  if (WR_NULL == webrays)
+    return false;
+
+  wr_update_flags flags;
+  wrays_set_traversal_stats(webrays, WR_TRUE);
+  wrays_update(webrays, &flags);
+
+  test_rays          rays = test_rays_create(4, 0.25f);
+  std::vector<int>   occlusion, intersections;
+  wr_traversal_stats stats;
+  bool               ok = test_gl_occlusion(webrays, ads, &rays, &occlusion);
+  wrays_get_traversal_stats(webrays, &stats);
+  printf("traversal_stats: occlusion rays %llu nodes %llu triangles %llu "
+         "terminated %llu\n",
+         stats.ray_count, stats.nodes_visited, stats.triangles_tested,
+         stats.terminated_rays);
+  ok = ok && test_check(TEST_WIDTH * TEST_HEIGHT == stats.ray_count &&
+                          stats.nodes_visited > 0 && stats.triangles_tested > 0,
+                        "traversal_stats", "occlusion rays not counted");
+  ok = ok && test_check(test_count_occluded(occlusion) > 0 &&
+                          (unsigned long long)test_count_occluded(occlusion) ==
+                            stats.terminated_rays,
+                        "traversal_stats",
+                        "terminated rays differ from the occluded rays");
+
+  ok = ok && test_gl_intersection(webrays, ads, &rays, &intersections);
+  wrays_get_traversal_stats(webrays, &stats);
+  ok = ok && test_check(2 * TEST_WIDTH * TEST_HEIGHT == stats.ray_count,
+                        "traversal_stats", "intersection rays not counted");
+
+  wrays_destroy(webrays);
+  return ok;
+}
+
+/* A packed query that runs first in its context must not depend on
+ * textures left bound by earlier queries. Its bits are decoded in a user
+ * shader through the accessor code and compared to an int query */
+static bool
+test_packed_occlusion(const test_scene* scene)
+{
+  wr_ads_descriptor options[] = { { "type", "BLAS" } };
+  wr_handle         ads;
+  wr_handle         webrays =
+    test_context_create(WR_BACKEND_TYPE_GLES, scene, options, 1, &ads);
+  if (WR_NULL == webrays)
+    return false;
+
+  wr_update_flags flags;
+  wrays_set_occlusion_format(webrays, WR_OCCLUSION_FORMAT_PACKED);
+  wrays_update(webrays, &flags);
+
+  wr_size        dimensions[] = { TEST_WIDTH, TEST_HEIGHT };
+  wr_buffer_info info;
+  wrays_occlusion_buffer_requirements(webrays, &info, dimensions, 2);
+
+  test_rays    rays    = test_rays_create(5, 0.25f);
+  test_gl_rays gl_rays = test_gl_rays_upload(webrays, &rays);
+  GLuint       result =
+    test_gl_texture(&info, GL_RED_INTEGER, GL_INT, WR_NULL);
+  wr_handle    ray_buffers[] = { (wr_handle)(size_t)gl_rays.origins,
+                              (wr_handle)(size_t)gl_rays.directions };
+
+  wr_error err =
+    wrays_query_occlusion(webrays, ads, ray_buffers, 2,
+                          (wr_handle)(size_t)result, dimensions, 2);
+  bool ok = test_check(WR_SUCCESS == err, "packed_occlusion",
+                       wrays_error_string(webrays, err));
+
+  std::string source = "#version 300 es\n";
+  source += wrays_get_scene_accessor(webrays);
+  source += "uniform highp isampler2D test_Input;\n"
+            "layout(location = 0) out int test_Occluded;\n"
+            "void main() {\n"
+            "  test_Occluded =\n"
+            "    wr_GetPackedOcclusion(test_Input, ivec2(gl_FragCoord.xy))\n"
+            "      ? 1 : 0;\n"
+            "}\n";
+  std::vector<int> packed = test_gl_read(result, info.data.as_texture_2d.width,
+                                         info.data.as_texture_2d.height, 1);
+  std::vector<int> decoded =
+    test_gl_draw(source.c_str(), result, TEST_WIDTH, TEST_HEIGHT);
+  glDeleteTextures(1, &result);
+  test_gl_rays_destroy(&gl_rays);
+
+  std::vector<int> expected;
+  wrays_set_occlusion_format(webrays, WR_OCCLUSION_FORMAT_INT);
+  wrays_update(webrays, &flags);
+  ok = ok && test_gl_occlusion(webrays, ads, &rays, &expected);
+  expected = test_unpack_occlusion(expected, false);
+
+  printf("packed_occlusion: %d of %d rays occluded, %d decoded mismatches\n",
+         test_count_occluded(expected), TEST_WIDTH * TEST_HEIGHT,
+         test_count_mismatches(expected, decoded));
+  ok = ok && test_check(test_count_occluded(expected) > 0, "packed_occlusion",
+                        "no rays occluded");
+  ok = ok && test_check(0 == test_count_mismatches(
+                               expected, test_unpack_occlusion(packed, true)),
+                        "packed_occlusion", "packed bits differ");
+  ok = ok && test_check(0 == test_count_mismatches(expected, decoded),
+                        "packed_occlusion",
+                        "wr_GetPackedOcclusion results differ");
+
+  wrays_destroy(webrays);
+  return ok;
+}
+
+/* Hits and misses of two intersection buffers that must agree, with hit
+ * distances within tolerance. The primitive ids are not compared */
+static int
+test_count_hit_mismatches(const std::vector<int>& a, const std::vector<int>& b,
+                          float tolerance)
+{
+  if (a.size() != b.size())
+    return (int)std::max(a.size(), b.size()) / 4;
+  int mismatches = 0;
+  for (size_t i = 0; i < a.size(); i += 4) {
+    float t_a, t_b;
+    std::memcpy(&t_a, &a[i + 3], sizeof(float));
+    std::memcpy(&t_b, &b[i + 3], sizeof(float));
+    if ((-1 == a[i]) != (-1 == b[i]) ||
+        (-1 != a[i] && std::abs(t_a - t_b) > tolerance))
+      ++mismatches;
+  }
+  return mismatches;
+}
+
+static int
+test_count_hits(const std::vector<int>& intersections)
+{
+  int hits = 0;
+  for (size_t i = 0; i < intersections.size(); i += 4)
+    hits += (-1 != intersections[i]) ? 1 : 0;
+  return hits;
+}
+
+/* Translated copies added to a deduplicating TLAS are instances of a few
+ * BLASes, and must be hit like the same triangles in a flat BLAS. The TLAS
+ * options reach its BLASes. Once the distinct meshes fill the BLAS table,
+ * copies are still added but a further distinct mesh fails */
+static bool
+test_dedup(const test_scene* scene)
+{
+  std::vector<test_scene> tents = test_tents_create();
+  test_scene              flat;
+  for (size_t i = 0; i < tents.size(); ++i) {
+    const int base = (int)flat.positions.size() / 3;
+    flat.positions.insert(flat.positions.end(), tents[i].positions.begin(),
+                          tents[i].positions.end());
+    for (size_t f = 0; f < tents[i].faces.size(); f += 4)
+      test_scene_add_face(&flat, base + tents[i].faces[f + 0],
+                          base + tents[i].faces[f + 1],
+                          base + tents[i].faces[f + 2]);
+  }
+
+  test_rays        rays = test_rays_create(6, 100.0f);
+  std::vector<int> expected;
+  wr_ads_descriptor flat_options[] = { { "type", "BLAS" },
+                                       { "layout", "TREELET" },
+                                       { "leaf_size", "1" } };
+  wr_handle         ads;
+  wr_handle         webrays =
+    test_context_create(WR_BACKEND_TYPE_GLES, &flat, flat_options, 3, &ads);
+  if (WR_NULL == webrays)
+    return false;
+  bool ok = test_gl_intersection(webrays, ads, &rays, &expected);
+  wrays_destroy(webrays);
+
+  wr_ads_descriptor options[] = { { "type", "TLAS" },
+                                  { "deduplicate", "TRANSLATION" },
+                                  { "layout", "TREELET" },
+                                  { "leaf_size", "1" } };
+  // The sized tent of 0.08 is a translated copy of the grid tents
+  const int         distinct_count  = 8;
+  const int         filler_counts[] = { 0, 256 - distinct_count };
+  for (int pass = 0; ok && pass < 2; ++pass) {
+    webrays = test_dedup_context_create(tents, options, 4,
+                                        filler_counts[pass], &ads);
+    if (WR_NULL == webrays)
+      return false;
+
+    std::vector<int> intersections;
+    ok = ok && test_gl_intersection(webrays, ads, &rays, &intersections);
+    const int mismatches =
+      test_count_hit_mismatches(expected, intersections, 1e-4f);
+    printf("dedup: %d filler BLASes, %d of %d rays hit, %d mismatches\n",
+           filler_counts[pass], test_count_hits(expected),
+           TEST_WIDTH * TEST_HEIGHT, mismatches);
+    ok = ok && test_check(test_count_hits(expected) > 0, "dedup", "no hits");
+    ok = ok && test_check(0 == mismatches, "dedup",
+                          "instanced hits differ from the flat BLAS");
+
+    // The first BLAS after the fillers holds the first tent
+    wr_handle    blas = (wr_handle)(size_t)filler_counts[pass];
+    wr_ads_stats stats;
+    ok = ok && test_check(WR_SUCCESS ==
+                              wrays_ads_get_stats(webrays, blas, &stats) &&
+                            1.0f == stats.average_leaf_size,
+                          "dedup", "TLAS options not passed to its BLASes");
+
+    if (filler_counts[pass] + distinct_count == 256) {
+      test_scene copy     = test_tent_create(2.0f, 2.0f, 0.0f, 0.08f);
+      test_scene distinct = test_tent_create(2.0f, 2.0f, 0.0f, 0.5f);
+      ok = ok && test_check(WR_SUCCESS == test_add_shape(webrays, ads, &copy),
+                            "dedup", "copy rejected with a full BLAS table");
+      ok = ok &&
+           test_check(WR_SUCCESS != test_add_shape(webrays, ads, &distinct),
+                      "dedup", "distinct mesh added with a full BLAS table");
+    }
+    wrays_destroy(webrays);
+  }
+
+  return ok;
+}
+
+/* Intersection buffers of components ints per ray that must agree: the same
+ * primitive, and attributes and hit distance within tolerance. Compact
+ * attributes are compared as 2x16 unorm */
+static int
+test_count_intersection_mismatches(const std::vector<int>& a,
+                                   const std::vector<int>& b, int components,
+                                   float tolerance)
+{
+  if (a.size() != b.size())
+    return (int)std::max(a.size(), b.size()) / components;
+  int mismatches = 0;
+  for (size_t i = 0; i < a.size(); i += components) {
+    bool differ = a[i] != b[i];
+    for (int c = 1; !differ && -1 != a[i] && 4 == components && c < 4; ++c) {
+      float v_a, v_b;
+      std::memcpy(&v_a, &a[i + c], sizeof(float));
+      std::memcpy(&v_b, &b[i + c], sizeof(float));
+      differ = std::abs(v_a - v_b) > tolerance;
+    }
+    if (!differ && 2 == components && -1 != a[i]) {
+      const unsigned u_a = (unsigned)a[i + 1], u_b = (unsigned)b[i + 1];
+      differ =
+        std::abs((int)(u_a & 0xFFFFu) - (int)(u_b & 0xFFFFu)) >
+          tolerance * 65535.0f ||
+        std::abs((int)(u_a >> 16) - (int)(u_b >> 16)) > tolerance * 65535.0f;
+    }
+    if (differ)
+      ++mismatches;
+  }
+  return mismatches;
+}
+
+/* Every builder, layout, triangle format and traversal of the GLES backend,
+ * and a streamed BLAS, must find the same hits as the CPU backend over the
+ * same BLAS. The builds are deterministic, so the primitive IDs must match
+ * too */
+static bool
+test_cpu_comparison(const test_scene* scene)
+{
+  static const struct
+  {
+    const char*            name;
+    wr_ads_descriptor      options[4];
+    int                    options_count;
+    wr_intersection_format format;
+  } configs[] = {
+    { "default", { { "type", "BLAS" } }, 1, WR_INTERSECTION_FORMAT_FULL },
+    { "SAH", { { "builder", "SAH" } }, 1, WR_INTERSECTION_FORMAT_FULL },
+    { "SBVH", { { "builder", "SBVH" } }, 1, WR_INTERSECTION_FORMAT_FULL },
+    { "WIDEBVH", { { "builder", "WIDEBVH" } }, 1, WR_INTERSECTION_FORMAT_FULL },
+    { "SAH treelets",
+      { { "builder", "SAH" }, { "layout", "TREELET" } },
+      2,
+      WR_INTERSECTION_FORMAT_FULL },
+    { "WIDEBVH treelets",
+      { { "builder", "WIDEBVH" }, { "layout", "TREELET" } },
+      2,
+      WR_INTERSECTION_FORMAT_FULL },
+    { "precomputed triangles",
+      { { "triangles", "PRECOMPUTED" } },
+      1,
+      WR_INTERSECTION_FORMAT_FULL },
+    { "compact triangles",
+      { { "triangles", "COMPACT" } },
+      1,
+      WR_INTERSECTION_FORMAT_FULL },
+    { "quads",
+      { { "builder", "SAH" }, { "quads", "ON" } },
+      2,
+      WR_INTERSECTION_FORMAT_FULL },
+    { "stackless",
+      { { "builder", "SAH" }, { "traversal", "STACKLESS" } },
+      2,
+      WR_INTERSECTION_FORMAT_FULL },
+    { "streaming",
+      { { "builder", "SAH" }, { "streaming", "ON" } },
+      2,
+      WR_INTERSECTION_FORMAT_FULL },
+    { "SAH parameters",
+      { { "builder", "SAH" }, { "leaf_size", "1" }, { "buckets", "16" } },
+      3,
+      WR_INTERSECTION_FORMAT_FULL },
+    { "WIDEBVH parameters",
+      { { "builder", "WIDEBVH" },
+        { "leaf_size", "2" },
+        { "node_cost", "2.0" },
+        { "triangle_cost", "0.1" } },
+      4,
+      WR_INTERSECTION_FORMAT_FULL },
+    { "compact intersections",
+      { { "type", "BLAS" } },
+      1,
+      WR_INTERSECTION_FORMAT_COMPACT }
+  };
+
+  test_rays rays           = test_rays_create(4, 100.0f);
+  test_rays occlusion_rays = test_rays_create(5, 0.25f);
+  bool      ok             = true;
+  for (size_t i = 0; ok && i < sizeof(configs) / sizeof(configs[0]); ++i) {
+    wr_ads_descriptor* options = (wr_ads_descriptor*)configs[i].options;
+    wr_handle          gl_ads, cpu_ads;
+    wr_handle          gl_webrays = test_context_create(
+      WR_BACKEND_TYPE_GLES, scene, options, configs[i].options_count, &gl_ads);
+    wr_handle cpu_webrays = test_context_create(
+      WR_BACKEND_TYPE_CPU, scene, options, configs[i].options_count, &cpu_ads);
+    ok = test_check(WR_NULL != gl_webrays && WR_NULL != cpu_webrays,
+                    "cpu_comparison", "context creation failed");
+
+    // Only the CPU backend sorts its rays, every other configuration is
+    // traced sorted there, which must not change the hits
+    const wr_bool sorted = (i % 2) ? WR_TRUE : WR_FALSE;
+    ok = ok && test_check(WR_SUCCESS != wrays_set_ray_sorting(gl_webrays,
+                                                              WR_TRUE) &&
+                            WR_SUCCESS ==
+                              wrays_set_ray_sorting(cpu_webrays, sorted),
+                          "cpu_comparison", "ray sorting support differs");
+
+    wr_update_flags flags;
+    if (ok && WR_INTERSECTION_FORMAT_FULL != configs[i].format) {
+      wrays_set_intersection_format(gl_webrays, configs[i].format);
+      wrays_set_intersection_format(cpu_webrays, configs[i].format);
+      wrays_update(gl_webrays, &flags);
+      wrays_update(cpu_webrays, &flags);
+    }
+
+    std::vector<int> gl_intersections, cpu_intersections;
+    std::vector<int> gl_occlusion, cpu_occlusion;
+    ok = ok && test_gl_intersection(gl_webrays, gl_ads, &rays,
+                                    &gl_intersections);
+    const int components =
+      (int)gl_intersections.size() / (TEST_WIDTH * TEST_HEIGHT);
+    ok = ok && test_cpu_intersection(cpu_webrays, cpu_ads, &rays, components,
+                                     &cpu_intersections);
+    ok = ok && test_gl_occlusion(gl_webrays, gl_ads, &occlusion_rays,
+                                 &gl_occlusion);
+    ok = ok && test_cpu_occlusion(cpu_webrays, cpu_ads, &occlusion_rays,
+                                  &cpu_occlusion);
+
+    if (ok) {
+      int hits = 0;
+      for (size_t r = 0; r < cpu_intersections.size(); r += components)
+        hits += (-1 != cpu_intersections[r]) ? 1 : 0;
+      const int intersection_mismatches = test_count_intersection_mismatches(
+        cpu_intersections, gl_intersections, components, 1e-4f);
+      const int occlusion_mismatches =
+        test_count_mismatches(cpu_occlusion, gl_occlusion);
+      printf("cpu_comparison: %s, %d hits, %d occluded, %d intersection and "
+             "%d occlusion mismatches\n",
+             configs[i].name, hits, test_count_occluded(cpu_occlusion),
+             intersection_mismatches, occlusion_mismatches);
+      ok = test_check(hits > 0 && test_count_occluded(cpu_occlusion) > 0,
+                      "cpu_comparison", "no hits") &&
+           test_check(0 == intersection_mismatches && 0 == occlusion_mismatches,
+                      "cpu_comparison", "GLES results differ from the CPU");
+    }
+
+    if (WR_NULL != gl_webrays)
+      wrays_destroy(gl_webrays);
+    if (WR_NULL != cpu_webrays)
+      wrays_destroy(cpu_webrays);
+  }
+
+  return ok;
+}
+
+/* A BLAS rebuilt by wrays_update_async must give the same hits as one
+ * built by wrays_update. Creating an ADS, reading the statistics of a
+ * building BLAS and CPU queries wait for the build, so each of them runs
+ * right after the build starts. The rebuild replaces the nodes that a CPU
+ * query would otherwise traverse concurrently, and the BLAS created during
+ * a build must not be picked up by its workers half initialized */
+static bool
+test_async_update(const test_scene* scene)
+{
+  wr_ads_descriptor options[] = { { "type", "BLAS" } };
+  test_scene        tent      = test_tent_create(0.5f, 0.5f, 0.4f, 0.3f);
+  test_rays         rays      = test_rays_create(7, 100.0f);
+  wr_update_flags   flags;
+
+  wr_handle ads;
+  wr_handle reference =
+    test_context_create(WR_BACKEND_TYPE_CPU, scene, options, 1, &ads);
+  if (WR_NULL == reference)
+    return false;
+  std::vector<int> expected;
+  wr_ads_stats     expected_stats;
+  bool ok = WR_SUCCESS == test_add_shape(reference, ads, &tent) &&
+            WR_SUCCESS == wrays_update(reference, &flags) &&
+            test_cpu_intersection(reference, ads, &rays, 4, &expected) &&
+            WR_SUCCESS == wrays_ads_get_stats(reference, ads, &expected_stats);
+  wrays_destroy(reference);
+
+  const wr_backend_type backends[] = { WR_BACKEND_TYPE_CPU,
+                                       WR_BACKEND_TYPE_GLES };
+  for (int b = 0; ok && b < 2; ++b) {
+    wr_handle webrays =
+      test_context_create(backends[b], scene, options, 1, &ads);
+    if (WR_NULL == webrays)
+      return false;
+
+    wr_handle        other;
+    wr_ads_stats     stats;
+    std::vector<int> intersections;
+    ok = WR_SUCCESS == test_add_shape(webrays, ads, &tent) &&
+         WR_SUCCESS == wrays_update_async(webrays) &&
+         WR_SUCCESS == wrays_create_ads(webrays, &other, options, 1) &&
+         WR_SUCCESS == test_add_shape(webrays, other, &tent) &&
+         WR_SUCCESS == wrays_update_async(webrays);
+    if (ok && WR_BACKEND_TYPE_CPU == backends[b])
+      ok = test_cpu_intersection(webrays, ads, &rays, 4, &intersections);
+    ok = ok && WR_SUCCESS == wrays_ads_get_stats(webrays, ads, &stats);
+    ok = ok && WR_SUCCESS == wrays_update(webrays, &flags);
+    if (ok && WR_BACKEND_TYPE_GLES == backends[b])
+      ok = test_gl_intersection(webrays, ads, &rays, &intersections);
+    ok = test_check(ok, "async_update", "asynchronous update failed");
+
+    if (ok) {
+      const int mismatches = test_count_intersection_mismatches(
+        expected, intersections, 4, 1e-4f);
+      printf("async_update: %s, %d nodes, %d mismatches\n",
+             (WR_BACKEND_TYPE_CPU == backends[b]) ? "CPU" : "GLES",
+             stats.node_count, mismatches);
+      ok = test_check(expected_stats.node_count == stats.node_count &&
+                        expected_stats.sah_cost == stats.sah_cost,
+                      "async_update", "asynchronous build differs") &&
+           test_check(0 == mismatches, "async_update",
+                      "asynchronous build hits differ");
+    }
+    wrays_destroy(webrays);
+  }
+
+  return ok;
+}
+
+/* Numeric options are parsed whole and must be finite, a value with
+ * trailing characters, a fraction for an integer option, an infinity or a
+ * NaN is rejected instead of being read up to where it stops being a
+ * number */
+static bool
+test_invalid_options(const test_scene*)
+{
+  wr_ads_descriptor options[][2] = {
+    { { "builder", "SAH" }, { "leaf_size", "16abc" } },
+    { { "builder", "SAH" }, { "leaf_size", "3.5" } },
+    { { "builder", "SAH" }, { "buckets", "4294967312" } },
+    { { "builder", "SAH" }, { "optimize", "inf" } },
+    { { "builder", "SAH" }, { "split_budget", "0.1x" } },
+    { { "builder", "WIDEBVH" }, { "node_cost", "nan" } },
+    { { "builder", "WIDEBVH" }, { "triangle_cost", "1e40" } }
+  };
+  wr_ads_descriptor valid_options[] = { { "builder", "SAH" },
+                                        { "leaf_size", "4" } };
+
+  wr_handle webrays = wrays_init(WR_BACKEND_TYPE_CPU, WR_NULL);
+  bool      ok      = test_check(WR_NULL != webrays, "invalid_options",
+                                 "context creation failed");
+  for (size_t i = 0; ok && i < sizeof(options) / sizeof(options[0]); ++i) {
+    wr_handle ads;
+    if (WR_SUCCESS == wrays_create_ads(webrays, &ads, options[i], 2)) {
+      fprintf(stderr, "webrays_gl_test: invalid_options: %s = %s was "
+                      "accepted\n",
+              options[i][1].key, options[i][1].value);
+      ok = false;
+    }
+  }
+
+  wr_handle ads;
+  ok = ok && test_check(WR_SUCCESS ==
+                          wrays_create_ads(webrays, &ads, valid_options, 2),
+                        "invalid_options", "valid options were rejected");
+
+  if (WR_NULL != webrays)
+    wrays_destroy(webrays);
+  return ok;
+}
+
+static const struct
+{
+  const char*   name;
+  test_function function;
+} test_registry[] = {
+  { "tiled_occlusion", test_tiled_occlusion },
+  { "intersection_occlusion", test_intersection_occlusion },
+  { "traversal_stats", test_traversal_stats },
+  { "packed_occlusion", test_packed_occlusion },
+  { "dedup", test_dedup },
+  { "cpu_comparison", test_cpu_comparison },
+  { "async_update", test_async_update },
+  { "invalid_options", test_invalid_options }
+};
+
+int
+main(int argc, char* argv[])
+{
+  const char* filter = (argc > 1) ? argv[1] : WR_NULL;
+
+  test_gl gl;
+  if (!test_gl_init(&gl)) {
+    fprintf(stderr, "webrays_gl_test: no OpenGL ES 3 context, skipping\n");
+    test_gl_destroy(&gl);
+    return TEST_SKIPPED;
+  }
+  printf("webrays_gl_test: %s, %s\n", glGetString(GL_RENDERER),
+         glGetString(GL_VERSION));
+
+  test_scene scene = test_scene_create();
+
+  int ran = 0, failed = 0;
+  for (size_t i = 0; i < sizeof(test_registry) / sizeof(test_registry[0]);
+       ++i) {
+    if (filter && strcmp(filter, test_registry[i].name))
+      continue;
+    ++ran;
+    if (!test_registry[i].function(&scene)) {
+      fprintf(stderr, "webrays_gl_test: %s FAILED\n", test_registry[i].name);
+      ++failed;
+    }
+  }
+
+  test_gl_destroy(&gl);
+
+  if (0 == ran) {
+    fprintf(stderr, "webrays_gl_test: unknown test %s\n", filter);
+    return 1;
+  }
+  return failed ? 1 : 0;
+}